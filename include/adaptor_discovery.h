@@ -0,0 +1,47 @@
+/*----------------------------------------------------------------------*
+ * File:    adaptor_discovery.h                                         *
+ * Purpose: Find over-represented sequences, such as unexpected         *
+ *          adaptors, in a sample of reads by counting k-mers           *
+ *----------------------------------------------------------------------*/
+
+#ifndef ADAPTOR_DISCOVERY_H_
+#define ADAPTOR_DISCOVERY_H_
+
+#define DISCOVERY_KMER_SIZE 21
+#define DISCOVERY_MAX_CANDIDATES 32
+#define DISCOVERY_MAX_CANDIDATE_LENGTH 200
+#define DISCOVERY_POSITION_BINS 10
+
+typedef struct {
+    char sequence[DISCOVERY_MAX_CANDIDATE_LENGTH + 1];
+    int length;
+    double mean_count;
+    char probe[2][DISCOVERY_KMER_SIZE + 1];
+    int probe_offset;
+    int reads[2];
+    int positions[DISCOVERY_POSITION_BINS];
+    double position_skew;
+} DiscoveredSequence;
+
+typedef struct {
+    char* sample;
+    long int sample_size;
+    long int sample_allocated;
+    int number_of_reads;
+    int max_read_length;
+    long int number_of_kmers;
+    int minimum_count;
+    HashTable* kmers;
+    Element** frequent;
+    int number_of_frequent;
+    int number_of_candidates;
+    DiscoveredSequence candidates[DISCOVERY_MAX_CANDIDATES];
+} AdaptorDiscovery;
+
+void adaptor_discovery_initialise(AdaptorDiscovery* discovery);
+void adaptor_discovery_add_read(AdaptorDiscovery* discovery, char* read, int read_size);
+void adaptor_discovery_run(AdaptorDiscovery* discovery);
+int adaptor_discovery_compare(char* candidate, int candidate_length, char* adaptor, int adaptor_length, int* overlap);
+void adaptor_discovery_free(AdaptorDiscovery* discovery);
+
+#endif /* ADAPTOR_DISCOVERY_H_ */
@@ -0,0 +1,72 @@
+/*----------------------------------------------------------------------*
+ * File:    adaptor_set.h                                               *
+ * Purpose: Sets of junction/external adaptors and a seed index used    *
+ *          to screen many adaptor variants in a single pass of a read  *
+ *----------------------------------------------------------------------*/
+
+#ifndef ADAPTOR_SET_H_
+#define ADAPTOR_SET_H_
+
+#define MAX_ADAPTORS 64
+#define MAX_ADAPTOR_NAME_LENGTH 64
+// Junction adaptors are stored doubled, so 2 * 63 still fits the gapped aligner and the 128 byte adaptor buffers
+#define MAX_ADAPTOR_LENGTH 63
+#define MAX_ADAPTOR_CANDIDATES 8192
+// At most half full, so probes stay short
+#define CANDIDATE_TABLE_BITS 14
+#define CANDIDATE_TABLE_SIZE (1 << CANDIDATE_TABLE_BITS)
+#define MINIMUM_SEED_SIZE 4
+#define MAXIMUM_SEED_SIZE 12
+
+// Candidates are stored as (adaptor << 16) | (offset + CANDIDATE_OFFSET_BIAS), so they sort by adaptor then offset
+#define CANDIDATE_OFFSET_BIAS 256
+#define CANDIDATE_ADAPTOR(c) ((c) >> 16)
+#define CANDIDATE_OFFSET(c) (((c) & 0xFFFF) - CANDIDATE_OFFSET_BIAS)
+
+#define ADAPTOR_JUNCTION 0
+#define ADAPTOR_EXTERNAL 1
+
+#define ADAPTOR_READ_ONE 1
+#define ADAPTOR_READ_TWO 2
+
+typedef struct {
+    char name[MAX_ADAPTOR_NAME_LENGTH];
+    char sequence[2 * MAX_ADAPTOR_LENGTH + 1];
+    int length;
+    int half_length;
+    int type;
+    int reads;
+    // Seeds an acceptable alignment is sure to share with the read - diagonals with fewer aren't scored
+    int minimum_hits;
+} Adaptor;
+
+typedef struct {
+    int number_of_adaptors;
+    Adaptor adaptors[MAX_ADAPTORS];
+    int primary_junction;
+    int primary_external[2];
+    int number_of_variants;
+    int seed_size;
+    int* seed_index;
+    uint32_t* seed_hits;
+} AdaptorSet;
+
+typedef struct {
+    int number_of_candidates;
+    boolean overflow;
+    uint32_t candidates[MAX_ADAPTOR_CANDIDATES];
+    // Seed hits per diagonal while a read is scanned - open addressed, and left empty between reads
+    uint32_t diagonals[CANDIDATE_TABLE_SIZE];
+    uint8_t hits[CANDIDATE_TABLE_SIZE];
+    uint16_t slots[MAX_ADAPTOR_CANDIDATES];
+} AdaptorCandidates;
+
+void adaptor_set_initialise(AdaptorSet* set);
+int adaptor_set_add(AdaptorSet* set, char* name, int type, int reads, char* sequence);
+void adaptor_set_load(AdaptorSet* set, char* filename);
+boolean adaptor_set_is_variant(AdaptorSet* set, int index);
+void adaptor_set_compile(AdaptorSet* set, int seed_size);
+void adaptor_set_find_candidates(AdaptorSet* set, char* read, int read_size, AdaptorCandidates* candidates);
+void adaptor_set_free(AdaptorSet* set);
+
+#endif /* ADAPTOR_SET_H_ */
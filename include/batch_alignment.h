@@ -0,0 +1,45 @@
+/*----------------------------------------------------------------------*
+ * File:    batch_alignment.h                                           *
+ * Purpose: Ungapped adaptor alignment of a batch of same-length reads, *
+ *          one read per SIMD lane                                      *
+ *----------------------------------------------------------------------*/
+
+#ifndef BATCH_ALIGNMENT_H_
+#define BATCH_ALIGNMENT_H_
+
+// Batching needs SSE2 - without it, callers should use the one read at a time path
+#ifdef __SSE2__
+#define BATCH_ALIGNMENT_AVAILABLE
+#endif
+
+// One read per byte of a 128-bit register
+#define BATCH_LANES 16
+
+// Longer reads aren't batched, which keeps the transposed reads small enough for the stack
+#define BATCH_MAX_READ_LENGTH 512
+
+// Scores are held in signed bytes, so adaptors must be shorter than this
+#define BATCH_MAX_ADAPTOR_LENGTH 127
+
+#define BATCH_NO_POSITION -100000
+
+typedef struct {
+    int read_size;
+    uint8_t columns[BATCH_MAX_READ_LENGTH][BATCH_LANES] __attribute__((aligned(16)));
+} BatchReads;
+
+typedef struct {
+    int score[BATCH_LANES];
+    int matches[BATCH_LANES][2];
+    int position[BATCH_LANES];
+    int offsets_evaluated[BATCH_LANES];
+} BatchAlignment;
+
+void batch_load_reads(char* reads[BATCH_LANES], int read_size, BatchReads* batch);
+void batch_junction_alignment(BatchReads* batch, char* adaptor, int adaptor_length, int half_length, int double_match, int single_match, BatchAlignment* result);
+void batch_sequence_alignment(BatchReads* batch, char* sequence, int seq_length, BatchAlignment* result);
+void batch_junction_alignment_generic(BatchReads* batch, char* adaptor, int adaptor_length, int half_length, int double_match, int single_match, BatchAlignment* result);
+void batch_sequence_alignment_generic(BatchReads* batch, char* sequence, int seq_length, BatchAlignment* result);
+void batch_alignment_benchmark(int double_match, int single_match);
+
+#endif /* BATCH_ALIGNMENT_H_ */
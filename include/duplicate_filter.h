@@ -0,0 +1,37 @@
+/*----------------------------------------------------------------------*
+ * File:    duplicate_filter.h                                          *
+ * Purpose: Fixed size counting cuckoo filter for approximate PCR       *
+ *          duplicate detection when the hash table won't fit           *
+ *----------------------------------------------------------------------*/
+
+#ifndef DUPLICATE_FILTER_H_
+#define DUPLICATE_FILTER_H_
+
+#define DUPLICATE_FILTER_BUCKET_SIZE 4
+#define DUPLICATE_FILTER_FINGERPRINT_BITS 20
+#define DUPLICATE_FILTER_COUNT_BITS 12
+#define DUPLICATE_FILTER_MAX_COUNT ((1 << DUPLICATE_FILTER_COUNT_BITS) - 1)
+
+typedef struct {
+    uint32_t* slots;
+    uint64_t bucket_mask;
+    uint64_t number_of_buckets;
+    long int entries;
+    long int lookups;
+    long int failed_inserts;
+    long int saturated;
+    double expected_false_matches;
+    uint32_t victim;
+    uint64_t victim_bucket;
+    uint32_t random_state;
+} DuplicateFilter;
+
+boolean duplicate_filter_initialise(DuplicateFilter* filter, long int memory_meg);
+boolean duplicate_filter_add(DuplicateFilter* filter, void* key, int length);
+void duplicate_filter_traverse(DuplicateFilter* filter, void (*f)(int count));
+long int duplicate_filter_capacity(DuplicateFilter* filter);
+double duplicate_filter_false_positive_rate(DuplicateFilter* filter);
+void duplicate_filter_print_stats(DuplicateFilter* filter);
+void duplicate_filter_free(DuplicateFilter* filter);
+
+#endif /* DUPLICATE_FILTER_H_ */
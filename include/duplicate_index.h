@@ -0,0 +1,39 @@
+/*----------------------------------------------------------------------*
+ * File:    duplicate_index.h                                           *
+ * Purpose: Error-tolerant PCR duplicate detection - one record per     *
+ *          pair, found through any of three sub-signatures             *
+ *----------------------------------------------------------------------*/
+
+#ifndef DUPLICATE_INDEX_H_
+#define DUPLICATE_INDEX_H_
+
+#define DUPLICATE_INDEX_SUBSIGNATURES 3
+#define DUPLICATE_INDEX_HASH_BITS 52
+#define DUPLICATE_INDEX_MIN_BITS 16
+#define DUPLICATE_INDEX_MAX_BITS 40
+
+typedef struct {
+    uint64_t* slots;
+    int slot_bits;
+    uint64_t number_of_slots;
+    uint64_t slot_mask;
+    int fingerprint_bits;
+    long int entries;
+    int longest_probe;
+    uint32_t* counts;
+    long int number_of_records;
+    long int records_allocated;
+    double expected_false_matches;
+} DuplicateIndex;
+
+int duplicate_index_bits_for(long int pairs);
+uint64_t duplicate_index_memory(int slot_bits, long int pairs);
+boolean duplicate_index_initialise(DuplicateIndex* index, int slot_bits);
+uint64_t duplicate_index_hash(BinaryKmer* signature, int which);
+boolean duplicate_index_reserve(DuplicateIndex* index, long int pairs);
+boolean duplicate_index_add(DuplicateIndex* index, uint64_t* hashes, uint64_t* record_return);
+void duplicate_index_traverse(DuplicateIndex* index, void (*f)(int count));
+void duplicate_index_print_stats(DuplicateIndex* index);
+void duplicate_index_free(DuplicateIndex* index);
+
+#endif /* DUPLICATE_INDEX_H_ */
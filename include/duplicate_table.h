@@ -0,0 +1,109 @@
+/*----------------------------------------------------------------------*
+ * File:    duplicate_table.h                                           *
+ * Purpose: Compact exact table of PCR duplicate signatures and counts  *
+ *----------------------------------------------------------------------*/
+
+#ifndef DUPLICATE_TABLE_H_
+#define DUPLICATE_TABLE_H_
+
+#include <pthread.h>
+
+#define DUPLICATE_TABLE_MIN_SIGNATURE_BITS 48
+#define DUPLICATE_TABLE_MAX_SIGNATURE_BITS 122
+#define DUPLICATE_TABLE_MAX_SLOT_WORDS 4
+#define DUPLICATE_TABLE_MIN_BITS 16
+#define DUPLICATE_TABLE_MAX_BITS 40
+#define DUPLICATE_TABLE_MAX_THREADS 64
+#define DUPLICATE_TABLE_PARTITION_SLOT_BITS 16
+#define DUPLICATE_TABLE_MAX_PARTITION_BITS 10
+#define DUPLICATE_TABLE_FILE_MAGIC 0x5041544550554443ULL
+#define DUPLICATE_TABLE_FILE_VERSION 4
+#define DUPLICATE_TABLE_FILE_ALIGNMENT 4096
+#define DUPLICATE_TABLE_MAX_PATH 1024
+
+typedef struct {
+    uint64_t slot;
+    uint64_t extra;
+} DuplicateOverflow;
+
+typedef struct {
+    uint64_t home;
+    uint32_t remainder[DUPLICATE_TABLE_MAX_SLOT_WORDS - 1];
+    uint32_t remainder_high;
+    uint32_t partition;
+    boolean flag;
+} DuplicateTableKey;
+
+typedef struct {
+    uint64_t read_pairs;
+    uint64_t invalid_pairs;
+    uint64_t duplicates;
+} DuplicateTableTotals;
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t signature_bits;
+    uint32_t slot_words;
+    uint32_t distance_bits;
+    uint32_t slot_bits;
+    uint32_t partition_bits;
+    uint32_t signature_type;
+    uint32_t window_count;
+    uint32_t window_size;
+    uint32_t window_offset;
+    uint64_t unique;
+    uint64_t longest_probe;
+    uint64_t slots_offset;
+    uint64_t overflow_offset;
+    uint64_t overflow_size;
+    DuplicateTableTotals totals;
+} DuplicateTableFileHeader;
+
+typedef struct {
+    uint32_t* slots;
+    LargeMemoryStats memory;
+    int signature_type;
+    int window_count;
+    int window_size;
+    int window_offset;
+    int signature_bits;
+    int slot_words;
+    int slot_bits;
+    uint64_t number_of_slots;
+    uint64_t slot_mask;
+    int remainder_bits;
+    int count_bits;
+    uint32_t max_count;
+    int partition_bits;
+    int number_of_partitions;
+    uint64_t partition_mask;
+    long int unique;
+    long int probes;
+    long int lookups;
+    int longest_probe;
+    DuplicateOverflow* overflow;
+    int overflow_size;
+    int overflow_allocated;
+    pthread_mutex_t overflow_lock;
+    void* mapping;
+    size_t mapping_size;
+} DuplicateTable;
+
+int duplicate_table_bits_for(long int entries);
+int duplicate_table_slot_words(int signature_bits);
+uint64_t duplicate_table_memory(int slot_bits, int signature_bits);
+boolean duplicate_table_initialise(DuplicateTable* table, int slot_bits, int signature_bits);
+void duplicate_table_prepare(DuplicateTable* table, BinaryKmer* signature, DuplicateTableKey* key);
+void duplicate_table_prefetch(DuplicateTable* table, DuplicateTableKey* key);
+uint64_t duplicate_table_add(DuplicateTable* table, DuplicateTableKey* key, boolean* found);
+boolean duplicate_table_reserve(DuplicateTable* table, long int incoming, int threads);
+boolean duplicate_table_get_flag(DuplicateTable* table, uint64_t slot);
+void duplicate_table_traverse(DuplicateTable* table, void (*f)(int count));
+void duplicate_table_print_stats(DuplicateTable* table);
+boolean duplicate_table_save(DuplicateTable* table, char* filename, DuplicateTableTotals* totals);
+boolean duplicate_table_load(DuplicateTable* table, char* filename, DuplicateTableTotals* totals);
+void duplicate_table_free(DuplicateTable* table);
+
+#endif /* DUPLICATE_TABLE_H_ */
@@ -0,0 +1,38 @@
+/*----------------------------------------------------------------------*
+ * File:    external_sort.h                                             *
+ * Purpose: Sort more fixed size records than fit in memory, using      *
+ *          radix sorted runs on disk and a k-way merge                 *
+ *----------------------------------------------------------------------*/
+
+#ifndef EXTERNAL_SORT_H_
+#define EXTERNAL_SORT_H_
+
+#define EXTERNAL_SORT_MAX_PATH 1024
+#define EXTERNAL_SORT_MAX_RUNS 1000
+#define EXTERNAL_SORT_MAX_THREADS 64
+
+typedef struct {
+    int words;
+    int threads;
+    char prefix[EXTERNAL_SORT_MAX_PATH];
+    long int memory_bytes;
+    uint64_t* buffer;
+    uint64_t* spare;
+    long int capacity;
+    long int used;
+    long int records;
+    long int position;
+    int number_of_runs;
+    FILE** run_fp;
+    uint64_t* heads;
+    int* heap;
+    int heap_size;
+} ExternalSort;
+
+boolean external_sort_initialise(ExternalSort* sorter, char* prefix, int words, long int memory_bytes, int threads);
+void external_sort_add(ExternalSort* sorter, uint64_t* record);
+void external_sort_finish(ExternalSort* sorter);
+boolean external_sort_next(ExternalSort* sorter, uint64_t* record);
+void external_sort_free(ExternalSort* sorter);
+
+#endif /* EXTERNAL_SORT_H_ */
@@ -0,0 +1,32 @@
+/*----------------------------------------------------------------------*
+ * File:    gapped_alignment.h                                          *
+ * Purpose: Banded Smith-Waterman used to rescue adaptors with indels   *
+ *----------------------------------------------------------------------*/
+
+#ifndef GAPPED_ALIGNMENT_H_
+#define GAPPED_ALIGNMENT_H_
+
+// The band is 8 diagonals wide (-4 to +3 around the ungapped offset), which is one SSE2 register of 16-bit cells
+#define GAPPED_BAND_WIDTH 8
+#define GAPPED_BAND_OFFSET 4
+#define GAPPED_MAX_QUERY_LENGTH 128
+
+#define GAPPED_MATCH_SCORE 2
+#define GAPPED_MISMATCH_PENALTY 3
+#define GAPPED_GAP_PENALTY 4
+
+typedef struct {
+    int score;
+    int matches[2];
+    int mismatches[2];
+    int insertions;
+    int deletions;
+    int read_start;
+    int read_end;
+    int query_start;
+    int query_end;
+} GappedAlignment;
+
+boolean gapped_alignment_banded(char* query, int query_length, int split_position, char* read, int read_size, int diagonal, GappedAlignment* result);
+
+#endif /* GAPPED_ALIGNMENT_H_ */
@@ -41,7 +41,8 @@
 #define HASH_H_
 
 #define MAGIC_TEXT "BINARY_HASH"
-#define HASH_VERSION 1
+#define HASH_VERSION 2
+#define TAG_GROUP_SIZE 16
 #ifdef ENABLE_READ_PAIR
 struct read_pair_descriptor_array;
 #endif
@@ -51,6 +52,8 @@ typedef struct {
     long long pruned_kmers;
     int bucket_size;
     Element * table;
+    LargeMemoryStats table_memory;
+    uint8_t * tags; //one per element, zero if empty
     long long * collisions;
     int * next_element; //keeps index of the next free element in bucket
     int max_rehash_tries;
@@ -41,6 +41,8 @@
 
 
 int hash_value(Key key, int number_buckets);
+uint32_t hashlittle(const void *key, size_t length, uint32_t initval);
+void hashlittle2(const void *key, size_t length, uint32_t *pc, uint32_t *pb);
 
 
 #endif /* HASH_VAL_H_ */
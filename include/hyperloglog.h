@@ -0,0 +1,21 @@
+/*----------------------------------------------------------------------*
+ * File:    hyperloglog.h                                               *
+ * Purpose: Estimate the number of distinct values seen in a few KB     *
+ *----------------------------------------------------------------------*/
+
+#ifndef HYPERLOGLOG_H_
+#define HYPERLOGLOG_H_
+
+#define HYPERLOGLOG_PRECISION 12
+#define HYPERLOGLOG_REGISTERS (1 << HYPERLOGLOG_PRECISION)
+
+typedef struct {
+    uint8_t registers[HYPERLOGLOG_REGISTERS];
+} HyperLogLog;
+
+void hyperloglog_initialise(HyperLogLog* sketch);
+void hyperloglog_add(HyperLogLog* sketch, uint64_t hash);
+double hyperloglog_estimate(HyperLogLog* sketch);
+double hyperloglog_standard_error(void);
+
+#endif /* HYPERLOGLOG_H_ */
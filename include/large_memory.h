@@ -0,0 +1,28 @@
+/*----------------------------------------------------------------------*
+ * File:    large_memory.h                                              *
+ * Purpose: Zeroed memory for big tables on huge pages, touched in      *
+ *          parallel across NUMA nodes                                  *
+ *----------------------------------------------------------------------*/
+
+#ifndef LARGE_MEMORY_H_
+#define LARGE_MEMORY_H_
+
+#define LARGE_MEMORY_SMALL_PAGES 0
+#define LARGE_MEMORY_TRANSPARENT_HUGE_PAGES 1
+#define LARGE_MEMORY_HUGETLB_PAGES 2
+
+typedef struct {
+    size_t bytes;
+    int pages;
+    int nodes;
+    boolean interleaved;
+    double seconds;
+    long int page_faults;
+} LargeMemoryStats;
+
+void large_memory_configure(int threads, boolean interleave_pages);
+void* large_memory_allocate(size_t bytes, LargeMemoryStats* stats);
+void large_memory_free(void* memory, size_t bytes);
+void large_memory_print_stats(LargeMemoryStats* stats);
+
+#endif /* LARGE_MEMORY_H_ */
@@ -0,0 +1,51 @@
+/*----------------------------------------------------------------------*
+ * File:    optical_grid.h                                              *
+ * Purpose: Spatial index of pairs by lane, tile and position, for      *
+ *          telling optical duplicates from PCR duplicates              *
+ *----------------------------------------------------------------------*/
+
+#ifndef OPTICAL_GRID_H_
+#define OPTICAL_GRID_H_
+
+typedef struct {
+    int lane;
+    int tile;
+    int x;
+    int y;
+} OpticalLocation;
+
+typedef struct {
+    uint64_t cluster;
+    int32_t x;
+    int32_t y;
+    int32_t tile;
+    int16_t lane;
+    int16_t occupied;
+} OpticalEntry;
+
+typedef struct {
+    OpticalEntry* entries;
+    uint64_t capacity;
+    uint64_t peak_capacity;
+    uint64_t mask;
+    long int used;
+    int distance;
+    int lane;
+    int tile;
+    long int tile_used;
+    boolean tile_ordered;
+    long int entries_dropped;
+    boolean undercounted;
+    uint64_t* finished_tiles;
+    int n_finished_tiles;
+    int finished_tiles_capacity;
+} OpticalGrid;
+
+boolean optical_grid_parse_header(char* header, OpticalLocation* location);
+boolean optical_grid_initialise(OpticalGrid* grid, int distance);
+boolean optical_grid_add(OpticalGrid* grid, uint64_t cluster, OpticalLocation* location);
+uint64_t optical_grid_memory_for(long int pairs);
+void optical_grid_print_stats(OpticalGrid* grid);
+void optical_grid_free(OpticalGrid* grid);
+
+#endif /* OPTICAL_GRID_H_ */
@@ -0,0 +1,52 @@
+/*----------------------------------------------------------------------*
+ * File:    pair_cache.h                                                *
+ * Purpose: Cache of adaptor classification results for read pairs     *
+ *          seen before, keyed by a fingerprint of both reads           *
+ *----------------------------------------------------------------------*/
+
+#ifndef PAIR_CACHE_H_
+#define PAIR_CACHE_H_
+
+#define PAIR_CACHE_JUNCTION_ACCEPTED 1
+#define PAIR_CACHE_EXTERNAL_ACCEPTED 2
+#define PAIR_CACHE_UNGAPPED_ACCEPTED 4
+#define PAIR_CACHE_JUNCTION_GAPPED 8
+#define PAIR_CACHE_EXTERNAL_GAPPED 16
+
+typedef struct {
+    uint64_t word[2];
+} PairFingerprint;
+
+typedef struct {
+    int16_t junction_read_start;
+    int16_t external_read_start;
+    uint16_t junction_offsets_evaluated;
+    uint16_t external_offsets_evaluated;
+    uint8_t junction_matches[2];
+    uint8_t junction_total_matches;
+    uint8_t ungapped_matches[2];
+    uint8_t ungapped_total_matches;
+    uint8_t junction_adaptor;
+    uint8_t external_adaptor;
+    uint8_t flags;
+} CachedRead;
+
+typedef struct {
+    PairFingerprint fingerprint;
+    CachedRead reads[2];
+} CachedPair;
+
+typedef struct {
+    uint64_t mask;
+    CachedPair* entries;
+    long int lookups;
+    long int hits;
+} PairCache;
+
+void pair_cache_fingerprint(char* read_one, int length_one, char* read_two, int length_two, PairFingerprint* fingerprint);
+boolean pair_cache_initialise(PairCache* cache, int entries);
+CachedPair* pair_cache_find(PairCache* cache, PairFingerprint* fingerprint);
+CachedPair* pair_cache_slot(PairCache* cache, PairFingerprint* fingerprint);
+void pair_cache_free(PairCache* cache);
+
+#endif /* PAIR_CACHE_H_ */
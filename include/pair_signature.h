@@ -0,0 +1,27 @@
+/*----------------------------------------------------------------------*
+ * File:    pair_signature.h                                            *
+ * Purpose: Pack read windows straight into a canonical duplicate       *
+ *          signature                                                   *
+ *----------------------------------------------------------------------*/
+
+#ifndef PAIR_SIGNATURE_H_
+#define PAIR_SIGNATURE_H_
+
+#define PAIR_SIGNATURE_MAX_WINDOW 16
+#define PAIR_SIGNATURE_MAX_BASES 63
+
+typedef struct PairSignatureGeometry PairSignatureGeometry;
+typedef void (*PairSignatureBuilder)(PairSignatureGeometry* geometry, char** windows, BinaryKmer* signature, boolean* swapped);
+
+struct PairSignatureGeometry {
+    int n_windows;
+    int window_size;
+    PairSignatureBuilder build;
+};
+
+void pair_signature_build(char** windows, int n_windows, int window_size, BinaryKmer* signature);
+void pair_signature_build_mate_swap(char** windows, int n_windows, int window_size, BinaryKmer* signature, boolean* swapped);
+boolean pair_signature_set_geometry(PairSignatureGeometry* geometry, int n_windows, int window_size, boolean mate_swap);
+void pair_signature_minimizers(char* read, int read_size, int window_size, int n_regions, int* positions);
+
+#endif /* PAIR_SIGNATURE_H_ */
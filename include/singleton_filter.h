@@ -0,0 +1,30 @@
+/*----------------------------------------------------------------------*
+ * File:    singleton_filter.h                                          *
+ * Purpose: Blocked Bloom filter that keeps signatures seen only once   *
+ *          out of the duplicate table                                  *
+ *----------------------------------------------------------------------*/
+
+#ifndef SINGLETON_FILTER_H_
+#define SINGLETON_FILTER_H_
+
+#define SINGLETON_FILTER_BLOCK_WORDS 8
+#define SINGLETON_FILTER_MAX_HASHES 7
+
+typedef struct {
+    uint64_t* blocks;
+    uint64_t number_of_blocks;
+    int block_bits;
+    int hashes;
+    long int entries;
+    long int repeats;
+    double expected_false_matches;
+} SingletonFilter;
+
+boolean singleton_filter_initialise(SingletonFilter* filter, long int memory_meg, long int expected_entries);
+void singleton_filter_prefetch(SingletonFilter* filter, uint64_t hash);
+boolean singleton_filter_add(SingletonFilter* filter, uint64_t hash);
+uint64_t singleton_filter_memory(SingletonFilter* filter);
+void singleton_filter_print_stats(SingletonFilter* filter);
+void singleton_filter_free(SingletonFilter* filter);
+
+#endif /* SINGLETON_FILTER_H_ */
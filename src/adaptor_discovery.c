@@ -0,0 +1,540 @@
+/*----------------------------------------------------------------------*
+ * File:    adaptor_discovery.c                                         *
+ * Purpose: Find over-represented sequences, such as unexpected         *
+ *          adaptors, in a sample of reads by counting k-mers           *
+ *----------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "global.h"
+#include "flags.h"
+#include "binary_kmer.h"
+#include "element.h"
+#include "large_memory.h"
+#include "hash_table.h"
+#include "adaptor_discovery.h"
+
+/*
+ * Every k-mer of every sampled read is counted in a HashTable, keyed on the
+ * canonical k-mer as for PCR duplicates. Adaptors turn up in a good fraction
+ * of reads, so their k-mers stand out from genomic ones, which are seen about
+ * once. Starting from the most frequent k-mer not yet used, candidates are
+ * assembled by greedily walking the de Bruijn graph of frequent k-mers in
+ * both directions. A second pass over the sample then finds how many reads
+ * contain each candidate, in which orientation and where.
+ *
+ * The junction adaptor is its own reverse complement, so walking through its
+ * middle revisits the same canonical k-mers in the opposite orientation. To
+ * allow that, but not loops, each k-mer records which candidate used it and
+ * in which orientation.
+ */
+
+#define DISCOVERY_MINIMUM_COUNT 10
+#define DISCOVERY_MINIMUM_FRACTION 200
+#define DISCOVERY_USED_FORWARD (1 << 1)
+#define DISCOVERY_USED_REVERSE (1 << 2)
+#define DISCOVERY_USED (DISCOVERY_USED_FORWARD | DISCOVERY_USED_REVERSE)
+#define DISCOVERY_CANDIDATE_SHIFT 3
+#define DISCOVERY_MAX_ID ((1 << (16 - DISCOVERY_CANDIDATE_SHIFT)) - 1)
+#define DISCOVERY_DOMINANCE 2
+
+/*----------------------------------------------------------------------*
+ * Function:   reverse_complement_string
+ * Purpose:    Reverse complement a sequence in place
+ * Parameters: sequence -> sequence
+ *             length = length of sequence
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void reverse_complement_string(char* sequence, int length)
+{
+    int i;
+
+    for (i=0; i<length/2; i++) {
+        char c = sequence[i];
+        sequence[i] = reverse_char_nucleotide(sequence[length - i - 1]);
+        sequence[length - i - 1] = reverse_char_nucleotide(c);
+    }
+
+    if (length % 2) {
+        sequence[length/2] = reverse_char_nucleotide(sequence[length/2]);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   find_kmer
+ * Purpose:    Look up a k-mer given as a string
+ * Parameters: discovery -> AdaptorDiscovery structure
+ *             kmer_string -> DISCOVERY_KMER_SIZE bases
+ *             orientation -> set to 0 if the k-mer is stored as given,
+ *                            1 if stored as its reverse complement
+ * Returns:    Pointer to element, or NULL if not found
+ *----------------------------------------------------------------------*/
+static Element* find_kmer(AdaptorDiscovery* discovery, char* kmer_string, int* orientation)
+{
+    BinaryKmer kmer;
+    BinaryKmer tmp_kmer;
+    Key key;
+
+    seq_to_binary_kmer(kmer_string, DISCOVERY_KMER_SIZE, &kmer);
+    key = element_get_key(&kmer, DISCOVERY_KMER_SIZE, &tmp_kmer);
+    *orientation = binary_kmer_comparison_operator(kmer, *key) ? 0:1;
+
+    return hash_table_find(key, discovery->kmers);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   adaptor_discovery_initialise
+ * Purpose:    Initialise an empty discovery
+ * Parameters: discovery -> AdaptorDiscovery structure
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void adaptor_discovery_initialise(AdaptorDiscovery* discovery)
+{
+    discovery->sample = NULL;
+    discovery->sample_size = 0;
+    discovery->sample_allocated = 0;
+    discovery->number_of_reads = 0;
+    discovery->max_read_length = 0;
+    discovery->number_of_kmers = 0;
+    discovery->minimum_count = 0;
+    discovery->kmers = NULL;
+    discovery->frequent = NULL;
+    discovery->number_of_frequent = 0;
+    discovery->number_of_candidates = 0;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   adaptor_discovery_add_read
+ * Purpose:    Add a read to the sample
+ * Parameters: discovery -> AdaptorDiscovery structure
+ *             read -> bases of read
+ *             read_size = length of read
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void adaptor_discovery_add_read(AdaptorDiscovery* discovery, char* read, int read_size)
+{
+    if (discovery->sample_size + read_size + 1 > discovery->sample_allocated) {
+        discovery->sample_allocated = 2 * (discovery->sample_allocated + read_size + 1);
+        discovery->sample = realloc(discovery->sample, discovery->sample_allocated);
+        if (discovery->sample == NULL) {
+            printf("Error: can't allocate memory for adaptor discovery sample\n");
+            exit(1);
+        }
+    }
+
+    memcpy(discovery->sample + discovery->sample_size, read, read_size);
+    discovery->sample[discovery->sample_size + read_size] = 0;
+    discovery->sample_size += read_size + 1;
+    discovery->number_of_reads++;
+
+    if (read_size > discovery->max_read_length) {
+        discovery->max_read_length = read_size;
+    }
+
+    if (read_size >= DISCOVERY_KMER_SIZE) {
+        discovery->number_of_kmers += read_size - DISCOVERY_KMER_SIZE + 1;
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   count_kmers
+ * Purpose:    Count every k-mer of the sample
+ * Parameters: discovery -> AdaptorDiscovery structure
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void count_kmers(AdaptorDiscovery* discovery)
+{
+    KmerSlidingWindowSet* windows;
+    BinaryKmer tmp_kmer;
+    double required_entries = discovery->number_of_kmers / 0.8;
+    int b = 100;
+    int n = ceil(log(required_entries/b)/log(2));
+    char* read;
+    int i, j;
+
+    // Size for the worst case, where every k-mer is different
+    if (n < 10) {
+        n = 10;
+    }
+
+    discovery->kmers = hash_table_new(n, b, 25, DISCOVERY_KMER_SIZE);
+    if (discovery->kmers == NULL) {
+        printf("Error: No memory for adaptor discovery hash table\n");
+        exit(101);
+    }
+
+    windows = binary_kmer_sliding_window_set_new_from_read_length(DISCOVERY_KMER_SIZE, discovery->max_read_length);
+
+    for (read = discovery->sample; read < discovery->sample + discovery->sample_size; read += strlen(read) + 1) {
+        get_sliding_windows_from_sequence(read, NULL, strlen(read), 0, DISCOVERY_KMER_SIZE, windows, windows->max_nwindows, windows->max_kmers, false, 0);
+
+        for (i=0; i<windows->nwindows; i++) {
+            KmerSlidingWindow* window = &windows->window[i];
+
+            for (j=0; j<window->nkmers; j++) {
+                boolean found = false;
+                Key key = element_get_key(&window->kmer[j], DISCOVERY_KMER_SIZE, &tmp_kmer);
+                Element* e = hash_table_find_or_insert(key, &found, discovery->kmers);
+
+                if (e == NULL) {
+                    printf("Error: adaptor discovery hash table not big enough!\n");
+                    exit(101);
+                }
+
+                if (found) {
+                    if (e->count < UINT16_MAX) {
+                        e->count++;
+                    }
+                } else {
+                    e->flags = ASSIGNED;
+                    e->count = 1;
+                }
+            }
+        }
+    }
+
+    binary_kmer_free_kmers_set(&windows);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   store_frequent_kmer
+ * Purpose:    Hash table traversal callback to collect frequent k-mers
+ * Parameters: e -> element
+ *             args -> AdaptorDiscovery structure
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void store_frequent_kmer(Element* e, void* args)
+{
+    AdaptorDiscovery* discovery = args;
+
+    if (e->count >= discovery->minimum_count) {
+        discovery->frequent[discovery->number_of_frequent++] = e;
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   compare_frequent_kmers
+ * Purpose:    qsort comparison to put most frequent k-mers first
+ * Parameters: a, b -> pointers to Element pointers
+ * Returns:    qsort order
+ *----------------------------------------------------------------------*/
+static int compare_frequent_kmers(const void* a, const void* b)
+{
+    Element* e_a = *(Element**)a;
+    Element* e_b = *(Element**)b;
+
+    if (e_a->count != e_b->count) {
+        return e_a->count > e_b->count ? -1:1;
+    }
+
+    // Ties broken by position in the table, so the order doesn't depend on qsort
+    return e_a < e_b ? -1 : (e_a > e_b ? 1:0);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   extend_candidate
+ * Purpose:    Greedily extend a candidate to the right, taking the most
+ *             frequent next k-mer for as long as it clearly dominates
+ * Parameters: discovery -> AdaptorDiscovery structure
+ *             candidate -> candidate
+ *             id = number marking k-mers used by this candidate
+ *             flip = 1 if the candidate is currently reverse complemented
+ *             total_count -> running total of k-mer counts
+ * Returns:    true if extension ran into an earlier candidate
+ *----------------------------------------------------------------------*/
+static boolean extend_candidate(AdaptorDiscovery* discovery, DiscoveredSequence* candidate, int id, int flip, long int* total_count)
+{
+    char kmer_string[DISCOVERY_KMER_SIZE + 1];
+    char* bases = "ACGT";
+
+    while (candidate->length < DISCOVERY_MAX_CANDIDATE_LENGTH) {
+        Element* best = NULL;
+        int best_orientation = 0;
+        int best_base = 0;
+        int second_count = 0;
+        int used;
+        int b;
+
+        strncpy(kmer_string, candidate->sequence + candidate->length - DISCOVERY_KMER_SIZE + 1, DISCOVERY_KMER_SIZE - 1);
+        kmer_string[DISCOVERY_KMER_SIZE] = 0;
+
+        for (b=0; b<4; b++) {
+            Element* e;
+            int orientation;
+
+            kmer_string[DISCOVERY_KMER_SIZE - 1] = bases[b];
+            e = find_kmer(discovery, kmer_string, &orientation);
+            if (e == NULL) {
+                continue;
+            }
+
+            if ((best == NULL) || (e->count > best->count)) {
+                if (best != NULL) {
+                    second_count = best->count;
+                }
+                best = e;
+                best_orientation = orientation;
+                best_base = b;
+            } else if (e->count > second_count) {
+                second_count = e->count;
+            }
+        }
+
+        // Stop at the end of the over-represented sequence, where what follows varies from read to read
+        if ((best == NULL) || (best->count < discovery->minimum_count) || (best->count < DISCOVERY_DOMINANCE * second_count)) {
+            break;
+        }
+
+        // Orientation relative to the finished candidate
+        used = (best_orientation ^ flip) ? DISCOVERY_USED_REVERSE : DISCOVERY_USED_FORWARD;
+
+        if (best->flags & DISCOVERY_USED) {
+            if ((best->flags >> DISCOVERY_CANDIDATE_SHIFT) != id) {
+                return true;
+            }
+            if (best->flags & used) {
+                break;
+            }
+        }
+
+        best->flags |= used | (id << DISCOVERY_CANDIDATE_SHIFT);
+        candidate->sequence[candidate->length++] = bases[best_base];
+        candidate->sequence[candidate->length] = 0;
+        *total_count += best->count;
+    }
+
+    return false;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   assemble_candidates
+ * Purpose:    Build candidate sequences from the frequent k-mers
+ * Parameters: discovery -> AdaptorDiscovery structure
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void assemble_candidates(AdaptorDiscovery* discovery)
+{
+    void* args[1] = {discovery};
+    int id = 0;
+    int f;
+
+    discovery->frequent = malloc(hash_table_get_unique_kmers(discovery->kmers) * sizeof(Element*));
+    if (discovery->frequent == NULL) {
+        printf("Error: can't allocate memory for frequent k-mers\n");
+        exit(1);
+    }
+
+    hash_table_traverse_with_args(&store_frequent_kmer, args, discovery->kmers);
+    qsort(discovery->frequent, discovery->number_of_frequent, sizeof(Element*), compare_frequent_kmers);
+
+    for (f=0; (f<discovery->number_of_frequent) && (discovery->number_of_candidates < DISCOVERY_MAX_CANDIDATES) && (id < DISCOVERY_MAX_ID); f++) {
+        Element* seed = discovery->frequent[f];
+        DiscoveredSequence* candidate = &discovery->candidates[discovery->number_of_candidates];
+        long int total_count = seed->count;
+        boolean branch = false;
+
+        if (seed->flags & DISCOVERY_USED) {
+            continue;
+        }
+
+        id++;
+        binary_kmer_to_seq(&seed->kmer, DISCOVERY_KMER_SIZE, candidate->sequence);
+        candidate->length = DISCOVERY_KMER_SIZE;
+        seed->flags |= DISCOVERY_USED_FORWARD | (id << DISCOVERY_CANDIDATE_SHIFT);
+
+        // Extend right, then left by extending the reverse complement
+        branch = extend_candidate(discovery, candidate, id, 0, &total_count);
+        reverse_complement_string(candidate->sequence, candidate->length);
+        branch |= extend_candidate(discovery, candidate, id, 1, &total_count);
+        reverse_complement_string(candidate->sequence, candidate->length);
+
+        // Anything running into an earlier candidate is just a variation of it, eg. an adaptor plus the next base
+        if (branch) {
+            continue;
+        }
+
+        candidate->mean_count = (double)total_count / (candidate->length - DISCOVERY_KMER_SIZE + 1);
+
+        // The middle k-mer is used to find the candidate in reads
+        candidate->probe_offset = (candidate->length - DISCOVERY_KMER_SIZE) / 2;
+        strncpy(candidate->probe[0], candidate->sequence + candidate->probe_offset, DISCOVERY_KMER_SIZE);
+        candidate->probe[0][DISCOVERY_KMER_SIZE] = 0;
+        strcpy(candidate->probe[1], candidate->probe[0]);
+        reverse_complement_string(candidate->probe[1], DISCOVERY_KMER_SIZE);
+
+        discovery->number_of_candidates++;
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   locate_candidates
+ * Purpose:    Count reads containing each candidate, in each orientation,
+ *             and where in the read it is
+ * Parameters: discovery -> AdaptorDiscovery structure
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void locate_candidates(AdaptorDiscovery* discovery)
+{
+    char* read;
+    int c, o, i;
+
+    for (read = discovery->sample; read < discovery->sample + discovery->sample_size; read += strlen(read) + 1) {
+        int read_size = strlen(read);
+
+        for (c=0; c<discovery->number_of_candidates; c++) {
+            DiscoveredSequence* candidate = &discovery->candidates[c];
+
+            for (o=0; o<2; o++) {
+                char* hit = strstr(read, candidate->probe[o]);
+                if (hit != NULL) {
+                    candidate->reads[o]++;
+                    candidate->positions[((hit - read) * DISCOVERY_POSITION_BINS) / read_size]++;
+                    break;
+                }
+            }
+        }
+    }
+
+    // Report each candidate the way round it's usually seen, and how far its positions are from uniform
+    for (c=0; c<discovery->number_of_candidates; c++) {
+        DiscoveredSequence* candidate = &discovery->candidates[c];
+        int total = candidate->reads[0] + candidate->reads[1];
+        int largest = 0;
+
+        if (candidate->reads[1] > candidate->reads[0]) {
+            int tmp = candidate->reads[0];
+            reverse_complement_string(candidate->sequence, candidate->length);
+            candidate->reads[0] = candidate->reads[1];
+            candidate->reads[1] = tmp;
+        }
+
+        for (i=0; i<DISCOVERY_POSITION_BINS; i++) {
+            if (candidate->positions[i] > largest) {
+                largest = candidate->positions[i];
+            }
+        }
+
+        candidate->position_skew = total > 0 ? ((double)largest * DISCOVERY_POSITION_BINS) / total : 0;
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   compare_candidates
+ * Purpose:    qsort comparison to put candidates in most reads first
+ * Parameters: a, b -> pointers to DiscoveredSequence structures
+ * Returns:    qsort order
+ *----------------------------------------------------------------------*/
+static int compare_candidates(const void* a, const void* b)
+{
+    const DiscoveredSequence* c_a = a;
+    const DiscoveredSequence* c_b = b;
+    int reads_a = c_a->reads[0] + c_a->reads[1];
+    int reads_b = c_b->reads[0] + c_b->reads[1];
+
+    if (reads_a != reads_b) {
+        return reads_a > reads_b ? -1:1;
+    }
+
+    return strcmp(c_a->sequence, c_b->sequence);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   adaptor_discovery_run
+ * Purpose:    Count k-mers of the sample, assemble over-represented ones
+ *             into candidates and find them in the sampled reads
+ * Parameters: discovery -> AdaptorDiscovery structure
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void adaptor_discovery_run(AdaptorDiscovery* discovery)
+{
+    int c;
+
+    discovery->minimum_count = discovery->number_of_reads / DISCOVERY_MINIMUM_FRACTION;
+    if (discovery->minimum_count < DISCOVERY_MINIMUM_COUNT) {
+        discovery->minimum_count = DISCOVERY_MINIMUM_COUNT;
+    }
+
+    for (c=0; c<DISCOVERY_MAX_CANDIDATES; c++) {
+        memset(&discovery->candidates[c], 0, sizeof(DiscoveredSequence));
+    }
+
+    count_kmers(discovery);
+    assemble_candidates(discovery);
+    locate_candidates(discovery);
+
+    qsort(discovery->candidates, discovery->number_of_candidates, sizeof(DiscoveredSequence), compare_candidates);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   adaptor_discovery_compare
+ * Purpose:    Find the best ungapped overlap between a candidate and
+ *             an adaptor, in either orientation
+ * Parameters: candidate -> candidate sequence
+ *             candidate_length = length of candidate
+ *             adaptor -> adaptor sequence
+ *             adaptor_length = length of adaptor
+ *             overlap -> set to length of best overlap
+ * Returns:    Number of matching bases in best overlap
+ *----------------------------------------------------------------------*/
+int adaptor_discovery_compare(char* candidate, int candidate_length, char* adaptor, int adaptor_length, int* overlap)
+{
+    char reverse[DISCOVERY_MAX_CANDIDATE_LENGTH + 1];
+    int best_matches = 0;
+    int o, x, p;
+
+    strcpy(reverse, candidate);
+    reverse_complement_string(reverse, candidate_length);
+    *overlap = 0;
+
+    for (o=0; o<2; o++) {
+        char* sequence = o == 0 ? candidate : reverse;
+
+        // x is the position in the candidate where the adaptor starts
+        for (x=-adaptor_length+1; x<candidate_length; x++) {
+            int matches = 0;
+            int length = 0;
+
+            for (p=0; p<adaptor_length; p++) {
+                if ((x+p >= 0) && (x+p < candidate_length)) {
+                    length++;
+                    if (sequence[x+p] == adaptor[p]) {
+                        matches++;
+                    }
+                }
+            }
+
+            if (matches > best_matches) {
+                best_matches = matches;
+                *overlap = length;
+            }
+        }
+    }
+
+    return best_matches;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   adaptor_discovery_free
+ * Purpose:    Free discovery memory
+ * Parameters: discovery -> AdaptorDiscovery structure
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void adaptor_discovery_free(AdaptorDiscovery* discovery)
+{
+    if (discovery->kmers) {
+        hash_table_free(&discovery->kmers);
+    }
+
+    if (discovery->frequent) {
+        free(discovery->frequent);
+        discovery->frequent = NULL;
+    }
+
+    if (discovery->sample) {
+        free(discovery->sample);
+        discovery->sample = NULL;
+    }
+}
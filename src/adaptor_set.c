@@ -0,0 +1,442 @@
+/*----------------------------------------------------------------------*
+ * File:    adaptor_set.c                                               *
+ * Purpose: Sets of junction/external adaptors and a seed index used    *
+ *          to screen many adaptor variants in a single pass of a read  *
+ *----------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include "global.h"
+#include "adaptor_set.h"
+
+/*
+ * Each set has one primary junction adaptor and one primary external adaptor
+ * per read - these are the first of each kind listed and get the usual full
+ * scan. Every other adaptor is a variant. Variants are found through a seed
+ * index: all k-mers of all variants go into a direct-indexed table of 4^k
+ * entries, so a single pass over the read finds every (variant, offset)
+ * diagonal sharing a k-mer with the read, whatever the number of variants.
+ * Since all seeds are the same length, the table is the goto function of an
+ * Aho-Corasick automaton over the seeds with the state being the last k
+ * bases. Hits are counted per diagonal, and only the diagonals with enough
+ * of them to hold an acceptable alignment (minimum_hits) are then scored.
+ */
+
+/*----------------------------------------------------------------------*
+ * Function:   base_code
+ * Purpose:    2-bit code for a base
+ * Parameters: c = base
+ * Returns:    0-3, or -1 for anything other than A, C, G, T
+ *----------------------------------------------------------------------*/
+static inline int base_code(char c)
+{
+    switch(c) {
+        case 'A': return 0;
+        case 'C': return 1;
+        case 'G': return 2;
+        case 'T': return 3;
+        default: return -1;
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   complement_base
+ * Purpose:    Complement a base
+ * Parameters: c = base
+ * Returns:    Complementary base
+ *----------------------------------------------------------------------*/
+static char complement_base(char c)
+{
+    switch(c) {
+        case 'A': return 'T';
+        case 'C': return 'G';
+        case 'G': return 'C';
+        case 'T': return 'A';
+        default: return 'N';
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   adaptor_set_initialise
+ * Purpose:    Initialise an empty adaptor set
+ * Parameters: set -> adaptor set
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void adaptor_set_initialise(AdaptorSet* set)
+{
+    set->number_of_adaptors = 0;
+    set->primary_junction = -1;
+    set->primary_external[0] = -1;
+    set->primary_external[1] = -1;
+    set->number_of_variants = 0;
+    set->seed_size = 0;
+    set->seed_index = NULL;
+    set->seed_hits = NULL;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   adaptor_set_add
+ * Purpose:    Add an adaptor to a set. Junction adaptors are stored as
+ *             the adaptor followed by its reverse compliment.
+ * Parameters: set -> adaptor set
+ *             name -> adaptor name
+ *             type = ADAPTOR_JUNCTION or ADAPTOR_EXTERNAL
+ *             reads = reads to look in (ADAPTOR_READ_ONE, ADAPTOR_READ_TWO)
+ *             sequence -> adaptor sequence
+ * Returns:    Index of adaptor in set
+ *----------------------------------------------------------------------*/
+int adaptor_set_add(AdaptorSet* set, char* name, int type, int reads, char* sequence)
+{
+    Adaptor* adaptor;
+    int length = strlen(sequence);
+    int i;
+
+    if (set->number_of_adaptors >= MAX_ADAPTORS) {
+        printf("Error: too many adaptors (maximum %d)\n", MAX_ADAPTORS);
+        exit(1);
+    }
+
+    if ((length < MINIMUM_SEED_SIZE) || (length > MAX_ADAPTOR_LENGTH)) {
+        printf("Error: adaptor %s must be between %d and %d bases\n", name, MINIMUM_SEED_SIZE, MAX_ADAPTOR_LENGTH);
+        exit(1);
+    }
+
+    for (i=0; i<length; i++) {
+        if (base_code(sequence[i]) < 0) {
+            printf("Error: bad base in adaptor %s\n", name);
+            exit(1);
+        }
+    }
+
+    adaptor = &set->adaptors[set->number_of_adaptors];
+    strncpy(adaptor->name, name, MAX_ADAPTOR_NAME_LENGTH - 1);
+    adaptor->name[MAX_ADAPTOR_NAME_LENGTH - 1] = 0;
+    adaptor->type = type;
+    adaptor->reads = reads;
+    adaptor->minimum_hits = 1;
+    strcpy(adaptor->sequence, sequence);
+
+    if (type == ADAPTOR_JUNCTION) {
+        for (i=0; i<length; i++) {
+            adaptor->sequence[length + i] = complement_base(sequence[length - i - 1]);
+        }
+        adaptor->sequence[2 * length] = 0;
+        adaptor->half_length = length;
+        adaptor->length = 2 * length;
+        if (set->primary_junction == -1) {
+            set->primary_junction = set->number_of_adaptors;
+        } else {
+            set->number_of_variants++;
+        }
+    } else {
+        adaptor->half_length = length;
+        adaptor->length = length;
+        for (i=0; i<2; i++) {
+            if ((reads & (1 << i)) && (set->primary_external[i] == -1)) {
+                set->primary_external[i] = set->number_of_adaptors;
+            }
+        }
+        if (adaptor_set_is_variant(set, set->number_of_adaptors)) {
+            set->number_of_variants++;
+        }
+    }
+
+    return set->number_of_adaptors++;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   adaptor_set_load
+ * Purpose:    Load adaptors from a file. Each line is a name, a type
+ *             (junction, external, external_r1 or external_r2) and a
+ *             sequence, separated by whitespace. # starts a comment.
+ * Parameters: set -> adaptor set
+ *             filename -> file to read
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void adaptor_set_load(AdaptorSet* set, char* filename)
+{
+    FILE* fp = fopen(filename, "r");
+    char line[1024];
+    char name[1024];
+    char type[1024];
+    char sequence[1024];
+    int line_number = 0;
+    int i;
+
+    if (!fp) {
+        printf("Error: can't open adaptor set %s\n", filename);
+        exit(2);
+    }
+
+    while (fgets(line, 1024, fp)) {
+        int n;
+
+        line_number++;
+        if (strchr(line, '#')) {
+            *strchr(line, '#') = 0;
+        }
+
+        n = sscanf(line, "%1023s %1023s %1023s", name, type, sequence);
+        if (n <= 0) {
+            continue;
+        } else if (n != 3) {
+            printf("Error: line %d of %s should be 'name type sequence'\n", line_number, filename);
+            exit(2);
+        }
+
+        for (i=0; sequence[i] != 0; i++) {
+            sequence[i] = toupper(sequence[i]);
+        }
+
+        if (strcmp(type, "junction") == 0) {
+            adaptor_set_add(set, name, ADAPTOR_JUNCTION, ADAPTOR_READ_ONE | ADAPTOR_READ_TWO, sequence);
+        } else if (strcmp(type, "external") == 0) {
+            adaptor_set_add(set, name, ADAPTOR_EXTERNAL, ADAPTOR_READ_ONE | ADAPTOR_READ_TWO, sequence);
+        } else if (strcmp(type, "external_r1") == 0) {
+            adaptor_set_add(set, name, ADAPTOR_EXTERNAL, ADAPTOR_READ_ONE, sequence);
+        } else if (strcmp(type, "external_r2") == 0) {
+            adaptor_set_add(set, name, ADAPTOR_EXTERNAL, ADAPTOR_READ_TWO, sequence);
+        } else {
+            printf("Error: unknown adaptor type %s at line %d of %s\n", type, line_number, filename);
+            exit(2);
+        }
+    }
+
+    fclose(fp);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   adaptor_set_is_variant
+ * Purpose:    Check if an adaptor is a variant, ie. not the primary
+ *             adaptor of its kind for every read it applies to
+ * Parameters: set -> adaptor set
+ *             index = adaptor index
+ * Returns:    true if variant
+ *----------------------------------------------------------------------*/
+boolean adaptor_set_is_variant(AdaptorSet* set, int index)
+{
+    Adaptor* adaptor = &set->adaptors[index];
+    int i;
+
+    if (adaptor->type == ADAPTOR_JUNCTION) {
+        return index != set->primary_junction ? true:false;
+    }
+
+    for (i=0; i<2; i++) {
+        if ((adaptor->reads & (1 << i)) && (set->primary_external[i] != index)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   adaptor_set_compile
+ * Purpose:    Build the seed index for all variant adaptors
+ * Parameters: set -> adaptor set
+ *             seed_size = k-mer size of seeds
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void adaptor_set_compile(AdaptorSet* set, int seed_size)
+{
+    int number_of_seeds;
+    int total_hits = 0;
+    int* fill;
+    int a, p, i;
+
+    if (seed_size < MINIMUM_SEED_SIZE) {
+        seed_size = MINIMUM_SEED_SIZE;
+    } else if (seed_size > MAXIMUM_SEED_SIZE) {
+        seed_size = MAXIMUM_SEED_SIZE;
+    }
+
+    adaptor_set_free(set);
+    set->seed_size = seed_size;
+    number_of_seeds = 1 << (2 * seed_size);
+
+    set->seed_index = calloc(number_of_seeds + 1, sizeof(int));
+    fill = calloc(number_of_seeds, sizeof(int));
+    if ((set->seed_index == NULL) || (fill == NULL)) {
+        printf("Error: can't allocate memory for adaptor seeds\n");
+        exit(1);
+    }
+
+    // Two passes - count seeds for each k-mer, then fill
+    for (i=0; i<2; i++) {
+        for (a=0; a<set->number_of_adaptors; a++) {
+            Adaptor* adaptor = &set->adaptors[a];
+
+            if (!adaptor_set_is_variant(set, a)) {
+                continue;
+            }
+
+            for (p=0; p+seed_size<=adaptor->length; p++) {
+                uint32_t kmer = 0;
+                int b;
+
+                for (b=0; b<seed_size; b++) {
+                    kmer = (kmer << 2) | base_code(adaptor->sequence[p+b]);
+                }
+
+                if (i == 0) {
+                    set->seed_index[kmer+1]++;
+                    total_hits++;
+                } else {
+                    set->seed_hits[set->seed_index[kmer] + fill[kmer]++] = (a << 16) | p;
+                }
+            }
+        }
+
+        if (i == 0) {
+            for (p=0; p<number_of_seeds; p++) {
+                set->seed_index[p+1] += set->seed_index[p];
+            }
+            set->seed_hits = calloc(total_hits > 0 ? total_hits : 1, sizeof(uint32_t));
+            if (set->seed_hits == NULL) {
+                printf("Error: can't allocate memory for adaptor seeds\n");
+                exit(1);
+            }
+        }
+    }
+
+    free(fill);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   candidate_slot
+ * Purpose:    Find the slot of a diagonal in the hit table, or the
+ *             empty slot it should go in
+ * Parameters: candidates -> candidate buffer
+ *             candidate = (adaptor, offset) diagonal, never 0
+ * Returns:    Slot index
+ *----------------------------------------------------------------------*/
+static inline int candidate_slot(AdaptorCandidates* candidates, uint32_t candidate)
+{
+    int slot = (candidate * 2654435761U) >> (32 - CANDIDATE_TABLE_BITS);
+
+    while ((candidates->diagonals[slot] != 0) && (candidates->diagonals[slot] != candidate)) {
+        slot = (slot + 1) & (CANDIDATE_TABLE_SIZE - 1);
+    }
+
+    return slot;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   clear_candidate_slots
+ * Purpose:    Empty the hit table slots used by a read
+ * Parameters: candidates -> candidate buffer
+ *             n = number of slots used
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void clear_candidate_slots(AdaptorCandidates* candidates, int n)
+{
+    int i;
+
+    for (i=0; i<n; i++) {
+        candidates->diagonals[candidates->slots[i]] = 0;
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   adaptor_set_find_candidates
+ * Purpose:    Find all (variant, offset) diagonals that share enough
+ *             seeds with a read to hold an acceptable alignment
+ * Parameters: set -> compiled adaptor set
+ *             read -> read sequence
+ *             read_size = length of read
+ *             candidates -> sorted, unique list of candidates. The
+ *                           hit table must start empty, eg. calloc.
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void adaptor_set_find_candidates(AdaptorSet* set, char* read, int read_size, AdaptorCandidates* candidates)
+{
+    uint32_t mask = (1 << (2 * set->seed_size)) - 1;
+    uint32_t kmer = 0;
+    int valid = 0;
+    int used = 0;
+    int p, h, n;
+
+    candidates->number_of_candidates = 0;
+    candidates->overflow = false;
+
+    if (set->seed_index == NULL) {
+        return;
+    }
+
+    // Count the seed hits on each diagonal - a diagonal's first hit lists it
+    for (p=0; p<read_size; p++) {
+        int code = base_code(read[p]);
+
+        if (code < 0) {
+            valid = 0;
+            continue;
+        }
+
+        kmer = ((kmer << 2) | code) & mask;
+        if (++valid < set->seed_size) {
+            continue;
+        }
+
+        for (h=set->seed_index[kmer]; h<set->seed_index[kmer+1]; h++) {
+            uint32_t hit = set->seed_hits[h];
+            int offset = p - set->seed_size + 1 - (int)(hit & 0xFFFF);
+            uint32_t candidate = (hit & 0xFFFF0000) | (offset + CANDIDATE_OFFSET_BIAS);
+            int slot = candidate_slot(candidates, candidate);
+
+            if (candidates->diagonals[slot] == 0) {
+                if (used == MAX_ADAPTOR_CANDIDATES) {
+                    clear_candidate_slots(candidates, used);
+                    candidates->overflow = true;
+                    return;
+                }
+                candidates->diagonals[slot] = candidate;
+                candidates->hits[slot] = 0;
+                candidates->slots[used++] = slot;
+            }
+            candidates->hits[slot]++;
+        }
+    }
+
+    // Keep the diagonals with enough hits, in order of adaptor then offset. There are
+    // few left by now, so an insertion sort will do.
+    for (n=0, h=0; h<used; h++) {
+        int slot = candidates->slots[h];
+        uint32_t candidate = candidates->diagonals[slot];
+        int i;
+
+        if (candidates->hits[slot] < set->adaptors[CANDIDATE_ADAPTOR(candidate)].minimum_hits) {
+            continue;
+        }
+
+        for (i=n++; (i > 0) && (candidates->candidates[i-1] > candidate); i--) {
+            candidates->candidates[i] = candidates->candidates[i-1];
+        }
+        candidates->candidates[i] = candidate;
+    }
+    candidates->number_of_candidates = n;
+
+    clear_candidate_slots(candidates, used);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   adaptor_set_free
+ * Purpose:    Free seed index
+ * Parameters: set -> adaptor set
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void adaptor_set_free(AdaptorSet* set)
+{
+    if (set->seed_index) {
+        free(set->seed_index);
+        set->seed_index = NULL;
+    }
+
+    if (set->seed_hits) {
+        free(set->seed_hits);
+        set->seed_hits = NULL;
+    }
+}
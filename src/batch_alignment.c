@@ -0,0 +1,809 @@
+/*----------------------------------------------------------------------*
+ * File:    batch_alignment.c                                           *
+ * Purpose: Ungapped adaptor alignment of a batch of same-length reads, *
+ *          one read per SIMD lane                                      *
+ *----------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "global.h"
+#include "batch_alignment.h"
+
+#ifdef BATCH_ALIGNMENT_AVAILABLE
+#include <emmintrin.h>
+#include <time.h>
+
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+/*
+ * The reads are transposed so that column j holds base j of all 16 reads.
+ * Because the reads are the same length, offset x covers the same columns in
+ * every lane, so one compare per adaptor base scores x for all 16 reads, with
+ * match counts accumulated in byte lanes. The decision about whether an
+ * offset beats the best so far, and the test for whether an offset could
+ * beat it at all, are done with lane masks so that each lane makes exactly
+ * the same choices as find_junction_adaptors/find_sequence_in_read would on
+ * its own.
+ *
+ * Only scores, matches and positions are kept. The caller re-scores each
+ * lane at its best position to fill in the rest of the alignment.
+ */
+
+/*----------------------------------------------------------------------*
+ * Function:   overlap_length
+ * Purpose:    Number of bases of [start, start+length) that lie in a read
+ * Parameters: start = start position, may be negative
+ *             length = length of region
+ *             read_size = length of read
+ * Returns:    Number of overlapping bases
+ *----------------------------------------------------------------------*/
+static inline int overlap_length(int start, int length, int read_size)
+{
+    int first = start > 0 ? start : 0;
+    int last = start + length < read_size ? start + length : read_size;
+
+    return last > first ? last - first : 0;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   threshold_vector
+ * Purpose:    Broadcast threshold-1, so that a signed byte compare for
+ *             greater than gives greater than or equal to threshold
+ * Parameters: threshold = threshold
+ * Returns:    Vector of threshold-1, clamped to the byte range
+ *----------------------------------------------------------------------*/
+static inline __m128i threshold_vector(int threshold)
+{
+    int t = threshold - 1;
+
+    if (t > 127) {
+        t = 127;
+    } else if (t < -128) {
+        t = -128;
+    }
+
+    return _mm_set1_epi8((char)t);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   count_matches
+ * Purpose:    Count matches of part of an adaptor at an offset, for all
+ *             lanes
+ * Parameters: batch -> transposed reads
+ *             adaptor -> broadcast adaptor bases
+ *             x = offset of adaptor in reads
+ *             first = first adaptor base to compare
+ *             last = one past last adaptor base to compare
+ * Returns:    Matches per lane
+ *----------------------------------------------------------------------*/
+static ALWAYS_INLINE __m128i count_matches(BatchReads* batch, __m128i* adaptor, int x, int first, int last)
+{
+    __m128i matches = _mm_setzero_si128();
+    int p;
+
+    for (p=first; p<last; p++) {
+        __m128i bases = _mm_load_si128((__m128i*)batch->columns[x+p]);
+        matches = _mm_sub_epi8(matches, _mm_cmpeq_epi8(bases, adaptor[p]));
+    }
+
+    return matches;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   count_matches_inside
+ * Purpose:    As count_matches, for an adaptor wholly inside the reads.
+ *             In the specialised kernels the length is constant and the
+ *             loop is fully unrolled.
+ * Parameters: batch -> transposed reads
+ *             adaptor -> broadcast adaptor bases
+ *             x = offset of adaptor in reads
+ *             first = first adaptor base to compare
+ *             last = one past last adaptor base to compare
+ * Returns:    Matches per lane
+ *----------------------------------------------------------------------*/
+static ALWAYS_INLINE __m128i count_matches_inside(BatchReads* batch, __m128i* adaptor, int x, int first, int last)
+{
+    __m128i matches = _mm_setzero_si128();
+    int p;
+
+#pragma GCC unroll 64
+    for (p=first; p<last; p++) {
+        __m128i bases = _mm_load_si128((__m128i*)batch->columns[x+p]);
+        matches = _mm_sub_epi8(matches, _mm_cmpeq_epi8(bases, adaptor[p]));
+    }
+
+    return matches;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   store_lanes
+ * Purpose:    Copy byte lanes of a vector into an int array
+ * Parameters: v = vector
+ *             out -> array of BATCH_LANES ints
+ *             stride = distance between output elements
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static inline void store_lanes(__m128i v, int* out, int stride)
+{
+    int8_t bytes[BATCH_LANES];
+    int l;
+
+    _mm_storeu_si128((__m128i*)bytes, v);
+    for (l=0; l<BATCH_LANES; l++) {
+        out[l * stride] = bytes[l];
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   lowest_lane
+ * Purpose:    Find the smallest byte lane of a vector
+ * Parameters: v = vector of non-negative lanes
+ * Returns:    Smallest lane value
+ *----------------------------------------------------------------------*/
+static inline int lowest_lane(__m128i v)
+{
+    v = _mm_min_epu8(v, _mm_srli_si128(v, 8));
+    v = _mm_min_epu8(v, _mm_srli_si128(v, 4));
+    v = _mm_min_epu8(v, _mm_srli_si128(v, 2));
+    v = _mm_min_epu8(v, _mm_srli_si128(v, 1));
+
+    return _mm_cvtsi128_si32(v) & 0xff;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   batch_load_reads
+ * Purpose:    Transpose a batch of reads into columns
+ * Parameters: reads -> BATCH_LANES reads, all of length read_size
+ *             read_size = length of reads
+ *             batch -> transposed reads
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void batch_load_reads(char* reads[BATCH_LANES], int read_size, BatchReads* batch)
+{
+    int j, l;
+
+    if (read_size > BATCH_MAX_READ_LENGTH) {
+        printf("Error: read too long for batch alignment (%d)\n", read_size);
+        exit(1);
+    }
+
+    batch->read_size = read_size;
+    for (j=0; j<read_size; j++) {
+        for (l=0; l<BATCH_LANES; l++) {
+            batch->columns[j][l] = reads[l][j];
+        }
+    }
+}
+
+typedef struct {
+    __m128i best_score;
+    __m128i best_matches[2];
+    __m128i done;
+    __m128i evaluated_low;
+    __m128i evaluated_high;
+} JunctionLanes;
+
+/*----------------------------------------------------------------------*
+ * Function:   junction_offset
+ * Purpose:    Score one junction adaptor offset for all lanes and update
+ *             the lanes it improves
+ * Parameters: lanes -> per lane best results
+ *             batch -> transposed reads
+ *             adaptor -> broadcast adaptor bases
+ *             x = offset of adaptor in reads
+ *             first, last = range of adaptor bases inside the reads
+ *             max_score = bases of adaptor inside the reads
+ *             max_single = most bases of one half inside the reads
+ *             inside = true if x >= 0
+ *             adaptor_length = length of double adaptor
+ *             half_length = length of single adaptor
+ *             double_match = strict double match threshold
+ *             single_match = strict single match threshold
+ *             result -> positions are stored here
+ * Returns:    false once every lane has finished
+ *----------------------------------------------------------------------*/
+static ALWAYS_INLINE boolean junction_offset(JunctionLanes* lanes, BatchReads* batch, __m128i* adaptor, int x, int first, int last, int max_score, int max_single, boolean inside,
+                                             int adaptor_length, int half_length, int double_match, int single_match, BatchAlignment* result)
+{
+    const __m128i ones = _mm_cmpeq_epi8(_mm_setzero_si128(), _mm_setzero_si128());
+    const __m128i double_threshold = threshold_vector(double_match);
+    const __m128i single_threshold = threshold_vector(single_match);
+    __m128i max_score_vector = _mm_set1_epi8(max_score);
+    __m128i best_result_match = _mm_max_epu8(lanes->best_matches[0], lanes->best_matches[1]);
+    __m128i result_double = _mm_cmpgt_epi8(lanes->best_score, double_threshold);
+    __m128i result_single = _mm_or_si128(_mm_cmpgt_epi8(lanes->best_matches[0], single_threshold), _mm_cmpgt_epi8(lanes->best_matches[1], single_threshold));
+    __m128i could_score_more = _mm_cmpgt_epi8(max_score_vector, lanes->best_score);
+    __m128i can_improve;
+    __m128i matches[2];
+    __m128i score, current_double, current_single, best_current_match, higher_score;
+    __m128i better_double, better_single, better_other, better;
+    int mask;
+    int l;
+
+    // Same decision as junction_offset_can_improve, per lane
+    if (max_score >= double_match) {
+        can_improve = _mm_or_si128(_mm_andnot_si128(result_double, ones), could_score_more);
+    } else {
+        __m128i max_single_vector = _mm_set1_epi8(max_single);
+        __m128i single_case = _mm_or_si128(_mm_cmpgt_epi8(max_single_vector, best_result_match),
+                                           _mm_and_si128(_mm_cmpeq_epi8(max_single_vector, best_result_match), could_score_more));
+        __m128i other_case = max_single >= single_match ? ones : could_score_more;
+
+        can_improve = _mm_or_si128(_mm_and_si128(result_single, single_case), _mm_andnot_si128(result_single, other_case));
+        can_improve = _mm_or_si128(_mm_and_si128(result_double, could_score_more), _mm_andnot_si128(result_double, can_improve));
+    }
+
+    // Once the adaptor is inside the read, a lane that can't improve is finished
+    if (inside) {
+        lanes->done = _mm_or_si128(lanes->done, _mm_andnot_si128(can_improve, ones));
+        if (_mm_movemask_epi8(lanes->done) == 0xFFFF) {
+            return false;
+        }
+    }
+    can_improve = _mm_andnot_si128(lanes->done, can_improve);
+
+    if (_mm_movemask_epi8(can_improve) == 0) {
+        return true;
+    }
+
+    lanes->evaluated_low = _mm_sub_epi16(lanes->evaluated_low, _mm_unpacklo_epi8(can_improve, can_improve));
+    lanes->evaluated_high = _mm_sub_epi16(lanes->evaluated_high, _mm_unpackhi_epi8(can_improve, can_improve));
+
+    if ((first == 0) && (last == adaptor_length)) {
+        matches[0] = count_matches_inside(batch, adaptor, x, 0, half_length);
+        matches[1] = count_matches_inside(batch, adaptor, x, half_length, adaptor_length);
+    } else {
+        matches[0] = count_matches(batch, adaptor, x, first, last < half_length ? last : half_length);
+        matches[1] = count_matches(batch, adaptor, x, first > half_length ? first : half_length, last);
+    }
+    score = _mm_add_epi8(matches[0], matches[1]);
+
+    // Same decision as junction_alignment_is_better, per lane
+    current_double = _mm_cmpgt_epi8(score, double_threshold);
+    current_single = _mm_andnot_si128(current_double, _mm_or_si128(_mm_cmpgt_epi8(matches[0], single_threshold), _mm_cmpgt_epi8(matches[1], single_threshold)));
+    best_current_match = _mm_max_epu8(matches[0], matches[1]);
+    higher_score = _mm_cmpgt_epi8(score, lanes->best_score);
+    better_double = _mm_and_si128(current_double, higher_score);
+    better_single = _mm_andnot_si128(result_double,
+                                     _mm_and_si128(current_single,
+                                                   _mm_or_si128(_mm_cmpgt_epi8(best_current_match, best_result_match),
+                                                                _mm_and_si128(_mm_cmpeq_epi8(best_current_match, best_result_match), higher_score))));
+    better_other = _mm_andnot_si128(_mm_or_si128(current_double, current_single),
+                                    _mm_andnot_si128(_mm_or_si128(result_double, result_single), higher_score));
+    better = _mm_and_si128(can_improve, _mm_or_si128(better_double, _mm_or_si128(better_single, better_other)));
+
+    mask = _mm_movemask_epi8(better);
+    if (mask != 0) {
+        lanes->best_score = _mm_or_si128(_mm_and_si128(better, score), _mm_andnot_si128(better, lanes->best_score));
+        lanes->best_matches[0] = _mm_or_si128(_mm_and_si128(better, matches[0]), _mm_andnot_si128(better, lanes->best_matches[0]));
+        lanes->best_matches[1] = _mm_or_si128(_mm_and_si128(better, matches[1]), _mm_andnot_si128(better, lanes->best_matches[1]));
+        for (l=0; l<BATCH_LANES; l++) {
+            if (mask & (1 << l)) {
+                result->position[l] = x;
+            }
+        }
+    }
+
+    return true;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   junction_edge_offset
+ * Purpose:    Score a junction adaptor offset where the adaptor hangs
+ *             off one end of the reads
+ * Parameters: As junction_offset
+ * Returns:    false once every lane has finished
+ *----------------------------------------------------------------------*/
+static ALWAYS_INLINE boolean junction_edge_offset(JunctionLanes* lanes, BatchReads* batch, __m128i* adaptor, int x, int read_size,
+                                                  int adaptor_length, int half_length, int double_match, int single_match, BatchAlignment* result)
+{
+    int first = x < 0 ? -x : 0;
+    int last = x + adaptor_length < read_size ? adaptor_length : read_size - x;
+    int max_part_one = overlap_length(x, half_length, read_size);
+    int max_part_two = overlap_length(x + half_length, adaptor_length - half_length, read_size);
+
+    return junction_offset(lanes, batch, adaptor, x, first, last, last - first, max_part_one > max_part_two ? max_part_one : max_part_two, x >= 0,
+                           adaptor_length, half_length, double_match, single_match, result);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   junction_kernel
+ * Purpose:    Find the best junction adaptor offset in every read of a
+ *             batch, using the same rules as find_junction_adaptors.
+ *             The offsets are split into the left overhang, the adaptor
+ *             wholly inside the read, and the right overhang, so that
+ *             in the middle loop the compare loop bounds and maximum
+ *             scores are constant. Always inlined, so that
+ *             specialisations with constant lengths get unrolled loops.
+ * Parameters: batch -> transposed reads
+ *             adaptor -> double junction adaptor
+ *             adaptor_length = length of double adaptor
+ *             half_length = length of single adaptor
+ *             read_size = length of reads
+ *             double_match = strict double match threshold
+ *             single_match = strict single match threshold
+ *             result -> best score, matches and position per lane
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static ALWAYS_INLINE void junction_kernel(BatchReads* batch, char* adaptor, int adaptor_length, int half_length, int read_size, int double_match, int single_match, BatchAlignment* result)
+{
+    __m128i adaptor_vectors[BATCH_MAX_ADAPTOR_LENGTH];
+    JunctionLanes lanes;
+    int16_t evaluated[BATCH_LANES];
+    int start = -adaptor_length+5;
+    int end = read_size-5;
+    int inside_end = read_size - adaptor_length + 1;
+    int max_single = half_length > adaptor_length - half_length ? half_length : adaptor_length - half_length;
+    boolean running = true;
+    int x, l;
+
+    if (adaptor_length > BATCH_MAX_ADAPTOR_LENGTH) {
+        printf("Error: adaptor too long for batch alignment (%d)\n", adaptor_length);
+        exit(1);
+    }
+
+    for (x=0; x<adaptor_length; x++) {
+        adaptor_vectors[x] = _mm_set1_epi8(adaptor[x]);
+    }
+
+    for (l=0; l<BATCH_LANES; l++) {
+        result->position[l] = BATCH_NO_POSITION;
+    }
+
+    lanes.best_score = _mm_set1_epi8(-1);
+    lanes.best_matches[0] = _mm_setzero_si128();
+    lanes.best_matches[1] = _mm_setzero_si128();
+    lanes.done = _mm_setzero_si128();
+    lanes.evaluated_low = _mm_setzero_si128();
+    lanes.evaluated_high = _mm_setzero_si128();
+
+    if (inside_end > end) {
+        inside_end = end;
+    }
+
+    for (x=start; (x<0) && (x<end); x++) {
+        junction_edge_offset(&lanes, batch, adaptor_vectors, x, read_size, adaptor_length, half_length, double_match, single_match, result);
+    }
+
+    for (; running && (x<inside_end); x++) {
+        running = junction_offset(&lanes, batch, adaptor_vectors, x, 0, adaptor_length, adaptor_length, max_single, true,
+                                  adaptor_length, half_length, double_match, single_match, result);
+    }
+
+    for (; running && (x<end); x++) {
+        running = junction_edge_offset(&lanes, batch, adaptor_vectors, x, read_size, adaptor_length, half_length, double_match, single_match, result);
+    }
+
+    store_lanes(lanes.best_score, result->score, 1);
+    store_lanes(lanes.best_matches[0], &result->matches[0][0], 2);
+    store_lanes(lanes.best_matches[1], &result->matches[0][1], 2);
+    _mm_storeu_si128((__m128i*)evaluated, lanes.evaluated_low);
+    _mm_storeu_si128((__m128i*)(evaluated + 8), lanes.evaluated_high);
+    for (l=0; l<BATCH_LANES; l++) {
+        result->offsets_evaluated[l] = evaluated[l];
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   sequence_offset
+ * Purpose:    Score one sequence offset for all lanes and update the
+ *             lanes it improves
+ * Parameters: best_score -> per lane best scores
+ *             batch -> transposed reads
+ *             sequence -> broadcast sequence bases
+ *             seq_length = length of sequence
+ *             x = offset of sequence in reads
+ *             first, last = range of sequence bases inside the reads
+ *             result -> positions are stored here
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static ALWAYS_INLINE void sequence_offset(__m128i* best_score, BatchReads* batch, __m128i* sequence, int seq_length, int x, int first, int last, BatchAlignment* result)
+{
+    __m128i score = first == 0 && last == seq_length ? count_matches_inside(batch, sequence, x, 0, seq_length) : count_matches(batch, sequence, x, first, last);
+    __m128i better = _mm_cmpgt_epi8(score, *best_score);
+    int mask = _mm_movemask_epi8(better);
+    int l;
+
+    if (mask != 0) {
+        *best_score = _mm_or_si128(_mm_and_si128(better, score), _mm_andnot_si128(better, *best_score));
+        for (l=0; l<BATCH_LANES; l++) {
+            if (mask & (1 << l)) {
+                result->position[l] = x;
+            }
+        }
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   sequence_kernel
+ * Purpose:    Find the best offset of a sequence (eg. external adaptor)
+ *             in every read of a batch, using the same rules as
+ *             find_sequence_in_read. As with junction_kernel, offsets
+ *             with the sequence wholly inside the reads get their own
+ *             loop. Always inlined, so that specialisations with
+ *             constant lengths get unrolled loops.
+ * Parameters: batch -> transposed reads
+ *             sequence -> sequence to look for
+ *             seq_length = length of sequence
+ *             read_size = length of reads
+ *             result -> best score, matches and position per lane
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static ALWAYS_INLINE void sequence_kernel(BatchReads* batch, char* sequence, int seq_length, int read_size, BatchAlignment* result)
+{
+    __m128i sequence_vectors[BATCH_MAX_ADAPTOR_LENGTH];
+    __m128i best_score = _mm_setzero_si128();
+    int start = -seq_length+5;
+    int stop = read_size-5;
+    int x, l;
+
+    if (seq_length > BATCH_MAX_ADAPTOR_LENGTH) {
+        printf("Error: sequence too long for batch alignment (%d)\n", seq_length);
+        exit(1);
+    }
+
+    for (x=0; x<seq_length; x++) {
+        sequence_vectors[x] = _mm_set1_epi8(sequence[x]);
+    }
+
+    for (l=0; l<BATCH_LANES; l++) {
+        result->position[l] = BATCH_NO_POSITION;
+        result->matches[l][1] = 0;
+    }
+
+    for (x=start; (x<0) && (x<stop); x++) {
+        sequence_offset(&best_score, batch, sequence_vectors, seq_length, x, -x, x + seq_length < read_size ? seq_length : read_size - x, result);
+    }
+
+    // Inside the reads, the best possible score only goes down as x increases, so stop once it can't beat any lane
+    for (; (x<stop) && (x+seq_length<=read_size); x++) {
+        if (seq_length <= lowest_lane(best_score)) {
+            break;
+        }
+        sequence_offset(&best_score, batch, sequence_vectors, seq_length, x, 0, seq_length, result);
+    }
+
+    for (; x<stop; x++) {
+        if (read_size - x <= lowest_lane(best_score)) {
+            break;
+        }
+        sequence_offset(&best_score, batch, sequence_vectors, seq_length, x, 0, read_size - x, result);
+    }
+
+    store_lanes(best_score, result->score, 1);
+    store_lanes(best_score, &result->matches[0][0], 2);
+
+    // A lane on its own would have stopped at the first offset after its best where the overlap can't beat it
+    for (l=0; l<BATCH_LANES; l++) {
+        int last = result->position[l] == BATCH_NO_POSITION ? start : result->position[l] + 1;
+        int lane_stop = seq_length <= result->score[l] ? 0 : read_size - result->score[l];
+
+        if (lane_stop < last) {
+            lane_stop = last;
+        }
+        if (lane_stop > stop) {
+            lane_stop = stop;
+        }
+        result->offsets_evaluated[l] = lane_stop - start;
+    }
+}
+
+/*
+ * Specialised kernels. Each is the kernel above with the adaptor and read
+ * lengths fixed, so the compiler can unroll the per-offset compare loops and
+ * resolve the read edge tests. The dispatchers pick one per batch if the
+ * lengths match, otherwise they use the generic kernel.
+ */
+#define JUNCTION_KERNEL(adaptor_length, half_length, read_size) \
+    static void junction_kernel_##adaptor_length##_##read_size(BatchReads* batch, char* adaptor, int double_match, int single_match, BatchAlignment* result) \
+    { \
+        junction_kernel(batch, adaptor, adaptor_length, half_length, read_size, double_match, single_match, result); \
+    }
+
+#define SEQUENCE_KERNEL(seq_length, read_size) \
+    static void sequence_kernel_##seq_length##_##read_size(BatchReads* batch, char* sequence, BatchAlignment* result) \
+    { \
+        sequence_kernel(batch, sequence, seq_length, read_size, result); \
+    }
+
+// Default Nextera junction adaptor, 2 x 19
+JUNCTION_KERNEL(38, 19, 100)
+JUNCTION_KERNEL(38, 19, 125)
+JUNCTION_KERNEL(38, 19, 150)
+JUNCTION_KERNEL(38, 19, 250)
+JUNCTION_KERNEL(38, 19, 300)
+
+// Default R1 and R2 external adaptors
+SEQUENCE_KERNEL(33, 100)
+SEQUENCE_KERNEL(33, 125)
+SEQUENCE_KERNEL(33, 150)
+SEQUENCE_KERNEL(33, 250)
+SEQUENCE_KERNEL(33, 300)
+SEQUENCE_KERNEL(32, 100)
+SEQUENCE_KERNEL(32, 125)
+SEQUENCE_KERNEL(32, 150)
+SEQUENCE_KERNEL(32, 250)
+SEQUENCE_KERNEL(32, 300)
+
+typedef void (*JunctionKernel)(BatchReads*, char*, int, int, BatchAlignment*);
+typedef void (*SequenceKernel)(BatchReads*, char*, BatchAlignment*);
+
+static struct {
+    int adaptor_length;
+    int half_length;
+    int read_size;
+    JunctionKernel kernel;
+} junction_kernels[] = {
+    {38, 19, 100, junction_kernel_38_100},
+    {38, 19, 125, junction_kernel_38_125},
+    {38, 19, 150, junction_kernel_38_150},
+    {38, 19, 250, junction_kernel_38_250},
+    {38, 19, 300, junction_kernel_38_300},
+    {0, 0, 0, NULL}
+};
+
+static struct {
+    int seq_length;
+    int read_size;
+    SequenceKernel kernel;
+} sequence_kernels[] = {
+    {33, 100, sequence_kernel_33_100},
+    {33, 125, sequence_kernel_33_125},
+    {33, 150, sequence_kernel_33_150},
+    {33, 250, sequence_kernel_33_250},
+    {33, 300, sequence_kernel_33_300},
+    {32, 100, sequence_kernel_32_100},
+    {32, 125, sequence_kernel_32_125},
+    {32, 150, sequence_kernel_32_150},
+    {32, 250, sequence_kernel_32_250},
+    {32, 300, sequence_kernel_32_300},
+    {0, 0, NULL}
+};
+
+/*----------------------------------------------------------------------*
+ * Function:   batch_junction_alignment_generic
+ * Purpose:    Junction adaptor batch alignment for any lengths
+ * Parameters: As batch_junction_alignment
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void batch_junction_alignment_generic(BatchReads* batch, char* adaptor, int adaptor_length, int half_length, int double_match, int single_match, BatchAlignment* result)
+{
+    junction_kernel(batch, adaptor, adaptor_length, half_length, batch->read_size, double_match, single_match, result);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   batch_sequence_alignment_generic
+ * Purpose:    Sequence batch alignment for any lengths
+ * Parameters: As batch_sequence_alignment
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void batch_sequence_alignment_generic(BatchReads* batch, char* sequence, int seq_length, BatchAlignment* result)
+{
+    sequence_kernel(batch, sequence, seq_length, batch->read_size, result);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   find_junction_kernel
+ * Purpose:    Find a specialised junction kernel for given lengths
+ * Parameters: adaptor_length = length of double adaptor
+ *             half_length = length of single adaptor
+ *             read_size = length of reads
+ * Returns:    Kernel, or NULL if there isn't one
+ *----------------------------------------------------------------------*/
+static JunctionKernel find_junction_kernel(int adaptor_length, int half_length, int read_size)
+{
+    int i;
+
+    for (i=0; junction_kernels[i].kernel != NULL; i++) {
+        if ((junction_kernels[i].adaptor_length == adaptor_length) &&
+            (junction_kernels[i].half_length == half_length) &&
+            (junction_kernels[i].read_size == read_size)) {
+            return junction_kernels[i].kernel;
+        }
+    }
+
+    return NULL;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   find_sequence_kernel
+ * Purpose:    Find a specialised sequence kernel for given lengths
+ * Parameters: seq_length = length of sequence
+ *             read_size = length of reads
+ * Returns:    Kernel, or NULL if there isn't one
+ *----------------------------------------------------------------------*/
+static SequenceKernel find_sequence_kernel(int seq_length, int read_size)
+{
+    int i;
+
+    for (i=0; sequence_kernels[i].kernel != NULL; i++) {
+        if ((sequence_kernels[i].seq_length == seq_length) && (sequence_kernels[i].read_size == read_size)) {
+            return sequence_kernels[i].kernel;
+        }
+    }
+
+    return NULL;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   batch_junction_alignment
+ * Purpose:    Find the best junction adaptor offset in every read of a
+ *             batch, using the same rules as find_junction_adaptors
+ * Parameters: batch -> transposed reads
+ *             adaptor -> double junction adaptor
+ *             adaptor_length = length of double adaptor
+ *             half_length = length of single adaptor
+ *             double_match = strict double match threshold
+ *             single_match = strict single match threshold
+ *             result -> best score, matches and position per lane
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void batch_junction_alignment(BatchReads* batch, char* adaptor, int adaptor_length, int half_length, int double_match, int single_match, BatchAlignment* result)
+{
+    JunctionKernel kernel = find_junction_kernel(adaptor_length, half_length, batch->read_size);
+
+    if (kernel != NULL) {
+        kernel(batch, adaptor, double_match, single_match, result);
+    } else {
+        batch_junction_alignment_generic(batch, adaptor, adaptor_length, half_length, double_match, single_match, result);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   batch_sequence_alignment
+ * Purpose:    Find the best offset of a sequence (eg. external adaptor)
+ *             in every read of a batch, using the same rules as
+ *             find_sequence_in_read
+ * Parameters: batch -> transposed reads
+ *             sequence -> sequence to look for
+ *             seq_length = length of sequence
+ *             result -> best score, matches and position per lane
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void batch_sequence_alignment(BatchReads* batch, char* sequence, int seq_length, BatchAlignment* result)
+{
+    SequenceKernel kernel = find_sequence_kernel(seq_length, batch->read_size);
+
+    if (kernel != NULL) {
+        kernel(batch, sequence, result);
+    } else {
+        batch_sequence_alignment_generic(batch, sequence, seq_length, result);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   make_benchmark_batch
+ * Purpose:    Make a batch of random reads, half of which contain a
+ *             copy of an adaptor with a couple of errors
+ * Parameters: adaptor -> adaptor sequence
+ *             adaptor_length = length of adaptor
+ *             read_size = length of reads
+ *             batch -> transposed reads
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void make_benchmark_batch(char* adaptor, int adaptor_length, int read_size, BatchReads* batch)
+{
+    char reads[BATCH_LANES][BATCH_MAX_READ_LENGTH];
+    char* lane_reads[BATCH_LANES];
+    int l, j;
+
+    for (l=0; l<BATCH_LANES; l++) {
+        for (j=0; j<read_size; j++) {
+            reads[l][j] = "ACGT"[rand() % 4];
+        }
+
+        if (l % 2) {
+            int position = rand() % (read_size - adaptor_length);
+            memcpy(reads[l] + position, adaptor, adaptor_length);
+            reads[l][position + rand() % adaptor_length] = 'N';
+            reads[l][position + rand() % adaptor_length] = 'N';
+        }
+
+        lane_reads[l] = reads[l];
+    }
+
+    batch_load_reads(lane_reads, read_size, batch);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   batch_alignment_benchmark
+ * Purpose:    Time each specialised kernel against the generic kernel
+ *             on random reads, and check they give the same results.
+ *             Times are the best of several trials.
+ * Parameters: double_match = strict double match threshold
+ *             single_match = strict single match threshold
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void batch_alignment_benchmark(int double_match, int single_match)
+{
+    BatchReads batch;
+    BatchAlignment specialised, generic;
+    char adaptor[BATCH_MAX_ADAPTOR_LENGTH];
+    int repeats = 5000;
+    int trials = 7;
+    int i, j, t;
+
+    srand(1);
+
+    printf("Kernel                  Generic (us/batch)  Specialised (us/batch)  Speedup\n");
+
+    for (i=0; junction_kernels[i].kernel != NULL; i++) {
+        int length = junction_kernels[i].adaptor_length;
+        clock_t start;
+        double generic_time, specialised_time;
+
+        for (j=0; j<length; j++) {
+            adaptor[j] = "ACGT"[rand() % 4];
+        }
+        make_benchmark_batch(adaptor, length, junction_kernels[i].read_size, &batch);
+
+        generic_time = specialised_time = 0;
+        for (t=0; t<trials; t++) {
+            double elapsed;
+
+            start = clock();
+            for (j=0; j<repeats; j++) {
+                batch_junction_alignment_generic(&batch, adaptor, length, junction_kernels[i].half_length, double_match, single_match, &generic);
+            }
+            elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+            generic_time = ((t == 0) || (elapsed < generic_time)) ? elapsed : generic_time;
+
+            start = clock();
+            for (j=0; j<repeats; j++) {
+                junction_kernels[i].kernel(&batch, adaptor, double_match, single_match, &specialised);
+            }
+            elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+            specialised_time = ((t == 0) || (elapsed < specialised_time)) ? elapsed : specialised_time;
+        }
+
+        if (memcmp(&generic, &specialised, sizeof(BatchAlignment)) != 0) {
+            printf("Error: junction kernel %d/%d gives different results to generic kernel\n", length, junction_kernels[i].read_size);
+            exit(1);
+        }
+
+        printf("Junction %3d, reads %3d  %18.2f  %22.2f  %6.2fx\n", length, junction_kernels[i].read_size,
+               1000000.0 * generic_time / repeats, 1000000.0 * specialised_time / repeats, generic_time / specialised_time);
+    }
+
+    for (i=0; sequence_kernels[i].kernel != NULL; i++) {
+        int length = sequence_kernels[i].seq_length;
+        clock_t start;
+        double generic_time, specialised_time;
+
+        for (j=0; j<length; j++) {
+            adaptor[j] = "ACGT"[rand() % 4];
+        }
+        make_benchmark_batch(adaptor, length, sequence_kernels[i].read_size, &batch);
+
+        generic_time = specialised_time = 0;
+        for (t=0; t<trials; t++) {
+            double elapsed;
+
+            start = clock();
+            for (j=0; j<repeats; j++) {
+                batch_sequence_alignment_generic(&batch, adaptor, length, &generic);
+            }
+            elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+            generic_time = ((t == 0) || (elapsed < generic_time)) ? elapsed : generic_time;
+
+            start = clock();
+            for (j=0; j<repeats; j++) {
+                sequence_kernels[i].kernel(&batch, adaptor, &specialised);
+            }
+            elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+            specialised_time = ((t == 0) || (elapsed < specialised_time)) ? elapsed : specialised_time;
+        }
+
+        if (memcmp(&generic, &specialised, sizeof(BatchAlignment)) != 0) {
+            printf("Error: sequence kernel %d/%d gives different results to generic kernel\n", length, sequence_kernels[i].read_size);
+            exit(1);
+        }
+
+        printf("External %3d, reads %3d  %18.2f  %22.2f  %6.2fx\n", length, sequence_kernels[i].read_size,
+               1000000.0 * generic_time / repeats, 1000000.0 * specialised_time / repeats, generic_time / specialised_time);
+    }
+}
+
+#endif
@@ -0,0 +1,351 @@
+/*----------------------------------------------------------------------*
+ * File:    duplicate_filter.c                                          *
+ * Purpose: Fixed size counting cuckoo filter for approximate PCR       *
+ *          duplicate detection when the hash table won't fit           *
+ *----------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "global.h"
+#include "binary_kmer.h"
+#include "element.h"
+#include "hash_value.h"
+#include "duplicate_filter.h"
+
+/*
+ * Instead of whole signatures, the filter keeps a 20-bit fingerprint of each
+ * one together with a 12-bit count, packed into a 32-bit slot. A signature
+ * can live in either of two buckets of four slots - the second bucket is
+ * found from the first and the fingerprint alone, so stored entries can be
+ * moved between their two buckets to make room ("cuckoo" insertion).
+ *
+ * Two different signatures are confused if they share a fingerprint and a
+ * bucket. For a new signature that's a chance of about 1 in 2^20 for each
+ * occupied slot in its two buckets, so a lookup in a filter at load a has a
+ * false positive rate of roughly 8a / 2^20 - under 8 per million. Each false
+ * positive counts a unique pair as a duplicate and adds one to a count in
+ * the duplication histogram. The filter adds up the chance for every new
+ * signature to give the expected number of false duplicates.
+ */
+
+#define MAX_KICKS 500
+#define FINGERPRINT_MASK ((1 << DUPLICATE_FILTER_FINGERPRINT_BITS) - 1)
+#define NUMBER_OF_FINGERPRINTS ((double)FINGERPRINT_MASK)
+#define ENTRY_FINGERPRINT(e) ((e) >> DUPLICATE_FILTER_COUNT_BITS)
+#define ENTRY_COUNT(e) ((e) & DUPLICATE_FILTER_MAX_COUNT)
+
+/*----------------------------------------------------------------------*
+ * Function:   alternate_bucket
+ * Purpose:    Find the other bucket an entry may be stored in
+ * Parameters: filter -> filter
+ *             bucket = one bucket of the entry
+ *             fingerprint = fingerprint of the entry
+ * Returns:    Other bucket
+ *----------------------------------------------------------------------*/
+static inline uint64_t alternate_bucket(DuplicateFilter* filter, uint64_t bucket, uint32_t fingerprint)
+{
+    return (bucket ^ ((uint64_t)fingerprint * 0x5bd1e995)) & filter->bucket_mask;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   next_random
+ * Purpose:    Cheap repeatable pseudo-random numbers for choosing which
+ *             entry to move when both buckets are full
+ * Parameters: filter -> filter
+ * Returns:    Random number
+ *----------------------------------------------------------------------*/
+static inline uint32_t next_random(DuplicateFilter* filter)
+{
+    uint32_t x = filter->random_state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    filter->random_state = x;
+
+    return x;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   find_in_bucket
+ * Purpose:    Look for a fingerprint in a bucket
+ * Parameters: filter -> filter
+ *             bucket = bucket to look in
+ *             fingerprint = fingerprint to find
+ *             occupied -> incremented for each occupied slot
+ * Returns:    Pointer to slot, or NULL if not found
+ *----------------------------------------------------------------------*/
+static inline uint32_t* find_in_bucket(DuplicateFilter* filter, uint64_t bucket, uint32_t fingerprint, int* occupied)
+{
+    uint32_t* slots = filter->slots + (bucket * DUPLICATE_FILTER_BUCKET_SIZE);
+    int i;
+
+    for (i=0; i<DUPLICATE_FILTER_BUCKET_SIZE; i++) {
+        if (slots[i] != 0) {
+            (*occupied)++;
+            if (ENTRY_FINGERPRINT(slots[i]) == fingerprint) {
+                return &slots[i];
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   place_in_bucket
+ * Purpose:    Store an entry in a free slot of a bucket
+ * Parameters: filter -> filter
+ *             bucket = bucket to store in
+ *             entry = fingerprint and count
+ * Returns:    true if there was a free slot
+ *----------------------------------------------------------------------*/
+static inline boolean place_in_bucket(DuplicateFilter* filter, uint64_t bucket, uint32_t entry)
+{
+    uint32_t* slots = filter->slots + (bucket * DUPLICATE_FILTER_BUCKET_SIZE);
+    int i;
+
+    for (i=0; i<DUPLICATE_FILTER_BUCKET_SIZE; i++) {
+        if (slots[i] == 0) {
+            slots[i] = entry;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   increment_entry
+ * Purpose:    Add one to the count of an entry, stopping at the largest
+ *             count a slot can hold
+ * Parameters: filter -> filter
+ *             entry -> entry to update
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static inline void increment_entry(DuplicateFilter* filter, uint32_t* entry)
+{
+    if (ENTRY_COUNT(*entry) < DUPLICATE_FILTER_MAX_COUNT) {
+        (*entry)++;
+    } else {
+        filter->saturated++;
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_filter_initialise
+ * Purpose:    Allocate an empty filter
+ * Parameters: filter -> filter
+ *             memory_meg = memory to use in MB, rounded down so the
+ *                          number of buckets is a power of 2
+ * Returns:    true if allocated
+ *----------------------------------------------------------------------*/
+boolean duplicate_filter_initialise(DuplicateFilter* filter, long int memory_meg)
+{
+    uint64_t bucket_bytes = DUPLICATE_FILTER_BUCKET_SIZE * sizeof(uint32_t);
+    uint64_t buckets = 1;
+
+    while (buckets * 2 * bucket_bytes <= (uint64_t)memory_meg * 1024 * 1024) {
+        buckets *= 2;
+    }
+
+    filter->number_of_buckets = buckets;
+    filter->bucket_mask = buckets - 1;
+    filter->entries = 0;
+    filter->lookups = 0;
+    filter->failed_inserts = 0;
+    filter->saturated = 0;
+    filter->expected_false_matches = 0;
+    filter->victim = 0;
+    filter->victim_bucket = 0;
+    filter->random_state = 2463534242U;
+    filter->slots = calloc(buckets * DUPLICATE_FILTER_BUCKET_SIZE, sizeof(uint32_t));
+
+    return filter->slots != NULL ? true:false;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_filter_add
+ * Purpose:    Count a signature, adding it if it hasn't been seen. If
+ *             the filter is full, new signatures are not stored and
+ *             are counted in failed_inserts.
+ * Parameters: filter -> filter
+ *             key -> signature
+ *             length = length of signature in bytes
+ * Returns:    true if the signature (probably) has been seen before
+ *----------------------------------------------------------------------*/
+boolean duplicate_filter_add(DuplicateFilter* filter, void* key, int length)
+{
+    uint32_t c = 5;
+    uint32_t b = 6;
+    uint64_t hash;
+    uint64_t bucket[2];
+    uint32_t fingerprint;
+    uint32_t entry;
+    uint32_t* slot;
+    uint64_t current;
+    int occupied = 0;
+    int kick;
+
+    hashlittle2(key, length, &c, &b);
+    hash = c + (((uint64_t)b) << 32);
+
+    // Zero marks an empty slot, so fingerprints can't be zero
+    fingerprint = (hash >> 40) & FINGERPRINT_MASK;
+    if (fingerprint == 0) {
+        fingerprint = 1;
+    }
+    bucket[0] = hash & filter->bucket_mask;
+    bucket[1] = alternate_bucket(filter, bucket[0], fingerprint);
+
+    filter->lookups++;
+
+    slot = find_in_bucket(filter, bucket[0], fingerprint, &occupied);
+    if ((slot == NULL) && (bucket[1] != bucket[0])) {
+        slot = find_in_bucket(filter, bucket[1], fingerprint, &occupied);
+    }
+
+    if ((slot == NULL) && (filter->victim != 0) &&
+        ((filter->victim_bucket == bucket[0]) || (filter->victim_bucket == bucket[1]))) {
+        occupied++;
+        if (ENTRY_FINGERPRINT(filter->victim) == fingerprint) {
+            slot = &filter->victim;
+        }
+    }
+
+    if (slot != NULL) {
+        increment_entry(filter, slot);
+        return true;
+    }
+
+    // New signature - it had this chance of matching something already there
+    filter->expected_false_matches += occupied / NUMBER_OF_FINGERPRINTS;
+
+    entry = (fingerprint << DUPLICATE_FILTER_COUNT_BITS) | 1;
+
+    if (place_in_bucket(filter, bucket[0], entry) || place_in_bucket(filter, bucket[1], entry)) {
+        filter->entries++;
+        return false;
+    }
+
+    // With the victim slot in use, there's nowhere to put what we'd displace
+    if (filter->victim != 0) {
+        filter->failed_inserts++;
+        return false;
+    }
+
+    // Both buckets full - move entries to their other bucket until one fits
+    current = bucket[next_random(filter) & 1];
+    for (kick=0; kick<MAX_KICKS; kick++) {
+        uint32_t* slots = filter->slots + (current * DUPLICATE_FILTER_BUCKET_SIZE);
+        int i = next_random(filter) % DUPLICATE_FILTER_BUCKET_SIZE;
+        uint32_t displaced = slots[i];
+
+        slots[i] = entry;
+        entry = displaced;
+        current = alternate_bucket(filter, current, ENTRY_FINGERPRINT(entry));
+
+        if (place_in_bucket(filter, current, entry)) {
+            filter->entries++;
+            return false;
+        }
+    }
+
+    filter->victim = entry;
+    filter->victim_bucket = current;
+    filter->entries++;
+
+    return false;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_filter_traverse
+ * Purpose:    Call a function with the count of every entry
+ * Parameters: filter -> filter
+ *             f -> function to call
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void duplicate_filter_traverse(DuplicateFilter* filter, void (*f)(int count))
+{
+    uint64_t i;
+
+    for (i=0; i<filter->number_of_buckets * DUPLICATE_FILTER_BUCKET_SIZE; i++) {
+        if (filter->slots[i] != 0) {
+            f(ENTRY_COUNT(filter->slots[i]));
+        }
+    }
+
+    if (filter->victim != 0) {
+        f(ENTRY_COUNT(filter->victim));
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_filter_capacity
+ * Purpose:    Number of signatures the filter can be expected to hold.
+ *             Cuckoo insertion with four slots per bucket starts to
+ *             fail at around 95% load.
+ * Parameters: filter -> filter
+ * Returns:    Capacity
+ *----------------------------------------------------------------------*/
+long int duplicate_filter_capacity(DuplicateFilter* filter)
+{
+    return (long int)(0.95 * filter->number_of_buckets * DUPLICATE_FILTER_BUCKET_SIZE);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_filter_false_positive_rate
+ * Purpose:    Chance that a signature not in the filter is reported as
+ *             seen, at the filter's current load
+ * Parameters: filter -> filter
+ * Returns:    False positive rate
+ *----------------------------------------------------------------------*/
+double duplicate_filter_false_positive_rate(DuplicateFilter* filter)
+{
+    double load = (double)filter->entries / (double)(filter->number_of_buckets * DUPLICATE_FILTER_BUCKET_SIZE);
+
+    return (2 * DUPLICATE_FILTER_BUCKET_SIZE * load) / NUMBER_OF_FINGERPRINTS;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_filter_print_stats
+ * Purpose:    Report size and load of filter
+ * Parameters: filter -> filter
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void duplicate_filter_print_stats(DuplicateFilter* filter)
+{
+    uint64_t slots = filter->number_of_buckets * DUPLICATE_FILTER_BUCKET_SIZE;
+
+    printf("Duplicate filter\n");
+    printf("           Buckets: %lu\n", filter->number_of_buckets);
+    printf("             Slots: %lu\n", slots);
+    printf("            Memory: %lu MB\n", (slots * sizeof(uint32_t)) / (1024 * 1024));
+    printf("          Capacity: %ld\n", duplicate_filter_capacity(filter));
+    printf("           Entries: %ld\t%.2f %%\n", filter->entries, (100.0 * filter->entries) / slots);
+    printf("   False pos. rate: %.2e\n", duplicate_filter_false_positive_rate(filter));
+
+    if (filter->failed_inserts > 0) {
+        printf("Warning: filter full - %ld signatures could not be stored, so their duplicates were missed\n", filter->failed_inserts);
+    }
+
+    if (filter->saturated > 0) {
+        printf("Warning: %ld duplicates not counted because a count reached %d\n", filter->saturated, DUPLICATE_FILTER_MAX_COUNT);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_filter_free
+ * Purpose:    Free memory used by filter
+ * Parameters: filter -> filter
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void duplicate_filter_free(DuplicateFilter* filter)
+{
+    if (filter->slots != NULL) {
+        free(filter->slots);
+        filter->slots = NULL;
+    }
+}
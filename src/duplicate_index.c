@@ -0,0 +1,381 @@
+/*----------------------------------------------------------------------*
+ * File:    duplicate_index.c                                           *
+ * Purpose: Error-tolerant PCR duplicate detection - one record per     *
+ *          pair, found through any of three sub-signatures             *
+ *----------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "global.h"
+#include "binary_kmer.h"
+#include "duplicate_index.h"
+
+/*
+ * Each pair has three sub-signatures, each made from two of three windows
+ * of each read. A base miscalled in one window only spoils the two
+ * sub-signatures that use it, so a pair is a duplicate if any of its
+ * sub-signatures has been seen before.
+ *
+ * A pair that isn't a duplicate gets a record - just its count - and all
+ * three sub-signatures go into one shared table pointing at that record.
+ * Duplicates add to the count of the record they matched, and any of
+ * their sub-signatures that weren't there are added too, pointing at the
+ * same record. That way every pair's first sub-signature - the usual
+ * signature - is always in the table, so any pair the exact table would
+ * call a duplicate is still called one.
+ *
+ * The table stores fingerprints, not whole signatures. Only the top 52
+ * bits of each sub-signature hash are used. With 2^q slots, the top q
+ * bits pick the home slot and the next 52-q bits are the fingerprint.
+ * A slot is 64 bits: 12 bits of distance from home, then a q bit record
+ * number, then the fingerprint. When the table doubles, the top bit of
+ * each fingerprint moves onto the bottom of its home slot and the record
+ * number gets one bit wider, so nothing needs rehashing. Collisions are
+ * resolved by linear probing. Entries are never removed, so an empty
+ * slot ends a search.
+ *
+ * Fingerprints can match by chance, which would make a pair look like a
+ * duplicate when it isn't. The chance of this is tracked as the table is
+ * used, so it can be reported.
+ */
+
+#define DISTANCE_BITS 12
+#define DISTANCE_MASK ((1ULL << DISTANCE_BITS) - 1)
+#define MAX_DISTANCE (DISTANCE_MASK - 1)
+#define UTILISATION 0.8
+#define INITIAL_RECORDS 65536
+
+static const uint64_t seeds[DUPLICATE_INDEX_SUBSIGNATURES] = {0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL};
+
+/*----------------------------------------------------------------------*
+ * Function:   mix
+ * Purpose:    Mix the bits of a 64-bit value
+ * Parameters: x = value to mix
+ * Returns:    Mixed value
+ *----------------------------------------------------------------------*/
+static inline uint64_t mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDULL;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ULL;
+    x ^= x >> 33;
+
+    return x;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   set_geometry
+ * Purpose:    Set the fields that depend on the number of slots
+ * Parameters: index -> index
+ *             slot_bits = log2 of number of slots
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void set_geometry(DuplicateIndex* index, int slot_bits)
+{
+    index->slot_bits = slot_bits;
+    index->number_of_slots = 1ULL << slot_bits;
+    index->slot_mask = index->number_of_slots - 1;
+    index->fingerprint_bits = DUPLICATE_INDEX_HASH_BITS - slot_bits;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   insert
+ * Purpose:    Put an entry into the first free slot from its home
+ * Parameters: index -> index
+ *             home = home slot
+ *             fingerprint = fingerprint
+ *             record = record number
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void insert(DuplicateIndex* index, uint64_t home, uint64_t fingerprint, uint64_t record)
+{
+    int distance;
+
+    for (distance=0; distance<=MAX_DISTANCE; distance++) {
+        uint64_t slot = (home + distance) & index->slot_mask;
+
+        if (index->slots[slot] == 0) {
+            index->slots[slot] = (fingerprint << (DISTANCE_BITS + index->slot_bits)) | (record << DISTANCE_BITS) | distance;
+            if (distance > index->longest_probe) {
+                index->longest_probe = distance;
+            }
+            return;
+        }
+    }
+
+    duplicate_index_print_stats(index);
+    printf("Error: duplicate index too full\n");
+    exit(101);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   lookup
+ * Purpose:    Find the record a sub-signature points to
+ * Parameters: index -> index
+ *             hash = sub-signature hash
+ * Returns:    Record number, or 0 if not found
+ *----------------------------------------------------------------------*/
+static uint64_t lookup(DuplicateIndex* index, uint64_t hash)
+{
+    uint64_t top = hash >> (64 - DUPLICATE_INDEX_HASH_BITS);
+    uint64_t home = top >> index->fingerprint_bits;
+    uint64_t fingerprint = top & ((1ULL << index->fingerprint_bits) - 1);
+    uint64_t record_mask = index->slot_mask;
+    int compared = 0;
+    int distance;
+
+    for (distance=0; distance<=index->longest_probe; distance++) {
+        uint64_t entry = index->slots[(home + distance) & index->slot_mask];
+
+        if (entry == 0) {
+            break;
+        }
+
+        if ((entry & DISTANCE_MASK) == distance) {
+            if ((entry >> (DISTANCE_BITS + index->slot_bits)) == fingerprint) {
+                return (entry >> DISTANCE_BITS) & record_mask;
+            }
+            compared++;
+        }
+    }
+
+    // Each fingerprint compared from the same home could have matched by chance
+    index->expected_false_matches += compared / (double)(1ULL << index->fingerprint_bits);
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_index_bits_for
+ * Purpose:    Work out index size for a number of pairs
+ * Parameters: pairs = expected number of pairs
+ * Returns:    log2 of number of slots
+ *----------------------------------------------------------------------*/
+int duplicate_index_bits_for(long int pairs)
+{
+    int bits = ceil(log((DUPLICATE_INDEX_SUBSIGNATURES * (double)pairs) / UTILISATION) / log(2));
+
+    if (bits < DUPLICATE_INDEX_MIN_BITS) {
+        bits = DUPLICATE_INDEX_MIN_BITS;
+    } else if (bits > DUPLICATE_INDEX_MAX_BITS) {
+        bits = DUPLICATE_INDEX_MAX_BITS;
+    }
+
+    return bits;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_index_memory
+ * Purpose:    Work out memory needed for an index
+ * Parameters: slot_bits = log2 of number of slots
+ *             pairs = expected number of pairs
+ * Returns:    Number of bytes
+ *----------------------------------------------------------------------*/
+uint64_t duplicate_index_memory(int slot_bits, long int pairs)
+{
+    return ((1ULL << slot_bits) * sizeof(uint64_t)) + (pairs * sizeof(uint32_t));
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_index_initialise
+ * Purpose:    Allocate an empty index
+ * Parameters: index -> index
+ *             slot_bits = log2 of number of slots
+ * Returns:    true if allocated
+ *----------------------------------------------------------------------*/
+boolean duplicate_index_initialise(DuplicateIndex* index, int slot_bits)
+{
+    set_geometry(index, slot_bits);
+    index->entries = 0;
+    index->longest_probe = 0;
+    index->expected_false_matches = 0;
+    index->number_of_records = 0;
+    index->records_allocated = INITIAL_RECORDS;
+
+    index->slots = calloc(index->number_of_slots, sizeof(uint64_t));
+    index->counts = malloc(index->records_allocated * sizeof(uint32_t));
+
+    return ((index->slots != NULL) && (index->counts != NULL)) ? true:false;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_index_hash
+ * Purpose:    Hash a sub-signature
+ * Parameters: signature -> sub-signature
+ *             which = which of the sub-signatures it is
+ * Returns:    Hash
+ *----------------------------------------------------------------------*/
+uint64_t duplicate_index_hash(BinaryKmer* signature, int which)
+{
+    uint64_t high = (*signature)[NUMBER_OF_BITFIELDS_IN_BINARY_KMER - 2];
+    uint64_t low = (*signature)[NUMBER_OF_BITFIELDS_IN_BINARY_KMER - 1];
+
+    return mix(low ^ mix(high + seeds[which]));
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_index_reserve
+ * Purpose:    Make sure there's room for a number of new pairs, growing
+ *             the index if not
+ * Parameters: index -> index
+ *             pairs = number of pairs about to be added
+ * Returns:    true if the index grew
+ *----------------------------------------------------------------------*/
+boolean duplicate_index_reserve(DuplicateIndex* index, long int pairs)
+{
+    uint64_t* old_slots = index->slots;
+    uint64_t old_mask = index->slot_mask;
+    uint64_t old_number_of_slots = index->number_of_slots;
+    int old_bits = index->slot_bits;
+    int bits = index->slot_bits;
+    int shift;
+    uint64_t slot;
+
+    while ((bits < DUPLICATE_INDEX_MAX_BITS) && ((index->entries + DUPLICATE_INDEX_SUBSIGNATURES * pairs) > UTILISATION * (1ULL << bits))) {
+        bits++;
+    }
+
+    if (bits == index->slot_bits) {
+        return false;
+    }
+
+    index->slots = calloc(1ULL << bits, sizeof(uint64_t));
+    if (index->slots == NULL) {
+        printf("Warning: can't allocate memory to grow duplicate index\n");
+        index->slots = old_slots;
+        return false;
+    }
+
+    set_geometry(index, bits);
+    index->longest_probe = 0;
+    shift = bits - old_bits;
+
+    for (slot=0; slot<old_number_of_slots; slot++) {
+        uint64_t entry = old_slots[slot];
+        uint64_t home, fingerprint, record;
+
+        if (entry == 0) {
+            continue;
+        }
+
+        home = (slot - (entry & DISTANCE_MASK)) & old_mask;
+        record = (entry >> DISTANCE_BITS) & old_mask;
+        fingerprint = entry >> (DISTANCE_BITS + old_bits);
+        home = (home << shift) | (fingerprint >> index->fingerprint_bits);
+        fingerprint &= (1ULL << index->fingerprint_bits) - 1;
+
+        insert(index, home, fingerprint, record);
+    }
+
+    free(old_slots);
+
+    return true;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_index_add
+ * Purpose:    Look for a pair by its sub-signatures. If found, count it
+ *             against the record it matched, otherwise give it a new
+ *             record. Pairs must be added in file order.
+ * Parameters: index -> index
+ *             hashes -> hashes of the pair's sub-signatures
+ *             record_return -> returned record the pair was counted in
+ * Returns:    true if the pair matched an earlier one
+ *----------------------------------------------------------------------*/
+boolean duplicate_index_add(DuplicateIndex* index, uint64_t* hashes, uint64_t* record_return)
+{
+    uint64_t found[DUPLICATE_INDEX_SUBSIGNATURES];
+    uint64_t record = 0;
+    boolean is_duplicate;
+    int i;
+
+    for (i=0; i<DUPLICATE_INDEX_SUBSIGNATURES; i++) {
+        found[i] = lookup(index, hashes[i]);
+        if ((record == 0) && (found[i] != 0)) {
+            record = found[i];
+        }
+    }
+
+    is_duplicate = record != 0 ? true:false;
+
+    if (is_duplicate) {
+        if (index->counts[record] < UINT32_MAX) {
+            index->counts[record]++;
+        }
+    } else {
+        // Record 0 means an empty slot, so record numbers start at 1
+        record = ++index->number_of_records;
+        if (record >= index->records_allocated) {
+            index->records_allocated *= 2;
+            index->counts = realloc(index->counts, index->records_allocated * sizeof(uint32_t));
+            if (index->counts == NULL) {
+                printf("Error: can't allocate memory for duplicate index records\n");
+                exit(101);
+            }
+        }
+        index->counts[record] = 1;
+    }
+
+    for (i=0; i<DUPLICATE_INDEX_SUBSIGNATURES; i++) {
+        if (found[i] == 0) {
+            uint64_t top = hashes[i] >> (64 - DUPLICATE_INDEX_HASH_BITS);
+            insert(index, top >> index->fingerprint_bits, top & ((1ULL << index->fingerprint_bits) - 1), record);
+            index->entries++;
+        }
+    }
+
+    *record_return = record;
+
+    return is_duplicate;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_index_traverse
+ * Purpose:    Call a function with the count of every record
+ * Parameters: index -> index
+ *             f -> function to call
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void duplicate_index_traverse(DuplicateIndex* index, void (*f)(int count))
+{
+    long int record;
+
+    for (record=1; record<=index->number_of_records; record++) {
+        f(index->counts[record]);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_index_print_stats
+ * Purpose:    Report size and load of index
+ * Parameters: index -> index
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void duplicate_index_print_stats(DuplicateIndex* index)
+{
+    printf("Duplicate index\n");
+    printf("            Slots: %lu\n", index->number_of_slots);
+    printf(" Fingerprint bits: %d\n", index->fingerprint_bits);
+    printf("           Memory: %lu MB\n", duplicate_index_memory(index->slot_bits, index->records_allocated) / (1024 * 1024));
+    printf("          Records: %ld\n", index->number_of_records);
+    printf("          Entries: %ld\t%.2f %%\n", index->entries, (100.0 * index->entries) / index->number_of_slots);
+    printf("    Longest probe: %d\n", index->longest_probe);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_index_free
+ * Purpose:    Free memory used by index
+ * Parameters: index -> index
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void duplicate_index_free(DuplicateIndex* index)
+{
+    free(index->slots);
+    free(index->counts);
+    index->slots = NULL;
+    index->counts = NULL;
+}
@@ -0,0 +1,947 @@
+/*----------------------------------------------------------------------*
+ * File:    duplicate_table.c                                           *
+ * Purpose: Compact exact table of PCR duplicate signatures and counts  *
+ *----------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <sched.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "global.h"
+#include "binary_kmer.h"
+#include "large_memory.h"
+#include "duplicate_table.h"
+
+/*
+ * A duplicate signature is s bits - 88 for the usual four windows of 11
+ * bases. Rather than store all of it, the signature is first scrambled
+ * with a 4 round Feistel network. Any Feistel network is a one-to-one
+ * mapping, so the scrambled value still identifies the signature exactly,
+ * but its bits are now well mixed. The top bits of the scrambled value
+ * choose the home slot and only the rest, the remainder, is stored. With
+ * 2^q slots, that's s-q bits.
+ *
+ * Collisions are resolved by linear probing and each slot records how far
+ * it is from its home slot, so the home slot - and therefore the whole
+ * signature - can always be worked out from where an entry is.
+ *
+ * A slot is two to four 32-bit words, the fewest that fit the signature
+ * length. All but the last hold the low bits of the remainder. The last
+ * holds, from the bottom up, the count, 12 bits of distance from home, a
+ * flag the caller can set when a signature is first added, then any
+ * remainder bits that didn't fit in the other words. Whatever space is
+ * left over goes to the count - for 88 bit signatures, 19 bits for tables
+ * of 2^24 slots or more, down to 11 bits at the minimum size. When a count
+ * fills up, further duplicates of that signature are counted in a small
+ * overflow list instead.
+ *
+ * A count of zero means the slot is free, and a count of zero with all the
+ * distance bits set means another thread is part way through writing it.
+ * New entries are added by claiming a free slot with compare-and-swap, so
+ * several threads can add to the table at once. That matters when a table
+ * grows, as entries moved by one thread can probe into another's slots.
+ *
+ * Big tables are split into partitions by the top bits of the home slot,
+ * and probing wraps around within a partition rather than the whole
+ * table. A signature only ever lives in one partition, so a batch can be
+ * sorted by partition and each thread given its own set of partitions to
+ * add to. Each thread then works through its own part of the table in
+ * order, and two threads never touch the same slots. Partitions are at
+ * least 2^16 slots, which is more than the longest allowed probe.
+ *
+ * A table can be saved and loaded again later, eg. to find duplicates of
+ * a top-up run against earlier lanes of the same library. The file is a
+ * header, then the slots starting on a page boundary, then the overflow
+ * list. Loading maps the file copy-on-write, so the table can be used
+ * straight away and new signatures never touch the file.
+ */
+
+#define FEISTEL_ROUNDS 4
+#define DISTANCE_BITS 12
+#define MIN_COUNT_BITS 8
+#define MAX_DISTANCE ((1 << DISTANCE_BITS) - 2)
+#define CLAIMED_DISTANCE ((1 << DISTANCE_BITS) - 1)
+#define FLAG_BIT (1 << DISTANCE_BITS)
+#define UTILISATION 0.8
+
+typedef struct {
+    DuplicateTable* from;
+    DuplicateTable* to;
+    uint64_t first_slot;
+    uint64_t last_slot;
+} MigrateChunk;
+
+static const uint64_t round_keys[FEISTEL_ROUNDS] = {0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL};
+
+/*----------------------------------------------------------------------*
+ * Function:   mix
+ * Purpose:    Round function for the Feistel network
+ * Parameters: x = value to mix
+ * Returns:    Mixed value
+ *----------------------------------------------------------------------*/
+static inline uint64_t mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDULL;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ULL;
+    x ^= x >> 33;
+
+    return x;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   split_remainder
+ * Purpose:    Split a remainder into the words it's stored in
+ * Parameters: table -> table
+ *             remainder = remainder
+ *             words -> returned low bits, one word per slot word but
+ *                      the last
+ *             remainder_high -> returned bits that go in the last word
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static inline void split_remainder(DuplicateTable* table, unsigned __int128 remainder, uint32_t* words, uint32_t* remainder_high)
+{
+    int i;
+
+    for (i=0; i<table->slot_words - 1; i++) {
+        words[i] = (uint32_t)(remainder >> (32 * i));
+    }
+    *remainder_high = (uint32_t)(remainder >> (32 * (table->slot_words - 1)));
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   scramble
+ * Purpose:    Split a signature into its home slot and remainder
+ * Parameters: table -> table
+ *             signature -> signature
+ *             home -> returned home slot
+ *             remainder -> returned remainder
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static inline void scramble(DuplicateTable* table, BinaryKmer* signature, uint64_t* home, unsigned __int128* remainder)
+{
+    int half_bits = table->signature_bits / 2;
+    uint64_t half_mask = (1ULL << half_bits) - 1;
+    unsigned __int128 value = ((unsigned __int128)(*signature)[NUMBER_OF_BITFIELDS_IN_BINARY_KMER - 2] << 64) | (*signature)[NUMBER_OF_BITFIELDS_IN_BINARY_KMER - 1];
+    uint64_t left = (uint64_t)(value >> half_bits) & half_mask;
+    uint64_t right = (uint64_t)value & half_mask;
+    unsigned __int128 scrambled;
+    int round;
+
+    for (round=0; round<FEISTEL_ROUNDS; round++) {
+        uint64_t next = left ^ (mix(right + round_keys[round]) & half_mask);
+        left = right;
+        right = next;
+    }
+
+    scrambled = ((unsigned __int128)left << half_bits) | right;
+    *home = (uint64_t)(scrambled >> table->remainder_bits);
+    *remainder = scrambled & ((((unsigned __int128)1) << table->remainder_bits) - 1);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   add_overflow
+ * Purpose:    Count a duplicate of a signature whose slot count is full
+ * Parameters: table -> table
+ *             slot = slot of signature
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void add_overflow(DuplicateTable* table, uint64_t slot)
+{
+    int i;
+
+    pthread_mutex_lock(&table->overflow_lock);
+
+    for (i=0; i<table->overflow_size; i++) {
+        if (table->overflow[i].slot == slot) {
+            table->overflow[i].extra++;
+            pthread_mutex_unlock(&table->overflow_lock);
+            return;
+        }
+    }
+
+    if (table->overflow_size == table->overflow_allocated) {
+        table->overflow_allocated = table->overflow_allocated == 0 ? 16 : table->overflow_allocated * 2;
+        table->overflow = realloc(table->overflow, table->overflow_allocated * sizeof(DuplicateOverflow));
+        if (table->overflow == NULL) {
+            printf("Error: can't allocate memory for duplicate count overflow\n");
+            exit(1);
+        }
+    }
+
+    table->overflow[table->overflow_size].slot = slot;
+    table->overflow[table->overflow_size].extra = 1;
+    table->overflow_size++;
+
+    pthread_mutex_unlock(&table->overflow_lock);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   overflow_count
+ * Purpose:    Find how many duplicates of a signature are in the
+ *             overflow list
+ * Parameters: table -> table
+ *             slot = slot of signature
+ * Returns:    Extra count
+ *----------------------------------------------------------------------*/
+static uint64_t overflow_count(DuplicateTable* table, uint64_t slot)
+{
+    int i;
+
+    for (i=0; i<table->overflow_size; i++) {
+        if (table->overflow[i].slot == slot) {
+            return table->overflow[i].extra;
+        }
+    }
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   set_geometry
+ * Purpose:    Set the fields that depend on the signature length and
+ *             number of slots
+ * Parameters: table -> table
+ *             signature_bits = bits in each signature
+ *             slot_bits = log2 of number of slots
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void set_geometry(DuplicateTable* table, int signature_bits, int slot_bits)
+{
+    int high_bits;
+
+    table->signature_bits = signature_bits;
+    table->slot_words = duplicate_table_slot_words(signature_bits);
+    table->slot_bits = slot_bits;
+    table->number_of_slots = 1ULL << slot_bits;
+    table->slot_mask = table->number_of_slots - 1;
+    table->remainder_bits = signature_bits - slot_bits;
+    high_bits = table->remainder_bits - (32 * (table->slot_words - 1));
+    if (high_bits < 0) {
+        high_bits = 0;
+    }
+    table->count_bits = 32 - DISTANCE_BITS - 1 - high_bits;
+    table->max_count = (1U << table->count_bits) - 1;
+    table->partition_bits = slot_bits - DUPLICATE_TABLE_PARTITION_SLOT_BITS;
+    if (table->partition_bits < 0) {
+        table->partition_bits = 0;
+    } else if (table->partition_bits > DUPLICATE_TABLE_MAX_PARTITION_BITS) {
+        table->partition_bits = DUPLICATE_TABLE_MAX_PARTITION_BITS;
+    }
+    table->number_of_partitions = 1 << table->partition_bits;
+    table->partition_mask = table->slot_mask >> table->partition_bits;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   probe_slot
+ * Purpose:    Find the slot a given distance from home, wrapping around
+ *             within the partition
+ * Parameters: table -> table
+ *             home = home slot
+ *             distance = distance from home
+ * Returns:    Slot
+ *----------------------------------------------------------------------*/
+static inline uint64_t probe_slot(DuplicateTable* table, uint64_t home, int distance)
+{
+    return (home & ~table->partition_mask) | ((home + distance) & table->partition_mask);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   note_probe
+ * Purpose:    Keep track of the longest probe
+ * Parameters: table -> table
+ *             distance = distance of new entry from its home slot
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static inline void note_probe(DuplicateTable* table, int distance)
+{
+    while (distance > __atomic_load_n(&table->longest_probe, __ATOMIC_RELAXED)) {
+        int longest = __atomic_load_n(&table->longest_probe, __ATOMIC_RELAXED);
+        __atomic_compare_exchange_n(&table->longest_probe, &longest, distance, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   read_slot
+ * Purpose:    Get the home slot and remainder of the entry in a slot
+ * Parameters: table -> table
+ *             slot = occupied slot
+ *             home -> returned home slot
+ *             remainder -> returned remainder
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static inline void read_slot(DuplicateTable* table, uint64_t slot, uint64_t* home, unsigned __int128* remainder)
+{
+    uint32_t* words = &table->slots[slot * table->slot_words];
+    int last = table->slot_words - 1;
+    uint32_t tag = words[last] >> table->count_bits;
+    int i;
+
+    *home = (slot & ~table->partition_mask) | ((slot - (tag & CLAIMED_DISTANCE)) & table->partition_mask);
+    *remainder = (unsigned __int128)(tag >> (DISTANCE_BITS + 1)) << (32 * last);
+    for (i=0; i<last; i++) {
+        *remainder |= (unsigned __int128)words[i] << (32 * i);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   rehome
+ * Purpose:    Convert a home slot and remainder from one table to a
+ *             bigger one. The top bits of the remainder move onto the
+ *             bottom of the home slot.
+ * Parameters: from -> table entry came from
+ *             to -> table entry is going to
+ *             home -> home slot, updated
+ *             remainder -> remainder, updated
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static inline void rehome(DuplicateTable* from, DuplicateTable* to, uint64_t* home, unsigned __int128* remainder)
+{
+    int shift = to->slot_bits - from->slot_bits;
+
+    *home = (*home << shift) | (uint64_t)(*remainder >> to->remainder_bits);
+    *remainder &= (((unsigned __int128)1) << to->remainder_bits) - 1;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   place
+ * Purpose:    Put an entry known not to be in the table into the first
+ *             free slot from its home. Safe to call from several threads
+ *             at once.
+ * Parameters: table -> table
+ *             home = home slot
+ *             remainder = remainder
+ *             flag = FLAG_BIT or 0
+ *             count = count to store
+ * Returns:    Slot used
+ *----------------------------------------------------------------------*/
+static uint64_t place(DuplicateTable* table, uint64_t home, unsigned __int128 remainder, uint32_t flag, uint32_t count)
+{
+    uint32_t remainder_words[DUPLICATE_TABLE_MAX_SLOT_WORDS];
+    uint32_t remainder_high;
+    int last = table->slot_words - 1;
+    int c = table->count_bits;
+    int distance;
+
+    split_remainder(table, remainder, remainder_words, &remainder_high);
+
+    for (distance=0; distance<=MAX_DISTANCE; distance++) {
+        uint64_t slot = probe_slot(table, home, distance);
+        uint32_t* words = &table->slots[slot * table->slot_words];
+        uint32_t info = 0;
+
+        if (__atomic_compare_exchange_n(&words[last], &info, CLAIMED_DISTANCE << c, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            uint32_t tag = (remainder_high << (DISTANCE_BITS + 1)) | flag | distance;
+
+            memcpy(words, remainder_words, last * sizeof(uint32_t));
+            __atomic_store_n(&words[last], (tag << c) | count, __ATOMIC_RELEASE);
+            note_probe(table, distance);
+
+            return slot;
+        }
+    }
+
+    printf("Error: duplicate table too full while growing\n");
+    exit(101);
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   locate
+ * Purpose:    Find the slot holding an entry
+ * Parameters: table -> table
+ *             home = home slot
+ *             remainder = remainder
+ * Returns:    Slot holding entry
+ *----------------------------------------------------------------------*/
+static uint64_t locate(DuplicateTable* table, uint64_t home, unsigned __int128 remainder)
+{
+    uint32_t remainder_words[DUPLICATE_TABLE_MAX_SLOT_WORDS];
+    uint32_t remainder_high;
+    int last = table->slot_words - 1;
+    int c = table->count_bits;
+    int distance;
+
+    split_remainder(table, remainder, remainder_words, &remainder_high);
+
+    for (distance=0; distance<=table->longest_probe; distance++) {
+        uint64_t slot = probe_slot(table, home, distance);
+        uint32_t* words = &table->slots[slot * table->slot_words];
+        uint32_t tag = (remainder_high << (DISTANCE_BITS + 1)) | distance;
+
+        if ((((words[last] >> c) & ~FLAG_BIT) == tag) &&
+            (memcmp(words, remainder_words, last * sizeof(uint32_t)) == 0)) {
+            return slot;
+        }
+    }
+
+    printf("Error: lost duplicate table entry while growing\n");
+    exit(101);
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   migrate_chunk
+ * Purpose:    Thread entry point to move one range of slots of the old
+ *             table into the new one
+ * Parameters: arg -> MigrateChunk structure
+ * Returns:    NULL
+ *----------------------------------------------------------------------*/
+static void* migrate_chunk(void* arg)
+{
+    MigrateChunk* chunk = (MigrateChunk*)arg;
+    DuplicateTable* from = chunk->from;
+    DuplicateTable* to = chunk->to;
+    uint64_t slot;
+
+    for (slot=chunk->first_slot; slot<chunk->last_slot; slot++) {
+        uint32_t info = from->slots[slot * from->slot_words + from->slot_words - 1];
+        uint64_t count = info & from->max_count;
+        uint64_t home;
+        unsigned __int128 remainder;
+
+        if (count == 0) {
+            continue;
+        }
+
+        // A bigger table can have wider counts, so take back what it can from the overflow list
+        if (count == from->max_count) {
+            count += overflow_count(from, slot);
+            if (count > to->max_count) {
+                count = to->max_count;
+            }
+        }
+
+        read_slot(from, slot, &home, &remainder);
+        rehome(from, to, &home, &remainder);
+        place(to, home, remainder, (info >> from->count_bits) & FLAG_BIT, count);
+    }
+
+    return NULL;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   release_slots
+ * Purpose:    Free the slots, whether allocated or mapped from a file
+ * Parameters: table -> table
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void release_slots(DuplicateTable* table)
+{
+    if (table->mapping != NULL) {
+        munmap(table->mapping, table->mapping_size);
+        table->mapping = NULL;
+        table->mapping_size = 0;
+    } else {
+        large_memory_free(table->slots, duplicate_table_memory(table->slot_bits, table->signature_bits));
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_table_bits_for
+ * Purpose:    Work out table size for a number of signatures
+ * Parameters: entries = expected number of signatures
+ * Returns:    log2 of number of slots
+ *----------------------------------------------------------------------*/
+int duplicate_table_bits_for(long int entries)
+{
+    int bits = ceil(log(entries / UTILISATION) / log(2));
+
+    if (bits < DUPLICATE_TABLE_MIN_BITS) {
+        bits = DUPLICATE_TABLE_MIN_BITS;
+    } else if (bits > DUPLICATE_TABLE_MAX_BITS) {
+        bits = DUPLICATE_TABLE_MAX_BITS;
+    }
+
+    return bits;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_table_slot_words
+ * Purpose:    Work out the fewest 32-bit words per slot that hold a
+ *             signature and still leave room for a useful count in the
+ *             smallest table
+ * Parameters: signature_bits = bits in each signature, up to
+ *                              DUPLICATE_TABLE_MAX_SIGNATURE_BITS
+ * Returns:    Words per slot
+ *----------------------------------------------------------------------*/
+int duplicate_table_slot_words(int signature_bits)
+{
+    int words = 2;
+
+    while ((words < DUPLICATE_TABLE_MAX_SLOT_WORDS) &&
+           (signature_bits - DUPLICATE_TABLE_MIN_BITS + DISTANCE_BITS + 1 + MIN_COUNT_BITS > 32 * words)) {
+        words++;
+    }
+
+    return words;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_table_memory
+ * Purpose:    Work out memory needed for a table
+ * Parameters: slot_bits = log2 of number of slots
+ *             signature_bits = bits in each signature
+ * Returns:    Bytes
+ *----------------------------------------------------------------------*/
+uint64_t duplicate_table_memory(int slot_bits, int signature_bits)
+{
+    return (1ULL << slot_bits) * duplicate_table_slot_words(signature_bits) * sizeof(uint32_t);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_table_initialise
+ * Purpose:    Allocate an empty table
+ * Parameters: table -> table
+ *             slot_bits = log2 of number of slots
+ *             signature_bits = bits in each signature, from
+ *                              DUPLICATE_TABLE_MIN_SIGNATURE_BITS to
+ *                              DUPLICATE_TABLE_MAX_SIGNATURE_BITS
+ * Returns:    true if allocated
+ *----------------------------------------------------------------------*/
+boolean duplicate_table_initialise(DuplicateTable* table, int slot_bits, int signature_bits)
+{
+    set_geometry(table, signature_bits, slot_bits);
+    table->signature_type = 0;
+    table->window_count = 0;
+    table->window_size = 0;
+    table->window_offset = 0;
+    table->unique = 0;
+    table->longest_probe = 0;
+    table->overflow = NULL;
+    table->overflow_size = 0;
+    table->overflow_allocated = 0;
+    pthread_mutex_init(&table->overflow_lock, NULL);
+    table->mapping = NULL;
+    table->mapping_size = 0;
+
+    table->slots = large_memory_allocate(duplicate_table_memory(slot_bits, signature_bits), &table->memory);
+
+    return table->slots != NULL ? true:false;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_table_prepare
+ * Purpose:    Work out where a signature goes in the table, so it can be
+ *             sorted by partition before being added. Only valid until
+ *             the table next grows.
+ * Parameters: table -> table
+ *             signature -> signature
+ *             key -> returned home slot, remainder and partition
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void duplicate_table_prepare(DuplicateTable* table, BinaryKmer* signature, DuplicateTableKey* key)
+{
+    unsigned __int128 remainder;
+
+    scramble(table, signature, &key->home, &remainder);
+    split_remainder(table, remainder, key->remainder, &key->remainder_high);
+    key->partition = key->home >> (table->slot_bits - table->partition_bits);
+    key->flag = false;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_table_prefetch
+ * Purpose:    Start fetching the home slot of a signature that's about
+ *             to be added
+ * Parameters: table -> table
+ *             key -> key from duplicate_table_prepare
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void duplicate_table_prefetch(DuplicateTable* table, DuplicateTableKey* key)
+{
+    __builtin_prefetch(&table->slots[key->home * table->slot_words], 1);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_table_add
+ * Purpose:    Count a signature, adding it if it hasn't been seen. Safe
+ *             to call from several threads at once, though a partition
+ *             is best left to one thread.
+ * Parameters: table -> table
+ *             key -> key from duplicate_table_prepare, with flag set
+ *             found -> returned true if the signature was already there
+ * Returns:    Slot holding the signature
+ *----------------------------------------------------------------------*/
+uint64_t duplicate_table_add(DuplicateTable* table, DuplicateTableKey* key, boolean* found)
+{
+    uint64_t home = key->home;
+    uint32_t remainder_high = key->remainder_high;
+    int last = table->slot_words - 1;
+    int c = table->count_bits;
+    int distance;
+
+    for (distance=0; distance<=MAX_DISTANCE; distance++) {
+        uint64_t slot = probe_slot(table, home, distance);
+        uint32_t* words = &table->slots[slot * table->slot_words];
+        uint32_t tag = (remainder_high << (DISTANCE_BITS + 1)) | distance;
+        uint32_t info = __atomic_load_n(&words[last], __ATOMIC_ACQUIRE);
+
+        if (info == 0) {
+            if (__atomic_compare_exchange_n(&words[last], &info, CLAIMED_DISTANCE << c, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+                memcpy(words, key->remainder, last * sizeof(uint32_t));
+                __atomic_store_n(&words[last], ((tag | (key->flag ? FLAG_BIT:0)) << c) | 1, __ATOMIC_RELEASE);
+                __atomic_fetch_add(&table->unique, 1, __ATOMIC_RELAXED);
+                note_probe(table, distance);
+
+                *found = false;
+                return slot;
+            }
+            // Lost the race - info now holds what the other thread wrote
+        }
+
+        // Another thread may be part way through writing this slot
+        while ((info & table->max_count) == 0) {
+            sched_yield();
+            info = __atomic_load_n(&words[last], __ATOMIC_ACQUIRE);
+        }
+
+        if ((((info >> c) & ~FLAG_BIT) == tag) && (memcmp(words, key->remainder, last * sizeof(uint32_t)) == 0)) {
+            while (1) {
+                if ((info & table->max_count) == table->max_count) {
+                    add_overflow(table, slot);
+                    break;
+                }
+                if (__atomic_compare_exchange_n(&words[last], &info, info + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                    break;
+                }
+            }
+
+            *found = true;
+            return slot;
+        }
+    }
+
+    duplicate_table_print_stats(table);
+    printf("Error: duplicate table too full - try specifying a larger number of reads\n");
+    exit(101);
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_table_reserve
+ * Purpose:    Make sure there's room for a number of new signatures,
+ *             growing the table if not. All entries are moved into the
+ *             new table in one go, split between threads. Slots returned
+ *             before growing are no longer valid, and neither are keys
+ *             from duplicate_table_prepare, so only call between
+ *             batches. Not safe while other threads are adding.
+ * Parameters: table -> table
+ *             incoming = number of signatures about to be added
+ *             threads = number of threads to use
+ * Returns:    true if the table grew
+ *----------------------------------------------------------------------*/
+boolean duplicate_table_reserve(DuplicateTable* table, long int incoming, int threads)
+{
+    DuplicateTable grown;
+    MigrateChunk chunks[DUPLICATE_TABLE_MAX_THREADS];
+    pthread_t thread_ids[DUPLICATE_TABLE_MAX_THREADS];
+    uint64_t per_chunk;
+    int bits = table->slot_bits;
+    int kept = 0;
+    int i;
+
+    while ((bits < DUPLICATE_TABLE_MAX_BITS) && ((table->unique + incoming) > UTILISATION * (1ULL << bits))) {
+        bits++;
+    }
+
+    if (bits == table->slot_bits) {
+        return false;
+    }
+
+    set_geometry(&grown, table->signature_bits, bits);
+    grown.longest_probe = 0;
+    grown.slots = large_memory_allocate(duplicate_table_memory(bits, table->signature_bits), &grown.memory);
+    if (grown.slots == NULL) {
+        printf("Warning: can't allocate memory to grow duplicate table\n");
+        return false;
+    }
+
+    if (threads > DUPLICATE_TABLE_MAX_THREADS) {
+        threads = DUPLICATE_TABLE_MAX_THREADS;
+    }
+
+    per_chunk = (table->number_of_slots + threads - 1) / threads;
+    for (i=0; i<threads; i++) {
+        chunks[i].from = table;
+        chunks[i].to = &grown;
+        chunks[i].first_slot = i * per_chunk;
+        chunks[i].last_slot = (i + 1) * per_chunk < table->number_of_slots ? (i + 1) * per_chunk : table->number_of_slots;
+    }
+
+    for (i=1; i<threads; i++) {
+        if (pthread_create(&thread_ids[i], NULL, migrate_chunk, &chunks[i]) != 0) {
+            printf("Error: can't create thread\n");
+            exit(1);
+        }
+    }
+
+    migrate_chunk(&chunks[0]);
+
+    for (i=1; i<threads; i++) {
+        pthread_join(thread_ids[i], NULL);
+    }
+
+    // Whatever didn't fit into the wider counts stays in the overflow list, against the new slot
+    for (i=0; i<table->overflow_size; i++) {
+        uint64_t total = table->max_count + table->overflow[i].extra;
+        uint64_t home;
+        unsigned __int128 remainder;
+
+        if (total > grown.max_count) {
+            read_slot(table, table->overflow[i].slot, &home, &remainder);
+            rehome(table, &grown, &home, &remainder);
+            table->overflow[kept].slot = locate(&grown, home, remainder);
+            table->overflow[kept].extra = total - grown.max_count;
+            kept++;
+        }
+    }
+    table->overflow_size = kept;
+
+    release_slots(table);
+    set_geometry(table, table->signature_bits, bits);
+    table->slots = grown.slots;
+    table->memory = grown.memory;
+    table->longest_probe = grown.longest_probe;
+
+    return true;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_table_get_flag
+ * Purpose:    Get the flag a signature was first added with
+ * Parameters: table -> table
+ *             slot = slot holding signature
+ * Returns:    Flag
+ *----------------------------------------------------------------------*/
+boolean duplicate_table_get_flag(DuplicateTable* table, uint64_t slot)
+{
+    uint32_t info = __atomic_load_n(&table->slots[slot * table->slot_words + table->slot_words - 1], __ATOMIC_RELAXED);
+
+    return ((info >> table->count_bits) & FLAG_BIT) ? true:false;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_table_traverse
+ * Purpose:    Call a function with the count of every signature
+ * Parameters: table -> table
+ *             f -> function to call
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void duplicate_table_traverse(DuplicateTable* table, void (*f)(int count))
+{
+    uint64_t slot;
+
+    for (slot=0; slot<table->number_of_slots; slot++) {
+        uint32_t count = table->slots[slot * table->slot_words + table->slot_words - 1] & table->max_count;
+
+        if (count == table->max_count) {
+            f(count + overflow_count(table, slot));
+        } else if (count > 0) {
+            f(count);
+        }
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_table_print_stats
+ * Purpose:    Report size and load of table
+ * Parameters: table -> table
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void duplicate_table_print_stats(DuplicateTable* table)
+{
+    printf("Duplicate table\n");
+    printf("            Slots: %lu\n", table->number_of_slots);
+    printf("        Slot size: %lu\n", table->slot_words * sizeof(uint32_t));
+    printf("       Partitions: %d\n", table->number_of_partitions);
+    printf("           Memory: %lu MB\n", duplicate_table_memory(table->slot_bits, table->signature_bits) / (1024 * 1024));
+    printf("       Signatures: %ld\t%.2f %%\n", table->unique, (100.0 * table->unique) / table->number_of_slots);
+    printf("    Longest probe: %d\n", table->longest_probe);
+    printf("  Overflow counts: %d\n", table->overflow_size);
+    if (table->mapping == NULL) {
+        large_memory_print_stats(&table->memory);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_table_save
+ * Purpose:    Write a table to a file that duplicate_table_load can map.
+ *             Written to a temporary file first, so a table can be saved
+ *             over the file it was loaded from.
+ * Parameters: table -> table
+ *             filename -> file to write
+ *             totals -> read pair counts to store with the table
+ * Returns:    true if saved
+ *----------------------------------------------------------------------*/
+boolean duplicate_table_save(DuplicateTable* table, char* filename, DuplicateTableTotals* totals)
+{
+    DuplicateTableFileHeader header;
+    char temporary[DUPLICATE_TABLE_MAX_PATH + 8];
+    char padding[DUPLICATE_TABLE_FILE_ALIGNMENT];
+    uint64_t slots_bytes = duplicate_table_memory(table->slot_bits, table->signature_bits);
+    boolean ok;
+    FILE* fp;
+
+    memset(&header, 0, sizeof(header));
+    memset(padding, 0, sizeof(padding));
+    header.magic = DUPLICATE_TABLE_FILE_MAGIC;
+    header.version = DUPLICATE_TABLE_FILE_VERSION;
+    header.header_size = sizeof(header);
+    header.signature_bits = table->signature_bits;
+    header.slot_words = table->slot_words;
+    header.distance_bits = DISTANCE_BITS;
+    header.slot_bits = table->slot_bits;
+    header.partition_bits = table->partition_bits;
+    header.signature_type = table->signature_type;
+    header.window_count = table->window_count;
+    header.window_size = table->window_size;
+    header.window_offset = table->window_offset;
+    header.unique = table->unique;
+    header.longest_probe = table->longest_probe;
+    header.slots_offset = DUPLICATE_TABLE_FILE_ALIGNMENT;
+    header.overflow_offset = header.slots_offset + slots_bytes;
+    header.overflow_size = table->overflow_size;
+    header.totals = *totals;
+
+    snprintf(temporary, sizeof(temporary), "%s.tmp", filename);
+    fp = fopen(temporary, "wb");
+    if (fp == NULL) {
+        printf("Error: can't open duplicate index file %s\n", temporary);
+        return false;
+    }
+
+    ok = (fwrite(&header, sizeof(header), 1, fp) == 1) &&
+         (fwrite(padding, DUPLICATE_TABLE_FILE_ALIGNMENT - sizeof(header), 1, fp) == 1) &&
+         (fwrite(table->slots, slots_bytes, 1, fp) == 1) &&
+         ((table->overflow_size == 0) || (fwrite(table->overflow, sizeof(DuplicateOverflow), table->overflow_size, fp) == table->overflow_size));
+
+    if ((fclose(fp) != 0) || (!ok) || (rename(temporary, filename) != 0)) {
+        printf("Error: can't write duplicate index file %s\n", filename);
+        unlink(temporary);
+        return false;
+    }
+
+    return true;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_table_load
+ * Purpose:    Map a table saved by duplicate_table_save. The mapping is
+ *             private, so the table can be added to and grown as usual
+ *             without changing the file.
+ * Parameters: table -> table
+ *             filename -> file to load
+ *             totals -> returned read pair counts stored with the table
+ * Returns:    true if loaded
+ *----------------------------------------------------------------------*/
+boolean duplicate_table_load(DuplicateTable* table, char* filename, DuplicateTableTotals* totals)
+{
+    DuplicateTableFileHeader* header;
+    struct stat file_stats;
+    void* mapping;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Error: can't open duplicate index file %s\n", filename);
+        return false;
+    }
+
+    if ((fstat(fd, &file_stats) != 0) || (file_stats.st_size < DUPLICATE_TABLE_FILE_ALIGNMENT)) {
+        printf("Error: %s is not a duplicate index file\n", filename);
+        close(fd);
+        return false;
+    }
+
+    mapping = mmap(NULL, file_stats.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        printf("Error: can't map duplicate index file %s\n", filename);
+        return false;
+    }
+
+    header = (DuplicateTableFileHeader*)mapping;
+    if (header->magic != DUPLICATE_TABLE_FILE_MAGIC) {
+        printf("Error: %s is not a duplicate index file\n", filename);
+        munmap(mapping, file_stats.st_size);
+        return false;
+    }
+
+    if ((header->version != DUPLICATE_TABLE_FILE_VERSION) ||
+        (header->header_size != sizeof(DuplicateTableFileHeader)) ||
+        (header->distance_bits != DISTANCE_BITS)) {
+        printf("Error: duplicate index file %s was written by a different version of nextclip\n", filename);
+        munmap(mapping, file_stats.st_size);
+        return false;
+    }
+
+    if ((header->signature_bits < DUPLICATE_TABLE_MIN_SIGNATURE_BITS) || (header->signature_bits > DUPLICATE_TABLE_MAX_SIGNATURE_BITS) ||
+        (header->slot_words != duplicate_table_slot_words(header->signature_bits)) ||
+        (header->slot_bits < DUPLICATE_TABLE_MIN_BITS) || (header->slot_bits > DUPLICATE_TABLE_MAX_BITS) ||
+        (header->overflow_offset != header->slots_offset + duplicate_table_memory(header->slot_bits, header->signature_bits)) ||
+        ((uint64_t)file_stats.st_size != header->overflow_offset + header->overflow_size * sizeof(DuplicateOverflow))) {
+        printf("Error: duplicate index file %s is damaged\n", filename);
+        munmap(mapping, file_stats.st_size);
+        return false;
+    }
+
+    set_geometry(table, header->signature_bits, header->slot_bits);
+    if (header->partition_bits != table->partition_bits) {
+        printf("Error: duplicate index file %s was written by a different version of nextclip\n", filename);
+        munmap(mapping, file_stats.st_size);
+        return false;
+    }
+
+    table->signature_type = header->signature_type;
+    table->window_count = header->window_count;
+    table->window_size = header->window_size;
+    table->window_offset = header->window_offset;
+    table->unique = header->unique;
+    table->longest_probe = header->longest_probe;
+    table->overflow_size = header->overflow_size;
+    table->overflow_allocated = header->overflow_size;
+    table->overflow = NULL;
+    pthread_mutex_init(&table->overflow_lock, NULL);
+    table->slots = (uint32_t*)((char*)mapping + header->slots_offset);
+    table->mapping = mapping;
+    table->mapping_size = file_stats.st_size;
+    *totals = header->totals;
+
+    if (table->overflow_size > 0) {
+        table->overflow = malloc(table->overflow_size * sizeof(DuplicateOverflow));
+        if (table->overflow == NULL) {
+            printf("Error: can't allocate memory for duplicate count overflow\n");
+            exit(1);
+        }
+        memcpy(table->overflow, (char*)mapping + header->overflow_offset, table->overflow_size * sizeof(DuplicateOverflow));
+    }
+
+    return true;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   duplicate_table_free
+ * Purpose:    Free memory used by table
+ * Parameters: table -> table
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void duplicate_table_free(DuplicateTable* table)
+{
+    release_slots(table);
+    free(table->overflow);
+    table->slots = NULL;
+    table->overflow = NULL;
+    pthread_mutex_destroy(&table->overflow_lock);
+}
@@ -0,0 +1,618 @@
+/*----------------------------------------------------------------------*
+ * File:    external_sort.c                                             *
+ * Purpose: Sort more fixed size records than fit in memory, using      *
+ *          radix sorted runs on disk and a k-way merge                 *
+ *----------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "global.h"
+#include "external_sort.h"
+
+/*
+ * Records are a fixed number of 64-bit words and are ordered by the first
+ * word, then the second and so on. Records are collected in a buffer and,
+ * when it fills, sorted with a least significant digit radix sort - one
+ * stable counting pass per byte, starting from the last byte of the last
+ * word. Passes where every record has the same byte are skipped, which
+ * avoids the unused high bytes of k-mer signatures and pair numbers.
+ * Each pass is split between threads: every thread counts the digits in
+ * its own share of the records, and the counts are combined so that each
+ * thread scatters to its own region of each digit's output, keeping the
+ * sort stable.
+ *
+ * Each sorted buffer is written to a run file. Once everything is added,
+ * the runs are merged with a heap holding the next record from each run.
+ * If everything fitted in one buffer, no files are written at all. If the
+ * number of runs reaches EXTERNAL_SORT_MAX_RUNS while records are still
+ * being added, the runs so far are merged into one and adding carries on,
+ * so there's no limit on the number of records.
+ */
+
+#define MIN_RUN_BUFFER (64 * 1024)
+#define MAX_RUN_BUFFER (4 * 1024 * 1024)
+#define RUN_FILENAME_LENGTH (EXTERNAL_SORT_MAX_PATH + 32)
+
+typedef struct {
+    ExternalSort* sorter;
+    uint64_t* from;
+    uint64_t* to;
+    long int first;
+    long int last;
+    int word;
+    int shift;
+    long int counts[256];
+    long int offsets[256];
+} RadixChunk;
+
+/*----------------------------------------------------------------------*
+ * Function:   compare_records
+ * Purpose:    Order two records
+ * Parameters: a -> first record
+ *             b -> second record
+ *             words = number of words in a record
+ * Returns:    -1, 0 or 1 as a is before, the same as or after b
+ *----------------------------------------------------------------------*/
+static inline int compare_records(uint64_t* a, uint64_t* b, int words)
+{
+    int i;
+
+    for (i=0; i<words; i++) {
+        if (a[i] != b[i]) {
+            return a[i] < b[i] ? -1:1;
+        }
+    }
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   run_filename
+ * Purpose:    Make the filename of a run
+ * Parameters: sorter -> sorter
+ *             run = run number
+ *             filename -> returned filename
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void run_filename(ExternalSort* sorter, int run, char* filename)
+{
+    snprintf(filename, RUN_FILENAME_LENGTH, "%s_%d.tmp", sorter->prefix, run);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   count_digits
+ * Purpose:    Thread entry point to count the current digit of each
+ *             record in a chunk
+ * Parameters: arg -> RadixChunk
+ * Returns:    NULL
+ *----------------------------------------------------------------------*/
+static void* count_digits(void* arg)
+{
+    RadixChunk* chunk = (RadixChunk*)arg;
+    int words = chunk->sorter->words;
+    long int i;
+
+    memset(chunk->counts, 0, sizeof(chunk->counts));
+
+    for (i=chunk->first; i<chunk->last; i++) {
+        chunk->counts[(chunk->from[i * words + chunk->word] >> chunk->shift) & 0xFF]++;
+    }
+
+    return NULL;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   scatter_records
+ * Purpose:    Thread entry point to move each record in a chunk to its
+ *             place in the output of a radix pass
+ * Parameters: arg -> RadixChunk
+ * Returns:    NULL
+ *----------------------------------------------------------------------*/
+static void* scatter_records(void* arg)
+{
+    RadixChunk* chunk = (RadixChunk*)arg;
+    int words = chunk->sorter->words;
+    long int i;
+    int w;
+
+    for (i=chunk->first; i<chunk->last; i++) {
+        uint64_t* record = &chunk->from[i * words];
+        long int destination = chunk->offsets[(record[chunk->word] >> chunk->shift) & 0xFF]++;
+
+        for (w=0; w<words; w++) {
+            chunk->to[destination * words + w] = record[w];
+        }
+    }
+
+    return NULL;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   run_chunks
+ * Purpose:    Run a function on every chunk, one thread each
+ * Parameters: f -> function
+ *             chunks -> array of chunks
+ *             n_chunks = number of chunks
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void run_chunks(void* (*f)(void*), RadixChunk* chunks, int n_chunks)
+{
+    pthread_t threads[EXTERNAL_SORT_MAX_THREADS];
+    int t;
+
+    for (t=1; t<n_chunks; t++) {
+        if (pthread_create(&threads[t], NULL, f, &chunks[t]) != 0) {
+            printf("Error: can't create thread\n");
+            exit(1);
+        }
+    }
+
+    f(&chunks[0]);
+
+    for (t=1; t<n_chunks; t++) {
+        pthread_join(threads[t], NULL);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   sort_buffer
+ * Purpose:    Radix sort the records in the buffer
+ * Parameters: sorter -> sorter
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void sort_buffer(ExternalSort* sorter)
+{
+    RadixChunk chunks[EXTERNAL_SORT_MAX_THREADS];
+    long int n = sorter->used;
+    int n_chunks = sorter->threads;
+    uint64_t* from = sorter->buffer;
+    uint64_t* to = sorter->spare;
+    int word, byte, t, d;
+
+    if (n < 2) {
+        return;
+    }
+
+    // Not worth threads for a handful of records
+    if (n < 1024 * n_chunks) {
+        n_chunks = 1;
+    }
+
+    for (t=0; t<n_chunks; t++) {
+        chunks[t].sorter = sorter;
+        chunks[t].first = (t * n) / n_chunks;
+        chunks[t].last = ((t + 1) * n) / n_chunks;
+    }
+
+    for (word=sorter->words-1; word>=0; word--) {
+        for (byte=0; byte<8; byte++) {
+            long int running = 0;
+            boolean one_digit = false;
+
+            for (t=0; t<n_chunks; t++) {
+                chunks[t].from = from;
+                chunks[t].to = to;
+                chunks[t].word = word;
+                chunks[t].shift = byte * 8;
+            }
+
+            run_chunks(count_digits, chunks, n_chunks);
+
+            // Work out where each thread's records with each digit go
+            for (d=0; d<256; d++) {
+                long int digit_total = 0;
+
+                for (t=0; t<n_chunks; t++) {
+                    chunks[t].offsets[d] = running;
+                    running += chunks[t].counts[d];
+                    digit_total += chunks[t].counts[d];
+                }
+
+                if (digit_total == n) {
+                    one_digit = true;
+                }
+            }
+
+            if (one_digit) {
+                continue;
+            }
+
+            run_chunks(scatter_records, chunks, n_chunks);
+
+            from = to;
+            to = (from == sorter->buffer) ? sorter->spare : sorter->buffer;
+        }
+    }
+
+    // Keep sorted records in the main buffer
+    if (from != sorter->buffer) {
+        sorter->spare = sorter->buffer;
+        sorter->buffer = from;
+    }
+}
+
+static void merge_runs(ExternalSort* sorter);
+
+/*----------------------------------------------------------------------*
+ * Function:   write_run
+ * Purpose:    Sort the buffer and write it out as a run
+ * Parameters: sorter -> sorter
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void write_run(ExternalSort* sorter)
+{
+    char filename[RUN_FILENAME_LENGTH];
+    FILE* fp;
+
+    sort_buffer(sorter);
+
+    run_filename(sorter, sorter->number_of_runs, filename);
+    fp = fopen(filename, "wb");
+    if (!fp) {
+        printf("Error: can't open scratch file %s\n", filename);
+        exit(2);
+    }
+
+    if (fwrite(sorter->buffer, sizeof(uint64_t) * sorter->words, sorter->used, fp) != sorter->used) {
+        printf("Error: can't write scratch file %s\n", filename);
+        exit(2);
+    }
+
+    fclose(fp);
+
+    sorter->number_of_runs++;
+    sorter->used = 0;
+
+    if (sorter->number_of_runs == EXTERNAL_SORT_MAX_RUNS) {
+        merge_runs(sorter);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   read_head
+ * Purpose:    Read the next record of a run into its heap slot
+ * Parameters: sorter -> sorter
+ *             run = run number
+ * Returns:    true if a record was read
+ *----------------------------------------------------------------------*/
+static boolean read_head(ExternalSort* sorter, int run)
+{
+    return fread(&sorter->heads[run * sorter->words], sizeof(uint64_t) * sorter->words, 1, sorter->run_fp[run]) == 1 ? true:false;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   sift_down
+ * Purpose:    Restore the heap after the top run has changed
+ * Parameters: sorter -> sorter
+ *             i = heap position to sift from
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void sift_down(ExternalSort* sorter, int i)
+{
+    int words = sorter->words;
+
+    while (1) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        int tmp;
+
+        if ((left < sorter->heap_size) &&
+            (compare_records(&sorter->heads[sorter->heap[left] * words], &sorter->heads[sorter->heap[smallest] * words], words) < 0)) {
+            smallest = left;
+        }
+
+        if ((right < sorter->heap_size) &&
+            (compare_records(&sorter->heads[sorter->heap[right] * words], &sorter->heads[sorter->heap[smallest] * words], words) < 0)) {
+            smallest = right;
+        }
+
+        if (smallest == i) {
+            return;
+        }
+
+        tmp = sorter->heap[i];
+        sorter->heap[i] = sorter->heap[smallest];
+        sorter->heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   open_runs
+ * Purpose:    Open every run and fill the heap with their first records
+ * Parameters: sorter -> sorter
+ *             run_buffer = bytes of file buffer for each run, or 0 for
+ *                          the default
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void open_runs(ExternalSort* sorter, long int run_buffer)
+{
+    char filename[RUN_FILENAME_LENGTH];
+    int i;
+
+    sorter->run_fp = calloc(sorter->number_of_runs, sizeof(FILE*));
+    sorter->heads = malloc(sorter->number_of_runs * sorter->words * sizeof(uint64_t));
+    sorter->heap = malloc(sorter->number_of_runs * sizeof(int));
+    if ((sorter->run_fp == NULL) || (sorter->heads == NULL) || (sorter->heap == NULL)) {
+        printf("Error: can't allocate memory for merging runs\n");
+        exit(1);
+    }
+
+    sorter->heap_size = 0;
+    for (i=0; i<sorter->number_of_runs; i++) {
+        run_filename(sorter, i, filename);
+        sorter->run_fp[i] = fopen(filename, "rb");
+        if (!sorter->run_fp[i]) {
+            printf("Error: can't open scratch file %s\n", filename);
+            exit(2);
+        }
+        if (run_buffer > 0) {
+            setvbuf(sorter->run_fp[i], NULL, _IOFBF, run_buffer);
+        }
+
+        if (read_head(sorter, i)) {
+            sorter->heap[sorter->heap_size++] = i;
+        }
+    }
+
+    for (i=sorter->heap_size/2 - 1; i>=0; i--) {
+        sift_down(sorter, i);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   next_merged
+ * Purpose:    Take the next record in order from the open runs
+ * Parameters: sorter -> sorter
+ *             record -> returned record
+ * Returns:    true if there was a record, false at the end
+ *----------------------------------------------------------------------*/
+static boolean next_merged(ExternalSort* sorter, uint64_t* record)
+{
+    int words = sorter->words;
+    int run;
+
+    if (sorter->heap_size == 0) {
+        return false;
+    }
+
+    run = sorter->heap[0];
+    memcpy(record, &sorter->heads[run * words], sizeof(uint64_t) * words);
+
+    if (!read_head(sorter, run)) {
+        sorter->heap[0] = sorter->heap[--sorter->heap_size];
+    }
+
+    sift_down(sorter, 0);
+
+    return true;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   close_runs
+ * Purpose:    Close the runs and free the merge memory
+ * Parameters: sorter -> sorter
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void close_runs(ExternalSort* sorter)
+{
+    int i;
+
+    for (i=0; i<sorter->number_of_runs; i++) {
+        if ((sorter->run_fp != NULL) && (sorter->run_fp[i] != NULL)) {
+            fclose(sorter->run_fp[i]);
+        }
+    }
+
+    free(sorter->run_fp);
+    free(sorter->heads);
+    free(sorter->heap);
+    sorter->run_fp = NULL;
+    sorter->heads = NULL;
+    sorter->heap = NULL;
+    sorter->heap_size = 0;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   merge_runs
+ * Purpose:    Merge all the runs so far into one, which becomes run 0.
+ *             The sort buffers are still in use, so the runs are read
+ *             with default sized file buffers.
+ * Parameters: sorter -> sorter
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void merge_runs(ExternalSort* sorter)
+{
+    char filename[RUN_FILENAME_LENGTH];
+    char merged_filename[RUN_FILENAME_LENGTH];
+    uint64_t* record = malloc(sorter->words * sizeof(uint64_t));
+    FILE* fp;
+    int i;
+
+    if (record == NULL) {
+        printf("Error: can't allocate memory for merging runs\n");
+        exit(1);
+    }
+
+    // The run number after the last is free to merge into
+    run_filename(sorter, sorter->number_of_runs, merged_filename);
+    fp = fopen(merged_filename, "wb");
+    if (!fp) {
+        printf("Error: can't open scratch file %s\n", merged_filename);
+        exit(2);
+    }
+
+    open_runs(sorter, 0);
+    while (next_merged(sorter, record)) {
+        if (fwrite(record, sizeof(uint64_t) * sorter->words, 1, fp) != 1) {
+            printf("Error: can't write scratch file %s\n", merged_filename);
+            exit(2);
+        }
+    }
+    close_runs(sorter);
+    fclose(fp);
+    free(record);
+
+    for (i=0; i<sorter->number_of_runs; i++) {
+        run_filename(sorter, i, filename);
+        remove(filename);
+    }
+
+    run_filename(sorter, 0, filename);
+    if (rename(merged_filename, filename) != 0) {
+        printf("Error: can't rename scratch file %s\n", merged_filename);
+        exit(2);
+    }
+
+    sorter->number_of_runs = 1;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   external_sort_initialise
+ * Purpose:    Set up a sorter
+ * Parameters: sorter -> sorter
+ *             prefix -> path and start of filename for run files
+ *             words = number of 64-bit words in a record
+ *             memory_bytes = memory to use for sorting
+ *             threads = number of threads for sorting
+ * Returns:    true if memory allocated
+ *----------------------------------------------------------------------*/
+boolean external_sort_initialise(ExternalSort* sorter, char* prefix, int words, long int memory_bytes, int threads)
+{
+    strncpy(sorter->prefix, prefix, EXTERNAL_SORT_MAX_PATH - 1);
+    sorter->prefix[EXTERNAL_SORT_MAX_PATH - 1] = 0;
+    sorter->words = words;
+    sorter->threads = threads < 1 ? 1 : (threads > EXTERNAL_SORT_MAX_THREADS ? EXTERNAL_SORT_MAX_THREADS : threads);
+    sorter->memory_bytes = memory_bytes;
+    sorter->used = 0;
+    sorter->records = 0;
+    sorter->position = 0;
+    sorter->number_of_runs = 0;
+    sorter->run_fp = NULL;
+    sorter->heads = NULL;
+    sorter->heap = NULL;
+    sorter->heap_size = 0;
+
+    // Radix sorting needs a second buffer the same size
+    sorter->capacity = memory_bytes / (2 * sizeof(uint64_t) * words);
+    if (sorter->capacity < 1) {
+        sorter->capacity = 1;
+    }
+
+    sorter->buffer = malloc(sorter->capacity * sizeof(uint64_t) * words);
+    sorter->spare = malloc(sorter->capacity * sizeof(uint64_t) * words);
+
+    return ((sorter->buffer != NULL) && (sorter->spare != NULL)) ? true:false;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   external_sort_add
+ * Purpose:    Add a record, writing out a run if the buffer is full
+ * Parameters: sorter -> sorter
+ *             record -> record to add
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void external_sort_add(ExternalSort* sorter, uint64_t* record)
+{
+    int w;
+
+    if (sorter->used == sorter->capacity) {
+        write_run(sorter);
+    }
+
+    for (w=0; w<sorter->words; w++) {
+        sorter->buffer[sorter->used * sorter->words + w] = record[w];
+    }
+
+    sorter->used++;
+    sorter->records++;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   external_sort_finish
+ * Purpose:    Sort what's left and get ready to return records in
+ *             order. If there are runs on disk, the sort buffers are
+ *             freed and the memory used for reading the runs instead.
+ * Parameters: sorter -> sorter
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void external_sort_finish(ExternalSort* sorter)
+{
+    long int run_buffer;
+
+    if (sorter->number_of_runs == 0) {
+        sort_buffer(sorter);
+        sorter->position = 0;
+        return;
+    }
+
+    if (sorter->used > 0) {
+        write_run(sorter);
+    }
+
+    free(sorter->buffer);
+    free(sorter->spare);
+    sorter->buffer = NULL;
+    sorter->spare = NULL;
+
+    run_buffer = sorter->memory_bytes / sorter->number_of_runs;
+    if (run_buffer > MAX_RUN_BUFFER) {
+        run_buffer = MAX_RUN_BUFFER;
+    } else if (run_buffer < MIN_RUN_BUFFER) {
+        run_buffer = MIN_RUN_BUFFER;
+    }
+
+    open_runs(sorter, run_buffer);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   external_sort_next
+ * Purpose:    Get the next record in order
+ * Parameters: sorter -> sorter
+ *             record -> returned record
+ * Returns:    true if there was a record, false at the end
+ *----------------------------------------------------------------------*/
+boolean external_sort_next(ExternalSort* sorter, uint64_t* record)
+{
+    int words = sorter->words;
+
+    if (sorter->number_of_runs == 0) {
+        if (sorter->position == sorter->used) {
+            return false;
+        }
+        memcpy(record, &sorter->buffer[sorter->position * words], sizeof(uint64_t) * words);
+        sorter->position++;
+        return true;
+    }
+
+    return next_merged(sorter, record);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   external_sort_free
+ * Purpose:    Free memory and delete run files
+ * Parameters: sorter -> sorter
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void external_sort_free(ExternalSort* sorter)
+{
+    char filename[RUN_FILENAME_LENGTH];
+    int i;
+
+    close_runs(sorter);
+
+    for (i=0; i<sorter->number_of_runs; i++) {
+        run_filename(sorter, i, filename);
+        remove(filename);
+    }
+
+    free(sorter->buffer);
+    free(sorter->spare);
+    sorter->buffer = NULL;
+    sorter->spare = NULL;
+    sorter->number_of_runs = 0;
+}
@@ -0,0 +1,212 @@
+/*----------------------------------------------------------------------*
+ * File:    gapped_alignment.c                                          *
+ * Purpose: Banded Smith-Waterman used to rescue adaptors with indels   *
+ *----------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "global.h"
+#include "gapped_alignment.h"
+
+/*
+ * The band is held in diagonal coordinates. Row i is query base i and lane l
+ * is the read base at i + diagonal + l - GAPPED_BAND_OFFSET, so each row is a
+ * single vector of GAPPED_BAND_WIDTH cells and the three Smith-Waterman moves
+ * become:
+ *
+ *   match/mismatch  H[i-1][l]   + s(i, l)
+ *   deletion        H[i-1][l+1] - gap     (query base, no read base)
+ *   insertion       H[i][l-1]   - gap     (read base, no query base)
+ *
+ * The insertion move is a prefix max along the row, done in log2(8) steps.
+ * Cells that fall off either end of the read are forced to zero.
+ */
+
+/*----------------------------------------------------------------------*
+ * Function:   fill_read_window
+ * Purpose:    Copy the part of the read covered by the band, padding
+ *             with zeros where the band falls off the read
+ * Parameters: read -> read sequence
+ *             read_size = length of read
+ *             first_base = read position of window[0]
+ *             window_size = number of bases to fill
+ *             window -> output buffer
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void fill_read_window(char* read, int read_size, int first_base, int window_size, char* window)
+{
+    int k;
+
+    for (k=0; k<window_size; k++) {
+        int j = first_base + k;
+        window[k] = ((j >= 0) && (j < read_size)) ? read[j] : 0;
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   fill_band
+ * Purpose:    Fill the banded score matrix
+ * Parameters: query -> query sequence
+ *             query_length = length of query
+ *             window -> read window from fill_read_window
+ *             h -> score matrix, query_length rows of GAPPED_BAND_WIDTH
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+#ifdef __SSE2__
+static void fill_band(char* query, int query_length, char* window, int16_t h[][GAPPED_BAND_WIDTH])
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i gap = _mm_set1_epi16(GAPPED_GAP_PENALTY);
+    const __m128i gap2 = _mm_set1_epi16(2 * GAPPED_GAP_PENALTY);
+    const __m128i gap4 = _mm_set1_epi16(4 * GAPPED_GAP_PENALTY);
+    const __m128i match_plus_mismatch = _mm_set1_epi16(GAPPED_MATCH_SCORE + GAPPED_MISMATCH_PENALTY);
+    const __m128i mismatch = _mm_set1_epi16(GAPPED_MISMATCH_PENALTY);
+    __m128i previous = zero;
+    int i;
+
+    for (i=0; i<query_length; i++) {
+        __m128i bases = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)(window + i)), zero);
+        __m128i valid = _mm_xor_si128(_mm_cmpeq_epi16(bases, zero), _mm_cmpeq_epi16(zero, zero));
+        __m128i same = _mm_cmpeq_epi16(bases, _mm_set1_epi16(query[i]));
+        __m128i s = _mm_sub_epi16(_mm_and_si128(same, match_plus_mismatch), mismatch);
+        __m128i diagonal = _mm_adds_epi16(previous, s);
+        __m128i up = _mm_subs_epi16(_mm_srli_si128(previous, 2), gap);
+        __m128i current = _mm_and_si128(_mm_max_epi16(_mm_max_epi16(diagonal, up), zero), valid);
+
+        // Cells off the read are zeroed before and after the insertion prefix max, as in the scalar fill
+        current = _mm_max_epi16(current, _mm_subs_epi16(_mm_slli_si128(current, 2), gap));
+        current = _mm_max_epi16(current, _mm_subs_epi16(_mm_slli_si128(current, 4), gap2));
+        current = _mm_max_epi16(current, _mm_subs_epi16(_mm_slli_si128(current, 8), gap4));
+        current = _mm_and_si128(current, valid);
+
+        _mm_storeu_si128((__m128i*)h[i], current);
+        previous = current;
+    }
+}
+#else
+static void fill_band(char* query, int query_length, char* window, int16_t h[][GAPPED_BAND_WIDTH])
+{
+    int16_t previous[GAPPED_BAND_WIDTH + 1];
+    int i, l;
+
+    for (l=0; l<=GAPPED_BAND_WIDTH; l++) {
+        previous[l] = 0;
+    }
+
+    for (i=0; i<query_length; i++) {
+        for (l=0; l<GAPPED_BAND_WIDTH; l++) {
+            int s = window[i+l] == query[i] ? GAPPED_MATCH_SCORE : -GAPPED_MISMATCH_PENALTY;
+            int best = previous[l] + s;
+
+            if (previous[l+1] - GAPPED_GAP_PENALTY > best) {
+                best = previous[l+1] - GAPPED_GAP_PENALTY;
+            }
+
+            if ((l > 0) && (h[i][l-1] - GAPPED_GAP_PENALTY > best)) {
+                best = h[i][l-1] - GAPPED_GAP_PENALTY;
+            }
+
+            if ((best < 0) || (window[i+l] == 0)) {
+                best = 0;
+            }
+
+            h[i][l] = best;
+        }
+
+        for (l=0; l<GAPPED_BAND_WIDTH; l++) {
+            previous[l] = h[i][l];
+        }
+    }
+}
+#endif
+
+/*----------------------------------------------------------------------*
+ * Function:   gapped_alignment_banded
+ * Purpose:    Local alignment of query to read, restricted to a band of
+ *             diagonals around an ungapped candidate offset
+ * Parameters: query -> query sequence (eg. adaptor)
+ *             query_length = length of query
+ *             split_position = query bases before this are counted in
+ *                              matches[0], the rest in matches[1]
+ *             read -> read sequence
+ *             read_size = length of read
+ *             diagonal = ungapped offset of query in read
+ *             result -> alignment result
+ * Returns:    true if an alignment was found
+ *----------------------------------------------------------------------*/
+boolean gapped_alignment_banded(char* query, int query_length, int split_position, char* read, int read_size, int diagonal, GappedAlignment* result)
+{
+    int16_t h[GAPPED_MAX_QUERY_LENGTH][GAPPED_BAND_WIDTH];
+    char window[GAPPED_MAX_QUERY_LENGTH + 2 * GAPPED_BAND_WIDTH];
+    int best_i = -1;
+    int best_l = -1;
+    int best_score = 0;
+    int i, l;
+
+    memset(result, 0, sizeof(GappedAlignment));
+    result->read_start = -1;
+    result->read_end = -1;
+    result->query_start = -1;
+    result->query_end = -1;
+
+    if (query_length > GAPPED_MAX_QUERY_LENGTH) {
+        printf("Error: query too long for gapped alignment (%d)\n", query_length);
+        exit(1);
+    }
+
+    fill_read_window(read, read_size, diagonal - GAPPED_BAND_OFFSET, query_length + 2 * GAPPED_BAND_WIDTH, window);
+    fill_band(query, query_length, window, h);
+
+    for (i=0; i<query_length; i++) {
+        for (l=0; l<GAPPED_BAND_WIDTH; l++) {
+            if (h[i][l] > best_score) {
+                best_score = h[i][l];
+                best_i = i;
+                best_l = l;
+            }
+        }
+    }
+
+    if (best_score == 0) {
+        return false;
+    }
+
+    result->score = best_score;
+    result->query_end = best_i;
+    result->read_end = best_i + diagonal + best_l - GAPPED_BAND_OFFSET;
+
+    // Trace back to the start of the local alignment
+    i = best_i;
+    l = best_l;
+    while ((i >= 0) && (h[i][l] > 0)) {
+        int s = window[i+l] == query[i] ? GAPPED_MATCH_SCORE : -GAPPED_MISMATCH_PENALTY;
+        int previous = i > 0 ? h[i-1][l] : 0;
+
+        if (h[i][l] == previous + s) {
+            if (s > 0) {
+                result->matches[i < split_position ? 0:1]++;
+            } else {
+                result->mismatches[i < split_position ? 0:1]++;
+            }
+            result->query_start = i;
+            result->read_start = i + diagonal + l - GAPPED_BAND_OFFSET;
+            i--;
+        } else if ((i > 0) && (l < GAPPED_BAND_WIDTH - 1) && (h[i][l] == h[i-1][l+1] - GAPPED_GAP_PENALTY)) {
+            result->deletions++;
+            i--;
+            l++;
+        } else if ((l > 0) && (h[i][l] == h[i][l-1] - GAPPED_GAP_PENALTY)) {
+            result->insertions++;
+            l--;
+        } else {
+            break;
+        }
+    }
+
+    return true;
+}
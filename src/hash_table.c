@@ -38,6 +38,9 @@
 #include <stdint.h>
 #include <assert.h>
 #include <locale.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #ifdef THREADS
 #include <pthread.h>
 #endif
@@ -46,6 +49,7 @@
 #include <string.h>
 #include <binary_kmer.h>
 #include <element.h>
+#include <large_memory.h>
 #include <hash_table.h>
 #include <hash_value.h>
 #include <logger.h>
@@ -62,7 +66,7 @@ HashTable * hash_table_new(int number_bits, int bucket_size, int max_rehash_trie
 		//return NULL;
 	}
 	
-	hash_table->collisions = calloc(max_rehash_tries, sizeof(long long));
+	hash_table->collisions = calloc(max_rehash_tries + 1, sizeof(long long));
 	if (hash_table->collisions == NULL) {
 		fprintf(stderr,"ERROR: could not allocate memory\n");
 		exit(1);
@@ -75,8 +79,8 @@ HashTable * hash_table_new(int number_bits, int bucket_size, int max_rehash_trie
 	hash_table->number_buckets = (long long) 1 << number_bits;
 	hash_table->bucket_size   = bucket_size;
 
-	//calloc is vital - we want to make sure initialised to zero
-	hash_table->table = calloc(hash_table->number_buckets * hash_table->bucket_size, sizeof(Element));
+	//must be initialised to zero - large_memory maps it on huge pages and faults it in across nodes
+	hash_table->table = large_memory_allocate(hash_table->number_buckets * hash_table->bucket_size * sizeof(Element), &hash_table->table_memory);
 	
 	if (hash_table->table == NULL) {
 		fprintf(stderr,"ERROR: could not allocate hash table of size %qd\n",hash_table->number_buckets * hash_table->bucket_size);
@@ -84,6 +88,13 @@ HashTable * hash_table_new(int number_bits, int bucket_size, int max_rehash_trie
 		exit(1);
 	}
 	
+	//one tag per element, plus a group's worth of padding so the last bucket can be read a whole group at a time
+	hash_table->tags = calloc(hash_table->number_buckets * hash_table->bucket_size + TAG_GROUP_SIZE, sizeof(uint8_t));
+	if (hash_table->tags == NULL) {
+		fprintf(stderr,"ERROR: could not allocate tags for hash table of size %qd\n",hash_table->number_buckets * hash_table->bucket_size);
+		exit(1);
+	}
+	
 	hash_table->next_element = calloc(hash_table->number_buckets, sizeof(int));
 	if (hash_table->table == NULL) {
 		fprintf(stderr,"ERROR: could not allocate array of pointers for next available element in buckets [%qd]\n",hash_table->number_buckets);
@@ -100,7 +111,8 @@ HashTable * hash_table_new(int number_bits, int bucket_size, int max_rehash_trie
 
 void hash_table_free(HashTable ** hash_table)
 { 
-	free((*hash_table)->table);
+	large_memory_free((*hash_table)->table, (*hash_table)->number_buckets * (*hash_table)->bucket_size * sizeof(Element));
+	free((*hash_table)->tags);
 	free((*hash_table)->next_element);
 	free((*hash_table)->collisions);
 	free(*hash_table);
@@ -108,73 +120,126 @@ void hash_table_free(HashTable ** hash_table)
 }
 
 
-// Lookup for key in bucket defined by the hash value. 
-// If key is in bucket, returns true and the position of the key/element in current_pos.
-// If key is not in bucket, and bucket is not full, returns the next available position in current_pos (and overflow is returned as false)
-// If key is not in bucket, and bucket is full, returns overflow=true
-boolean hash_table_find_in_bucket(Key key, long long * current_pos, boolean * overflow, HashTable * hash_table, int rehash){
+// Every element has a one byte tag in a separate array. Zero means the slot is empty,
+// otherwise the top bit is set and the other seven bits come from a hash of the key.
+// A lookup compares the tags of a whole group of slots at once and only looks at the
+// elements whose tags match, so a miss usually reads a few bytes of tags rather than
+// every element in the bucket. Buckets fill from the front and elements are never
+// removed, so the first empty tag ends the search.
+#define TAG_OCCUPIED 0x80
+
+// Tag for key - independent of the bucket hash, so it can tell apart keys in the same bucket
+static inline uint8_t hash_table_tag(Key key){
+	uint64_t x = (*key)[0];
+	int i;
 	
+	for (i=1; i<NUMBER_OF_BITFIELDS_IN_BINARY_KMER; i++) {
+		x = (x * 0x9E3779B97F4A7C15ULL) ^ (*key)[i];
+	}
+	x ^= x >> 33;
+	x *= 0xFF51AFD7ED558CCDULL;
 	
+	return TAG_OCCUPIED | (uint8_t)(x >> 57);
+}
+
+// Compare a group of TAG_GROUP_SIZE tags with tag. Bit i of the returned masks is set
+// if tag i matches or is empty.
+static inline void hash_table_match_tags(uint8_t * tags, uint8_t tag, uint32_t * matches, uint32_t * empty){
+#ifdef __SSE2__
+	__m128i group = _mm_loadu_si128((__m128i *) tags);
+	
+	*matches = _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+	*empty = _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_setzero_si128()));
+#else
+	int i;
+	
+	*matches = 0;
+	*empty = 0;
+	for (i=0; i<TAG_GROUP_SIZE; i++) {
+		*matches |= (uint32_t)(tags[i] == tag) << i;
+		*empty |= (uint32_t)(tags[i] == 0) << i;
+	}
+#endif
+}
+
+// Mask of the lanes of a group that are still inside the bucket
+static inline uint32_t hash_table_lanes(HashTable * hash_table, int i){
+	int lanes = hash_table->bucket_size - i;
+	
+	return lanes >= TAG_GROUP_SIZE ? (1U << TAG_GROUP_SIZE) - 1 : (1U << lanes) - 1;
+}
+
+// Element and tag for a new key
+static inline void hash_table_assign(HashTable * hash_table, long long pos, Key key){
+	Element element;
+	
+	element_initialise(&element,key, hash_table->kmer_size);
+	element_assign(&(hash_table->table[pos]), &element);
+	hash_table->tags[pos] = hash_table_tag(key);
+}
+
+// Hash value of key for the given number of rehashes
+static int hash_table_bucket(Key key, HashTable * hash_table, int rehash){
 	//add the rehash to the final bitfield in the BinaryKmer
 	BinaryKmer bkmer_with_rehash_added;
 	binary_kmer_initialise_to_zero(&bkmer_with_rehash_added);
 	binary_kmer_assignment_operator(bkmer_with_rehash_added, *key);
 	bkmer_with_rehash_added[NUMBER_OF_BITFIELDS_IN_BINARY_KMER-1] =   bkmer_with_rehash_added[NUMBER_OF_BITFIELDS_IN_BINARY_KMER-1]+ (bitfield_of_64bits) rehash;
 	
-	int hashval = hash_value(&bkmer_with_rehash_added,hash_table->number_buckets);
+	return hash_value(&bkmer_with_rehash_added,hash_table->number_buckets);
+}
+
+// Lookup for key in bucket defined by the hash value. 
+// If key is in bucket, returns true and the position of the key/element in current_pos.
+// If key is not in bucket, and bucket is not full, returns the next available position in current_pos (and overflow is returned as false)
+// If key is not in bucket, and bucket is full, returns overflow=true
+boolean hash_table_find_in_bucket(Key key, long long * current_pos, boolean * overflow, HashTable * hash_table, int rehash){
 	
+	int hashval = hash_table_bucket(key, hash_table, rehash);
+	long long start = (long long) hashval * hash_table->bucket_size;   //position in hash table
+	uint8_t tag = hash_table_tag(key);
+	int i;                       //position in bucket
 	
-	boolean found = false;
-	int i=0;                     //position in bucket
-	*overflow    = false;
-	*current_pos   = (long long) hashval * hash_table->bucket_size;   //position in hash table
+	*overflow = false;
 	
-    //printf("Start of bucket: %lld\n", *current_pos);
-    //printf("Flag: %d\n", element_check_for_flag_ALL_OFF(&hash_table->table[*current_pos]));
-    
-	while( (i<hash_table->bucket_size) &&   // still within the bucket
-		  (!element_check_for_flag_ALL_OFF(&hash_table->table[*current_pos]) )  && // not yet reached an empty space
-		  (!found)
-		  )
-    {
-        //printf("Loopy\n");
+	for (i=0; i<hash_table->bucket_size; i+=TAG_GROUP_SIZE)
+	{
+		uint32_t lanes = hash_table_lanes(hash_table, i);
+		uint32_t matches, empty;
+		
+		hash_table_match_tags(&hash_table->tags[start + i], tag, &matches, &empty);
+		matches &= lanes;
+		empty &= lanes;
 		
-		//sanity check -- to avoid out of boundary access
-		if (*current_pos >= hash_table->number_buckets * hash_table->bucket_size || *current_pos<0)
+		//nothing after the first empty slot
+		if (empty)
 		{
-			printf("out of bounds problem found in hash table_find_with_position\n");
-			exit(1);
+			matches &= (empty & -empty) - 1;
 		}
 		
-		//element found
-		
-		
-		if (element_is_key(key,hash_table->table[*current_pos], hash_table->kmer_size))
+		while (matches)
 		{
-			found = true;
+			long long pos = start + i + __builtin_ctz(matches);
+			
+			if (binary_kmer_comparison_operator(hash_table->table[pos].kmer, *key))
+			{
+				*current_pos = pos;
+				return true;
+			}
+			matches &= matches - 1;
 		}
-		else
+		
+		if (empty)
 		{
-			(*current_pos)++;
-			i++;
+			*current_pos = start + i + __builtin_ctz(empty);
+			return false;
 		}
-		
-    }
-	
+	}
 	
-	if (i == hash_table->bucket_size)
-    {
-		*overflow = true;
-    }
+	*current_pos = start + hash_table->bucket_size;
+	*overflow = true;
 	
-    //if (found == true) {
-        //printf("Found element at %lld\n", *current_pos);
-    //} else {
-    //    printf("Overflowed\n");
-    //}
-    
-	assert(!found || !(*overflow));
-	return found;
+	return false;
 }
 
 
@@ -186,7 +251,6 @@ boolean hash_table_apply_or_insert(Key key, void (*f)(Element *), HashTable * ha
 	}
 	
 	long long current_pos;
-	Element element;
 	boolean overflow;
 	int rehash=0;
 	boolean found;
@@ -198,14 +262,7 @@ boolean hash_table_apply_or_insert(Key key, void (*f)(Element *), HashTable * ha
 		{
 			if (!overflow)
 			{
-				//sanity check
-				if (!element_check_for_flag_ALL_OFF(&hash_table->table[current_pos])){
-					printf("Out of bounds - trying to insert new node beyond end of bucket\n");
-					exit(1);
-				}
-				
-				element_initialise(&element,key, hash_table->kmer_size);
-				element_assign( &(hash_table->table[current_pos]),  &element); 
+				hash_table_assign(hash_table, current_pos, key);
 				hash_table->unique_kmers++;
 			}
 			else//overflow
@@ -397,6 +454,7 @@ HashTable *  hash_table_read_dumped_memory(char * filename ){
 	long long number_buckets;
 	int bucket_size; 
 	long long hash_size;	
+	long long i;
 	
 	
 	if(fp == NULL){
@@ -467,11 +525,12 @@ HashTable *  hash_table_read_dumped_memory(char * filename ){
 	//printf("Hash size %lld \n", hash_size);
 	
 	//Allocating the table according to the description of the file
-	hash->table = calloc(hash_size, sizeof(Element));
+	hash->table = large_memory_allocate(hash_size * sizeof(Element), &hash->table_memory);
+	hash->tags = calloc(hash_size + TAG_GROUP_SIZE, sizeof(uint8_t));
 	hash->next_element = calloc(number_buckets, sizeof(int));
 	hash->collisions = calloc(number_buckets, sizeof(long long));
 	
-	if(hash->table == NULL){
+	if((hash->table == NULL) || (hash->tags == NULL)){
 		log_and_screen_printf( "Unable to create hash table\n ");
 		exit_while_reading(fp, filename);
 	}
@@ -480,6 +539,13 @@ HashTable *  hash_table_read_dumped_memory(char * filename ){
 	readed = fread(hash->table, size_e, hash_size, fp);
 	validate_read(readed, hash_size,  fp,  filename);
 	
+	//tags aren't stored, so rebuild them from the elements in use
+	for (i=0; i<hash_size; i++) {
+		if (!element_check_for_flag_ALL_OFF(&hash->table[i])) {
+			hash->tags[i] = hash_table_tag(&hash->table[i].kmer);
+		}
+	}
+	
 	readed = fread(hash->next_element, sizeof(int), number_buckets, fp);
 	validate_read(readed, number_buckets,  fp,  filename);
 	
@@ -706,7 +772,6 @@ Element * hash_table_find_or_insert(Key key, boolean * found,  HashTable * hash_
 		exit(1);
 	}
 	
-	Element element;
 	Element * ret = NULL;
 	int rehash = 0;
 	boolean overflow; 
@@ -721,21 +786,8 @@ Element * hash_table_find_or_insert(Key key, boolean * found,  HashTable * hash_
 		{
 			if (!overflow) //it is definitely nowhere in the hashtable, so free to insert
 			{
-				//sanity check
-				if (!element_check_for_flag_ALL_OFF(&hash_table->table[current_pos]))
-				{
-					fprintf(stderr,"error trying to write on an occupied element\n");
-					exit(1);
-				}
-				
 				//insert element
-				//printf("Inserting element at position %qd in bucket \n", current_pos);
-				element_initialise(&element,key, hash_table->kmer_size);
-				
-				//hash_table->table[current_pos] = element; //structure assignment
-				element_assign(&(hash_table->table[current_pos]) , &element);
-				//printf("Assigned at: %lld\n", current_pos);
-                
+				hash_table_assign(hash_table, current_pos, key);
 				ret = &hash_table->table[current_pos];
 				hash_table->unique_kmers++;
 				
@@ -775,7 +827,6 @@ Element * hash_table_insert(Key key, HashTable * hash_table){
 		exit(1);
 	}
 	
-	Element element;
 	Element * ret = NULL;
 	int rehash = 0;
 	boolean inserted = false;
@@ -793,14 +844,12 @@ Element * hash_table_insert(Key key, HashTable * hash_table){
 			long long  current_pos   = (long long) hashval * hash_table->bucket_size + (long long) hash_table->next_element[hashval] ;   //position in hash table
 			
 			//sanity check
-			if (!element_check_for_flag_ALL_OFF(&hash_table->table[current_pos])){
+			if (hash_table->tags[current_pos] != 0){
 				printf("Out of bounds - trying to insert new node beyond end of bucket\n");
 				exit(1);
 			}
 			
-			
-			element_initialise(&element,key, hash_table->kmer_size);
-			element_assign( &(hash_table->table[current_pos]),  &element); 
+			hash_table_assign(hash_table, current_pos, key);
 			hash_table->unique_kmers++;
 			hash_table->next_element[hashval]++;	
 			ret = &hash_table->table[current_pos];
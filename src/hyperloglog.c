@@ -0,0 +1,93 @@
+/*----------------------------------------------------------------------*
+ * File:    hyperloglog.c                                               *
+ * Purpose: Estimate the number of distinct values seen in a few KB     *
+ *----------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "global.h"
+#include "hyperloglog.h"
+
+/*
+ * HyperLogLog (Flajolet et al. 2007). The top bits of each 64-bit hash
+ * pick a register, and the register keeps the longest run of leading
+ * zeros seen in the rest of the hash. Runs of k zeros turn up about once
+ * every 2^k distinct values, so the registers' harmonic mean gives the
+ * count. Duplicates hash the same, so they never change it. With 2^12
+ * one byte registers the standard error is about 1.6%. For small counts,
+ * where many registers are still empty, linear counting is used instead.
+ */
+
+/*----------------------------------------------------------------------*
+ * Function:   hyperloglog_initialise
+ * Purpose:    Empty a sketch
+ * Parameters: sketch -> sketch
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void hyperloglog_initialise(HyperLogLog* sketch)
+{
+    memset(sketch->registers, 0, sizeof(sketch->registers));
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   hyperloglog_add
+ * Purpose:    Add a value to a sketch
+ * Parameters: sketch -> sketch
+ *             hash = well mixed 64-bit hash of value
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void hyperloglog_add(HyperLogLog* sketch, uint64_t hash)
+{
+    uint64_t index = hash >> (64 - HYPERLOGLOG_PRECISION);
+    uint64_t rest = hash << HYPERLOGLOG_PRECISION;
+    uint8_t rank = rest == 0 ? 64 - HYPERLOGLOG_PRECISION + 1 : __builtin_clzll(rest) + 1;
+
+    if (rank > sketch->registers[index]) {
+        sketch->registers[index] = rank;
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   hyperloglog_estimate
+ * Purpose:    Estimate number of distinct values added to a sketch
+ * Parameters: sketch -> sketch
+ * Returns:    Estimate
+ *----------------------------------------------------------------------*/
+double hyperloglog_estimate(HyperLogLog* sketch)
+{
+    double m = HYPERLOGLOG_REGISTERS;
+    double alpha = 0.7213 / (1.0 + 1.079 / m);
+    double sum = 0;
+    int empty = 0;
+    double estimate;
+    int i;
+
+    for (i=0; i<HYPERLOGLOG_REGISTERS; i++) {
+        sum += ldexp(1.0, -sketch->registers[i]);
+        if (sketch->registers[i] == 0) {
+            empty++;
+        }
+    }
+
+    estimate = alpha * m * m / sum;
+
+    if ((estimate <= 2.5 * m) && (empty > 0)) {
+        estimate = m * log(m / empty);
+    }
+
+    return estimate;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   hyperloglog_standard_error
+ * Purpose:    Relative standard error of estimates
+ * Parameters: None
+ * Returns:    Standard error, as a fraction
+ *----------------------------------------------------------------------*/
+double hyperloglog_standard_error(void)
+{
+    return 1.04 / sqrt(HYPERLOGLOG_REGISTERS);
+}
@@ -0,0 +1,331 @@
+/*----------------------------------------------------------------------*
+ * File:    large_memory.c                                              *
+ * Purpose: Zeroed memory for big tables on huge pages, touched in      *
+ *          parallel across NUMA nodes                                  *
+ *----------------------------------------------------------------------*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "global.h"
+#include "large_memory.h"
+
+/*
+ * The big tables are looked up at random, so with 4KB pages nearly every
+ * lookup also misses the TLB. And calloc leaves the pages to be faulted in
+ * one at a time by whichever thread first writes to them - usually all on
+ * the NUMA node the main thread is running on, so threads on the other
+ * socket pay remote latency for every lookup.
+ *
+ * Instead, memory is mapped directly. It comes from the hugetlbfs pool if
+ * 2MB pages have been reserved there, or else is ordinary memory marked
+ * for transparent huge pages. It's then touched in chunks, one thread per
+ * chunk. On a machine with several nodes each thread is pinned to the CPUs
+ * of the next node in turn, so its chunk is placed there. Alternatively the
+ * whole mapping can be interleaved across nodes page by page. Mappings are
+ * always a whole number of huge pages, so that's what gets freed too.
+ *
+ * The interleave policy is set with the mbind system call directly, so
+ * there's no need to link with libnuma.
+ */
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define SMALL_PAGE_SIZE 4096
+#define MAX_NODES 64
+#define MAX_TOUCH_THREADS 64
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3
+#endif
+
+typedef struct {
+    char* start;
+    size_t bytes;
+    cpu_set_t* cpus;
+} TouchChunk;
+
+static int touch_threads = 1;
+static boolean interleave = false;
+static int number_of_nodes = 0;
+static unsigned long node_mask = 0;
+static cpu_set_t node_cpus[MAX_NODES];
+
+/*----------------------------------------------------------------------*
+ * Function:   read_id_list
+ * Purpose:    Read a list of CPU or node numbers from sysfs, eg. 0-3,8-11
+ * Parameters: filename -> file to read
+ *             ids -> returned set of numbers
+ * Returns:    true if read
+ *----------------------------------------------------------------------*/
+static boolean read_id_list(char* filename, cpu_set_t* ids)
+{
+    char line[4096];
+    char* p = line;
+    FILE* fp = fopen(filename, "r");
+
+    CPU_ZERO(ids);
+
+    if (fp == NULL) {
+        return false;
+    }
+
+    if (fgets(line, sizeof(line), fp) == NULL) {
+        fclose(fp);
+        return false;
+    }
+    fclose(fp);
+
+    while ((*p >= '0') && (*p <= '9')) {
+        int first = strtol(p, &p, 10);
+        int last = first;
+        int i;
+
+        if (*p == '-') {
+            last = strtol(p + 1, &p, 10);
+        }
+
+        for (i=first; (i<=last) && (i<CPU_SETSIZE); i++) {
+            CPU_SET(i, ids);
+        }
+
+        if (*p == ',') {
+            p++;
+        }
+    }
+
+    return CPU_COUNT(ids) > 0 ? true:false;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   find_nodes
+ * Purpose:    Find the online NUMA nodes and their CPUs, the first time
+ *             it's called. Without NUMA information, there's one node.
+ * Parameters: None
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void find_nodes(void)
+{
+    cpu_set_t nodes;
+    char filename[256];
+    int node;
+
+    if (number_of_nodes > 0) {
+        return;
+    }
+
+    if (read_id_list("/sys/devices/system/node/online", &nodes)) {
+        for (node=0; node<MAX_NODES; node++) {
+            if (!CPU_ISSET(node, &nodes)) {
+                continue;
+            }
+            snprintf(filename, sizeof(filename), "/sys/devices/system/node/node%d/cpulist", node);
+            if (read_id_list(filename, &node_cpus[number_of_nodes])) {
+                node_mask |= 1UL << node;
+                number_of_nodes++;
+            }
+        }
+    }
+
+    if (number_of_nodes == 0) {
+        number_of_nodes = 1;
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   touch_chunk
+ * Purpose:    Thread entry point to fault in one chunk of a mapping, on
+ *             the CPUs of the chunk's node if it has one
+ * Parameters: arg -> TouchChunk structure
+ * Returns:    NULL
+ *----------------------------------------------------------------------*/
+static void* touch_chunk(void* arg)
+{
+    TouchChunk* chunk = (TouchChunk*)arg;
+    volatile char* memory = chunk->start;
+    size_t offset;
+
+    if (chunk->cpus != NULL) {
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), chunk->cpus);
+    }
+
+    for (offset=0; offset<chunk->bytes; offset+=SMALL_PAGE_SIZE) {
+        memory[offset] = 0;
+    }
+
+    return NULL;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   touch
+ * Purpose:    Fault in a whole mapping, split between threads
+ * Parameters: memory -> start of mapping
+ *             bytes = size of mapping, a multiple of HUGE_PAGE_SIZE
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void touch(char* memory, size_t bytes)
+{
+    TouchChunk chunks[MAX_TOUCH_THREADS];
+    pthread_t thread_ids[MAX_TOUCH_THREADS];
+    size_t huge_pages = bytes / HUGE_PAGE_SIZE;
+    size_t per_chunk;
+    int threads = touch_threads;
+    boolean pin = ((number_of_nodes > 1) && (!interleave)) ? true:false;
+    int i;
+
+    // Every node should get a share, even with fewer threads
+    if ((pin) && (threads < number_of_nodes)) {
+        threads = number_of_nodes;
+    }
+    if (threads > MAX_TOUCH_THREADS) {
+        threads = MAX_TOUCH_THREADS;
+    }
+    if ((size_t)threads > huge_pages) {
+        threads = huge_pages;
+    }
+
+    if ((threads <= 1) && (!pin)) {
+        chunks[0].start = memory;
+        chunks[0].bytes = bytes;
+        chunks[0].cpus = NULL;
+        touch_chunk(&chunks[0]);
+        return;
+    }
+
+    per_chunk = (huge_pages + threads - 1) / threads;
+    for (i=0; i<threads; i++) {
+        size_t first = i * per_chunk;
+        size_t last = (i + 1) * per_chunk < huge_pages ? (i + 1) * per_chunk : huge_pages;
+
+        chunks[i].start = memory + first * HUGE_PAGE_SIZE;
+        chunks[i].bytes = first < last ? (last - first) * HUGE_PAGE_SIZE : 0;
+        chunks[i].cpus = pin ? &node_cpus[i % number_of_nodes] : NULL;
+
+        if (pthread_create(&thread_ids[i], NULL, touch_chunk, &chunks[i]) != 0) {
+            printf("Error: can't create thread\n");
+            exit(1);
+        }
+    }
+
+    for (i=0; i<threads; i++) {
+        pthread_join(thread_ids[i], NULL);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   large_memory_configure
+ * Purpose:    Set how later allocations are placed
+ * Parameters: threads = number of threads to touch memory with
+ *             interleave_pages = true to interleave pages across nodes
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void large_memory_configure(int threads, boolean interleave_pages)
+{
+    touch_threads = threads;
+    interleave = interleave_pages;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   large_memory_allocate
+ * Purpose:    Allocate zeroed memory for a big table
+ * Parameters: bytes = size wanted
+ *             stats -> returned details of allocation
+ * Returns:    Pointer to memory, or NULL if none
+ *----------------------------------------------------------------------*/
+void* large_memory_allocate(size_t bytes, LargeMemoryStats* stats)
+{
+    size_t mapped = ((bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE) * HUGE_PAGE_SIZE;
+    struct timespec start, end;
+    struct rusage usage_start, usage_end;
+    void* memory;
+
+    if (mapped == 0) {
+        mapped = HUGE_PAGE_SIZE;
+    }
+
+    find_nodes();
+    getrusage(RUSAGE_SELF, &usage_start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    memory = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+    if (memory != MAP_FAILED) {
+        stats->pages = LARGE_MEMORY_HUGETLB_PAGES;
+    } else {
+        memory = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            return NULL;
+        }
+        stats->pages = LARGE_MEMORY_SMALL_PAGES;
+#ifdef MADV_HUGEPAGE
+        if (madvise(memory, mapped, MADV_HUGEPAGE) == 0) {
+            stats->pages = LARGE_MEMORY_TRANSPARENT_HUGE_PAGES;
+        }
+#endif
+    }
+
+    stats->interleaved = false;
+#ifdef SYS_mbind
+    if ((interleave) && (number_of_nodes > 1)) {
+        stats->interleaved = syscall(SYS_mbind, memory, mapped, MPOL_INTERLEAVE, &node_mask, MAX_NODES + 1, 0) == 0 ? true:false;
+    }
+#endif
+
+    touch(memory, mapped);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &usage_end);
+
+    stats->bytes = mapped;
+    stats->nodes = number_of_nodes;
+    stats->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    stats->page_faults = (usage_end.ru_minflt - usage_start.ru_minflt) + (usage_end.ru_majflt - usage_start.ru_majflt);
+
+    return memory;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   large_memory_free
+ * Purpose:    Free memory from large_memory_allocate
+ * Parameters: memory -> memory to free, or NULL
+ *             bytes = size asked for when allocated
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void large_memory_free(void* memory, size_t bytes)
+{
+    size_t mapped = ((bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE) * HUGE_PAGE_SIZE;
+
+    if (memory == NULL) {
+        return;
+    }
+
+    munmap(memory, mapped > 0 ? mapped : HUGE_PAGE_SIZE);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   large_memory_print_stats
+ * Purpose:    Report how an allocation went
+ * Parameters: stats -> details from large_memory_allocate
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void large_memory_print_stats(LargeMemoryStats* stats)
+{
+    char* pages[] = {"4KB pages", "transparent huge pages", "hugetlbfs 2MB pages"};
+
+    printf("       Page setup: %s\n", pages[stats->pages]);
+    printf("       NUMA nodes: %d%s\n", stats->nodes, stats->interleaved ? ", interleaved":"");
+    printf("  Allocation time: %.3f s\n", stats->seconds);
+    printf("      Page faults: %ld\n", stats->page_faults);
+}
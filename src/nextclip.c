@@ -13,16 +13,26 @@
 #include <getopt.h>
 #include <math.h>
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "global.h"
 #include "binary_kmer.h"
 #include "element.h"
+#include "large_memory.h"
 #include "hash_table.h"
-
-/* Experiment that I decided against using
- * #define USE_MULTIPLE_HASHES
- * #define NUMBER_OF_HASHES 3
- * Who knows, may use in the future!
- */
+#include "gapped_alignment.h"
+#include "adaptor_set.h"
+#include "batch_alignment.h"
+#include "pair_cache.h"
+#include "adaptor_discovery.h"
+#include "duplicate_filter.h"
+#include "external_sort.h"
+#include "duplicate_table.h"
+#include "duplicate_index.h"
+#include "optical_grid.h"
+#include "hyperloglog.h"
+#include "pair_signature.h"
+#include "singleton_filter.h"
 
 /*----------------------------------------------------------------------*
  * Constants
@@ -30,10 +40,31 @@
 #define NEXTCLIP_VERSION "1.3.3"
 #define MAX_PATH_LENGTH 1024
 #define NUMBER_OF_CATEGORIES 5
-#define SEPARATE_KMER_SIZE 11
-#define TOTAL_KMER_SIZE (4 * SEPARATE_KMER_SIZE)
+#define DEFAULT_SIGNATURE_WINDOWS 4
+#define DEFAULT_WINDOW_SIZE 11
+#define DEFAULT_FIRST_WINDOW_OFFSET 20
+#define MIN_WINDOW_SIZE 4
+#define MAX_SIGNATURE_WINDOWS 16
 #define MAX_DUPLICATES 1000
-#define FIRST_KMER_OFFSET 20
+#define PAIR_BATCH_SIZE 256
+#define MAX_SWEEP_VALUES 16
+#define DISCOVERY_SAMPLE_PAIRS 25000
+#define DISCOVERY_REPORTED_CANDIDATES 10
+#define MAX_THREADS 64
+
+// Where PCR duplicate signatures are kept
+#define DUPLICATE_BACKEND_HASH 0
+#define DUPLICATE_BACKEND_FILTER 1
+#define DUPLICATE_BACKEND_EXTERNAL 2
+#define DUPLICATE_BACKEND_TOLERANT 3
+#define DEFAULT_EXTERNAL_MEMORY 1024
+#define MAX_EXTERNAL_COUNT 65535
+#define COMPLEXITY_REPORT_INTERVAL 1000000
+#define DUPLICATE_PREFETCH_DISTANCE 8
+#define SIGNATURE_REVERSE_COMPLEMENT 0
+#define SIGNATURE_MATE_SWAP 1
+#define SIGNATURE_MINIMIZERS 2
+#define MAX_WINDOWS_PER_READ (MAX_SIGNATURE_WINDOWS / 2 + 1)
 
 // The kmer-based PCR duplication assessment won't work so well with very small reads, so have set this limit
 #define MINIMUM_INPUT_READ_SIZE 64
@@ -68,6 +99,11 @@ typedef struct {
     int query_start;
     int query_end;
     int accepted;
+    int gapped;
+    int insertions;
+    int deletions;
+    int offsets_evaluated;
+    int adaptor_index;
 } JunctionAdaptorAlignment;
 
 typedef struct {
@@ -84,8 +120,43 @@ typedef struct {
     int query_start;
     int query_end;
     int accepted;
+    int gapped;
+    int insertions;
+    int deletions;
+    int offsets_evaluated;
+    int adaptor_index;
 } GenericAdaptorAlignment;
 
+typedef struct {
+    FastQRead reads[2];
+    JunctionAdaptorAlignment junction_adaptor_alignments[2];
+    JunctionAdaptorAlignment ungapped_alignments[2];
+    GenericAdaptorAlignment external_adaptor_alignments[2];
+    boolean gapped_junction_rescued[2];
+    boolean gapped_external_rescued[2];
+    int n_reads;
+    int is_duplicate;
+    boolean classify;
+    boolean cached;
+    PairFingerprint fingerprint;
+    boolean duplicate_valid;
+    int gc[2];
+    char duplicate_kmer[PAIR_SIGNATURE_MAX_BASES+1];
+    int windows[2][MAX_WINDOWS_PER_READ];
+    BinaryKmer duplicate_key;
+    long int ordinal;
+    DuplicateTableKey duplicate_table_key;
+    boolean duplicate_to_add;
+    boolean duplicate_found;
+    boolean mate_swapped;
+    uint64_t duplicate_hashes[DUPLICATE_INDEX_SUBSIGNATURES];
+    uint64_t signature_hash;
+    uint64_t duplicate_cluster;
+    boolean located;
+    OpticalLocation location;
+} ReadPair;
+
+
 typedef struct {
     int read_length;
     FILE* input_fp[2];
@@ -129,6 +200,11 @@ typedef struct {
     int read_length_counts[NUMBER_OF_CATEGORIES][2][MAX_READ_LENGTH];
     int read_pair_length_counts[NUMBER_OF_CATEGORIES][MAX_READ_LENGTH];
     int n_duplicates;
+    long int n_optical_duplicates;
+    long int n_mate_swapped_duplicates;
+    long int n_marked_duplicates;
+    double estimated_unique_pairs;
+    double estimated_library_size;
     int n_invalid_for_duplicate;
     double percent_duplicates;
     int duplicates_not_written;
@@ -141,8 +217,73 @@ typedef struct {
     double percent_pairs_containing_n;
     long int bases_before_clipping[NUMBER_OF_CATEGORIES];
     long int bases_written[NUMBER_OF_CATEGORIES];
+    int count_gapped_junction_rescued[2];
+    int count_gapped_external_rescued[2];
+    int count_gapped_category_changed;
+    int count_gapped_category_change[NUMBER_OF_CATEGORIES][NUMBER_OF_CATEGORIES];
+    long int junction_scans;
+    long int junction_offsets_evaluated;
+    long int external_scans;
+    long int external_offsets_evaluated;
+    int count_adaptor_hits[MAX_ADAPTORS][2];
 } MPStats;
 
+typedef struct {
+    MPStats* stats;
+    ReadPair* pairs;
+    int n_pairs;
+    AdaptorCandidates* candidates;
+} BatchChunk;
+
+typedef struct {
+    ReadPair* pairs;
+    int* order;
+    int n_pairs;
+} DuplicateChunk;
+
+typedef struct {
+    void* (*stage)(void*);
+    void* args[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    int ids[MAX_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    int n_workers;
+    int n_chunks;
+    int round;
+    int busy;
+    boolean stop;
+} BatchWorkers;
+
+typedef struct {
+    int strict_double_match;
+    int strict_single_match;
+    int relaxed_double_match;
+    int relaxed_single_match;
+    int minimum_read_size;
+    int strict_index;
+    long int count_by_category[NUMBER_OF_CATEGORIES];
+    long int count_by_category_long_enough[NUMBER_OF_CATEGORIES];
+    long int usable_pairs;
+    long int usable_bases;
+} SweepPoint;
+
+typedef struct {
+    int n_strict;
+    int strict[MAX_SWEEP_VALUES][2];
+    int n_relaxed;
+    int relaxed[MAX_SWEEP_VALUES][2];
+    int n_minimum;
+    int minimum[MAX_SWEEP_VALUES];
+    int n_points;
+    SweepPoint* points;
+    uint8_t* offset_matches[2];
+    char* padded_read;
+    JunctionAdaptorAlignment junction_adaptor_alignments[MAX_SWEEP_VALUES][2];
+    GenericAdaptorAlignment external_adaptor_alignments[MAX_SWEEP_VALUES][2];
+} Sweep;
+
 /*----------------------------------------------------------------------*
  * Globals
  *----------------------------------------------------------------------*/
@@ -162,6 +303,35 @@ int trim_ends = 19;
 int approximate_reads = 20000000;
 int output_memory_requirements = false;
 int duplicate_only_mode = false;
+int benchmark_kernels = false;
+int discover_adaptors = false;
+int number_of_threads = 1;
+int interleave_memory = false;
+int duplicate_backend = DUPLICATE_BACKEND_HASH;
+int error_tolerant = false;
+int signature_type = SIGNATURE_REVERSE_COMPLEMENT;
+int signature_windows = DEFAULT_SIGNATURE_WINDOWS;
+int signature_window_size = DEFAULT_WINDOW_SIZE;
+int signature_offset = DEFAULT_FIRST_WINDOW_OFFSET;
+PairSignatureGeometry signature_geometry;
+PairSignatureGeometry subsignature_geometry[DUPLICATE_INDEX_SUBSIGNATURES];
+int optical_distance = 0;
+char load_index_filename[MAX_PATH_LENGTH] = "";
+char save_index_filename[MAX_PATH_LENGTH] = "";
+DuplicateTableTotals loaded_totals = {0, 0, 0};
+HyperLogLog complexity_sketch;
+OpticalGrid optical_grid;
+long int duplicate_memory = 0;
+long int singleton_memory = 0;
+char scratch_directory[MAX_PATH_LENGTH] = "";
+int pair_cache_size = 1048576;
+int use_pair_cache = false;
+PairCache pair_cache;
+int gapped_mode = false;
+char sweep_filename[MAX_PATH_LENGTH] = "";
+Sweep sweep;
+char adaptor_set_filename[MAX_PATH_LENGTH] = "";
+AdaptorSet adaptor_set;
 
 /*
  * Single hash option algorithm
@@ -174,28 +344,32 @@ int duplicate_only_mode = false;
  * Then we make a hash AAABBBaaabbb.
  *
  *
- * Multiple hash option algorithm
+ * Error-tolerant option algorithm
  *
- * We take a kmer from each read, from a third of the way and from two thirds of the way through, eg.
+ * We also take a kmer from three quarters of the way through each read, eg.
  *
  *   R1: TGACTGACTGACTGACTGACTGACTGACTG     R2: TGACTGACTGACTGACTGACTGACTGACTG
- * kmer: AAA       BBB       CCC                aaa       bbb       ccc
+ * kmer: AAA           BBB     CCC              aaa           bbb     ccc
  *
- * Then we make three kmer hashes:
- * kmer_hashes[0] = AAABBBaaabbb
- * kmer_hashes[1] = AAACCCaaaccc
- * kmer_hashes[2] = BBBCCCbbbccc
+ * Then we make three sub-signatures:
+ *   AAABBBaaabbb (the same as the single hash)
+ *   AAACCCaaaccc
+ *   BBBCCCbbbccc
  *
- * Then, for something to be declared a duplicate, we ask for a match to any of the three hash tables.
+ * Then, for something to be declared a duplicate, we ask for a match to any of the three.
  * This allows one of the three kmers to not match - eg. because of miscalled base.
+ * See duplicate_index.c for how they are stored.
  */
 
-#ifdef USE_MULTIPLE_HASHES
-HashTable* kmer_hashes[NUMBER_OF_HASHES];
-int kmer_offsets[NUMBER_OF_HASHES][2];
-#else
-HashTable* duplicate_hash = NULL;
-#endif
+DuplicateTable duplicate_table;
+DuplicateIndex duplicate_index;
+DuplicateFilter duplicate_filter;
+SingletonFilter singleton_filter;
+ExternalSort duplicate_ordinals;
+BatchWorkers batch_workers;
+long int* external_duplicate_counts = NULL;
+uint64_t next_duplicate_ordinal;
+boolean more_duplicate_ordinals = false;
 
 /*----------------------------------------------------------------------*
  * Function:   initialise_stats
@@ -216,6 +390,13 @@ void initialise_stats(MPStats* stats)
         stats->input_fp[i] = 0;
         stats->count_adaptor_and_external_found[i] = 0;
         stats->count_external_only_found[i] = 0;
+        stats->count_gapped_junction_rescued[i] = 0;
+        stats->count_gapped_external_rescued[i] = 0;
+    }
+
+    for (i=0; i<MAX_ADAPTORS; i++) {
+        stats->count_adaptor_hits[i][0] = 0;
+        stats->count_adaptor_hits[i][1] = 0;
     }
 
     for (i=0; i<NUMBER_OF_CATEGORIES; i++) {
@@ -230,6 +411,10 @@ void initialise_stats(MPStats* stats)
         stats->bases_written[i] = 0;
         stats->bases_before_clipping[i] = 0;
 
+        for (j=0; j<NUMBER_OF_CATEGORIES; j++) {
+            stats->count_gapped_category_change[i][j] = 0;
+        }
+
         for (j=0; j<MAX_READ_LENGTH; j++) {
             stats->read_length_counts[i][0][j] = 0;
             stats->read_length_counts[i][1][j] = 0;
@@ -250,12 +435,22 @@ void initialise_stats(MPStats* stats)
     stats->duplicates_fp = 0;
     stats->num_read_pairs = 0;
     stats->n_duplicates = 0;
+    stats->n_optical_duplicates = 0;
+    stats->n_mate_swapped_duplicates = 0;
+    stats->n_marked_duplicates = 0;
+    stats->estimated_unique_pairs = 0;
+    stats->estimated_library_size = 0;
     stats->n_invalid_for_duplicate = 0;
     stats->duplicates_not_written = 0;
     stats->total_usable = 0;
     stats->gc_bases = 0;
     stats->at_bases = 0;
     stats->pairs_containing_n = 0;
+    stats->count_gapped_category_changed = 0;
+    stats->junction_scans = 0;
+    stats->junction_offsets_evaluated = 0;
+    stats->external_scans = 0;
+    stats->external_offsets_evaluated = 0;
 }
 
 /*----------------------------------------------------------------------*
@@ -280,6 +475,11 @@ void initialise_junction_adaptor_alignment(JunctionAdaptorAlignment* result)
     result->query_start = 0;
     result->query_end = 0;
     result->accepted = 0;
+    result->gapped = 0;
+    result->insertions = 0;
+    result->deletions = 0;
+    result->offsets_evaluated = 0;
+    result->adaptor_index = -1;
 }
 
 /*----------------------------------------------------------------------*
@@ -301,6 +501,11 @@ void initialise_generic_adaptor_alignment(GenericAdaptorAlignment* result)
     result->query_start = 0;
     result->query_end = 0;
     result->accepted = 0;
+    result->gapped = 0;
+    result->insertions = 0;
+    result->deletions = 0;
+    result->offsets_evaluated = 0;
+    result->adaptor_index = -1;
 }
 
 /*----------------------------------------------------------------------*
@@ -330,41 +535,80 @@ char* reverse_compliment(char* fwd, char* rev)
 }
 
 /*----------------------------------------------------------------------*
- * Function:   size_hashtable
- * Purpose:    Calculate memory required for hashtable
+ * Function:   size_optical_grid
+ * Purpose:    Calculate memory for the optical duplicate grid. Input
+ *             grouped by tile only needs about one tile's worth, but
+ *             anything else keeps every located pair.
  * Parameters: None
- * Returns:    None
+ * Returns:    Memory in MB
  *----------------------------------------------------------------------*/
-void size_hashtable(int* n_return, int* b_return)
+long int size_optical_grid(void)
 {
-    double utilisation = 0.8;
-    double required_entries = approximate_reads / utilisation;
-    int b = 100;
-    double c = log(required_entries/b)/log(2);
-    int n = ceil(c);
-    int entries = pow(2.0, (double)n)*b;
-    long int memory_bytes = entries*sizeof(Element);
-    long int memory_meg = memory_bytes/(1024*1024);
+    long int memory_meg;
+    
+    if (optical_distance == 0) {
+        return 0;
+    }
+    
+    memory_meg = optical_grid_memory_for(approximate_reads) / (1024 * 1024);
+    printf("     Optical grid: %ld MB, much less if the input is grouped by tile\n", memory_meg);
+    
+    return memory_meg;
+}
 
-#ifdef USE_MULTIPLE_HASHES
-    memory_meg = memory_meg * NUMBER_OF_HASHES;
-#endif
+/*----------------------------------------------------------------------*
+ * Function:   size_duplicate_table
+ * Purpose:    Calculate size of duplicate table
+ * Parameters: None
+ * Returns:    log2 of number of slots
+ *----------------------------------------------------------------------*/
+int size_duplicate_table(void)
+{
+    int bits = duplicate_table_bits_for(approximate_reads);
+    long int memory_meg;
     
-    memory_meg += 256;
+    // Only duplicated signatures get into the table, so start small and let it grow
+    if (singleton_memory > 0) {
+        bits = DUPLICATE_TABLE_MIN_BITS;
+    }
     
-    printf("                n: %d\n", n);
-    printf("                b: %d\n", b);
-    printf("          Entries: %d\n", entries);
-    printf("       Entry size: %ld\n", sizeof(Element));
+    memory_meg = duplicate_table_memory(bits, 2 * signature_windows * signature_window_size) / (1024 * 1024) + singleton_memory + 256;
     
-#ifdef USE_MULTIPLE_HASHES
-    printf(" Number of tables: %d\n", NUMBER_OF_HASHES);
-#endif
+    printf("        Slot bits: %d\n", bits);
+    printf("            Slots: %ld\n", 1L << bits);
+    printf("        Slot size: %ld\n", duplicate_table_slot_words(2 * signature_windows * signature_window_size) * sizeof(uint32_t));
+    memory_meg += size_optical_grid();
+    if (singleton_memory > 0) {
+        printf(" Singleton filter: %ld MB\n", singleton_memory);
+        printf("  Memory required: %ld MB, plus table growth for duplicated signatures\n\n", memory_meg);
+    } else {
+        printf("  Memory required: %ld MB\n\n", memory_meg);
+    }
+    
+    return bits;
+}
 
+/*----------------------------------------------------------------------*
+ * Function:   size_duplicate_index
+ * Purpose:    Calculate size of error-tolerant duplicate index
+ * Parameters: None
+ * Returns:    log2 of number of slots
+ *----------------------------------------------------------------------*/
+int size_duplicate_index(void)
+{
+    int bits = duplicate_index_bits_for(approximate_reads);
+    long int memory_meg = duplicate_index_memory(bits, approximate_reads) / (1024 * 1024);
+    
+    memory_meg += 256;
+    
+    printf("        Slot bits: %d\n", bits);
+    printf("            Slots: %ld\n", 1L << bits);
+    printf("        Slot size: %ld\n", sizeof(uint64_t));
+    printf("      Record size: %ld\n", sizeof(uint32_t));
+    memory_meg += size_optical_grid();
     printf("  Memory required: %ld MB\n\n", memory_meg);
     
-    *n_return = n;
-    *b_return = b;
+    return bits;
 }
 
 /*----------------------------------------------------------------------*
@@ -378,19 +622,41 @@ void usage(void)
     printf("Clip and analyse Illumina Nextera Long Mate Pair reads\n" \
            "\nSyntax: nextclip [-i r1.fastq] [-j r2.fastq] [-o prefix] [options]\n" \
            "\nOptions:\n" \
+           "    [-a | --adaptor_set] File of junction and external adaptors to screen for (name type sequence per line)\n" \
+           "    [-b | --benchmark_kernels] Time the specialised alignment kernels against the generic ones\n" \
+           "    [-B | --singleton_filter] Memory in MB for a Bloom filter that only lets signatures into the duplicate table once\n" \
+           "                              seen twice, which shrinks the table for libraries with few duplicates\n" \
+           "    [-c | --cache_size] Number of read pairs in classification cache, 0 to disable (default 1,048,576)\n" \
            "    [-d | --remove_duplicates] Remove PCR duplicates\n"
            "    [-e | --use_category_e] Use category E\n"
+           "    [-E | --error_tolerant] Also call pairs duplicates when one of three kmers in each read differs, eg. from a miscalled base\n" \
+           "    [-g | --gapped] Use banded gapped alignment to rescue adaptors containing indels\n" \
+           "    [-G | --signature_geometry] Windows and window size for duplicate signatures, split between R1 and R2, then optionally\n" \
+           "                                the offset of the first R1 window, eg. 6x10 or 4x15+10 (default 4x11+20)\n" \
            "    [-h | --help] This help screen\n" \
            "    [-i | --input_one] Input FASTQ R1 file\n" \
+           "    [-I | --interleave] Spread the pages of big tables evenly across NUMA nodes, instead of splitting them into a block per node\n" \
            "    [-j | --input_two] Input FASTQ R2 file\n" \
+           "    [-k | --discover_adaptors] Look for over-represented sequences in a sample of reads and compare with the adaptors\n" \
+           "    [-K | --minimizers] Take duplicate signature kmers from wherever each read's minimizers are rather than fixed offsets,\n" \
+           "                        so copies that start a base or two apart or were trimmed differently still match\n" \
            "    [-l | --log] Log filename\n" \
+           "    [-L | --load_dup_index] Duplicate table saved by an earlier run, eg. of other lanes of the same library, to find duplicates against\n" \
+           "    [-M | --mate_swap] Make duplicate signatures the same whichever way round R1 and R2 are, instead of canonical under reverse complement\n" \
            "    [-m | --min_length] Minimum usable read length (default 25)\n" \
-           "    [-n | --number_of_reads] Approximate number of reads (default 20,000,000)\n" \
+           "    [-n | --number_of_reads] Approximate number of reads, used for initial table sizes (default 20,000,000)\n" \
            "    [-o | --output_prefix] Prefix for output files\n" \
+           "    [-O | --optical_distance] Count duplicates within this many pixels of another copy on the same tile as optical (eg. 100, or 2500 for patterned flowcells)\n" \
            "    [-p | --only_duplicates] Only remove duplicates, don't trim\n" \
            "    [-q | --duplicates_log] PCR duplicates log filename\n" \
            "    [-r | --memory_requirements] Output memory requirements for specified number of reads\n" \
+           "    [-S | --save_dup_index] Save the duplicate table to this file when done, for use with --load_dup_index\n" \
            "    [-t | --trim_ends] Trim ends of non-matching reads by amount (default 19)\n" \
+           "    [-T | --threads] Number of threads for duplicate checking and adaptor finding (default 1)\n" \
+           "    [-u | --dup_memory] Memory in MB for approximate duplicate detection with a fixed size filter instead of the hash table,\n" \
+           "                        or with -v for sorting (default 1024)\n" \
+           "    [-v | --scratch_dir] Directory for temporary files - find duplicates exactly by sorting on disk instead of the hash table\n" \
+           "    [-w | --sweep] File of strict_match, relaxed_match and min_length values - output category counts for every combination instead of reads\n" \
            "    [-x | --strict_match] Strict alignment matches (default '34,18')\n" \
            "    [-y | --relaxed_match] Relaxed alignment matches (default '32,17')\n" \
            "\nComments/suggestions to richard.leggett@earlham.ac.uk\n" \
@@ -438,20 +704,38 @@ void parse_csv_params(char* s, int* a, int* b)
 void parse_command_line(int argc, char* argv[], MPStats* stats)
 {
     static struct option long_options[] = {
+        {"adaptor_set", required_argument, NULL, 'a'},
+        {"benchmark_kernels", no_argument, NULL, 'b'},
+        {"singleton_filter", required_argument, NULL, 'B'},
+        {"cache_size", required_argument, NULL, 'c'},
         {"remove_duplicates", no_argument, NULL, 'd'},
         {"use_category_e", no_argument, NULL, 'e'},
+        {"error_tolerant", no_argument, NULL, 'E'},
+        {"gapped", no_argument, NULL, 'g'},
+        {"signature_geometry", required_argument, NULL, 'G'},
         {"help", no_argument, NULL, 'h'},
         {"input_one", required_argument, NULL, 'i'},
+        {"interleave", no_argument, NULL, 'I'},
         {"input_two", required_argument, NULL, 'j'},
+        {"discover_adaptors", no_argument, NULL, 'k'},
+        {"minimizers", no_argument, NULL, 'K'},
         {"log", required_argument, NULL, 'l'},
+        {"load_dup_index", required_argument, NULL, 'L'},
         {"min_length", required_argument, NULL, 'm'},
+        {"mate_swap", no_argument, NULL, 'M'},
         {"number_of_reads", required_argument, NULL, 'n'},
         {"output_prefix", required_argument, NULL, 'o'},
+        {"optical_distance", required_argument, NULL, 'O'},
         {"only_duplicates", no_argument, NULL, 'p'},
         {"duplicates_log", required_argument, NULL, 'q'},
         {"memory_requirements", no_argument, NULL, 'r'},
         {"adaptor_sequence", required_argument, NULL, 's'},
+        {"save_dup_index", required_argument, NULL, 'S'},
         {"trim_ends", required_argument, NULL, 't'},
+        {"threads", required_argument, NULL, 'T'},
+        {"dup_memory", required_argument, NULL, 'u'},
+        {"scratch_dir", required_argument, NULL, 'v'},
+        {"sweep", required_argument, NULL, 'w'},
         {"strict_match", required_argument, NULL, 'x'},
         {"relaxed_match", required_argument, NULL, 'y'},
         {0, 0, 0, 0}
@@ -465,15 +749,51 @@ void parse_command_line(int argc, char* argv[], MPStats* stats)
         exit(0);
     }
     
-    while ((opt = getopt_long(argc, argv, "dehi:j:l:m:n:o:pq:rs:t:x:y:z:", long_options, &longopt_index)) > 0)
+    while ((opt = getopt_long(argc, argv, "a:bB:c:deEgG:hi:Ij:kKl:L:m:Mn:o:O:pq:rs:S:t:T:u:v:w:x:y:z:", long_options, &longopt_index)) > 0)
     {
         switch(opt) {
+            case 'a':
+                if (optarg==NULL) {
+                    printf("Error: [-a | --adaptor_set] option requires an argument.\n");
+                    exit(1);
+                }
+                strcpy(adaptor_set_filename, optarg);
+                break;
+            case 'b':
+                benchmark_kernels = true;
+                break;
+            case 'c':
+                if (optarg==NULL) {
+                    printf("Error: [-c | --cache_size] option requires an argument.\n");
+                    exit(1);
+                }
+                pair_cache_size = atoi(optarg);
+                break;
             case 'd':
                 remove_duplicates=1;
                 break;
             case 'e':
                 use_category_e = 1;
                 break;
+            case 'E':
+                error_tolerant = true;
+                break;
+            case 'g':
+                gapped_mode = true;
+                break;
+            case 'G':
+                if (optarg==NULL) {
+                    printf("Error: [-G | --signature_geometry] option requires an argument.\n");
+                    exit(1);
+                }
+                if (sscanf(optarg, "%dx%d+%d", &signature_windows, &signature_window_size, &signature_offset) < 2) {
+                    printf("Error: [-G | --signature_geometry] option is of the format 'windows x size', optionally '+offset', eg. 6x10+20.\n");
+                    exit(1);
+                }
+                break;
+            case 'M':
+                signature_type |= SIGNATURE_MATE_SWAP;
+                break;
             case 'h':
                 usage();
                 exit(0);
@@ -492,6 +812,15 @@ void parse_command_line(int argc, char* argv[], MPStats* stats)
                 }
                 strcpy(stats->input_filenames[1], optarg);
                 break;
+            case 'I':
+                interleave_memory = true;
+                break;
+            case 'k':
+                discover_adaptors = true;
+                break;
+            case 'K':
+                signature_type |= SIGNATURE_MINIMIZERS;
+                break;
             case 'l':
                 if (optarg==NULL) {
                     printf("Error: [-l | --log] option requires an argument.\n");
@@ -499,6 +828,13 @@ void parse_command_line(int argc, char* argv[], MPStats* stats)
                 }
                 strcpy(stats->log_filename, optarg);
                 break;                
+            case 'L':
+                if (optarg==NULL) {
+                    printf("Error: [-L | --load_dup_index] option requires an argument.\n");
+                    exit(1);
+                }
+                strcpy(load_index_filename, optarg);
+                break;
             case 'm':
                 if (optarg==NULL) {
                     printf("Error: [-m | --minium_length] option requires an argument.\n");
@@ -520,6 +856,17 @@ void parse_command_line(int argc, char* argv[], MPStats* stats)
                 }
                 strcpy(stats->output_prefix, optarg);
                 break;
+            case 'O':
+                if (optarg==NULL) {
+                    printf("Error: [-O | --optical_distance] option requires an argument.\n");
+                    exit(1);
+                }
+                optical_distance = atoi(optarg);
+                if (optical_distance < 1) {
+                    printf("Error: [-O | --optical_distance] must be at least 1 pixel\n");
+                    exit(1);
+                }
+                break;
             case 'p':
                 duplicate_only_mode = true;
                 remove_duplicates=1;
@@ -541,6 +888,13 @@ void parse_command_line(int argc, char* argv[], MPStats* stats)
                 }
                 strcpy(single_junction_adaptor, optarg);
                 break;
+            case 'S':
+                if (optarg==NULL) {
+                    printf("Error: [-S | --save_dup_index] option requires an argument.\n");
+                    exit(1);
+                }
+                strcpy(save_index_filename, optarg);
+                break;
             case 't':
                 if (optarg==NULL) {
                     printf("Error: [-t | --trim_ends] option requires an argument.\n");
@@ -548,6 +902,53 @@ void parse_command_line(int argc, char* argv[], MPStats* stats)
                 }
                 trim_ends = atoi(optarg);
                 break;                
+            case 'T':
+                if (optarg==NULL) {
+                    printf("Error: [-T | --threads] option requires an argument.\n");
+                    exit(1);
+                }
+                number_of_threads = atoi(optarg);
+                if ((number_of_threads < 1) || (number_of_threads > MAX_THREADS)) {
+                    printf("Error: [-T | --threads] must be between 1 and %d\n", MAX_THREADS);
+                    exit(1);
+                }
+                break;
+            case 'B':
+                if (optarg==NULL) {
+                    printf("Error: [-B | --singleton_filter] option requires an argument.\n");
+                    exit(1);
+                }
+                singleton_memory = atol(optarg);
+                if (singleton_memory < 1) {
+                    printf("Error: [-B | --singleton_filter] must be at least 1 MB\n");
+                    exit(1);
+                }
+                break;
+            case 'u':
+                if (optarg==NULL) {
+                    printf("Error: [-u | --dup_memory] option requires an argument.\n");
+                    exit(1);
+                }
+                duplicate_memory = atol(optarg);
+                if (duplicate_memory < 1) {
+                    printf("Error: [-u | --dup_memory] must be at least 1 MB\n");
+                    exit(1);
+                }
+                break;
+            case 'v':
+                if (optarg==NULL) {
+                    printf("Error: [-v | --scratch_dir] option requires an argument.\n");
+                    exit(1);
+                }
+                strcpy(scratch_directory, optarg);
+                break;
+            case 'w':
+                if (optarg==NULL) {
+                    printf("Error: [-w | --sweep] option requires an argument.\n");
+                    exit(1);
+                }
+                strcpy(sweep_filename, optarg);
+                break;
             case 'x':
                 if (optarg==NULL) {
                     printf("Error: [-x | --strict_match] option requires an argument.\n");
@@ -577,12 +978,83 @@ void parse_command_line(int argc, char* argv[], MPStats* stats)
         }
     }
     
+    if ((signature_windows < 2) || (signature_windows > MAX_SIGNATURE_WINDOWS) || (signature_windows % 2 != 0)) {
+        printf("Error: [-G | --signature_geometry] needs an even number of windows, up to %d\n", MAX_SIGNATURE_WINDOWS);
+        exit(1);
+    }
+    
+    if ((signature_window_size < MIN_WINDOW_SIZE) || (signature_window_size > PAIR_SIGNATURE_MAX_WINDOW) || (signature_offset < 0)) {
+        printf("Error: [-G | --signature_geometry] windows must be %d to %d bases\n", MIN_WINDOW_SIZE, PAIR_SIGNATURE_MAX_WINDOW);
+        exit(1);
+    }
+    
+    if ((2 * signature_windows * signature_window_size < DUPLICATE_TABLE_MIN_SIGNATURE_BITS) || (2 * signature_windows * signature_window_size > DUPLICATE_TABLE_MAX_SIGNATURE_BITS)) {
+        printf("Error: [-G | --signature_geometry] windows must add up to %d to %d bases\n", DUPLICATE_TABLE_MIN_SIGNATURE_BITS / 2, DUPLICATE_TABLE_MAX_SIGNATURE_BITS / 2);
+        exit(1);
+    }
+    
+    // The first error-tolerant sub-signature has half the windows, rounded up, and one more from each read
+    if ((error_tolerant == true) && (((signature_windows / 2 + 1) / 2 + 1) * 2 * signature_window_size > PAIR_SIGNATURE_MAX_BASES)) {
+        printf("Error: [-G | --signature_geometry] windows too big for [-E | --error_tolerant]\n");
+        exit(1);
+    }
+    
     if (output_memory_requirements == true) {
-        int n, b;
-        size_hashtable(&n, &b);
+        if (error_tolerant == true) {
+            size_duplicate_index();
+        } else {
+            size_duplicate_table();
+        }
+        exit(0);
+    }
+    
+    if (benchmark_kernels == true) {
+#ifdef BATCH_ALIGNMENT_AVAILABLE
+        batch_alignment_benchmark(strict_double_match, strict_single_match);
+#else
+        printf("Batch alignment kernels not available in this build\n");
+#endif
         exit(0);
     }
 
+    if ((error_tolerant == true) && ((scratch_directory[0] != 0) || (duplicate_memory > 0))) {
+        printf("Error: [-E | --error_tolerant] can't be used with [-u | --dup_memory] or [-v | --scratch_dir]\n");
+        exit(1);
+    }
+
+    if (error_tolerant == true) {
+        duplicate_backend = DUPLICATE_BACKEND_TOLERANT;
+    } else if (scratch_directory[0] != 0) {
+        duplicate_backend = DUPLICATE_BACKEND_EXTERNAL;
+        if (duplicate_memory == 0) {
+            duplicate_memory = DEFAULT_EXTERNAL_MEMORY;
+        }
+    } else if (duplicate_memory > 0) {
+        duplicate_backend = DUPLICATE_BACKEND_FILTER;
+    }
+
+    if (((load_index_filename[0] != 0) || (save_index_filename[0] != 0)) && (duplicate_backend != DUPLICATE_BACKEND_HASH)) {
+        printf("Error: [-L | --load_dup_index] and [-S | --save_dup_index] only work with the duplicate hash table, not -E, -u or -v\n");
+        exit(1);
+    }
+
+    if ((singleton_memory > 0) && (duplicate_backend != DUPLICATE_BACKEND_HASH)) {
+        printf("Error: [-B | --singleton_filter] only works with the duplicate hash table, not -E, -u or -v\n");
+        exit(1);
+    }
+
+    // A saved table wouldn't have the signatures seen once
+    if ((singleton_memory > 0) && ((load_index_filename[0] != 0) || (save_index_filename[0] != 0))) {
+        printf("Error: [-B | --singleton_filter] can't be used with [-L | --load_dup_index] or [-S | --save_dup_index]\n");
+        exit(1);
+    }
+
+    if ((sweep_filename[0] != 0) &&
+        ((gapped_mode == true) || (adaptor_set_filename[0] != 0) || (duplicate_only_mode == true) || (stats->log_filename[0] != 0))) {
+        printf("Error: [-w | --sweep] can't be used with gapped mode, adaptor sets, logging or only removing duplicates\n");
+        exit(1);
+    }
+
     if (use_category_e == 1) {
         num_categories = 5;
     } else {
@@ -602,10 +1074,13 @@ void parse_command_line(int argc, char* argv[], MPStats* stats)
         }
     }
     
-    for (i=0; i<num_categories; i++) {
-        if (stats->output_filenames[i][0] == 0) {
-            printf("Error: you must specify four output filenames\n");
-            exit(2);
+    // Adaptor discovery only reports to the screen
+    if (discover_adaptors == false) {
+        for (i=0; i<num_categories; i++) {
+            if (stats->output_filenames[i][0] == 0) {
+                printf("Error: you must specify four output filenames\n");
+                exit(2);
+            }
         }
     }
 }
@@ -651,6 +1126,121 @@ void relaxed_check(JunctionAdaptorAlignment* result)
     }    
 }
 
+/*----------------------------------------------------------------------*
+ * Function:   external_check
+ * Purpose:    Decide if a sequence alignment is good enough to accept
+ * Parameters: result -> alignment result
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void external_check(GenericAdaptorAlignment* result)
+{
+    if ((result->alignment_length > 20) && (result->identity > 90)) {
+        result->accepted = 1;
+    } else {
+        result->accepted = 0;
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   overlap_length
+ * Purpose:    Number of bases of [start, start+length) that lie in a read
+ * Parameters: start = start position, may be negative
+ *             length = length of region
+ *             read_size = length of read
+ * Returns:    Number of overlapping bases
+ *----------------------------------------------------------------------*/
+static inline int overlap_length(int start, int length, int read_size)
+{
+    int first = start > 0 ? start : 0;
+    int last = start + length < read_size ? start + length : read_size;
+    
+    return last > first ? last - first : 0;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   external_offset_can_improve
+ * Purpose:    Decide if a sequence at a given offset needs scoring. Only
+ *             offsets where a perfect match could beat the best so far
+ *             are, so the offset chosen is the same as a full scan would
+ *             choose. Offsets hanging off the start of the read are
+ *             always tried, as the best so far may be from a longer
+ *             sequence.
+ * Parameters: x = offset of sequence in read
+ *             seq_length = length of sequence
+ *             read_size = length of read
+ *             result -> best result so far
+ * Returns:    true if the offset needs to be evaluated
+ *----------------------------------------------------------------------*/
+static inline boolean external_offset_can_improve(int x, int seq_length, int read_size, GenericAdaptorAlignment* result)
+{
+    if (x < 0) {
+        return true;
+    }
+    
+    return overlap_length(x, seq_length, read_size) > result->score ? true:false;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   evaluate_sequence_offset
+ * Purpose:    Score a sequence at one offset in a read and keep it if
+ *             it's the best so far
+ * Parameters: read -> read to find sequence in
+ *             sequence -> sequence to look for
+ *             seq_length = length of sequence
+ *             adaptor_index = index of sequence in adaptor set, or -1
+ *             x = position in the read of the start of the sequence
+ *             result -> alignment result
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static inline void evaluate_sequence_offset(FastQRead* read, char* sequence, int seq_length, int adaptor_index, int x, GenericAdaptorAlignment* result)
+{
+    int p;
+    int score = 0;
+    int read_start = -1;
+    int read_end = -1;
+    int query_start = -1;
+    int query_end = -1;
+    int matches = 0;
+    int mismatches = 0;
+    
+    // Go through each base of sequence, count matches and store start and end of match
+    for (p=0; p<seq_length; p++) {
+        if (((x+p) >= 0) && ((x+p) < read->read_size)) {
+            if (sequence[p] == read->read[x+p]) {
+                matches++;
+                if (read_start == -1) {
+                    read_start = x+p;
+                    query_start = p;
+                } else {
+                    read_end = x+p;
+                    query_end = p;
+                }
+            } else {
+                mismatches++;
+            }
+        }
+    }
+    
+    // Score is simply matches for now
+    score = matches;
+    result->offsets_evaluated++;
+    
+    // Is this the best score yet?
+    if (score > result->score) {
+        result->score = score;
+        result->matches = matches;
+        result->mismatches = mismatches;
+        result->position = x;
+        result->read_start = read_start;
+        result->read_end = read_end;
+        result->query_start = query_start;
+        result->query_end = query_end;
+        result->alignment_length = 1 + (query_end - query_start);
+        result->identity = 100.0 * result->matches / result->alignment_length;
+        result->adaptor_index = adaptor_index;
+    }
+}
+
 /*----------------------------------------------------------------------*
  * Function:   find_sequence_in_read
  * Purpose:    Find a sequence within a read, eg. external adaptor
@@ -661,188 +1251,487 @@ void relaxed_check(JunctionAdaptorAlignment* result)
  *----------------------------------------------------------------------*/
 void find_sequence_in_read(FastQRead* read, char* sequence, GenericAdaptorAlignment* result)
 {
-    int x, p;
+    int x;
     int seq_length = strlen(sequence);
     
     // Initialise a result structure to store information
     initialise_generic_adaptor_alignment(result);
     result->read_size = read->read_size;
     
-    // Start searching for the sequence... x is the position in the read where we start to compare the sequence
+    // Start searching for the sequence... x is the position in the read where we start to compare the sequence.
+    // Once inside the read, the best possible score only goes down as x increases, so we can stop.
     for (x=-seq_length+5; x<read->read_size-5; x++) {
-        int score = 0;
-        int read_start = -1;
-        int read_end = -1;
-        int query_start = -1;
-        int query_end = -1;
-        int matches = 0;
-        int mismatches = 0;
-        
-        // Go through each base of sequence, count matches and store start and end of match
-        for (p=0; p<seq_length; p++) {
-            if (((x+p) >= 0) && ((x+p) < read->read_size)) {
-                if (sequence[p] == read->read[x+p]) {
-                    matches++;
-                    if (read_start == -1) {
-                        read_start = x+p;
-                        query_start = p;
-                    } else {
-                        read_end = x+p;
-                        query_end = p;
-                    }
-                } else {
-                    mismatches++;
-                }
-            }
-        }
-        
-        // Score is simply matches for now
-        score = matches;
-        
-        // Is this the best score yet?
-        if (score > result->score) {
-            result->score = score;
-            result->matches = matches;
-            result->mismatches = mismatches;
-            result->position = x;
-            result->read_start = read_start;
-            result->read_end = read_end;
-            result->query_start = query_start;
-            result->query_end = query_end;
-            result->alignment_length = 1 + (query_end - query_start);
-            result->identity = 100.0 * result->matches / result->alignment_length;
+        if (!external_offset_can_improve(x, seq_length, read->read_size, result)) {
+            break;
         }
+        evaluate_sequence_offset(read, sequence, seq_length, -1, x, result);
     }
     
     strcpy(result->adaptor, sequence);
-    if ((result->alignment_length > 20) && (result->identity > 90)) {
-        result->accepted = 1;
-    } else {
-        result->accepted = 0;
-    }
+    external_check(result);
 }
 
-
 /*----------------------------------------------------------------------*
- * Function:   find_junction_adaptors
- * Purpose:    Find junction adaptors in a read
+ * Function:   find_external_variants
+ * Purpose:    Try external adaptor variants at the offsets where they
+ *             share a seed with the read, then make the final decision
+ *             on the best external adaptor alignment
  * Parameters: read -> read to find adaptors in
- *             result -> alignment result
+ *             read_number = 0 for R1, 1 for R2
+ *             candidates -> seed hits for the read, or NULL if none
+ *             result -> alignment result for primary external adaptor
  * Returns:    None
  *----------------------------------------------------------------------*/
-void find_junction_adaptors(FastQRead* read, JunctionAdaptorAlignment* result)
+void find_external_variants(FastQRead* read, int read_number, AdaptorCandidates* candidates, GenericAdaptorAlignment* result)
 {
-    int x, p;
-    int adaptor_length = strlen(duplicate_junction_adaptor);
-
-    // Initialise a result structure to store information
-    initialise_junction_adaptor_alignment(result);
-    result->read_size = read->read_size;
+    int primary = adaptor_set.primary_external[read_number];
+    int i;
     
-    // Start searching for the transposon... x is the position in the read where we start to compare the transposon
-    for (x=-adaptor_length+5; x<read->read_size-5; x++) {
-        int matches[2] = {0, 0};
-        int mismatches[2] = {0, 0};
-        int score = 0;
-        int read_start = -1;
-        int read_end = -1;
-        int query_start = -1;
-        int query_end = -1;
-        int better_result = 0;
- 
-        // Go through each base of transposon, count matches and store start and end of match
-        // For interest, we store the 19nt sequence and it's reverse as a part 1 and part 2!
-        for (p=0; p<adaptor_length; p++) {
-            if (((x+p) >= 0) && ((x+p) < read->read_size)) {
-                if (duplicate_junction_adaptor[p] == read->read[x+p]) {
-                    matches[p < 19 ? 0:1]++;
-                    if (read_start == -1) {
-                        read_start = x+p;
-                        query_start = p;
-                    } else {
-                        read_end = x+p;
-                        query_end = p;
-                    }
-                } else {
-                    mismatches[p < 19 ? 0:1]++;
-                }
-            }
-        }
-        
-        // Score is simply matches for part 1 and 2
-        score = matches[0] + matches[1];
+    if ((candidates == NULL) || (adaptor_set.number_of_variants == 0)) {
+        return;
+    }
+
+    for (i=0; i<adaptor_set.number_of_adaptors; i++) {
+        Adaptor* adaptor = &adaptor_set.adaptors[i];
+        int x;
         
-        // Decide if it's a better match
+        if ((adaptor->type != ADAPTOR_EXTERNAL) || (!(adaptor->reads & (1 << read_number))) || (i == primary)) {
+            continue;
+        }
         
-        // If we've found a double match...
-        if (score >= strict_double_match) {
-            // Then see if it's a better double match than we've already got...
-            if (score > result->score) {
-                better_result = 1;
-            }
-        // Failing a double match, have we found a single match?
-        } else if ((matches[0] >= strict_single_match) || (matches[1] >= strict_single_match)) {
-            // Only consider if we haven't already found a double match
-            if (result->score < strict_double_match) {
-                int best_current_match = matches[0] > matches[1] ? matches[0]:matches[1];
-                int best_result_match = result->matches[0] > result->matches[1] ? result->matches[0]:result->matches[1];
-                
-                // It's a better match if there are more bases of a single adaptor
-                // OR, the same number of bases of a single adaptor, but a higher score.
-                
-                if (best_current_match > best_result_match) {
-                    better_result = 1;
-                } else if ((best_current_match == best_result_match) &&
-                           (score > result->score)) {
-                    better_result = 1;
+        if (candidates->overflow) {
+            for (x=-adaptor->length+5; x<read->read_size-5; x++) {
+                if (!external_offset_can_improve(x, adaptor->length, read->read_size, result)) {
+                    break;
                 }
-            }
-        } else {
-            // No matches... well, at least store best match, if not already got a good double or single match
-            if ((result->score < strict_double_match) &&
-                (result->matches[0] < strict_single_match) &&
-                (result->matches[1] < strict_single_match)) {
-                    if (score > result->score) {
-                        better_result = 1;
-                    }
+                evaluate_sequence_offset(read, adaptor->sequence, adaptor->length, i, x, result);
             }
         }
+    }
     
-        // Is this the best score yet?
-        if (better_result == 1) {
-            result->score = score;
-            result->matches[0] = matches[0];
-            result->mismatches[0] = mismatches[0];
-            result->matches[1] = matches[1];
-            result->mismatches[1] = mismatches[1];
-            result->position = x;
-            result->read_start = read_start;
-            result->read_end = read_end;
-            result->query_start = query_start;
-            result->query_end = query_end;
-            result->alignment_length[0] = query_start < 19 ? 19 - query_start : 0;
-            result->alignment_length[1] = query_end >= 19 ? query_end-18 : 0;
-            result->total_matches = matches[0] + matches[1];
-            result->total_alignment_length = 1 + (query_end - query_start);
+    if (!candidates->overflow) {
+        for (i=0; i<candidates->number_of_candidates; i++) {
+            int a = CANDIDATE_ADAPTOR(candidates->candidates[i]);
+            int x = CANDIDATE_OFFSET(candidates->candidates[i]);
+            Adaptor* adaptor = &adaptor_set.adaptors[a];
+            
+            if ((adaptor->type != ADAPTOR_EXTERNAL) || (!(adaptor->reads & (1 << read_number))) || (a == primary)) {
+                continue;
+            }
+            
+            if ((x >= -adaptor->length+5) && (x < read->read_size-5) && (external_offset_can_improve(x, adaptor->length, read->read_size, result))) {
+                evaluate_sequence_offset(read, adaptor->sequence, adaptor->length, a, x, result);
+            }
         }
     }
     
-    // If we found a match, do some calculation
-    if (result->score > 0) {
-        result->total_identity = 100.0 * result->total_matches / result->total_alignment_length;
-        result->identity[0] = 100.0 * result->matches[0] / result->alignment_length[0];
-        result->identity[1] = 100.0 * result->matches[1] / result->alignment_length[1];
-        strict_check(result);
-    }
+    strcpy(result->adaptor, adaptor_set.adaptors[result->adaptor_index].sequence);
+    external_check(result);
 }
 
 /*----------------------------------------------------------------------*
- * Function:   log_output_alignment
- * Purpose:    Output an alignment to the log
- * Parameters: stats -> MPStats structure
- *             read -> read adaptors were aligned to
- *             result -> junction adaptor alignment result
- *             external_adaptor_result -> external adaptor alignment result
+ * Function:   find_external_adaptors
+ * Purpose:    Find the primary external adaptor for a read with a full
+ *             scan, then try any external adaptor variants
+ * Parameters: read -> read to find adaptors in
+ *             read_number = 0 for R1, 1 for R2
+ *             candidates -> seed hits for the read, or NULL if none
+ *             result -> alignment result
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void find_external_adaptors(FastQRead* read, int read_number, AdaptorCandidates* candidates, GenericAdaptorAlignment* result)
+{
+    int primary = adaptor_set.primary_external[read_number];
+    
+    find_sequence_in_read(read, adaptor_set.adaptors[primary].sequence, result);
+    result->adaptor_index = primary;
+    find_external_variants(read, read_number, candidates, result);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   junction_offset_can_improve
+ * Purpose:    Decide if the junction adaptor at a given offset could
+ *             possibly beat the current result, assuming every base in
+ *             the overlap with the read matches
+ * Parameters: x = offset of adaptor in read
+ *             adaptor_length = length of double adaptor
+ *             half_length = length of single adaptor
+ *             read_size = length of read
+ *             result -> best result so far
+ * Returns:    true if the offset needs to be evaluated
+ *----------------------------------------------------------------------*/
+static inline boolean junction_offset_can_improve(int x, int adaptor_length, int half_length, int read_size, JunctionAdaptorAlignment* result)
+{
+    int max_score = overlap_length(x, adaptor_length, read_size);
+    int max_part_one = overlap_length(x, half_length, read_size);
+    int max_part_two = overlap_length(x + half_length, adaptor_length - half_length, read_size);
+    int max_single = max_part_one > max_part_two ? max_part_one : max_part_two;
+    int best_result_match = result->matches[0] > result->matches[1] ? result->matches[0]:result->matches[1];
+    
+    // Already got a double match - only a better double match will do
+    if (result->score >= strict_double_match) {
+        return max_score > result->score ? true:false;
+    }
+    
+    // A double match would beat anything we have
+    if (max_score >= strict_double_match) {
+        return true;
+    }
+    
+    // Already got a single match - need more bases of a single adaptor, or same number and higher score
+    if ((result->matches[0] >= strict_single_match) || (result->matches[1] >= strict_single_match)) {
+        if (max_single > best_result_match) {
+            return true;
+        }
+        return ((max_single == best_result_match) && (max_score > result->score)) ? true:false;
+    }
+    
+    // Only got a partial match - a single match or a higher score will do
+    if (max_single >= strict_single_match) {
+        return true;
+    }
+
+    return max_score > result->score ? true:false;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   junction_alignment_is_better
+ * Purpose:    Decide if a junction adaptor alignment beats the current
+ *             best result
+ * Parameters: score = total matches of new alignment
+ *             matches -> matches in part 1 and 2 of new alignment
+ *             result -> best result so far
+ * Returns:    true if the new alignment is better
+ *----------------------------------------------------------------------*/
+static inline boolean junction_alignment_is_better(int score, int* matches, JunctionAdaptorAlignment* result)
+{
+    // If we've found a double match...
+    if (score >= strict_double_match) {
+        // Then see if it's a better double match than we've already got...
+        return score > result->score ? true:false;
+    }
+    
+    // Failing a double match, have we found a single match?
+    if ((matches[0] >= strict_single_match) || (matches[1] >= strict_single_match)) {
+        // Only consider if we haven't already found a double match
+        if (result->score < strict_double_match) {
+            int best_current_match = matches[0] > matches[1] ? matches[0]:matches[1];
+            int best_result_match = result->matches[0] > result->matches[1] ? result->matches[0]:result->matches[1];
+            
+            // It's a better match if there are more bases of a single adaptor
+            // OR, the same number of bases of a single adaptor, but a higher score.
+            if (best_current_match > best_result_match) {
+                return true;
+            } else if ((best_current_match == best_result_match) && (score > result->score)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    // No matches... well, at least store best match, if not already got a good double or single match
+    if ((result->score < strict_double_match) &&
+        (result->matches[0] < strict_single_match) &&
+        (result->matches[1] < strict_single_match)) {
+        return score > result->score ? true:false;
+    }
+    
+    return false;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   evaluate_junction_offset
+ * Purpose:    Score a junction adaptor at one offset in a read and keep
+ *             it if it's the best so far
+ * Parameters: read -> read to find adaptors in
+ *             adaptor_index = index of junction adaptor in adaptor set
+ *             x = position in the read of the start of the adaptor
+ *             result -> alignment result
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static inline void evaluate_junction_offset(FastQRead* read, int adaptor_index, int x, JunctionAdaptorAlignment* result)
+{
+    Adaptor* adaptor = &adaptor_set.adaptors[adaptor_index];
+    char* sequence = adaptor->sequence;
+    int adaptor_length = adaptor->length;
+    int half_length = adaptor->half_length;
+    int matches[2] = {0, 0};
+    int mismatches[2] = {0, 0};
+    int score = 0;
+    int read_start = -1;
+    int read_end = -1;
+    int query_start = -1;
+    int query_end = -1;
+    int p;
+    
+    result->offsets_evaluated++;
+    
+    // Go through each base of transposon, count matches and store start and end of match
+    // For interest, we store the 19nt sequence and it's reverse as a part 1 and part 2!
+    for (p=0; p<adaptor_length; p++) {
+        if (((x+p) >= 0) && ((x+p) < read->read_size)) {
+            if (sequence[p] == read->read[x+p]) {
+                matches[p < half_length ? 0:1]++;
+                if (read_start == -1) {
+                    read_start = x+p;
+                    query_start = p;
+                } else {
+                    read_end = x+p;
+                    query_end = p;
+                }
+            } else {
+                mismatches[p < half_length ? 0:1]++;
+            }
+        }
+    }
+    
+    // Score is simply matches for part 1 and 2
+    score = matches[0] + matches[1];
+    
+    // Is this the best score yet?
+    if (junction_alignment_is_better(score, matches, result)) {
+        result->score = score;
+        result->matches[0] = matches[0];
+        result->mismatches[0] = mismatches[0];
+        result->matches[1] = matches[1];
+        result->mismatches[1] = mismatches[1];
+        result->position = x;
+        result->read_start = read_start;
+        result->read_end = read_end;
+        result->query_start = query_start;
+        result->query_end = query_end;
+        result->alignment_length[0] = query_start < half_length ? half_length - query_start : 0;
+        result->alignment_length[1] = query_end >= half_length ? query_end - half_length + 1 : 0;
+        result->total_matches = matches[0] + matches[1];
+        result->total_alignment_length = 1 + (query_end - query_start);
+        result->adaptor_index = adaptor_index;
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   scan_junction_adaptor
+ * Purpose:    Try a junction adaptor at every offset in a read that
+ *             could beat the current result
+ * Parameters: read -> read to find adaptors in
+ *             adaptor_index = index of junction adaptor in adaptor set
+ *             result -> alignment result
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void scan_junction_adaptor(FastQRead* read, int adaptor_index, JunctionAdaptorAlignment* result)
+{
+    Adaptor* adaptor = &adaptor_set.adaptors[adaptor_index];
+    int x;
+    
+    // Start searching for the transposon... x is the position in the read where we start to compare the transposon
+    for (x=-adaptor->length+5; x<read->read_size-5; x++) {
+        // Skip offsets that can't beat what we've got. Once the adaptor starts inside the read, the best
+        // possible score only goes down as x increases, so nothing after this offset can win either.
+        if (!junction_offset_can_improve(x, adaptor->length, adaptor->half_length, read->read_size, result)) {
+            if (x >= 0) {
+                break;
+            }
+            continue;
+        }
+        
+        evaluate_junction_offset(read, adaptor_index, x, result);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   finish_junction_alignment
+ * Purpose:    Calculate identities and make the strict decision once
+ *             the best junction adaptor alignment has been found
+ * Parameters: result -> alignment result
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void finish_junction_alignment(JunctionAdaptorAlignment* result)
+{
+    // If we found a match, do some calculation
+    if (result->score > 0) {
+        result->total_identity = 100.0 * result->total_matches / result->total_alignment_length;
+        result->identity[0] = 100.0 * result->matches[0] / result->alignment_length[0];
+        result->identity[1] = 100.0 * result->matches[1] / result->alignment_length[1];
+        strict_check(result);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   find_junction_variants
+ * Purpose:    Try junction adaptor variants at the offsets where they
+ *             share a seed with the read
+ * Parameters: read -> read to find adaptors in
+ *             candidates -> seed hits for the read, or NULL if none
+ *             result -> alignment result for primary junction adaptor
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void find_junction_variants(FastQRead* read, AdaptorCandidates* candidates, JunctionAdaptorAlignment* result)
+{
+    int i;
+    
+    if ((candidates == NULL) || (adaptor_set.number_of_variants == 0)) {
+        return;
+    }
+    
+    if (candidates->overflow) {
+        // Too many seed hits to list - fall back to scanning every junction variant
+        for (i=0; i<adaptor_set.number_of_adaptors; i++) {
+            if ((adaptor_set.adaptors[i].type == ADAPTOR_JUNCTION) && (i != adaptor_set.primary_junction)) {
+                scan_junction_adaptor(read, i, result);
+            }
+        }
+        return;
+    }
+    
+    for (i=0; i<candidates->number_of_candidates; i++) {
+        int a = CANDIDATE_ADAPTOR(candidates->candidates[i]);
+        int x = CANDIDATE_OFFSET(candidates->candidates[i]);
+        Adaptor* adaptor = &adaptor_set.adaptors[a];
+        
+        if ((adaptor->type != ADAPTOR_JUNCTION) || (a == adaptor_set.primary_junction)) {
+            continue;
+        }
+        
+        if ((x >= -adaptor->length+5) && (x < read->read_size-5) &&
+            (junction_offset_can_improve(x, adaptor->length, adaptor->half_length, read->read_size, result))) {
+            evaluate_junction_offset(read, a, x, result);
+        }
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   find_junction_adaptors
+ * Purpose:    Find junction adaptors in a read. The primary junction
+ *             adaptor gets a full scan; variants are only tried at the
+ *             offsets where they share a seed with the read.
+ * Parameters: read -> read to find adaptors in
+ *             candidates -> seed hits for the read, or NULL if none
+ *             result -> alignment result
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void find_junction_adaptors(FastQRead* read, AdaptorCandidates* candidates, JunctionAdaptorAlignment* result)
+{
+    // Initialise a result structure to store information
+    initialise_junction_adaptor_alignment(result);
+    result->read_size = read->read_size;
+    
+    scan_junction_adaptor(read, adaptor_set.primary_junction, result);
+    find_junction_variants(read, candidates, result);
+    finish_junction_alignment(result);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   rescue_junction_adaptor_gapped
+ * Purpose:    Realign the junction adaptor with gaps allowed, around the
+ *             best ungapped offset, and keep it if it passes strict_check
+ * Parameters: read -> read to find adaptors in
+ *             result -> ungapped alignment result, replaced if accepted
+ * Returns:    true if the gapped alignment was accepted
+ *----------------------------------------------------------------------*/
+boolean rescue_junction_adaptor_gapped(FastQRead* read, JunctionAdaptorAlignment* result)
+{
+    GappedAlignment gapped;
+    JunctionAdaptorAlignment candidate;
+    Adaptor* adaptor;
+    int adaptor_length;
+    int split_position;
+
+    if ((result->accepted == 1) || (result->score <= 0)) {
+        return false;
+    }
+
+    adaptor = &adaptor_set.adaptors[result->adaptor_index];
+    adaptor_length = adaptor->length;
+    split_position = adaptor->half_length;
+
+    if (!gapped_alignment_banded(adaptor->sequence, adaptor_length, split_position, read->read, read->read_size, result->position, &gapped)) {
+        return false;
+    }
+
+    candidate = *result;
+    candidate.score = gapped.matches[0] + gapped.matches[1];
+    candidate.matches[0] = gapped.matches[0];
+    candidate.matches[1] = gapped.matches[1];
+    candidate.mismatches[0] = gapped.mismatches[0];
+    candidate.mismatches[1] = gapped.mismatches[1];
+    candidate.read_start = gapped.read_start;
+    candidate.read_end = gapped.read_end;
+    candidate.query_start = gapped.query_start;
+    candidate.query_end = gapped.query_end;
+    candidate.alignment_length[0] = gapped.query_start < split_position ? split_position - gapped.query_start : 0;
+    candidate.alignment_length[1] = gapped.query_end >= split_position ? gapped.query_end - split_position + 1 : 0;
+    candidate.total_matches = candidate.score;
+    candidate.total_alignment_length = 1 + (gapped.query_end - gapped.query_start) + gapped.insertions;
+    candidate.total_identity = 100.0 * candidate.total_matches / candidate.total_alignment_length;
+    candidate.identity[0] = 100.0 * candidate.matches[0] / candidate.alignment_length[0];
+    candidate.identity[1] = 100.0 * candidate.matches[1] / candidate.alignment_length[1];
+    candidate.insertions = gapped.insertions;
+    candidate.deletions = gapped.deletions;
+    candidate.gapped = 1;
+    strict_check(&candidate);
+
+    if (candidate.accepted == 0) {
+        return false;
+    }
+    
+    *result = candidate;
+
+    return true;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   rescue_sequence_in_read_gapped
+ * Purpose:    Realign a sequence (eg. external adaptor) with gaps allowed,
+ *             around the best ungapped offset
+ * Parameters: read -> read to find sequence in
+ *             result -> ungapped alignment result, replaced if accepted
+ * Returns:    true if the gapped alignment was accepted
+ *----------------------------------------------------------------------*/
+boolean rescue_sequence_in_read_gapped(FastQRead* read, GenericAdaptorAlignment* result)
+{
+    GappedAlignment gapped;
+    int seq_length = strlen(result->adaptor);
+    int alignment_length;
+    double identity;
+
+    if ((result->accepted == 1) || (result->score <= 0)) {
+        return false;
+    }
+
+    if (!gapped_alignment_banded(result->adaptor, seq_length, seq_length, read->read, read->read_size, result->position, &gapped)) {
+        return false;
+    }
+
+    alignment_length = 1 + (gapped.query_end - gapped.query_start) + gapped.insertions;
+    identity = 100.0 * gapped.matches[0] / alignment_length;
+    
+    if ((alignment_length <= 20) || (identity <= 90)) {
+        return false;
+    }
+
+    result->score = gapped.matches[0];
+    result->matches = gapped.matches[0];
+    result->mismatches = gapped.mismatches[0];
+    result->read_start = gapped.read_start;
+    result->read_end = gapped.read_end;
+    result->query_start = gapped.query_start;
+    result->query_end = gapped.query_end;
+    result->alignment_length = alignment_length;
+    result->identity = identity;
+    result->insertions = gapped.insertions;
+    result->deletions = gapped.deletions;
+    result->gapped = 1;
+    result->accepted = 1;
+
+    return true;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   log_output_alignment
+ * Purpose:    Output an alignment to the log
+ * Parameters: stats -> MPStats structure
+ *             read -> read adaptors were aligned to
+ *             result -> junction adaptor alignment result
+ *             external_adaptor_result -> external adaptor alignment result
  * Returns:    None
  *----------------------------------------------------------------------*/
 void log_output_alignment(MPStats* stats, FastQRead* read, JunctionAdaptorAlignment* result, GenericAdaptorAlignment* external_adaptor_result)
@@ -850,7 +1739,8 @@ void log_output_alignment(MPStats* stats, FastQRead* read, JunctionAdaptorAlignm
     char s1[MAX_READ_LENGTH];
     char s2[MAX_READ_LENGTH];
     int i;
-    int duplicate_junction_adaptor_length = strlen(duplicate_junction_adaptor);
+    char* junction_adaptor = result->adaptor_index >= 0 ? adaptor_set.adaptors[result->adaptor_index].sequence : duplicate_junction_adaptor;
+    int duplicate_junction_adaptor_length = strlen(junction_adaptor);
     int external_adaptor_length =  strlen(external_adaptor_result->adaptor);
 
     fprintf(stats->log_fp, "\n---------- Read ID: %s ----------\n", read->read_header);
@@ -870,10 +1760,10 @@ void log_output_alignment(MPStats* stats, FastQRead* read, JunctionAdaptorAlignm
                 int p = i - result->position;
                 
                 if ((p >= 0) && (p < duplicate_junction_adaptor_length)) {
-                    if (duplicate_junction_adaptor[p] == read->read[i]) {
+                    if (junction_adaptor[p] == read->read[i]) {
                         s1[i] = '|';
                     }
-                    s2[i] = duplicate_junction_adaptor[p];
+                    s2[i] = junction_adaptor[p];
                 }
             }
         }
@@ -904,9 +1794,21 @@ void log_output_alignment(MPStats* stats, FastQRead* read, JunctionAdaptorAlignm
            result->mismatches[0], result->mismatches[1],
            result->alignment_length[0], result->alignment_length[1],
            result->identity[0], result->identity[1]);
+    if (result->gapped == 1) {
+        fprintf(stats->log_fp, "                  Gapped (Insertions %d Deletions %d)\n", result->insertions, result->deletions);
+    }
+    if ((adaptor_set_filename[0] != 0) && (result->adaptor_index >= 0)) {
+        fprintf(stats->log_fp, "                  Adaptor %s\n", adaptor_set.adaptors[result->adaptor_index].name);
+    }
     fprintf(stats->log_fp, "                  JUNCTION ADAPTOR %s\n", result->accepted == 1 ? "GOOD ALIGNMENT":"BAD ALIGNMENT");
     
     fprintf(stats->log_fp, "External adaptor: Read %d-%d Adaptor %d-%d Score %d Id %.1f\n", external_adaptor_result->read_start, external_adaptor_result->read_end, external_adaptor_result->query_start, external_adaptor_result->query_end, external_adaptor_result->score, external_adaptor_result->identity);
+    if (external_adaptor_result->gapped == 1) {
+        fprintf(stats->log_fp, "                  Gapped (Insertions %d Deletions %d)\n", external_adaptor_result->insertions, external_adaptor_result->deletions);
+    }
+    if ((adaptor_set_filename[0] != 0) && (external_adaptor_result->adaptor_index >= 0)) {
+        fprintf(stats->log_fp, "                  Adaptor %s\n", adaptor_set.adaptors[external_adaptor_result->adaptor_index].name);
+    }
     fprintf(stats->log_fp, "                  EXTERNAL ADAPTOR %s\n", external_adaptor_result->accepted == 1 ? "GOOD ALIGNMENT":"BAD ALIGNMENT");
 }
 
@@ -937,7 +1839,7 @@ int get_read(FILE* fp, FastQRead* read)
         got_read = 0;
     }
     
-    if (strlen(read->read) < MINIMUM_INPUT_READ_SIZE) {
+    if ((got_read == 1) && (strlen(read->read) < MINIMUM_INPUT_READ_SIZE)) {
         printf("Warning: read shorter than minimum read size (%d) - ignoring\n", MINIMUM_INPUT_READ_SIZE);
         got_read = 0;
     }
@@ -1028,6 +1930,43 @@ int decide_category(MPStats* stats, FastQRead* read_one, JunctionAdaptorAlignmen
     return category;
 }
 
+/*----------------------------------------------------------------------*
+ * Function:   category_from_alignments
+ * Purpose:    Work out the category a pair would get from a pair of
+ *             alignment results, without touching stats or trimming
+ * Parameters: result_one -> alignment result for read 1
+ *             result_two -> alignment result for read 2
+ * Returns:    0 for category A, 1 for category B etc.
+ *----------------------------------------------------------------------*/
+int category_from_alignments(JunctionAdaptorAlignment* result_one, JunctionAdaptorAlignment* result_two)
+{
+    JunctionAdaptorAlignment relaxed;
+    
+    if ((result_one->accepted == 1) && (result_two->accepted == 1)) {
+        return 0;
+    } else if ((result_one->accepted == 0) && (result_two->accepted == 1)) {
+        if (use_category_e == 1) {
+            relaxed = *result_one;
+            relaxed_check(&relaxed);
+            if (relaxed.accepted == 1) {
+                return 4;
+            }
+        }
+        return 1;
+    } else if ((result_one->accepted == 1) && (result_two->accepted == 0)) {
+        if (use_category_e == 1) {
+            relaxed = *result_two;
+            relaxed_check(&relaxed);
+            if (relaxed.accepted == 1) {
+                return 4;
+            }
+        }
+        return 2;
+    }
+    
+    return 3;
+}
+
 /*----------------------------------------------------------------------*
  * Function:   trim_and_write_pair
  * Purpose:    Trim read and write to output file
@@ -1146,181 +2085,1812 @@ boolean valid_bases(char *string)
  *----------------------------------------------------------------------*/
 boolean check_valid_bases_and_gc_content(char *string, int* gc)
 {
+    int length = strlen(string);
+    int count = 0;
     int i; 
 
     *gc = 0;
 
-    for (i=0; i<strlen(string); i++) {
+    // Count locally - gc may point into the same structure as string
+    for (i=0; i<length; i++) {
         if ((string[i] == 'G') || (string[i] == 'C')) {
-            *gc = (*gc) + 1;
+            count++;
         } else if  ((string[i] != 'A') && (string[i] != 'T')) {
             return false;
         }
     }
 
+    *gc = count;
+
     return true;
 }
 
-#ifdef USE_MULTIPLE_HASHES
 /*----------------------------------------------------------------------*
- * Function:   check_pcr_duplicates
- * Purpose:    Calculate kmer signature and check for duplicates
- * Parameters: read_one -> FastQRead structure for read 1
- *             read_two -> FastQRead structure for read 2
- *             stats -> MPStats structure
- * Returns:    true if duplicate, false otherwise
+ * Function:   first_window_offset
+ * Purpose:    Find where the first signature window of a read starts. A
+ *             mate swap signature needs the same windows from both reads.
+ * Parameters: r = 0 for R1, 1 for R2
+ * Returns:    Offset of first window
  *----------------------------------------------------------------------*/
-boolean check_pcr_duplicates(FastQRead* read_one, FastQRead* read_two, MPStats* stats)
+int first_window_offset(int r)
 {
-    char kmer_string[TOTAL_KMER_SIZE+1];
-    BinaryKmer kmer;
-    BinaryKmer tmp_kmer;
-    Element* e;
-    boolean is_duplicate = 0;
-    boolean found = false;
-    int i;
+    return ((r == 0) || (signature_type & SIGNATURE_MATE_SWAP)) ? signature_offset:0;
+}
 
-    if ((!valid_bases(read_one->read)) || (!valid_bases(read_two->read))) {
-        stats->pairs_containing_n++;
-        return false;
-    }
-    
-    if (kmer_offsets[0][0] == -1) {
-        kmer_offsets[0][0] = 0;
-        kmer_offsets[0][1] = read_one->read_size / 3;
-        kmer_offsets[1][0] = 0;
-        kmer_offsets[1][1] = 2 * read_one->read_size / 3;
-        kmer_offsets[2][0] = read_one->read_size / 3;
-        kmer_offsets[2][1] = 2 * read_one->read_size / 3;
-    }
-    
-    for (i=0; i<NUMBER_OF_HASHES; i++) {
-        strncpy(kmer_string,                        read_one->read + kmer_offsets[i][0], SEPARATE_KMER_SIZE);
-        strncpy(kmer_string+(1*SEPARATE_KMER_SIZE), read_one->read + kmer_offsets[i][1], SEPARATE_KMER_SIZE);
-        strncpy(kmer_string+(2*SEPARATE_KMER_SIZE), read_two->read + kmer_offsets[i][0], SEPARATE_KMER_SIZE);
-        strncpy(kmer_string+(3*SEPARATE_KMER_SIZE), read_two->read + kmer_offsets[i][1], SEPARATE_KMER_SIZE);
-        kmer_string[TOTAL_KMER_SIZE]=0;
+/*----------------------------------------------------------------------*
+ * Function:   subsignature_keeps
+ * Purpose:    Check if an error-tolerant sub-signature uses one of the
+ *             usual windows of each read. The first sub-signature is the
+ *             usual signature, the second drops every other window
+ *             starting from the second and the third drops the rest, so
+ *             each window is left out of at least one. The second and
+ *             third also use the extra window at the end of each read.
+ * Parameters: i = sub-signature
+ *             k = window of read, less than signature_windows / 2
+ * Returns:    true if used
+ *----------------------------------------------------------------------*/
+boolean subsignature_keeps(int i, int k)
+{
+    return ((i == 0) || (k % 2 == i - 1)) ? true:false;
+}
 
-        seq_to_binary_kmer(kmer_string, TOTAL_KMER_SIZE, &kmer);
-        Key key = element_get_key(&kmer, TOTAL_KMER_SIZE, &tmp_kmer);
-        e = hash_table_find_or_insert(key, &found, kmer_hashes[i]);
-        if (e == NULL) {
-            printf("Error: Hash table not big enough! Try specifying a larger number of reads.")
-            exit(101);
-        }
+/*----------------------------------------------------------------------*
+ * Function:   read_windows_fit
+ * Purpose:    Check the signature windows always fit in a read of a
+ *             given length. Minimizer windows can start anywhere in
+ *             their region, so the start of the region is used. A
+ *             window that fits in a read of one length fits in any
+ *             longer read.
+ * Parameters: r = 0 for R1, 1 for R2
+ *             size = length of read
+ * Returns:    true if every window used fits
+ *----------------------------------------------------------------------*/
+boolean read_windows_fit(int r, int size)
+{
+    int per_read = signature_windows / 2;
+    int used = duplicate_backend == DUPLICATE_BACKEND_TOLERANT ? per_read + 1 : per_read;
+    int k;
+    
+    for (k=0; k<used; k++) {
+        int start;
         
-        if (found) {
-            is_duplicate = true;
-            e->count++;
+        if (signature_type & SIGNATURE_MINIMIZERS) {
+            start = (k * size) / (per_read + 1);
+        } else if (k == 0) {
+            start = first_window_offset(r);
+        } else if (k < per_read) {
+            start = (k * size) / per_read;
         } else {
-            e->flags = 1;
-            e->count = 1;
+            start = ((2 * per_read - 1) * size) / (2 * per_read);
         }
-    }
-    
-    if (is_duplicate) {
-        stats->n_duplicates++;
-        if (stats->duplicates_fp) {
-            fprintf(stats->duplicates_fp, "Match: %s\n", kmer_string);
-            fprintf(stats->duplicates_fp, "   R1: %s\n", read_one->read);
-            fprintf(stats->duplicates_fp, "   R2: %s\n\n", read_two->read);
+        
+        if (start + signature_window_size > size) {
+            return false;
         }
     }
     
-    return is_duplicate;
+    return true;
 }
-#else
-/*----------------------------------------------------------------------*
- * Function:   check_pcr_duplicates
- * Purpose:    Calculate kmer signature and check for duplicates
- * Parameters: read_one -> FastQRead structure for read 1
- *             read_two -> FastQRead structure for read 2
- *             stats -> MPStats structure
- * Returns:    true if duplicate, false otherwise
- *----------------------------------------------------------------------*/
-boolean check_pcr_duplicates(FastQRead* read_one, FastQRead* read_two, MPStats* stats)
-{
-    char kmer_string[TOTAL_KMER_SIZE+1];
-    BinaryKmer kmer;
-    BinaryKmer tmp_kmer;
-    Element* e;
-    boolean is_duplicate = false;
-    boolean found = false;
-    int gc_one = 0;
-    int gc_two = 0;
-    
-    if ((!check_valid_bases_and_gc_content(read_one->read, &gc_one)) || (!check_valid_bases_and_gc_content(read_two->read, &gc_two))) {
-        stats->pairs_containing_n++;
-        stats->n_invalid_for_duplicate++;
-        return false;
-    }
 
-    stats->gc_bases+=gc_one;
-    stats->gc_bases+=gc_two;
-    stats->at_bases+=(read_one->read_size - gc_one);
-    stats->at_bases+=(read_two->read_size - gc_two);
-    
-    if (gc_one > 0) {
-        gc_one=(gc_one*100)/read_one->read_size;
-    }
+/*----------------------------------------------------------------------*
+ * Function:   set_signature_geometry
+ * Purpose:    Check the chosen windows fit in the shortest reads used,
+ *             then pick the signature builders for them, for the usual
+ *             signature and each error-tolerant sub-signature
+ * Parameters: None
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void set_signature_geometry(void)
+{
+    boolean mate_swap = (signature_type & SIGNATURE_MATE_SWAP) ? true:false;
+    int per_read = signature_windows / 2;
+    int i, k;
     
-    if (gc_two > 0) {
-        gc_two=(gc_two*100)/read_two->read_size;
+    // The length check in get_read counts the newline, so reads can be a base shorter than the minimum
+    if ((read_windows_fit(0, MINIMUM_INPUT_READ_SIZE - 1) == false) || (read_windows_fit(1, MINIMUM_INPUT_READ_SIZE - 1) == false)) {
+        printf("Error: [-G | --signature_geometry] windows must fit in reads of %d bases, the shortest used\n", MINIMUM_INPUT_READ_SIZE - 1);
+        exit(1);
     }
     
-    stats->gc_content[0][gc_one]++;
-    stats->gc_content[1][gc_two]++;
-
-    strncpy(kmer_string, read_one->read + FIRST_KMER_OFFSET, SEPARATE_KMER_SIZE);
-    strncpy(kmer_string+(1*SEPARATE_KMER_SIZE), (read_one->read) + (read_one->read_size / 2), SEPARATE_KMER_SIZE);
-    strncpy(kmer_string+(2*SEPARATE_KMER_SIZE), read_two->read, SEPARATE_KMER_SIZE);
-    strncpy(kmer_string+(3*SEPARATE_KMER_SIZE), (read_two->read) + (read_two->read_size / 2), SEPARATE_KMER_SIZE);
-    //strncpy(kmer_string, read_one->read, TOTAL_KMER_SIZE);
-    kmer_string[TOTAL_KMER_SIZE]=0;
-    
-    seq_to_binary_kmer(kmer_string, TOTAL_KMER_SIZE, &kmer);
-    Key key = element_get_key(&kmer, TOTAL_KMER_SIZE, &tmp_kmer);
-    e = hash_table_find_or_insert(key, &found, duplicate_hash);
-    if (e == NULL) {
-        printf("Error: Hash table not big enough! Try specifying a larger number of reads.");
-        exit(101);
-    }
+    pair_signature_set_geometry(&signature_geometry, signature_windows, signature_window_size, mate_swap);
     
-    if (found) {
-        e->count++;
-        is_duplicate = true;
-        if (stats->duplicates_fp) {
-            fprintf(stats->duplicates_fp, "Match: %s\n", kmer_string);
-            fprintf(stats->duplicates_fp, "   R1: %s\n", read_one->read);
-            fprintf(stats->duplicates_fp, "   R2: %s\n\n", read_two->read);
+    for (i=0; i<DUPLICATE_INDEX_SUBSIGNATURES; i++) {
+        int kept = i == 0 ? 0:1;
+        
+        for (k=0; k<per_read; k++) {
+            if (subsignature_keeps(i, k)) {
+                kept++;
+            }
         }
-    } else {
-        e->flags = 1;
-        e->count = 1;
+        pair_signature_set_geometry(&subsignature_geometry[i], 2 * kept, signature_window_size, mate_swap);
     }
-
-    return is_duplicate;
 }
-#endif
 
 /*----------------------------------------------------------------------*
- * Function:   process_files
- * Purpose:    Main function to process FASTQ files
- * Parameters: stats -> MPStats structure
- * Returns:    None
+ * Function:   find_read_windows
+ * Purpose:    Find where the signature windows of each read of a pair
+ *             start. The usual signature uses the first
+ *             signature_windows / 2 windows of each read and the
+ *             error-tolerant sub-signatures also use one more.
+ * Parameters: pair -> read pair, with valid bases
+ * Returns:    true if the reads are long enough for the windows
  *----------------------------------------------------------------------*/
-void process_files(MPStats* stats)
+boolean find_read_windows(ReadPair* pair)
 {
-    FastQRead reads[2];
-    JunctionAdaptorAlignment junction_adaptor_alignments[2];
-    GenericAdaptorAlignment external_adaptor_alignments[2];
-    int i, j;
-    int is_duplicate;
+    int per_read = signature_windows / 2;
+    int used = duplicate_backend == DUPLICATE_BACKEND_TOLERANT ? per_read + 1 : per_read;
+    int r, k;
     
-    if (stats->log_filename[0] != 0) {
-        stats->log_fp = fopen(stats->log_filename, "w");
-        if (!stats->log_fp) {
-            printf("Error: Can't open %s\n", stats->log_filename);
+    for (r=0; r<2; r++) {
+        int size = pair->reads[r].read_size;
+        
+        if (size < signature_window_size) {
+            return false;
+        }
+        
+        if (signature_type & SIGNATURE_MINIMIZERS) {
+            pair_signature_minimizers(pair->reads[r].read, size, signature_window_size, per_read + 1, pair->windows[r]);
+        } else {
+            pair->windows[r][0] = first_window_offset(r);
+            for (k=1; k<per_read; k++) {
+                pair->windows[r][k] = (k * size) / per_read;
+            }
+            pair->windows[r][per_read] = ((2 * per_read - 1) * size) / (2 * per_read);
+        }
+        
+        for (k=0; k<used; k++) {
+            if (pair->windows[r][k] + signature_window_size > size) {
+                return false;
+            }
+        }
+    }
+    
+    return true;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   find_signature_windows
+ * Purpose:    Find the windows of a pair used for its duplicate
+ *             signature, R1 first
+ * Parameters: pair -> read pair, after find_read_windows
+ *             bases -> returned pointers to first base of each window
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void find_signature_windows(ReadPair* pair, char** bases)
+{
+    int per_read = signature_windows / 2;
+    int r, k;
+    
+    for (r=0; r<2; r++) {
+        for (k=0; k<per_read; k++) {
+            bases[r * per_read + k] = pair->reads[r].read + pair->windows[r][k];
+        }
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   build_signature
+ * Purpose:    Join the windows of a pair into a signature of the type
+ *             chosen
+ * Parameters: geometry -> geometry from set_signature_geometry
+ *             bases -> pointers to first base of each window, R1 first
+ *             signature -> returned signature
+ *             swapped -> returned true if a mate swap signature has the
+ *                        R2 windows first
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void build_signature(PairSignatureGeometry* geometry, char** bases, BinaryKmer* signature, boolean* swapped)
+{
+    geometry->build(geometry, bases, signature, swapped);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   find_subsignature_hashes
+ * Purpose:    Calculate the three sub-signatures of a pair used for
+ *             error-tolerant duplicate detection
+ * Parameters: pair -> read pair, with windows and signature_hash set
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void find_subsignature_hashes(ReadPair* pair)
+{
+    BinaryKmer signature;
+    boolean swapped;
+    char* bases[2 * MAX_WINDOWS_PER_READ];
+    int per_read = signature_windows / 2;
+    int i, k, r;
+    
+    // First is the usual signature
+    pair->duplicate_hashes[0] = pair->signature_hash;
+    
+    // Then each half of the windows with the extra one
+    for (i=1; i<DUPLICATE_INDEX_SUBSIGNATURES; i++) {
+        int n = 0;
+        
+        for (r=0; r<2; r++) {
+            for (k=0; k<per_read; k++) {
+                if (subsignature_keeps(i, k)) {
+                    bases[n++] = pair->reads[r].read + pair->windows[r][k];
+                }
+            }
+            bases[n++] = pair->reads[r].read + pair->windows[r][per_read];
+        }
+        
+        build_signature(&subsignature_geometry[i], bases, &signature, &swapped);
+        pair->duplicate_hashes[i] = duplicate_index_hash(&signature, i);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   find_pcr_duplicate
+ * Purpose:    Calculate kmer signature of a pair and, if using the
+ *             duplicate table, where it goes in the table. Safe to call
+ *             for several pairs at once from different threads - the
+ *             signatures are counted by add_pcr_duplicates and the stats
+ *             updated by record_pcr_duplicates.
+ * Parameters: pair -> read pair
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void find_pcr_duplicate(ReadPair* pair)
+{
+    FastQRead* read_one = &pair->reads[0];
+    FastQRead* read_two = &pair->reads[1];
+    BinaryKmer signature;
+    Key key = &signature;
+    boolean swapped;
+    char* bases[MAX_SIGNATURE_WINDOWS];
+    
+    pair->duplicate_valid = false;
+    pair->mate_swapped = false;
+    
+    if ((!check_valid_bases_and_gc_content(read_one->read, &pair->gc[0])) || (!check_valid_bases_and_gc_content(read_two->read, &pair->gc[1]))) {
+        return;
+    }
+    
+    if (!find_read_windows(pair)) {
+        return;
+    }
+    
+    find_signature_windows(pair, bases);
+    build_signature(&signature_geometry, bases, &signature, &swapped);
+    
+    pair->duplicate_valid = true;
+    pair->signature_hash = duplicate_index_hash(key, 0);
+    pair->duplicate_cluster = pair->signature_hash;
+    
+    if (optical_distance > 0) {
+        pair->located = optical_grid_parse_header(read_one->read_header, &pair->location);
+    }
+    
+    // The index is looked up in order later, but the hashing can be done here
+    if (duplicate_backend == DUPLICATE_BACKEND_TOLERANT) {
+        find_subsignature_hashes(pair);
+        return;
+    }
+    
+    // The filter moves entries around as it inserts, so it's done in order
+    // later, and external duplicates were found before reading started
+    if (duplicate_backend != DUPLICATE_BACKEND_HASH) {
+        binary_kmer_assignment_operator(pair->duplicate_key, *key);
+        return;
+    }
+    
+    duplicate_table_prepare(&duplicate_table, key, &pair->duplicate_table_key);
+    pair->duplicate_table_key.flag = swapped;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   is_external_duplicate
+ * Purpose:    Check a pair against the sorted list of duplicate pair
+ *             numbers from find_external_duplicates. Pairs must be
+ *             checked in file order.
+ * Parameters: ordinal = number of pair in file, from 0
+ * Returns:    true if duplicate
+ *----------------------------------------------------------------------*/
+boolean is_external_duplicate(long int ordinal)
+{
+    while ((more_duplicate_ordinals == true) && (next_duplicate_ordinal < ordinal)) {
+        more_duplicate_ordinals = external_sort_next(&duplicate_ordinals, &next_duplicate_ordinal);
+    }
+    
+    if ((more_duplicate_ordinals == true) && (next_duplicate_ordinal == ordinal)) {
+        more_duplicate_ordinals = external_sort_next(&duplicate_ordinals, &next_duplicate_ordinal);
+        return true;
+    }
+    
+    return false;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   report_complexity_progress
+ * Purpose:    Report estimated number of unique pairs so far
+ * Parameters: stats -> MPStats structure
+ *             n_pairs = number of pairs read so far
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void report_complexity_progress(MPStats* stats, long int n_pairs)
+{
+    long int valid_pairs = n_pairs - stats->n_invalid_for_duplicate;
+    double unique = hyperloglog_estimate(&complexity_sketch);
+    
+    if (unique > valid_pairs) {
+        unique = valid_pairs;
+    }
+    
+    printf("Read %ld pairs - about %.0f unique (%.2f %% duplicates)\n", n_pairs, unique, valid_pairs > 0 ? 100.0 * (1.0 - unique / valid_pairs) : 0);
+    fflush(stdout);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   record_pcr_duplicates
+ * Purpose:    Mark duplicates and update stats for a batch of pairs that
+ *             have been through find_pcr_duplicate and, if using the
+ *             duplicate table, add_pcr_duplicates.
+ * Parameters: stats -> MPStats structure
+ *             pairs -> batch of read pairs
+ *             n_pairs = number of pairs in batch
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void record_pcr_duplicates(MPStats* stats, ReadPair* pairs, int n_pairs)
+{
+    int p;
+    
+    for (p=0; p<n_pairs; p++) {
+        ReadPair* pair = &pairs[p];
+        FastQRead* read_one = &pair->reads[0];
+        FastQRead* read_two = &pair->reads[1];
+        int gc_one = pair->gc[0];
+        int gc_two = pair->gc[1];
+        
+        pair->is_duplicate = false;
+        
+        if ((pair->ordinal > 0) && ((pair->ordinal % COMPLEXITY_REPORT_INTERVAL) == 0)) {
+            report_complexity_progress(stats, pair->ordinal);
+        }
+        
+        if (pair->duplicate_valid == false) {
+            stats->pairs_containing_n++;
+            stats->n_invalid_for_duplicate++;
+            continue;
+        }
+        
+        stats->gc_bases+=gc_one;
+        stats->gc_bases+=gc_two;
+        stats->at_bases+=(read_one->read_size - gc_one);
+        stats->at_bases+=(read_two->read_size - gc_two);
+        
+        if (gc_one > 0) {
+            gc_one=(gc_one*100)/read_one->read_size;
+        }
+        
+        if (gc_two > 0) {
+            gc_two=(gc_two*100)/read_two->read_size;
+        }
+        
+        stats->gc_content[0][gc_one]++;
+        stats->gc_content[1][gc_two]++;
+        
+        hyperloglog_add(&complexity_sketch, pair->signature_hash);
+        
+        if (duplicate_backend == DUPLICATE_BACKEND_FILTER) {
+            pair->is_duplicate = duplicate_filter_add(&duplicate_filter, pair->duplicate_key, sizeof(BinaryKmer));
+        } else if (duplicate_backend == DUPLICATE_BACKEND_EXTERNAL) {
+            pair->is_duplicate = is_external_duplicate(pair->ordinal);
+        } else if (duplicate_backend == DUPLICATE_BACKEND_TOLERANT) {
+            pair->is_duplicate = duplicate_index_add(&duplicate_index, pair->duplicate_hashes, &pair->duplicate_cluster);
+        } else {
+            pair->is_duplicate = pair->duplicate_found;
+        }
+        
+        // Every located pair goes in the grid, as any of them could be the original of a later copy
+        if ((optical_distance > 0) && (pair->located == true)) {
+            if (optical_grid_add(&optical_grid, pair->duplicate_cluster, &pair->location) && (pair->is_duplicate)) {
+                stats->n_optical_duplicates++;
+            }
+        }
+        
+        if (pair->is_duplicate) {
+            stats->n_marked_duplicates++;
+            if (pair->mate_swapped) {
+                stats->n_mate_swapped_duplicates++;
+            }
+            if (stats->duplicates_fp) {
+                char* bases[MAX_SIGNATURE_WINDOWS];
+                int i;
+                
+                find_signature_windows(pair, bases);
+                for (i=0; i<signature_windows; i++) {
+                    memcpy(pair->duplicate_kmer + (i * signature_window_size), bases[i], signature_window_size);
+                }
+                pair->duplicate_kmer[signature_windows * signature_window_size] = 0;
+                
+                fprintf(stats->duplicates_fp, "Match: %s\n", pair->duplicate_kmer);
+                fprintf(stats->duplicates_fp, "   R1: %s\n", read_one->read);
+                fprintf(stats->duplicates_fp, "   R2: %s\n\n", read_two->read);
+            }
+        }
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   add_pcr_duplicates_chunk
+ * Purpose:    Thread entry point to add the signatures of one range of
+ *             duplicate table partitions
+ * Parameters: arg -> DuplicateChunk structure
+ * Returns:    NULL
+ *----------------------------------------------------------------------*/
+void* add_pcr_duplicates_chunk(void* arg)
+{
+    DuplicateChunk* chunk = (DuplicateChunk*)arg;
+    int i;
+    
+    for (i=0; i<chunk->n_pairs; i++) {
+        ReadPair* pair = &chunk->pairs[chunk->order[i]];
+        
+        if (i + DUPLICATE_PREFETCH_DISTANCE < chunk->n_pairs) {
+            duplicate_table_prefetch(&duplicate_table, &chunk->pairs[chunk->order[i + DUPLICATE_PREFETCH_DISTANCE]].duplicate_table_key);
+        }
+        
+        boolean found;
+        uint64_t slot = duplicate_table_add(&duplicate_table, &pair->duplicate_table_key, &found);
+        
+        // The first copy's orientation is kept with the signature
+        if ((found) && (duplicate_table_get_flag(&duplicate_table, slot) != pair->duplicate_table_key.flag)) {
+            pair->mate_swapped = true;
+        }
+        
+        // Past the singleton filter, even the first copy in the table is a second sighting
+        pair->duplicate_found = ((found) || (singleton_memory > 0)) ? true:false;
+    }
+    
+    return NULL;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   batch_worker
+ * Purpose:    Thread entry point for a long-lived batch worker. Waits
+ *             for each stage of a batch, does its chunk if it has one,
+ *             then reports back, until told to stop.
+ * Parameters: arg -> worker number, which is also its chunk number
+ * Returns:    NULL
+ *----------------------------------------------------------------------*/
+void* batch_worker(void* arg)
+{
+    BatchWorkers* workers = &batch_workers;
+    int id = *(int*)arg;
+    int seen = 0;
+    
+    while (1) {
+        pthread_mutex_lock(&workers->lock);
+        while ((workers->round == seen) && (workers->stop == false)) {
+            pthread_cond_wait(&workers->start, &workers->lock);
+        }
+        if (workers->stop == true) {
+            pthread_mutex_unlock(&workers->lock);
+            return NULL;
+        }
+        seen = workers->round;
+        pthread_mutex_unlock(&workers->lock);
+        
+        if (id < workers->n_chunks) {
+            workers->stage(workers->args[id]);
+        }
+        
+        pthread_mutex_lock(&workers->lock);
+        workers->busy--;
+        if (workers->busy == 0) {
+            pthread_cond_signal(&workers->done);
+        }
+        pthread_mutex_unlock(&workers->lock);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   start_batch_workers
+ * Purpose:    Start the batch workers, the first time they're needed.
+ *             The main thread does chunk 0 itself, so there's one
+ *             worker fewer than there are threads.
+ * Parameters: None
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void start_batch_workers(void)
+{
+    BatchWorkers* workers = &batch_workers;
+    int t;
+    
+    if (workers->n_workers > 0) {
+        return;
+    }
+    
+    pthread_mutex_init(&workers->lock, NULL);
+    pthread_cond_init(&workers->start, NULL);
+    pthread_cond_init(&workers->done, NULL);
+    workers->round = 0;
+    workers->busy = 0;
+    workers->stop = false;
+    
+    for (t=1; t<number_of_threads; t++) {
+        workers->ids[t] = t;
+        if (pthread_create(&workers->threads[t], NULL, batch_worker, &workers->ids[t]) != 0) {
+            printf("Error: can't create thread\n");
+            exit(1);
+        }
+        workers->n_workers++;
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   stop_batch_workers
+ * Purpose:    Stop the batch workers, if they were started
+ * Parameters: None
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void stop_batch_workers(void)
+{
+    BatchWorkers* workers = &batch_workers;
+    int t;
+    
+    if (workers->n_workers == 0) {
+        return;
+    }
+    
+    pthread_mutex_lock(&workers->lock);
+    workers->stop = true;
+    pthread_cond_broadcast(&workers->start);
+    pthread_mutex_unlock(&workers->lock);
+    
+    for (t=1; t<=workers->n_workers; t++) {
+        pthread_join(workers->threads[t], NULL);
+    }
+    
+    pthread_cond_destroy(&workers->done);
+    pthread_cond_destroy(&workers->start);
+    pthread_mutex_destroy(&workers->lock);
+    workers->n_workers = 0;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   run_on_batch_workers
+ * Purpose:    Run one stage of a batch, a chunk per thread, on the
+ *             batch workers. The main thread does the first chunk and
+ *             returns once every chunk is done.
+ * Parameters: stage -> function to run on each chunk
+ *             args -> argument for each chunk
+ *             n_chunks = number of chunks, up to number_of_threads
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void run_on_batch_workers(void* (*stage)(void*), void** args, int n_chunks)
+{
+    BatchWorkers* workers = &batch_workers;
+    int t;
+    
+    if (n_chunks <= 1) {
+        if (n_chunks == 1) {
+            stage(args[0]);
+        }
+        return;
+    }
+    
+    start_batch_workers();
+    
+    pthread_mutex_lock(&workers->lock);
+    workers->stage = stage;
+    for (t=0; t<n_chunks; t++) {
+        workers->args[t] = args[t];
+    }
+    workers->n_chunks = n_chunks;
+    workers->busy = workers->n_workers;
+    workers->round++;
+    pthread_cond_broadcast(&workers->start);
+    pthread_mutex_unlock(&workers->lock);
+    
+    stage(args[0]);
+    
+    pthread_mutex_lock(&workers->lock);
+    while (workers->busy > 0) {
+        pthread_cond_wait(&workers->done, &workers->lock);
+    }
+    pthread_mutex_unlock(&workers->lock);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   add_pcr_duplicates
+ * Purpose:    Count the signatures of a batch in the duplicate table.
+ *             Pairs are sorted by table partition, keeping file order
+ *             within a partition, and each thread is given its own
+ *             range of partitions. Identical signatures share a
+ *             partition, so the first in file order is always the one
+ *             treated as the original. With the singleton filter, only
+ *             signatures it has seen before go on to the table.
+ *             The sort only covers one batch, as a batch's reads are
+ *             written out before the next is read.
+ * Parameters: pairs -> batch of read pairs
+ *             n_pairs = number of pairs in batch
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void add_pcr_duplicates(ReadPair* pairs, int n_pairs)
+{
+    int partition_start[(1 << DUPLICATE_TABLE_MAX_PARTITION_BITS) + 1];
+    int order[PAIR_BATCH_SIZE];
+    DuplicateChunk chunks[MAX_THREADS];
+    void* args[MAX_THREADS];
+    int n_partitions = duplicate_table.number_of_partitions;
+    int n_chunks = number_of_threads < n_partitions ? number_of_threads : n_partitions;
+    int p, t;
+    
+    memset(partition_start, 0, (n_partitions + 1) * sizeof(int));
+    
+    for (p=0; p<n_pairs; p++) {
+        pairs[p].duplicate_to_add = pairs[p].duplicate_valid;
+        pairs[p].duplicate_found = false;
+    }
+    
+    // The filter is checked in file order, so the same pair is always the first sighting
+    if (singleton_memory > 0) {
+        for (p=0; p<n_pairs; p++) {
+            if ((p + DUPLICATE_PREFETCH_DISTANCE < n_pairs) && (pairs[p + DUPLICATE_PREFETCH_DISTANCE].duplicate_valid == true)) {
+                singleton_filter_prefetch(&singleton_filter, pairs[p + DUPLICATE_PREFETCH_DISTANCE].signature_hash);
+            }
+            if ((pairs[p].duplicate_valid == true) && (singleton_filter_add(&singleton_filter, pairs[p].signature_hash) == false)) {
+                pairs[p].duplicate_to_add = false;
+            }
+        }
+    }
+    
+    for (p=0; p<n_pairs; p++) {
+        if (pairs[p].duplicate_to_add == true) {
+            partition_start[pairs[p].duplicate_table_key.partition + 1]++;
+        }
+    }
+    
+    for (p=0; p<n_partitions; p++) {
+        partition_start[p + 1] += partition_start[p];
+    }
+    
+    for (p=0; p<n_pairs; p++) {
+        if (pairs[p].duplicate_to_add == true) {
+            order[partition_start[pairs[p].duplicate_table_key.partition]++] = p;
+        }
+    }
+    
+    // Filling the order moved each start along to the next partition's
+    for (p=n_partitions; p>0; p--) {
+        partition_start[p] = partition_start[p - 1];
+    }
+    partition_start[0] = 0;
+    
+    for (t=0; t<n_chunks; t++) {
+        int first = partition_start[(t * n_partitions) / n_chunks];
+        int last = partition_start[((t + 1) * n_partitions) / n_chunks];
+        
+        chunks[t].pairs = pairs;
+        chunks[t].order = order + first;
+        chunks[t].n_pairs = last - first;
+        args[t] = &chunks[t];
+    }
+    
+    run_on_batch_workers(add_pcr_duplicates_chunk, args, n_chunks);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   find_pcr_duplicates_chunk
+ * Purpose:    Thread entry point to run find_pcr_duplicate on a chunk
+ *             of a batch
+ * Parameters: arg -> BatchChunk structure
+ * Returns:    NULL
+ *----------------------------------------------------------------------*/
+void* find_pcr_duplicates_chunk(void* arg)
+{
+    BatchChunk* chunk = (BatchChunk*)arg;
+    int p;
+    
+    for (p=0; p<chunk->n_pairs; p++) {
+        find_pcr_duplicate(&chunk->pairs[p]);
+    }
+    
+    return NULL;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   rescue_read_gapped
+ * Purpose:    If in gapped mode, try to rescue junction and external
+ *             adaptor alignments of a read with gapped alignment
+ * Parameters: pair -> read pair
+ *             i = 0 for R1, 1 for R2
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void rescue_read_gapped(ReadPair* pair, int i)
+{
+    pair->gapped_junction_rescued[i] = false;
+    pair->gapped_external_rescued[i] = false;
+    
+    if (gapped_mode == true) {
+        pair->ungapped_alignments[i] = pair->junction_adaptor_alignments[i];
+        pair->gapped_junction_rescued[i] = rescue_junction_adaptor_gapped(&pair->reads[i], &pair->junction_adaptor_alignments[i]);
+        pair->gapped_external_rescued[i] = rescue_sequence_in_read_gapped(&pair->reads[i], &pair->external_adaptor_alignments[i]);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   classify_read
+ * Purpose:    Find junction and external adaptors in one read
+ * Parameters: pair -> read pair
+ *             i = 0 for R1, 1 for R2
+ *             candidates -> buffer for adaptor seed hits, or NULL if
+ *                           there are no adaptor variants
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void classify_read(ReadPair* pair, int i, AdaptorCandidates* candidates)
+{
+    FastQRead* read = &pair->reads[i];
+    JunctionAdaptorAlignment* junction = &pair->junction_adaptor_alignments[i];
+    
+    // Find where any adaptor variants share a seed with the read
+    if (candidates != NULL) {
+        adaptor_set_find_candidates(&adaptor_set, read->read, read->read_size, candidates);
+    }
+    
+    // Find junction adaptor
+    find_junction_adaptors(read, candidates, junction);
+    
+    // Look for external adaptor
+    find_external_adaptors(read, i, candidates, &pair->external_adaptor_alignments[i]);
+    
+    // If asked, try again allowing for indels
+    rescue_read_gapped(pair, i);
+}
+
+#ifdef BATCH_ALIGNMENT_AVAILABLE
+/*----------------------------------------------------------------------*
+ * Function:   classify_lanes
+ * Purpose:    Find junction and external adaptors in up to BATCH_LANES
+ *             reads of the same length, all R1 or all R2, at once. Each
+ *             read is then re-scored at its best offset to fill in the
+ *             rest of the alignment, and adaptor variants are tried one
+ *             read at a time.
+ * Parameters: pairs -> read pairs
+ *             n_lanes = number of pairs, unused lanes repeat the first
+ *             i = 0 for R1, 1 for R2
+ *             candidates -> buffer for adaptor seed hits, or NULL if
+ *                           there are no adaptor variants
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void classify_lanes(ReadPair* pairs[BATCH_LANES], int n_lanes, int i, AdaptorCandidates* candidates)
+{
+    BatchReads batch;
+    BatchAlignment junction_alignment;
+    BatchAlignment external_alignment;
+    char* lane_reads[BATCH_LANES];
+    Adaptor* junction_adaptor = &adaptor_set.adaptors[adaptor_set.primary_junction];
+    int external = adaptor_set.primary_external[i];
+    Adaptor* external_adaptor = &adaptor_set.adaptors[external];
+    int l;
+    
+    for (l=0; l<BATCH_LANES; l++) {
+        lane_reads[l] = pairs[l < n_lanes ? l:0]->reads[i].read;
+    }
+    
+    batch_load_reads(lane_reads, pairs[0]->reads[i].read_size, &batch);
+    batch_junction_alignment(&batch, junction_adaptor->sequence, junction_adaptor->length, junction_adaptor->half_length, strict_double_match, strict_single_match, &junction_alignment);
+    batch_sequence_alignment(&batch, external_adaptor->sequence, external_adaptor->length, &external_alignment);
+    
+    for (l=0; l<n_lanes; l++) {
+        FastQRead* read = &pairs[l]->reads[i];
+        JunctionAdaptorAlignment* junction = &pairs[l]->junction_adaptor_alignments[i];
+        GenericAdaptorAlignment* result = &pairs[l]->external_adaptor_alignments[i];
+        
+        // One seed scan serves both the junction and external variants
+        if (candidates != NULL) {
+            adaptor_set_find_candidates(&adaptor_set, read->read, read->read_size, candidates);
+        }
+        
+        // Junction adaptor
+        initialise_junction_adaptor_alignment(junction);
+        junction->read_size = read->read_size;
+        if (junction_alignment.position[l] != BATCH_NO_POSITION) {
+            evaluate_junction_offset(read, adaptor_set.primary_junction, junction_alignment.position[l], junction);
+        }
+        junction->offsets_evaluated = junction_alignment.offsets_evaluated[l];
+        find_junction_variants(read, candidates, junction);
+        finish_junction_alignment(junction);
+        
+        // External adaptor
+        initialise_generic_adaptor_alignment(result);
+        result->read_size = read->read_size;
+        if (external_alignment.score[l] > 0) {
+            evaluate_sequence_offset(read, external_adaptor->sequence, external_adaptor->length, external, external_alignment.position[l], result);
+        }
+        result->offsets_evaluated = external_alignment.offsets_evaluated[l];
+        result->adaptor_index = external;
+        strcpy(result->adaptor, external_adaptor->sequence);
+        external_check(result);
+        find_external_variants(read, i, candidates, result);
+        
+        rescue_read_gapped(pairs[l], i);
+    }
+}
+#endif
+
+/*----------------------------------------------------------------------*
+ * Function:   cache_classification
+ * Purpose:    Store the adaptor finding results of a pair in the
+ *             classification cache. Only what's needed for stats,
+ *             trimming and categorisation is kept.
+ * Parameters: pair -> read pair
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void cache_classification(ReadPair* pair)
+{
+    CachedPair* entry = pair_cache_slot(&pair_cache, &pair->fingerprint);
+    int i;
+    
+    for (i=0; i<2; i++) {
+        JunctionAdaptorAlignment* junction = &pair->junction_adaptor_alignments[i];
+        JunctionAdaptorAlignment* ungapped = &pair->ungapped_alignments[i];
+        GenericAdaptorAlignment* external = &pair->external_adaptor_alignments[i];
+        CachedRead* cached = &entry->reads[i];
+        
+        cached->flags = 0;
+        if (junction->accepted == 1) cached->flags |= PAIR_CACHE_JUNCTION_ACCEPTED;
+        if (external->accepted == 1) cached->flags |= PAIR_CACHE_EXTERNAL_ACCEPTED;
+        if ((gapped_mode == true) && (ungapped->accepted == 1)) cached->flags |= PAIR_CACHE_UNGAPPED_ACCEPTED;
+        if (pair->gapped_junction_rescued[i]) cached->flags |= PAIR_CACHE_JUNCTION_GAPPED;
+        if (pair->gapped_external_rescued[i]) cached->flags |= PAIR_CACHE_EXTERNAL_GAPPED;
+        
+        cached->junction_read_start = junction->read_start;
+        cached->junction_matches[0] = junction->matches[0];
+        cached->junction_matches[1] = junction->matches[1];
+        cached->junction_total_matches = junction->total_matches;
+        cached->junction_adaptor = junction->adaptor_index;
+        cached->junction_offsets_evaluated = junction->offsets_evaluated;
+        
+        if (gapped_mode == true) {
+            cached->ungapped_matches[0] = ungapped->matches[0];
+            cached->ungapped_matches[1] = ungapped->matches[1];
+            cached->ungapped_total_matches = ungapped->total_matches;
+        }
+        
+        cached->external_read_start = external->read_start;
+        cached->external_adaptor = external->adaptor_index;
+        cached->external_offsets_evaluated = external->offsets_evaluated;
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   restore_classification
+ * Purpose:    Fill in the adaptor finding results of a pair from a
+ *             classification cache entry
+ * Parameters: pair -> read pair
+ *             entry -> cache entry for a pair with identical bases
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void restore_classification(ReadPair* pair, CachedPair* entry)
+{
+    int i;
+    
+    for (i=0; i<2; i++) {
+        JunctionAdaptorAlignment* junction = &pair->junction_adaptor_alignments[i];
+        JunctionAdaptorAlignment* ungapped = &pair->ungapped_alignments[i];
+        GenericAdaptorAlignment* external = &pair->external_adaptor_alignments[i];
+        CachedRead* cached = &entry->reads[i];
+        
+        initialise_junction_adaptor_alignment(junction);
+        junction->read_size = pair->reads[i].read_size;
+        junction->accepted = (cached->flags & PAIR_CACHE_JUNCTION_ACCEPTED) ? 1:0;
+        junction->read_start = cached->junction_read_start;
+        junction->matches[0] = cached->junction_matches[0];
+        junction->matches[1] = cached->junction_matches[1];
+        junction->total_matches = cached->junction_total_matches;
+        junction->adaptor_index = cached->junction_adaptor;
+        junction->offsets_evaluated = cached->junction_offsets_evaluated;
+        
+        if (gapped_mode == true) {
+            initialise_junction_adaptor_alignment(ungapped);
+            ungapped->read_size = pair->reads[i].read_size;
+            ungapped->accepted = (cached->flags & PAIR_CACHE_UNGAPPED_ACCEPTED) ? 1:0;
+            ungapped->matches[0] = cached->ungapped_matches[0];
+            ungapped->matches[1] = cached->ungapped_matches[1];
+            ungapped->total_matches = cached->ungapped_total_matches;
+        }
+        
+        initialise_generic_adaptor_alignment(external);
+        external->read_size = pair->reads[i].read_size;
+        external->accepted = (cached->flags & PAIR_CACHE_EXTERNAL_ACCEPTED) ? 1:0;
+        external->read_start = cached->external_read_start;
+        external->adaptor_index = cached->external_adaptor;
+        external->offsets_evaluated = cached->external_offsets_evaluated;
+        
+        pair->gapped_junction_rescued[i] = (cached->flags & PAIR_CACHE_JUNCTION_GAPPED) ? true:false;
+        pair->gapped_external_rescued[i] = (cached->flags & PAIR_CACHE_EXTERNAL_GAPPED) ? true:false;
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   run_batch_stage
+ * Purpose:    Split a batch into one contiguous chunk per thread and
+ *             run a stage of processing on each chunk, using the batch
+ *             workers
+ * Parameters: stage -> function to run on each BatchChunk
+ *             stats -> MPStats structure
+ *             pairs -> batch of read pairs
+ *             n_pairs = number of pairs in batch
+ *             candidates -> array of one adaptor seed hit buffer per
+ *                           thread, or NULL
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void run_batch_stage(void* (*stage)(void*), MPStats* stats, ReadPair* pairs, int n_pairs, AdaptorCandidates** candidates)
+{
+    BatchChunk chunks[MAX_THREADS];
+    void* args[MAX_THREADS];
+    int n_chunks = number_of_threads < n_pairs ? number_of_threads : n_pairs;
+    int t;
+    
+    for (t=0; t<n_chunks; t++) {
+        int first = (t * n_pairs) / n_chunks;
+        int last = ((t + 1) * n_pairs) / n_chunks;
+        
+        chunks[t].stats = stats;
+        chunks[t].pairs = pairs + first;
+        chunks[t].n_pairs = last - first;
+        chunks[t].candidates = candidates != NULL ? candidates[t] : NULL;
+        args[t] = &chunks[t];
+    }
+    
+    run_on_batch_workers(stage, args, n_chunks);
+}
+
+
+/*----------------------------------------------------------------------*
+ * Function:   classify_chunk
+ * Purpose:    Find adaptors in all reads of a chunk that need it. Reads
+ *             of the usual length are done BATCH_LANES at a time, the
+ *             rest one at a time. Only touches the pairs in the chunk,
+ *             so chunks can be done in parallel.
+ * Parameters: arg -> BatchChunk structure
+ * Returns:    NULL
+ *----------------------------------------------------------------------*/
+void* classify_chunk(void* arg)
+{
+    BatchChunk* chunk = (BatchChunk*)arg;
+    ReadPair* pairs = chunk->pairs;
+    AdaptorCandidates* candidates = chunk->candidates;
+#ifdef BATCH_ALIGNMENT_AVAILABLE
+    int read_length = chunk->stats->read_length;
+    ReadPair* lanes[2][BATCH_LANES];
+    int n_lanes[2] = {0, 0};
+#endif
+    int p, i;
+    
+    for (p=0; p<chunk->n_pairs; p++) {
+        if ((pairs[p].classify == false) || (pairs[p].cached == true)) {
+            continue;
+        }
+        
+        for (i=0; i<2; i++) {
+#ifdef BATCH_ALIGNMENT_AVAILABLE
+            if ((pairs[p].reads[i].read_size == read_length) && (read_length <= BATCH_MAX_READ_LENGTH)) {
+                lanes[i][n_lanes[i]++] = &pairs[p];
+                if (n_lanes[i] == BATCH_LANES) {
+                    classify_lanes(lanes[i], BATCH_LANES, i, candidates);
+                    n_lanes[i] = 0;
+                }
+                continue;
+            }
+#endif
+            classify_read(&pairs[p], i, candidates);
+        }
+    }
+    
+#ifdef BATCH_ALIGNMENT_AVAILABLE
+    // Leftovers that don't fill a batch
+    for (i=0; i<2; i++) {
+        if (n_lanes[i] > 0) {
+            classify_lanes(lanes[i], n_lanes[i], i, candidates);
+        }
+    }
+#endif
+    
+    return NULL;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   classify_batch
+ * Purpose:    Find adaptors in all reads of a batch that need it. Pairs
+ *             already in the classification cache are skipped. The
+ *             rest are split between threads.
+ * Parameters: stats -> MPStats structure
+ *             pairs -> batch of read pairs
+ *             n_pairs = number of pairs in batch
+ *             candidates -> array of one adaptor seed hit buffer per
+ *                           thread, or NULL if there are no adaptor
+ *                           variants
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void classify_batch(MPStats* stats, ReadPair* pairs, int n_pairs, AdaptorCandidates** candidates)
+{
+    int p;
+    
+    if (use_pair_cache == true) {
+        for (p=0; p<n_pairs; p++) {
+            if (pairs[p].classify == true) {
+                CachedPair* entry;
+                
+                pair_cache_fingerprint(pairs[p].reads[0].read, pairs[p].reads[0].read_size, pairs[p].reads[1].read, pairs[p].reads[1].read_size, &pairs[p].fingerprint);
+                entry = pair_cache_find(&pair_cache, &pairs[p].fingerprint);
+                if (entry != NULL) {
+                    restore_classification(&pairs[p], entry);
+                    pairs[p].cached = true;
+                }
+            }
+        }
+    }
+    
+    run_batch_stage(classify_chunk, stats, pairs, n_pairs, candidates);
+    
+    if (use_pair_cache == true) {
+        for (p=0; p<n_pairs; p++) {
+            if ((pairs[p].classify == true) && (pairs[p].cached == false)) {
+                cache_classification(&pairs[p]);
+            }
+        }
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   find_external_duplicates
+ * Purpose:    First pass for exact duplicate detection without the
+ *             hash table. Signatures of every pair, each with the
+ *             pair's number, are sorted on disk. Runs of the same
+ *             signature then give the duplication counts, and every
+ *             pair after the first in a run is a duplicate. Their
+ *             numbers are sorted again so the second pass through the
+ *             files can pick them out in order.
+ * Parameters: stats -> MPStats structure
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void find_external_duplicates(MPStats* stats)
+{
+    ExternalSort signatures;
+    ReadPair* pairs;
+    FILE* input_fp[2];
+    char prefix[MAX_PATH_LENGTH];
+    // The signature sorter is still merging while the duplicate sorter fills, so each gets half
+    long int memory_bytes = duplicate_memory * 1024 * 1024 / 2;
+    int words = NUMBER_OF_BITFIELDS_IN_BINARY_KMER + 1;
+    uint64_t record[NUMBER_OF_BITFIELDS_IN_BINARY_KMER + 1];
+    uint64_t previous[NUMBER_OF_BITFIELDS_IN_BINARY_KMER + 1];
+    long int ordinal = 0;
+    long int group_size = 0;
+    long int duplicates = 0;
+    int n_pairs;
+    int i, p;
+    
+    printf("Finding duplicates by sorting signatures in %s...\n", scratch_directory);
+    
+    pairs = malloc(PAIR_BATCH_SIZE * sizeof(ReadPair));
+    external_duplicate_counts = calloc(MAX_EXTERNAL_COUNT + 1, sizeof(long int));
+    if ((pairs == NULL) || (external_duplicate_counts == NULL)) {
+        printf("Error: can't allocate memory for external duplicate detection\n");
+        exit(1);
+    }
+    
+    if (snprintf(prefix, sizeof(prefix), "%s/nextclip_%d_signatures", scratch_directory, (int)getpid()) >= sizeof(prefix)) {
+        printf("Error: scratch directory name too long\n");
+        exit(1);
+    }
+    if (external_sort_initialise(&signatures, prefix, words, memory_bytes, number_of_threads) == false) {
+        printf("Error: can't allocate memory for sorting signatures\n");
+        exit(1);
+    }
+    
+    for (i=0; i<2; i++) {
+        input_fp[i] = fopen(stats->input_filenames[i], "r");
+        if (!input_fp[i]) {
+            printf("Error: can't open file %s\n", stats->input_filenames[i]);
+            exit(2);
+        }
+    }
+    
+    // Pairs are numbered as read_batch will number them on the second pass
+    do {
+        n_pairs = 0;
+        while ((n_pairs < PAIR_BATCH_SIZE) && (!feof(input_fp[0]))) {
+            ReadPair* pair = &pairs[n_pairs];
+            
+            pair->n_reads = 0;
+            for (i=0; i<2; i++) {
+                if (get_read(input_fp[i], &pair->reads[i]) == 1) {
+                    pair->n_reads++;
+                }
+            }
+            
+            if (pair->n_reads == 2) {
+                pair->ordinal = ordinal++;
+                n_pairs++;
+            }
+        }
+        
+        run_batch_stage(find_pcr_duplicates_chunk, stats, pairs, n_pairs, NULL);
+        
+        for (p=0; p<n_pairs; p++) {
+            if (pairs[p].duplicate_valid == true) {
+                for (i=0; i<NUMBER_OF_BITFIELDS_IN_BINARY_KMER; i++) {
+                    record[i] = pairs[p].duplicate_key[i];
+                }
+                record[NUMBER_OF_BITFIELDS_IN_BINARY_KMER] = pairs[p].ordinal;
+                external_sort_add(&signatures, record);
+            }
+        }
+    } while (n_pairs > 0);
+    
+    for (i=0; i<2; i++) {
+        fclose(input_fp[i]);
+    }
+    free(pairs);
+    
+    external_sort_finish(&signatures);
+    printf("Sorted %ld signatures in %d runs\n", signatures.records, signatures.number_of_runs);
+    
+    if (snprintf(prefix, sizeof(prefix), "%s/nextclip_%d_duplicates", scratch_directory, (int)getpid()) >= sizeof(prefix)) {
+        printf("Error: scratch directory name too long\n");
+        exit(1);
+    }
+    if (external_sort_initialise(&duplicate_ordinals, prefix, 1, memory_bytes, number_of_threads) == false) {
+        printf("Error: can't allocate memory for sorting duplicates\n");
+        exit(1);
+    }
+    
+    // Equal signatures come out together, lowest pair number first
+    while (external_sort_next(&signatures, record)) {
+        if ((group_size > 0) && (memcmp(record, previous, NUMBER_OF_BITFIELDS_IN_BINARY_KMER * sizeof(uint64_t)) == 0)) {
+            uint64_t duplicate_ordinal = record[NUMBER_OF_BITFIELDS_IN_BINARY_KMER];
+            external_sort_add(&duplicate_ordinals, &duplicate_ordinal);
+            duplicates++;
+            group_size++;
+        } else {
+            if (group_size > 0) {
+                external_duplicate_counts[group_size < MAX_EXTERNAL_COUNT ? group_size : MAX_EXTERNAL_COUNT]++;
+            }
+            memcpy(previous, record, sizeof(previous));
+            group_size = 1;
+        }
+    }
+    
+    if (group_size > 0) {
+        external_duplicate_counts[group_size < MAX_EXTERNAL_COUNT ? group_size : MAX_EXTERNAL_COUNT]++;
+    }
+    
+    external_sort_free(&signatures);
+    
+    external_sort_finish(&duplicate_ordinals);
+    more_duplicate_ordinals = external_sort_next(&duplicate_ordinals, &next_duplicate_ordinal);
+    printf("Found %ld duplicates\n\n", duplicates);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   read_batch
+ * Purpose:    Read the next batch of pairs, checking IDs and PCR
+ *             duplicates
+ * Parameters: stats -> MPStats structure
+ *             pairs -> batch of PAIR_BATCH_SIZE read pairs
+ * Returns:    Number of pairs read
+ *----------------------------------------------------------------------*/
+int read_batch(MPStats* stats, ReadPair* pairs)
+{
+    int n_pairs = 0;
+    int i;
+    
+    while ((n_pairs < PAIR_BATCH_SIZE) && (!feof(stats->input_fp[0]))) {
+        ReadPair* pair = &pairs[n_pairs];
+        
+        pair->n_reads = 0;
+        pair->classify = false;
+        pair->cached = false;
+        
+        for (i=0; i<2; i++) {
+            if (get_read(stats->input_fp[i], &pair->reads[i]) == 1) {
+                pair->n_reads++;
+            }
+
+            if (stats->read_length == 0) {
+                stats->read_length = strlen(pair->reads[i].read);
+            }
+        }
+        
+        if (pair->n_reads == 2) {
+            // Check read IDs match up
+            check_read_ids(stats, &pair->reads[0], &pair->reads[1]);
+
+            // Count pairs
+            pair->ordinal = stats->num_read_pairs;
+            stats->num_read_pairs++;
+            
+            n_pairs++;
+        } else if (pair->n_reads == 1) {
+            printf("Warning: Only managed to get one read - pair ignored\n");
+        }
+    }
+    
+    // Grow the table before any thread starts adding, so slots stay valid for the batch
+    if ((duplicate_backend == DUPLICATE_BACKEND_HASH) && (duplicate_table_reserve(&duplicate_table, n_pairs, number_of_threads))) {
+        printf("Duplicate table grown to %lu slots\n", duplicate_table.number_of_slots);
+    } else if ((duplicate_backend == DUPLICATE_BACKEND_TOLERANT) && (duplicate_index_reserve(&duplicate_index, n_pairs))) {
+        printf("Duplicate index grown to %lu slots\n", duplicate_index.number_of_slots);
+    }
+    
+    // Handle PCR duplicates - signatures in parallel, table partitions in parallel, then stats in file order
+    run_batch_stage(find_pcr_duplicates_chunk, stats, pairs, n_pairs, NULL);
+    if (duplicate_backend == DUPLICATE_BACKEND_HASH) {
+        add_pcr_duplicates(pairs, n_pairs);
+    }
+    record_pcr_duplicates(stats, pairs, n_pairs);
+    
+    for (i=0; i<n_pairs; i++) {
+        if ((duplicate_only_mode == false) &&
+            ((remove_duplicates == 0) || (pairs[i].is_duplicate == 0))) {
+            pairs[i].classify = true;
+        }
+    }
+    
+    return n_pairs;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   output_pair
+ * Purpose:    Log, count, categorise, trim and write a classified pair
+ * Parameters: stats -> MPStats structure
+ *             pair -> read pair
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void output_pair(MPStats* stats, ReadPair* pair)
+{
+    FastQRead* reads = pair->reads;
+    JunctionAdaptorAlignment* junction_adaptor_alignments = pair->junction_adaptor_alignments;
+    GenericAdaptorAlignment* external_adaptor_alignments = pair->external_adaptor_alignments;
+    int category = -1;
+    int i;
+    
+    if ((remove_duplicates == 1) && (pair->is_duplicate != 0)) {
+        stats->duplicates_not_written++;
+        return;
+    }
+
+    if (stats->log_fp != 0) {
+        fprintf(stats->log_fp, "==================== New read pair ====================\n");
+    }
+    
+    if (duplicate_only_mode == true) {
+        category = 3; // D
+    } else {
+        for (i=0; i<2; i++) {
+            stats->junction_scans++;
+            stats->junction_offsets_evaluated += junction_adaptor_alignments[i].offsets_evaluated;
+            stats->external_scans++;
+            stats->external_offsets_evaluated += external_adaptor_alignments[i].offsets_evaluated;
+
+            if (pair->gapped_junction_rescued[i]) {
+                stats->count_gapped_junction_rescued[i]++;
+            }
+            if (pair->gapped_external_rescued[i]) {
+                stats->count_gapped_external_rescued[i]++;
+            }
+
+            // Display log information
+            if (stats->log_fp != 0) {
+                log_output_alignment(stats, &reads[i], &junction_adaptor_alignments[i], &external_adaptor_alignments[i]);
+            }
+                            
+            // If junction adaptor found...
+            if (junction_adaptor_alignments[i].accepted == 1) {
+                // Count
+                stats->count_adaptor_found[i]++;
+                stats->count_adaptor_hits[junction_adaptor_alignments[i].adaptor_index][i]++;
+                
+                // Trim
+                reads[i].trim_at_base = junction_adaptor_alignments[i].read_start;
+                reads[i].trimmed_for_junction_adaptor = true;
+            } else {
+                if (trim_ends > 0) {
+                    reads[i].trim_at_base = reads[i].read_size - trim_ends;
+                }
+            }
+
+            // If external adaptor found...?
+            if (external_adaptor_alignments[i].accepted == 1) {
+                stats->count_adaptor_hits[external_adaptor_alignments[i].adaptor_index][i]++;
+                
+                if (external_adaptor_alignments[i].read_start < reads[i].trim_at_base) {
+                    reads[i].trim_at_base = external_adaptor_alignments[i].read_start;
+                    reads[i].trimmed_for_external_adaptor = true;
+                    if (reads[i].trimmed_for_junction_adaptor) {
+                        if (stats->log_fp != 0) {
+                            fprintf(stats->log_fp, "                  EXTERNAL ADAPTOR BEFORE JUNCTION ADAPTOR\n");
+                        }
+                    }
+                }
+                
+                if (junction_adaptor_alignments[i].accepted == 1) {
+                    stats->count_adaptor_and_external_found[i]++;
+                } else {
+                    stats->count_external_only_found[i]++;
+                }
+            
+            }
+            
+            if (junction_adaptor_alignments[i].accepted == 1) {
+                if (reads[i].trim_at_base < (minimum_read_size)) {
+                    stats->count_too_short[i]++;
+                } else {
+                    stats->count_long_enough[i]++;
+                }
+            } else {
+                stats->count_no_adaptor[i]++;
+            }
+            
+        }
+        
+        // Decide category (A, B, C, D, E)
+        category = decide_category(stats, &reads[0], &junction_adaptor_alignments[0], &reads[1], &junction_adaptor_alignments[1]);
+        
+        // Keep track of what gapped alignment changed
+        if (gapped_mode == true) {
+            int ungapped_category = category_from_alignments(&pair->ungapped_alignments[0], &pair->ungapped_alignments[1]);
+            stats->count_gapped_category_change[ungapped_category][category]++;
+            if (ungapped_category != category) {
+                stats->count_gapped_category_changed++;
+            }
+        }
+    }
+    
+    // Trim and write reads
+    trim_and_write_pair(stats, category, &reads[0], &reads[1]);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   parse_sweep_values
+ * Purpose:    Parse the values on one line of a sweep grid file
+ * Parameters: line -> rest of line after the setting name
+ *             values -> array to store values in
+ *             pairs = true if values are of the form 'a,b'
+ *             name -> setting name, for error messages
+ * Returns:    Number of values
+ *----------------------------------------------------------------------*/
+int parse_sweep_values(char* line, int* values, boolean pairs, char* name)
+{
+    char* token = strtok(line, " \t\r\n");
+    int n = 0;
+    
+    while (token != NULL) {
+        if (n == MAX_SWEEP_VALUES) {
+            printf("Error: too many values for %s in sweep file (maximum %d)\n", name, MAX_SWEEP_VALUES);
+            exit(1);
+        }
+        
+        if (pairs == true) {
+            if (strchr(token, ',') == 0) {
+                printf("Error: %s values in sweep file are of the format 'a,b'\n", name);
+                exit(1);
+            }
+            parse_csv_params(token, &values[n*2], &values[n*2 + 1]);
+        } else {
+            values[n] = atoi(token);
+        }
+        
+        n++;
+        token = strtok(NULL, " \t\r\n");
+    }
+    
+    if (n == 0) {
+        printf("Error: no values for %s in sweep file\n", name);
+        exit(1);
+    }
+    
+    return n;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   load_sweep_grid
+ * Purpose:    Read a sweep grid file and make a point for every
+ *             combination of the settings in it. Each line is a setting
+ *             name followed by the values to try, eg.
+ *               strict_match 34,18 36,19
+ *               relaxed_match 32,17 30,16
+ *               min_length 25 50
+ *             Settings not in the file keep their command line value.
+ * Parameters: sweep -> Sweep structure
+ *             filename -> grid filename
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void load_sweep_grid(Sweep* sweep, char* filename)
+{
+    FILE* fp;
+    char line[1024];
+    int s, r, m;
+    
+    sweep->n_strict = 1;
+    sweep->strict[0][0] = strict_double_match;
+    sweep->strict[0][1] = strict_single_match;
+    sweep->n_relaxed = 1;
+    sweep->relaxed[0][0] = relaxed_double_match;
+    sweep->relaxed[0][1] = relaxed_single_match;
+    sweep->n_minimum = 1;
+    sweep->minimum[0] = minimum_read_size;
+    
+    fp = fopen(filename, "r");
+    if (!fp) {
+        printf("Error: can't open sweep file %s\n", filename);
+        exit(2);
+    }
+    
+    while (fgets(line, 1024, fp)) {
+        char* name = strtok(line, " \t\r\n");
+        char* values = strtok(NULL, "");
+        
+        if ((name == NULL) || (name[0] == '#')) {
+            continue;
+        }
+        
+        if (values == NULL) {
+            values = "";
+        }
+        
+        if (strcmp(name, "strict_match") == 0) {
+            sweep->n_strict = parse_sweep_values(values, &sweep->strict[0][0], true, name);
+        } else if (strcmp(name, "relaxed_match") == 0) {
+            sweep->n_relaxed = parse_sweep_values(values, &sweep->relaxed[0][0], true, name);
+        } else if (strcmp(name, "min_length") == 0) {
+            sweep->n_minimum = parse_sweep_values(values, sweep->minimum, false, name);
+        } else {
+            printf("Error: unknown setting %s in sweep file\n", name);
+            exit(1);
+        }
+    }
+    
+    fclose(fp);
+    
+    sweep->n_points = sweep->n_strict * sweep->n_relaxed * sweep->n_minimum;
+    sweep->points = calloc(sweep->n_points, sizeof(SweepPoint));
+    sweep->offset_matches[0] = malloc(MAX_READ_LENGTH + 2 * MAX_ADAPTOR_LENGTH);
+    sweep->offset_matches[1] = malloc(MAX_READ_LENGTH + 2 * MAX_ADAPTOR_LENGTH);
+    sweep->padded_read = calloc(MAX_READ_LENGTH + 4 * MAX_ADAPTOR_LENGTH, sizeof(char));
+    if ((sweep->points == NULL) || (sweep->offset_matches[0] == NULL) || (sweep->offset_matches[1] == NULL) || (sweep->padded_read == NULL)) {
+        printf("Error: can't allocate memory for sweep\n");
+        exit(1);
+    }
+    
+    for (s=0; s<sweep->n_strict; s++) {
+        for (r=0; r<sweep->n_relaxed; r++) {
+            for (m=0; m<sweep->n_minimum; m++) {
+                SweepPoint* point = &sweep->points[(s * sweep->n_relaxed + r) * sweep->n_minimum + m];
+                point->strict_index = s;
+                point->strict_double_match = sweep->strict[s][0];
+                point->strict_single_match = sweep->strict[s][1];
+                point->relaxed_double_match = sweep->relaxed[r][0];
+                point->relaxed_single_match = sweep->relaxed[r][1];
+                point->minimum_read_size = sweep->minimum[m];
+            }
+        }
+    }
+    
+    printf("Sweeping %d settings from %s\n", sweep->n_points, filename);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   count_offset_matches
+ * Purpose:    Count matching bases of a sequence at a range of offsets
+ *             in a read, split into the bases before and after a point
+ *             in the sequence
+ * Parameters: padded -> read with 2 * MAX_ADAPTOR_LENGTH bases of
+ *                       padding each side that match nothing
+ *             sequence -> sequence to align
+ *             length = length of sequence
+ *             split = position in sequence where second count starts
+ *             first_x = first offset in read
+ *             last_x = offset after the last one to count
+ *             counts -> two arrays of match counts, indexed from first_x
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void count_offset_matches(char* padded, char* sequence, int length, int split, int first_x, int last_x, uint8_t* counts[2])
+{
+    char* window = padded + 2 * MAX_ADAPTOR_LENGTH + first_x;
+    int n = last_x - first_x;
+    int x, p;
+    
+    if (n <= 0) {
+        return;
+    }
+    
+    memset(counts[0], 0, n);
+    memset(counts[1], 0, n);
+    
+    // Going along the read for each base of the sequence, rather than the other way round, gives long
+    // inner loops that vectorise well. The padding means no offset needs its own bounds check.
+    for (p=0; p<length; p++) {
+        uint8_t* count = counts[p < split ? 0:1];
+        char base = sequence[p];
+        
+        for (x=0; x<n; x++) {
+            count[x] += window[x+p] == base;
+        }
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   junction_alignment_rank
+ * Purpose:    Give a junction alignment a rank that orders alignments
+ *             the same way as junction_alignment_is_better - double
+ *             matches by score, then single matches by bases of one
+ *             adaptor and score, then the rest by score. Working with
+ *             ranks avoids the branches of comparing alignments.
+ * Parameters: match_one = matches to first part of adaptor
+ *             match_two = matches to second part of adaptor
+ * Returns:    Rank, higher is better
+ *----------------------------------------------------------------------*/
+static inline int junction_alignment_rank(int match_one, int match_two)
+{
+    int score = match_one + match_two;
+    int best_match = match_one > match_two ? match_one : match_two;
+    
+    if (score >= strict_double_match) {
+        return (2 << 16) | (score << 8);
+    }
+    
+    if (best_match >= strict_single_match) {
+        return (1 << 16) | (best_match << 8) | score;
+    }
+    
+    return score;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   sweep_read
+ * Purpose:    Find the junction and external adaptor alignments a read
+ *             would get under each strict setting of the sweep. Bases
+ *             are only compared once - each setting then just replays
+ *             the choice of best offset on the stored match counts.
+ * Parameters: sweep -> Sweep structure
+ *             read -> read
+ *             i = 0 for R1, 1 for R2
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void sweep_read(Sweep* sweep, FastQRead* read, int i)
+{
+    Adaptor* junction_adaptor = &adaptor_set.adaptors[adaptor_set.primary_junction];
+    int external = adaptor_set.primary_external[i];
+    Adaptor* external_adaptor = &adaptor_set.adaptors[external];
+    int saved_double_match = strict_double_match;
+    int saved_single_match = strict_single_match;
+    int first_x = -junction_adaptor->length + 5;
+    int best_score;
+    int best_x;
+    int s, x;
+    
+    // Padding either side is zeroed, so never matches an adaptor base
+    memcpy(sweep->padded_read + 2 * MAX_ADAPTOR_LENGTH, read->read, read->read_size);
+    memset(sweep->padded_read + 2 * MAX_ADAPTOR_LENGTH + read->read_size, 0, 2 * MAX_ADAPTOR_LENGTH);
+    
+    // Junction adaptor - the best offset depends on the strict setting. Only the match counts matter while
+    // choosing, so the full alignment is filled in once at the end.
+    count_offset_matches(sweep->padded_read, junction_adaptor->sequence, junction_adaptor->length, junction_adaptor->half_length, first_x, read->read_size-5, sweep->offset_matches);
+    
+    for (s=0; s<sweep->n_strict; s++) {
+        JunctionAdaptorAlignment* result = &sweep->junction_adaptor_alignments[s][i];
+        
+        strict_double_match = sweep->strict[s][0];
+        strict_single_match = sweep->strict[s][1];
+        
+        best_x = first_x - 1;
+        best_score = -1;
+        
+        for (x=first_x; x<read->read_size-5; x++) {
+            int rank = junction_alignment_rank(sweep->offset_matches[0][x - first_x], sweep->offset_matches[1][x - first_x]);
+            if (rank > best_score) {
+                best_score = rank;
+                best_x = x;
+            }
+        }
+        
+        initialise_junction_adaptor_alignment(result);
+        result->read_size = read->read_size;
+        if (best_x >= first_x) {
+            evaluate_junction_offset(read, adaptor_set.primary_junction, best_x, result);
+        }
+        finish_junction_alignment(result);
+    }
+    
+    strict_double_match = saved_double_match;
+    strict_single_match = saved_single_match;
+    
+    // External adaptor - the best offset is the same whatever the strict setting, as the junction
+    // adaptor only decides where the read gets trimmed
+    first_x = -external_adaptor->length + 5;
+    count_offset_matches(sweep->padded_read, external_adaptor->sequence, external_adaptor->length, external_adaptor->length, first_x, read->read_size-5, sweep->offset_matches);
+    best_x = first_x - 1;
+    best_score = 0;
+    
+    for (x=first_x; x<read->read_size-5; x++) {
+        if (sweep->offset_matches[0][x - first_x] > best_score) {
+            best_score = sweep->offset_matches[0][x - first_x];
+            best_x = x;
+        }
+    }
+    
+    for (s=0; s<sweep->n_strict; s++) {
+        GenericAdaptorAlignment* result = &sweep->external_adaptor_alignments[s][i];
+        
+        initialise_generic_adaptor_alignment(result);
+        result->read_size = read->read_size;
+        if (best_x >= first_x) {
+            evaluate_sequence_offset(read, external_adaptor->sequence, external_adaptor->length, external, best_x, result);
+        }
+        result->adaptor_index = external;
+        external_check(result);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   sweep_pair
+ * Purpose:    Work out the category and trimmed lengths of a pair at
+ *             every point of the sweep, as output_pair would
+ * Parameters: sweep -> Sweep structure
+ *             pair -> read pair
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void sweep_pair(Sweep* sweep, ReadPair* pair)
+{
+    int g, i;
+    
+    for (i=0; i<2; i++) {
+        sweep_read(sweep, &pair->reads[i], i);
+    }
+    
+    for (g=0; g<sweep->n_points; g++) {
+        SweepPoint* point = &sweep->points[g];
+        JunctionAdaptorAlignment* junction = sweep->junction_adaptor_alignments[point->strict_index];
+        GenericAdaptorAlignment* external = sweep->external_adaptor_alignments[point->strict_index];
+        int trim_at_base[2];
+        int category;
+        
+        for (i=0; i<2; i++) {
+            trim_at_base[i] = pair->reads[i].read_size;
+            if (junction[i].accepted == 1) {
+                trim_at_base[i] = junction[i].read_start;
+            } else if (trim_ends > 0) {
+                trim_at_base[i] = pair->reads[i].read_size - trim_ends;
+            }
+            
+            if ((external[i].accepted == 1) && (external[i].read_start < trim_at_base[i])) {
+                trim_at_base[i] = external[i].read_start;
+            }
+        }
+        
+        if ((junction[0].accepted == 1) && (junction[1].accepted == 1)) {
+            category = 0;
+        } else if ((junction[0].accepted == 1) || (junction[1].accepted == 1)) {
+            // Category B if only R2 has the adaptor, C if only R1 - E if a relaxed check finds it in the other
+            int other = junction[0].accepted == 1 ? 1:0;
+            
+            category = other == 0 ? 1:2;
+            if ((use_category_e == 1) &&
+                ((junction[other].total_matches >= point->relaxed_double_match) ||
+                 (junction[other].matches[0] >= point->relaxed_single_match) ||
+                 (junction[other].matches[1] >= point->relaxed_single_match))) {
+                if (junction[other].read_start < trim_at_base[other]) {
+                    trim_at_base[other] = junction[other].read_start;
+                }
+                category = 4;
+            }
+        } else {
+            category = 3;
+        }
+        
+        point->count_by_category[category]++;
+        
+        if ((trim_at_base[0] >= point->minimum_read_size) && (trim_at_base[1] >= point->minimum_read_size)) {
+            point->count_by_category_long_enough[category]++;
+            if (category != 3) {
+                point->usable_pairs++;
+                point->usable_bases += trim_at_base[0] + trim_at_base[1];
+            }
+        }
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   output_sweep
+ * Purpose:    Write a TSV file of results for each point of the sweep
+ * Parameters: stats -> MPStats structure
+ *             sweep -> Sweep structure
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void output_sweep(MPStats* stats, Sweep* sweep)
+{
+    FILE* fp;
+    char filename[MAX_PATH_LENGTH];
+    int g, i;
+    
+    if (snprintf(filename, sizeof(filename), "%s_sweep.txt", stats->output_prefix) >= sizeof(filename)) {
+        printf("Error: output prefix too long\n");
+        exit(1);
+    }
+    printf("\nWriting sweep results to %s\n", filename);
+    
+    fp = fopen(filename, "w");
+    if (!fp) {
+        printf("Error: can't open %s\n", filename);
+        exit(2);
+    }
+    
+    fprintf(fp, "StrictDouble\tStrictSingle\tRelaxedDouble\tRelaxedSingle\tMinLength");
+    for (i=0; i<num_categories; i++) {
+        fprintf(fp, "\t%cPairs\t%cLongEnough", 'A'+i, 'A'+i);
+    }
+    fprintf(fp, "\tUsablePairs\tUsablePercent\tUsableBases\n");
+    
+    for (g=0; g<sweep->n_points; g++) {
+        SweepPoint* point = &sweep->points[g];
+        
+        fprintf(fp, "%d\t%d\t%d\t%d\t%d", point->strict_double_match, point->strict_single_match, point->relaxed_double_match, point->relaxed_single_match, point->minimum_read_size);
+        for (i=0; i<num_categories; i++) {
+            fprintf(fp, "\t%ld\t%ld", point->count_by_category[i], point->count_by_category_long_enough[i]);
+        }
+        fprintf(fp, "\t%ld\t%.2f\t%ld\n", point->usable_pairs, stats->num_read_pairs > 0 ? (100.0 * point->usable_pairs) / stats->num_read_pairs : 0, point->usable_bases);
+    }
+    
+    fclose(fp);
+    
+    free(sweep->points);
+    free(sweep->offset_matches[0]);
+    free(sweep->offset_matches[1]);
+    free(sweep->padded_read);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   process_files
+ * Purpose:    Main function to process FASTQ files. Pairs are read in
+ *             batches, so that adaptor finding can work on many reads
+ *             at once, then output in the order they were read.
+ * Parameters: stats -> MPStats structure
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void process_files(MPStats* stats)
+{
+    ReadPair* pairs;
+    AdaptorCandidates* candidates[MAX_THREADS];
+    boolean use_candidates = false;
+    int n_pairs;
+    int i, j;
+    
+    pairs = malloc(PAIR_BATCH_SIZE * sizeof(ReadPair));
+    if (pairs == NULL) {
+        printf("Error: can't allocate memory for read batch\n");
+        exit(1);
+    }
+    
+    // Each thread needs its own buffer for adaptor seed hits
+    if (adaptor_set.number_of_variants > 0) {
+        for (i=0; i<number_of_threads; i++) {
+            candidates[i] = calloc(1, sizeof(AdaptorCandidates));
+            if (candidates[i] == NULL) {
+                printf("Error: can't allocate memory for adaptor candidates\n");
+                exit(1);
+            }
+        }
+        use_candidates = true;
+    }
+    
+    // The log shows full alignments, which the cache doesn't keep
+    if ((pair_cache_size > 0) && (stats->log_filename[0] == 0) && (duplicate_only_mode == false) && (sweep_filename[0] == 0)) {
+        if (pair_cache_initialise(&pair_cache, pair_cache_size) == false) {
+            printf("Error: can't allocate memory for classification cache\n");
+            exit(1);
+        }
+        use_pair_cache = true;
+    }
+    
+    if (stats->log_filename[0] != 0) {
+        stats->log_fp = fopen(stats->log_filename, "w");
+        if (!stats->log_fp) {
+            printf("Error: Can't open %s\n", stats->log_filename);
             exit(102);
         }
     }
@@ -1344,9 +3914,10 @@ void process_files(MPStats* stats)
         }
     }
 
-    // Open output files
+    // Open output files - a sweep doesn't write any reads
     for (i=0; i<num_categories; i++) {
-        if ((duplicate_only_mode == false) || ((duplicate_only_mode == true) && (i == 3))) {
+        if ((sweep_filename[0] == 0) &&
+            ((duplicate_only_mode == false) || ((duplicate_only_mode == true) && (i == 3)))) {
             for (j=0; j<2; j++) {
                 char filename[MAX_PATH_LENGTH];
                 sprintf(filename, "%s_R%d.fastq", stats->output_filenames[i], j+1);
@@ -1360,112 +3931,21 @@ void process_files(MPStats* stats)
         }
     }
     
-    // Read each entry in FASTQ files
-    while (!feof(stats->input_fp[0])) {
-        // Go next pair of reads
-        int n_reads = 0;
-        int category = -1;
-        
-        for (i=0; i<2; i++) {
-            if (get_read(stats->input_fp[i], &reads[i]) == 1) {
-                n_reads++;
-            }
-
-            if (stats->read_length == 0) {
-                stats->read_length = strlen(reads[i].read);
+    // Read each batch of pairs, find adaptors, then write out
+    while ((n_pairs = read_batch(stats, pairs)) > 0) {
+        if (sweep_filename[0] != 0) {
+            for (i=0; i<n_pairs; i++) {
+                if (pairs[i].classify == true) {
+                    sweep_pair(&sweep, &pairs[i]);
+                }
             }
+            continue;
         }
         
-        // Process pair
-        if (n_reads == 2) {
-            // Check read IDs match up
-            check_read_ids(stats, &reads[0], &reads[1]);
-
-            // Count pairs
-            stats->num_read_pairs++;
-            
-            // Handle PCR duplicates
-            is_duplicate = check_pcr_duplicates(&reads[0], &reads[1], stats);
-            
-            if ((remove_duplicates == 0) ||
-                ((remove_duplicates == 1) && (is_duplicate == 0))) {
-
-                if (stats->log_fp != 0) {
-                    fprintf(stats->log_fp, "==================== New read pair ====================\n");
-                }
-                
-                if (duplicate_only_mode == true) {
-                    category = 3; // D
-                } else {
-                    for (i=0; i<2; i++) {
-                        // Find junction adaptor
-                        find_junction_adaptors(&reads[i], &junction_adaptor_alignments[i]);
-
-                        // Look for external adaptor
-                        find_sequence_in_read(&reads[i], external_adaptors[i], &external_adaptor_alignments[i]);
-
-                        // Display log information
-                        if (stats->log_fp != 0) {
-                            log_output_alignment(stats, &reads[i], &junction_adaptor_alignments[i], &external_adaptor_alignments[i]);
-                        }
-                                        
-                        // If junction adaptor found...
-                        if (junction_adaptor_alignments[i].accepted == 1) {
-                            // Count
-                            stats->count_adaptor_found[i]++;
-                            
-                            // Trim
-                            reads[i].trim_at_base = junction_adaptor_alignments[i].read_start;
-                            reads[i].trimmed_for_junction_adaptor = true;
-                        } else {
-                            if (trim_ends > 0) {
-                                reads[i].trim_at_base = reads[i].read_size - trim_ends;
-                            }
-                        }
-
-                        // If external adaptor found...?
-                        if (external_adaptor_alignments[i].accepted == 1) {
-                            if (external_adaptor_alignments[i].read_start < reads[i].trim_at_base) {
-                                reads[i].trim_at_base = external_adaptor_alignments[i].read_start;
-                                reads[i].trimmed_for_external_adaptor = true;
-                                if (reads[i].trimmed_for_junction_adaptor) {
-                                    if (stats->log_fp != 0) {
-                                        fprintf(stats->log_fp, "                  EXTERNAL ADAPTOR BEFORE JUNCTION ADAPTOR\n");
-                                    }
-                                }
-                            }
-                            
-                            if (junction_adaptor_alignments[i].accepted == 1) {
-                                stats->count_adaptor_and_external_found[i]++;
-                            } else {
-                                stats->count_external_only_found[i]++;
-                            }
-                        
-                        }
-                        
-                        if (junction_adaptor_alignments[i].accepted == 1) {
-                            if (reads[i].trim_at_base < (minimum_read_size)) {
-                                stats->count_too_short[i]++;
-                            } else {
-                                stats->count_long_enough[i]++;
-                            }
-                        } else {
-                            stats->count_no_adaptor[i]++;
-                        }
-                        
-                    }
-                    
-                    // Decide category (A, B, C, D, E)
-                    category = decide_category(stats, &reads[0], &junction_adaptor_alignments[0], &reads[1], &junction_adaptor_alignments[1]);
-                }
-                
-                // Trim and write reads
-                trim_and_write_pair(stats, category, &reads[0], &reads[1]);
-            } else {
-                stats->duplicates_not_written++;
-            }
-        } else if (n_reads == 1) {
-            printf("Warning: Only managed to get one read - pair ignored\n");
+        classify_batch(stats, pairs, n_pairs, use_candidates == true ? candidates : NULL);
+        
+        for (i=0; i<n_pairs; i++) {
+            output_pair(stats, &pairs[i]);
         }
     }
     
@@ -1475,38 +3955,196 @@ void process_files(MPStats* stats)
     }
     
     for (i=0; i<num_categories; i++) {
-        if ((duplicate_only_mode == false) || ((duplicate_only_mode == true) && (i == 3))) {
+        if ((sweep_filename[0] == 0) &&
+            ((duplicate_only_mode == false) || ((duplicate_only_mode == true) && (i == 3)))) {
             for (j=0; j<2; j++) {
                 fclose(stats->output_fp[i][j]);
             }
         }
-    }
-    
-    if (stats->log_fp != 0) {
-        fprintf(stats->log_fp, "\nDONE\n");
-        fclose(stats->log_fp);
-    }
-    
-    if (stats->duplicates_fp != 0) {
-        fclose(stats->duplicates_fp);
+    }
+    
+    if (stats->log_fp != 0) {
+        fprintf(stats->log_fp, "\nDONE\n");
+        fclose(stats->log_fp);
+    }
+    
+    if (stats->duplicates_fp != 0) {
+        fclose(stats->duplicates_fp);
+    }
+    
+    if (use_candidates == true) {
+        for (i=0; i<number_of_threads; i++) {
+            free(candidates[i]);
+        }
+    }
+    
+    stop_batch_workers();
+    pair_cache_free(&pair_cache);
+    free(pairs);
+    
+    if (duplicate_backend == DUPLICATE_BACKEND_EXTERNAL) {
+        external_sort_free(&duplicate_ordinals);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   adaptor_seed_size
+ * Purpose:    Work out the longest seed that every acceptable variant
+ *             alignment is guaranteed to contain. An alignment with m
+ *             matches and at most e mismatches has a run of at least
+ *             ceil(m / (e+1)) consecutive matches. The thresholds are
+ *             absolute, so a long junction variant can be accepted
+ *             with so many mismatches that no seed is guaranteed -
+ *             those are rejected rather than scanned with tiny seeds.
+ * Parameters: None
+ * Returns:    Seed size
+ *----------------------------------------------------------------------*/
+int adaptor_seed_size(void)
+{
+    int seed_size = MAXIMUM_SEED_SIZE;
+    int i, j;
+    
+    for (i=0; i<adaptor_set.number_of_adaptors; i++) {
+        Adaptor* adaptor = &adaptor_set.adaptors[i];
+        
+        if (!adaptor_set_is_variant(&adaptor_set, i)) {
+            continue;
+        }
+        
+        if (adaptor->type == ADAPTOR_JUNCTION) {
+            int thresholds[4][2] = {{strict_double_match, adaptor->length},
+                                    {relaxed_double_match, adaptor->length},
+                                    {strict_single_match, adaptor->half_length},
+                                    {relaxed_single_match, adaptor->half_length}};
+            
+            for (j=0; j<4; j++) {
+                int m = thresholds[j][0];
+                int e = thresholds[j][1] - m;
+                int run = e < 0 ? m : (m + e) / (e + 1);
+                
+                if (run < MINIMUM_SEED_SIZE) {
+                    printf("Error: junction variant %s is too long for the match thresholds - %d matches in %d bases only guarantees a run of %d.\n", adaptor->name, m, thresholds[j][1], run);
+                    printf("Raise the thresholds with -x and -y, or shorten the variant.\n");
+                    exit(1);
+                }
+                
+                if (run < seed_size) {
+                    seed_size = run;
+                }
+            }
+        } else {
+            // external_check needs > 20 bases at > 90% identity - at worst 19 matches and 2 mismatches
+            if (7 < seed_size) {
+                seed_size = 7;
+            }
+        }
+    }
+    
+    return seed_size;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   set_adaptor_seed_hits
+ * Purpose:    Work out how many seeds an acceptable alignment of each
+ *             variant must share with a read. Each mismatch spoils at
+ *             most k of the k-mers of an alignment, so L bases with e
+ *             mismatches keep at least L - k + 1 - k*e of them. Fewer
+ *             bases in the read allows fewer mismatches, so the full
+ *             length gives the bound. Gapped rescue starts from the best
+ *             ungapped alignment even when it isn't acceptable, and an
+ *             indel splits the seeds over two diagonals, so in gapped
+ *             mode every seeded diagonal is still scored.
+ * Parameters: seed_size = k-mer size of seeds
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void set_adaptor_seed_hits(int seed_size)
+{
+    int i, j;
+    
+    for (i=0; i<adaptor_set.number_of_adaptors; i++) {
+        Adaptor* adaptor = &adaptor_set.adaptors[i];
+        int hits = MAX_ADAPTOR_CANDIDATES;
+        
+        if (!adaptor_set_is_variant(&adaptor_set, i)) {
+            continue;
+        }
+        
+        if (adaptor->type == ADAPTOR_JUNCTION) {
+            int thresholds[4][2] = {{strict_double_match, adaptor->length},
+                                    {relaxed_double_match, adaptor->length},
+                                    {strict_single_match, adaptor->half_length},
+                                    {relaxed_single_match, adaptor->half_length}};
+            
+            for (j=0; j<4; j++) {
+                int length = thresholds[j][1];
+                int e = length - thresholds[j][0];
+                
+                if ((e >= 0) && (length - seed_size + 1 - seed_size * e < hits)) {
+                    hits = length - seed_size + 1 - seed_size * e;
+                }
+            }
+        } else {
+            // > 90% identity allows (length - 1) / 10 mismatches
+            for (j=21; j<=adaptor->length; j++) {
+                int e = (j - 1) / 10;
+                
+                if (j - seed_size + 1 - seed_size * e < hits) {
+                    hits = j - seed_size + 1 - seed_size * e;
+                }
+            }
+        }
+        
+        // No threshold can be met, or every diagonal qualifies - keep them all
+        if ((gapped_mode == true) || (hits < 1) || (hits == MAX_ADAPTOR_CANDIDATES)) {
+            hits = 1;
+        }
+        
+        adaptor->minimum_hits = hits;
     }
 }
 
 /*----------------------------------------------------------------------*
  * Function:   process_adaptor
- * Purpose:    Make double junction adaptor from adaptor and reverse
+ * Purpose:    Build the adaptor set, load any adaptor set file and make
+ *             double junction adaptor from adaptor and reverse
  * Parameters: None
  * Returns:    None
  *----------------------------------------------------------------------*/
 void process_adaptor(void)
 {
-    char reverse[1024];
-
-    reverse_compliment(single_junction_adaptor, reverse);
-    strcpy(duplicate_junction_adaptor, single_junction_adaptor);
-    strcat(duplicate_junction_adaptor, reverse);
+    int i;
+    
+    adaptor_set_initialise(&adaptor_set);
+    
+    if (adaptor_set_filename[0] != 0) {
+        adaptor_set_load(&adaptor_set, adaptor_set_filename);
+    }
+    
+    // Anything not given in the adaptor set file comes from the defaults/command line
+    if (adaptor_set.primary_junction == -1) {
+        adaptor_set_add(&adaptor_set, "junction", ADAPTOR_JUNCTION, ADAPTOR_READ_ONE | ADAPTOR_READ_TWO, single_junction_adaptor);
+    }
+    
+    for (i=0; i<2; i++) {
+        if (adaptor_set.primary_external[i] == -1) {
+            char name[32];
+            sprintf(name, "external_r%d", i+1);
+            adaptor_set_add(&adaptor_set, name, ADAPTOR_EXTERNAL, 1 << i, external_adaptors[i]);
+        }
+        external_adaptors[i] = adaptor_set.adaptors[adaptor_set.primary_external[i]].sequence;
+    }
+    
+    strcpy(duplicate_junction_adaptor, adaptor_set.adaptors[adaptor_set.primary_junction].sequence);
+    strncpy(single_junction_adaptor, duplicate_junction_adaptor, adaptor_set.adaptors[adaptor_set.primary_junction].half_length);
+    single_junction_adaptor[adaptor_set.adaptors[adaptor_set.primary_junction].half_length] = 0;
 
     printf("Adaptor: %s\n\n", duplicate_junction_adaptor);
+    
+    if (adaptor_set.number_of_variants > 0) {
+        adaptor_set_compile(&adaptor_set, adaptor_seed_size());
+        set_adaptor_seed_hits(adaptor_set.seed_size);
+        printf("Adaptor set: %d adaptors, %d variants, seed size %d\n\n", adaptor_set.number_of_adaptors, adaptor_set.number_of_variants, adaptor_set.seed_size);
+    }
 }
 
 /*----------------------------------------------------------------------*
@@ -1643,6 +4281,49 @@ void calculate_stats(MPStats* stats)
     }
 }
 
+/*----------------------------------------------------------------------*
+ * Function:   report_mate_swapped_duplicates
+ * Purpose:    Report how many duplicates were only found because the
+ *             signature ignores which read is which
+ * Parameters: stats -> MPStats structure
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void report_mate_swapped_duplicates(MPStats* stats)
+{
+    if ((signature_type & SIGNATURE_MATE_SWAP) == 0) {
+        return;
+    }
+    
+    // The singleton filter doesn't keep which way round the first copy was
+    if ((duplicate_backend == DUPLICATE_BACKEND_HASH) && (singleton_memory == 0)) {
+        printf(" Mate swapped duplicate pairs: %ld\t%.2f %%\n", stats->n_mate_swapped_duplicates, (100.0 * stats->n_mate_swapped_duplicates) / stats->num_read_pairs);
+    } else {
+        printf(" Mate swapped duplicate pairs: only counted with the duplicate table, without -B\n");
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   report_optical_duplicates
+ * Purpose:    Split the duplicate count into optical and PCR duplicates
+ * Parameters: stats -> MPStats structure
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void report_optical_duplicates(MPStats* stats)
+{
+    long int pcr_duplicates = stats->n_duplicates - stats->n_optical_duplicates;
+    
+    if (optical_distance == 0) {
+        return;
+    }
+    
+    if (pcr_duplicates < 0) {
+        pcr_duplicates = 0;
+    }
+    
+    printf("     Optical duplicate pairs: %ld\t%.2f %%\n", stats->n_optical_duplicates, (100.0 * stats->n_optical_duplicates) / stats->num_read_pairs);
+    printf("         PCR duplicate pairs: %ld\t%.2f %%\n", pcr_duplicates, (100.0 * pcr_duplicates) / stats->num_read_pairs);
+}
+
 /*----------------------------------------------------------------------*
  * Function:   report_stats
  * Purpose:    Output report of stats
@@ -1665,6 +4346,21 @@ void report_stats(MPStats* stats)
     printf("\n");
     printf("        Number of read pairs: %d\n", stats->num_read_pairs);
     printf("   Number of duplicate pairs: %d\t%.2f %%\n", stats->n_duplicates, stats->percent_duplicates);
+    if (duplicate_backend == DUPLICATE_BACKEND_FILTER) {
+        printf("  Estimated false duplicates: %.0f\t%.4f %%\n", duplicate_filter.expected_false_matches, (100.0 * duplicate_filter.expected_false_matches) / stats->num_read_pairs);
+    } else if (duplicate_backend == DUPLICATE_BACKEND_TOLERANT) {
+        printf("  Estimated false duplicates: %.0f\t%.4f %%\n", duplicate_index.expected_false_matches, (100.0 * duplicate_index.expected_false_matches) / stats->num_read_pairs);
+    } else if (singleton_memory > 0) {
+        printf("  Estimated false duplicates: %.0f\t%.4f %%\n", singleton_filter.expected_false_matches, (100.0 * singleton_filter.expected_false_matches) / stats->num_read_pairs);
+    }
+    report_mate_swapped_duplicates(stats);
+    report_optical_duplicates(stats);
+    printf("      Estimated unique pairs: %.0f\t(+/- %.1f %%)\n", stats->estimated_unique_pairs, 100.0 * hyperloglog_standard_error());
+    if (stats->estimated_library_size > 0) {
+        printf("      Estimated library size: %.0f\n", stats->estimated_library_size);
+    } else {
+        printf("      Estimated library size: too few duplicates to estimate\n");
+    }
     printf("Number of pairs containing N: %ld\t%.2f %%\n", stats->pairs_containing_n, stats->percent_pairs_containing_n);
     
     for (i=0; i<2; i++) {
@@ -1703,6 +4399,42 @@ void report_stats(MPStats* stats)
 
     printf("          Overall GC content: %.2f %%\n", stats->percent_gc);
     
+    if (stats->junction_scans > 0) {
+        printf("\n");
+        printf("  Junction offsets per read: %.1f\n", (double)stats->junction_offsets_evaluated / (double)stats->junction_scans);
+        printf("  External offsets per read: %.1f\n", (double)stats->external_offsets_evaluated / (double)stats->external_scans);
+    }
+    
+    if ((use_pair_cache == true) && (pair_cache.lookups > 0)) {
+        printf("  Classification cache hits: %ld\t%.2f %%\n", pair_cache.hits, (100.0 * pair_cache.hits) / pair_cache.lookups);
+    }
+    
+    if (adaptor_set_filename[0] != 0) {
+        printf("\n");
+        printf("Adaptor hits (R1, R2):\n");
+        for (i=0; i<adaptor_set.number_of_adaptors; i++) {
+            printf("%28s: %d\t%d\n", adaptor_set.adaptors[i].name, stats->count_adaptor_hits[i][0], stats->count_adaptor_hits[i][1]);
+        }
+    }
+    
+    if (gapped_mode == true) {
+        int j;
+
+        printf("\n");
+        for (i=0; i<2; i++) {
+            printf("R%d junction rescued by gapped: %d\n", i+1, stats->count_gapped_junction_rescued[i]);
+            printf("R%d external rescued by gapped: %d\n", i+1, stats->count_gapped_external_rescued[i]);
+        }
+        printf("   Pairs changed by gapped mode: %d\t%.2f %%\n", stats->count_gapped_category_changed, (100.0 * stats->count_gapped_category_changed) / stats->num_read_pairs);
+        for (i=0; i<num_categories; i++) {
+            for (j=0; j<num_categories; j++) {
+                if ((i != j) && (stats->count_gapped_category_change[i][j] > 0)) {
+                    printf("             Category %c became %c: %d\n", 'A'+i, 'A'+j, stats->count_gapped_category_change[i][j]);
+                }
+            }
+        }
+    }
+    
     printf("\n");
 }
 
@@ -1776,32 +4508,6 @@ void output_histograms(MPStats* stats)
  * Parameters: stats -> MPStats structure
  * Returns:    None
  *----------------------------------------------------------------------*/
-#ifdef USE_MULTIPLE_HASHES
-void calculate_pcr_duplicate_stats(MPStats* stats)
-{
-    int n_duplicates;
-    double pc_duplicates;
-    int t;
-
-    void store_duplicates(Element * node) {
-        if (node->count > 1) {
-            n_duplicates+=(node->count-1);
-        } 
-    }
-
-    printf("\n");
-    for (t=0; t<3; t++) {
-        printf("Counting duplicates for table %d\n", t);
-        hash_table_print_stats(kmer_hashes[t]);
-        n_duplicates=0;
-        hash_table_traverse(&store_duplicates, kmer_hashes[t]);
-        pc_duplicates=(double)((100.0*n_duplicates)/(double)stats->num_read_pairs);
-        printf("\nDuplicates: %d (%.2f %%)\n", n_duplicates, pc_duplicates);
-    }
- 
-    stats->percent_duplicates=(double)((100.0*stats->n_duplicates)/(double)stats->num_read_pairs);
-}
-#else
 void calculate_pcr_duplicate_stats(MPStats* stats)
 {
     FILE* fp;
@@ -1816,9 +4522,7 @@ void calculate_pcr_duplicate_stats(MPStats* stats)
         exit(1);
     }
     
-    void store_duplicates(Element * node) {
-        int count = node->count;
-
+    void store_count(int count) {
         if (count > largest_count) {
             largest_count = count;
         }
@@ -1837,7 +4541,20 @@ void calculate_pcr_duplicate_stats(MPStats* stats)
     }
     
     printf("\n");
-    hash_table_print_stats(duplicate_hash);
+    if (duplicate_backend == DUPLICATE_BACKEND_FILTER) {
+        duplicate_filter_print_stats(&duplicate_filter);
+    } else if (duplicate_backend == DUPLICATE_BACKEND_TOLERANT) {
+        duplicate_index_print_stats(&duplicate_index);
+    } else if (duplicate_backend == DUPLICATE_BACKEND_HASH) {
+        if (singleton_memory > 0) {
+            singleton_filter_print_stats(&singleton_filter);
+        }
+        duplicate_table_print_stats(&duplicate_table);
+    }
+    if (optical_distance > 0) {
+        printf("\n");
+        optical_grid_print_stats(&optical_grid);
+    }
     printf("\nCounting duplicates...\n");
     
     for (i=0; i<MAX_DUPLICATES; i++) {
@@ -1846,7 +4563,34 @@ void calculate_pcr_duplicate_stats(MPStats* stats)
     
     stats->n_duplicates=0;
     
-    hash_table_traverse(&store_duplicates, duplicate_hash);
+    if (duplicate_backend == DUPLICATE_BACKEND_FILTER) {
+        duplicate_filter_traverse(&duplicate_filter, &store_count);
+    } else if (duplicate_backend == DUPLICATE_BACKEND_EXTERNAL) {
+        long int j;
+        for (i=1; i<=MAX_EXTERNAL_COUNT; i++) {
+            for (j=0; j<external_duplicate_counts[i]; j++) {
+                store_count(i);
+            }
+        }
+    } else if (duplicate_backend == DUPLICATE_BACKEND_TOLERANT) {
+        duplicate_index_traverse(&duplicate_index, &store_count);
+    } else if (singleton_memory > 0) {
+        // Table counts are one short, and signatures seen once are only in the filter
+        void store_count_and_first(int count) {
+            store_count(count + 1);
+        }
+        duplicate_table_traverse(&duplicate_table, &store_count_and_first);
+        if (singleton_filter.entries > duplicate_table.unique) {
+            duplicate_counts[1] += singleton_filter.entries - duplicate_table.unique;
+        }
+    } else {
+        duplicate_table_traverse(&duplicate_table, &store_count);
+    }
+    
+    // A loaded table also counts earlier runs - the histogram covers them all, but this run's duplicates are reported
+    if (load_index_filename[0] != 0) {
+        stats->n_duplicates = stats->n_marked_duplicates;
+    }
     
     if (stats->n_duplicates > 0 ) {
         stats->percent_duplicates = (double)((100.0*stats->n_duplicates)/(double)stats->num_read_pairs);
@@ -1856,7 +4600,7 @@ void calculate_pcr_duplicate_stats(MPStats* stats)
 
     sprintf(filename, "%s_duplicates.txt", stats->output_prefix);
 
-    if (stats->num_read_pairs == extra_duplicates) {
+    if (stats->num_read_pairs + loaded_totals.read_pairs == extra_duplicates) {
         printf("Error: number of read pairs is equal to extra duplicates!\n");
         exit(1);
     }
@@ -1869,11 +4613,11 @@ void calculate_pcr_duplicate_stats(MPStats* stats)
             double percent = 0;
             
             if (count > 0) {
-                percent = (100.0*count)/(double)(stats->num_read_pairs - extra_duplicates);
+                percent = (100.0*count)/(double)(stats->num_read_pairs + loaded_totals.read_pairs - extra_duplicates);
             }
             
             if (i == 1) {
-                count += stats->n_invalid_for_duplicate;
+                count += stats->n_invalid_for_duplicate + loaded_totals.invalid_pairs;
             }
             
             fprintf(fp, "%d\t%d\t%.2f\n", i, count, percent);
@@ -1887,7 +4631,129 @@ void calculate_pcr_duplicate_stats(MPStats* stats)
         printf("Note: %d pairs represented by duplicates of more than %d\n", extra_duplicates, MAX_DUPLICATES);
     }
 }
-#endif 
+
+/*----------------------------------------------------------------------*
+ * Function:   lander_waterman
+ * Purpose:    Evaluate C/X - 1 + exp(-N/X), which is zero when X is the
+ *             library size
+ * Parameters: pairs = number of pairs read (N)
+ *             unique = number of unique pairs seen (C)
+ *             size = candidate library size (X)
+ * Returns:    Value of function
+ *----------------------------------------------------------------------*/
+double lander_waterman(double pairs, double unique, double size)
+{
+    return unique / size - 1 + exp(-pairs / size);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   estimate_library_size
+ * Purpose:    Estimate number of unique molecules in a library from the
+ *             Lander-Waterman equation, C/X = 1 - exp(-N/X), solving for
+ *             X by bisection as Picard's EstimateLibraryComplexity does
+ * Parameters: pairs = number of pairs read (N)
+ *             unique = number of unique pairs seen (C)
+ * Returns:    Estimated library size, or 0 if there are too few
+ *             duplicates to say
+ *----------------------------------------------------------------------*/
+double estimate_library_size(double pairs, double unique)
+{
+    double lower = 1.0;
+    double upper = 100.0;
+    int i;
+    
+    if ((unique <= 0) || (unique >= pairs)) {
+        return 0;
+    }
+    
+    while (lander_waterman(pairs, unique, upper * unique) >= 0) {
+        upper *= 10.0;
+        if (upper > 1e12) {
+            return 0;
+        }
+    }
+    
+    for (i=0; i<40; i++) {
+        double middle = (lower + upper) / 2.0;
+        double value = lander_waterman(pairs, unique, unique * middle);
+        
+        if (value == 0) {
+            break;
+        } else if (value > 0) {
+            lower = middle;
+        } else {
+            upper = middle;
+        }
+    }
+    
+    return unique * (lower + upper) / 2.0;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   calculate_library_complexity
+ * Purpose:    Estimate library size from the HyperLogLog count of
+ *             unique signatures and write expected unique pairs at
+ *             greater sequencing depth
+ * Parameters: stats -> MPStats structure
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void calculate_library_complexity(MPStats* stats)
+{
+    double depths[] = {1, 2, 3, 4, 5, 10, 20, 50, 100};
+    double valid_pairs = stats->num_read_pairs - stats->n_invalid_for_duplicate;
+    char filename[MAX_PATH_LENGTH];
+    FILE* fp;
+    int i;
+    
+    stats->estimated_unique_pairs = hyperloglog_estimate(&complexity_sketch);
+    if (stats->estimated_unique_pairs > valid_pairs) {
+        stats->estimated_unique_pairs = valid_pairs;
+    }
+    stats->estimated_library_size = estimate_library_size(valid_pairs, stats->estimated_unique_pairs);
+    
+    if (snprintf(filename, sizeof(filename), "%s_complexity.txt", stats->output_prefix) >= sizeof(filename)) {
+        printf("Error: output prefix too long\n");
+        exit(1);
+    }
+    fp = fopen(filename, "w");
+    if (fp) {
+        fprintf(fp, "Depth\tPairs\tUnique\tPercent duplicates\n");
+        for (i=0; i<sizeof(depths)/sizeof(double); i++) {
+            double pairs = depths[i] * valid_pairs;
+            double unique = pairs;
+            
+            if (stats->estimated_library_size > 0) {
+                unique = stats->estimated_library_size * (1 - exp(-pairs / stats->estimated_library_size));
+            }
+            
+            fprintf(fp, "%.0f\t%.0f\t%.0f\t%.2f\n", depths[i], pairs, unique, pairs > 0 ? 100.0 * (1 - unique / pairs) : 0);
+        }
+        fclose(fp);
+    } else {
+        printf("Error: can't open complexity file %s\n", filename);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   save_duplicate_table
+ * Purpose:    Save duplicate table, with totals including any earlier
+ *             runs it was loaded from
+ * Parameters: stats -> MPStats structure
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void save_duplicate_table(MPStats* stats)
+{
+    DuplicateTableTotals totals;
+    
+    totals.read_pairs = loaded_totals.read_pairs + stats->num_read_pairs;
+    totals.invalid_pairs = loaded_totals.invalid_pairs + stats->n_invalid_for_duplicate;
+    totals.duplicates = loaded_totals.duplicates + stats->n_marked_duplicates;
+    
+    printf("\nSaving duplicate table to %s\n", save_index_filename);
+    if (duplicate_table_save(&duplicate_table, save_index_filename, &totals) == false) {
+        exit(1);
+    }
+}
 
 /*----------------------------------------------------------------------*
  * Function:   create_hash_table
@@ -1897,35 +4763,196 @@ void calculate_pcr_duplicate_stats(MPStats* stats)
  *----------------------------------------------------------------------*/
 void create_hash_table(void)
 {
-    int b = 0;
     int n = 0;
 
-    size_hashtable(&n, &b);
-
-    printf("Creating hash tables for duplicate storage...\n");
+    if (duplicate_backend == DUPLICATE_BACKEND_EXTERNAL) {
+        return;
+    }
+    
+    if (duplicate_backend == DUPLICATE_BACKEND_FILTER) {
+        printf("Creating filter for duplicate storage...\n");
+        if (duplicate_filter_initialise(&duplicate_filter, duplicate_memory) == false) {
+            printf("Error: No memory for duplicate filter\n");
+            exit(101);
+        }
+        duplicate_filter_print_stats(&duplicate_filter);
+        if (duplicate_filter_capacity(&duplicate_filter) < approximate_reads) {
+            printf("Warning: filter holds about %ld pairs - once full, duplicates of new pairs will be missed\n", duplicate_filter_capacity(&duplicate_filter));
+        }
+        printf("\n");
+        return;
+    }
+    
+    if (duplicate_backend == DUPLICATE_BACKEND_TOLERANT) {
+        n = size_duplicate_index();
+        
+        printf("Creating index for error-tolerant duplicate storage...\n");
+        if (duplicate_index_initialise(&duplicate_index, n) == false) {
+            printf("Error: No memory for duplicate index\n");
+            exit(101);
+        }
+        duplicate_index_print_stats(&duplicate_index);
+        return;
+    }
+    
+    if (load_index_filename[0] != 0) {
+        printf("Loading duplicate table from %s...\n", load_index_filename);
+        if (duplicate_table_load(&duplicate_table, load_index_filename, &loaded_totals) == false) {
+            exit(1);
+        }
+        if (duplicate_table.signature_type != signature_type) {
+            printf("Error: duplicate table in %s was built %s [-M | --mate_swap] and %s [-K | --minimizers]\n", load_index_filename,
+                   duplicate_table.signature_type & SIGNATURE_MATE_SWAP ? "with":"without",
+                   duplicate_table.signature_type & SIGNATURE_MINIMIZERS ? "with":"without");
+            exit(1);
+        }
+        if ((duplicate_table.window_count != signature_windows) || (duplicate_table.window_size != signature_window_size) || (duplicate_table.window_offset != signature_offset)) {
+            printf("Error: duplicate table in %s was built with [-G | --signature_geometry] %dx%d+%d\n", load_index_filename,
+                   duplicate_table.window_count, duplicate_table.window_size, duplicate_table.window_offset);
+            exit(1);
+        }
+        printf("Earlier runs: %lu read pairs, %lu duplicates\n", loaded_totals.read_pairs, loaded_totals.duplicates);
+        duplicate_table_print_stats(&duplicate_table);
+        return;
+    }
+    
+    n = size_duplicate_table();
+    
+    if (singleton_memory > 0) {
+        printf("Creating singleton filter...\n");
+        if (singleton_filter_initialise(&singleton_filter, singleton_memory, approximate_reads) == false) {
+            printf("Error: No memory for singleton filter\n");
+            exit(101);
+        }
+        singleton_filter_print_stats(&singleton_filter);
+        printf("\n");
+    }
+    
+    printf("Creating table for duplicate storage...\n");
+    if (duplicate_table_initialise(&duplicate_table, n, 2 * signature_windows * signature_window_size) == false) {
+        printf("Error: No memory for duplicate table\n");
+        exit(101);
+    }
+    duplicate_table.signature_type = signature_type;
+    duplicate_table.window_count = signature_windows;
+    duplicate_table.window_size = signature_window_size;
+    duplicate_table.window_offset = signature_offset;
+    duplicate_table_print_stats(&duplicate_table);
+}
 
-#ifdef USE_MULTIPLE_HASHES
-    int i;
 
-    for (i=0; i<NUMBER_OF_HASHES; i++) {
-        kmer_hashes[i] = hash_table_new(n, b, 25, TOTAL_KMER_SIZE);
-        hash_table_print_stats(kmer_hashes[i]);
-        kmer_offsets[i][0] = -1;
-        kmer_offsets[i][1] = -1;
+/*----------------------------------------------------------------------*
+ * Function:   run_adaptor_discovery
+ * Purpose:    Find over-represented sequences in a sample of read pairs
+ *             from the start of the input and report how they compare
+ *             with the adaptors being used
+ * Parameters: stats -> MPStats structure
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void run_adaptor_discovery(MPStats* stats)
+{
+    AdaptorDiscovery discovery;
+    FastQRead* reads;
+    Adaptor* junction = &adaptor_set.adaptors[adaptor_set.primary_junction];
+    int junction_candidate = -1;
+    int junction_matches = 0;
+    int junction_overlap = 0;
+    int n_pairs = 0;
+    int c, i;
+    
+    reads = malloc(2 * sizeof(FastQRead));
+    if (reads == NULL) {
+        printf("Error: can't allocate memory for reads\n");
+        exit(1);
     }
-#else
-    duplicate_hash = hash_table_new(n, b, 25, TOTAL_KMER_SIZE);
     
-    if (duplicate_hash == NULL) {
-        printf("Error: No memory for hash table\n");
-        exit(101);
+    for (i=0; i<2; i++) {
+        printf("Opening input filename %s\n", stats->input_filenames[i]);
+        stats->input_fp[i] = fopen(stats->input_filenames[i], "r");
+        if (!stats->input_fp[i]) {
+            printf("Error: can't open file %s\n", stats->input_filenames[i]);
+            exit(2);
+        }
     }
     
-    hash_table_print_stats(duplicate_hash);
-#endif
+    adaptor_discovery_initialise(&discovery);
+    
+    while ((n_pairs < DISCOVERY_SAMPLE_PAIRS) &&
+           (get_read(stats->input_fp[0], &reads[0]) == 1) &&
+           (get_read(stats->input_fp[1], &reads[1]) == 1)) {
+        for (i=0; i<2; i++) {
+            adaptor_discovery_add_read(&discovery, reads[i].read, reads[i].read_size);
+        }
+        n_pairs++;
+    }
+    
+    for (i=0; i<2; i++) {
+        fclose(stats->input_fp[i]);
+    }
+    
+    free(reads);
+    
+    if (n_pairs == 0) {
+        printf("Error: no read pairs to sample\n");
+        exit(1);
+    }
+    
+    printf("Counting %d-mers in %d reads...\n", DISCOVERY_KMER_SIZE, discovery.number_of_reads);
+    adaptor_discovery_run(&discovery);
+    
+    printf("\nK-mer table\n");
+    large_memory_print_stats(&discovery.kmers->table_memory);
+    
+    printf("\nOVER-REPRESENTED SEQUENCES\n\n");
+    printf("Minimum k-mer count: %d\n", discovery.minimum_count);
+    printf("    Frequent k-mers: %d\n\n", discovery.number_of_frequent);
+    printf("#\tReads\t%%\tReverse\tSkew\tLength\tBest adaptor match\tSequence\n");
+    
+    for (c=0; (c<discovery.number_of_candidates) && (c<DISCOVERY_REPORTED_CANDIDATES); c++) {
+        DiscoveredSequence* candidate = &discovery.candidates[c];
+        int total = candidate->reads[0] + candidate->reads[1];
+        int best_adaptor = -1;
+        int best_matches = 0;
+        int best_overlap = 0;
+        
+        for (i=0; i<adaptor_set.number_of_adaptors; i++) {
+            int overlap;
+            int matches = adaptor_discovery_compare(candidate->sequence, candidate->length, adaptor_set.adaptors[i].sequence, adaptor_set.adaptors[i].length, &overlap);
+            if (matches > best_matches) {
+                best_adaptor = i;
+                best_matches = matches;
+                best_overlap = overlap;
+            }
+            
+            // A junction adaptor hit needs at least one whole half at 90% identity, as for a strict single match
+            if ((i == adaptor_set.primary_junction) &&
+                (overlap >= junction->half_length) && (matches * 10 >= overlap * 9) &&
+                (matches > junction_matches)) {
+                junction_candidate = c;
+                junction_matches = matches;
+                junction_overlap = overlap;
+            }
+        }
+        
+        printf("%d\t%d\t%.2f\t%d\t%.1f\t%d\t", c+1, total, (100.0 * total) / discovery.number_of_reads, candidate->reads[1], candidate->position_skew, candidate->length);
+        if ((best_adaptor >= 0) && (best_matches * 10 >= best_overlap * 9) && (best_overlap >= DISCOVERY_KMER_SIZE / 2)) {
+            printf("%s %d/%d\t", adaptor_set.adaptors[best_adaptor].name, best_matches, best_overlap);
+        } else {
+            printf("-\t");
+        }
+        printf("%s\n", candidate->sequence);
+    }
+    
+    printf("\n");
+    if (junction_candidate >= 0) {
+        printf("Junction adaptor %s matches sequence %d (%d/%d bases)\n", junction->name, junction_candidate+1, junction_matches, junction_overlap);
+    } else {
+        printf("Warning: no over-represented sequence matches junction adaptor %s - check the adaptor sequence\n", junction->name);
+    }
+    
+    adaptor_discovery_free(&discovery);
 }
 
-
 /*----------------------------------------------------------------------*
  * Function:   main
  *----------------------------------------------------------------------*/
@@ -1941,16 +4968,57 @@ int main(int argc, char* argv[])
     
     initialise_stats(&stats);
     parse_command_line(argc, argv, &stats);
+    set_signature_geometry();
+    large_memory_configure(number_of_threads, interleave_memory);
+    
+    if (discover_adaptors == true) {
+        process_adaptor();
+        run_adaptor_discovery(&stats);
+        exit(0);
+    }
+    
     create_hash_table();
+    
+    hyperloglog_initialise(&complexity_sketch);
+    
+    if ((optical_distance > 0) && (optical_grid_initialise(&optical_grid, optical_distance) == false)) {
+        printf("Error: No memory for optical duplicate grid\n");
+        exit(101);
+    }
 
     process_adaptor();
+    
+    if (duplicate_backend == DUPLICATE_BACKEND_EXTERNAL) {
+        find_external_duplicates(&stats);
+    }
+    
+    if (sweep_filename[0] != 0) {
+        load_sweep_grid(&sweep, sweep_filename);
+    }
+    
     process_files(&stats);
-    calculate_stats(&stats);
-    calculate_pcr_duplicate_stats(&stats);
-    report_stats(&stats);
     
-    if (duplicate_only_mode == false) {
-        output_histograms(&stats);
+    if (sweep_filename[0] != 0) {
+        calculate_pcr_duplicate_stats(&stats);
+        calculate_library_complexity(&stats);
+        printf("\n        Number of read pairs: %d\n", stats.num_read_pairs);
+        printf("   Number of duplicate pairs: %d\t%.2f %%\n", stats.n_duplicates, stats.percent_duplicates);
+        report_mate_swapped_duplicates(&stats);
+        report_optical_duplicates(&stats);
+        output_sweep(&stats, &sweep);
+    } else {
+        calculate_stats(&stats);
+        calculate_pcr_duplicate_stats(&stats);
+        calculate_library_complexity(&stats);
+        report_stats(&stats);
+        
+        if (duplicate_only_mode == false) {
+            output_histograms(&stats);
+        }
+    }
+    
+    if (save_index_filename[0] != 0) {
+        save_duplicate_table(&stats);
     }
     
     time(&end);
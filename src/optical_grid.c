@@ -0,0 +1,377 @@
+/*----------------------------------------------------------------------*
+ * File:    optical_grid.c                                              *
+ * Purpose: Spatial index of pairs by lane, tile and position, for      *
+ *          telling optical duplicates from PCR duplicates              *
+ *----------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include "global.h"
+#include "optical_grid.h"
+
+/*
+ * An optical duplicate is a copy of a pair that sits close to another
+ * copy on the same tile - eg. a neighbouring well on a patterned flowcell.
+ * Rather than compare every copy of a signature with every other, each
+ * pair is put in a hash table keyed on its duplicate cluster, lane, tile
+ * and the grid cell it falls in, where cells are the optical distance
+ * across. Anything within that distance must then be in the same cell or
+ * one of the eight around it.
+ *
+ * Files straight off the instrument come a tile at a time, and once the
+ * input has moved on from a tile nothing later can be close to its pairs.
+ * So while every tile has been seen in a single run, the finished tiles
+ * are dropped when the grid fills rather than growing it, which keeps the
+ * grid to about one tile. As soon as a tile comes back, every tile is kept
+ * from then on. The grid only fills after tens of thousands of pairs, so
+ * input that isn't grouped by tile shows itself long before anything is
+ * dropped - if a dropped tile does come back, that's reported, as some of
+ * its optical duplicates will have been missed.
+ */
+
+#define INITIAL_CAPACITY 65536
+#define UTILISATION 0.7
+
+/*----------------------------------------------------------------------*
+ * Function:   mix
+ * Purpose:    Mix the bits of a 64-bit value
+ * Parameters: x = value to mix
+ * Returns:    Mixed value
+ *----------------------------------------------------------------------*/
+static inline uint64_t mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDULL;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ULL;
+    x ^= x >> 33;
+
+    return x;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   tile_key
+ * Purpose:    Combine lane and tile into one value
+ * Parameters: lane = lane
+ *             tile = tile
+ * Returns:    Key
+ *----------------------------------------------------------------------*/
+static inline uint64_t tile_key(int lane, int tile)
+{
+    return ((uint64_t)(uint32_t)lane << 32) | (uint32_t)tile;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   cell_hash
+ * Purpose:    Hash a cluster, tile and grid cell
+ * Parameters: cluster = duplicate cluster
+ *             lane = lane
+ *             tile = tile
+ *             cell_x = grid cell column
+ *             cell_y = grid cell row
+ * Returns:    Hash
+ *----------------------------------------------------------------------*/
+static inline uint64_t cell_hash(uint64_t cluster, int lane, int tile, int cell_x, int cell_y)
+{
+    uint64_t tile_hash = mix(tile_key(lane, tile));
+
+    return mix(cluster ^ mix(tile_hash ^ (((uint64_t)(uint32_t)cell_x << 32) | (uint32_t)cell_y)));
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   place
+ * Purpose:    Put an entry into the first free slot from its home
+ * Parameters: grid -> grid
+ *             cluster = duplicate cluster
+ *             lane = lane
+ *             tile = tile
+ *             x = x coordinate
+ *             y = y coordinate
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void place(OpticalGrid* grid, uint64_t cluster, int lane, int tile, int x, int y)
+{
+    uint64_t slot = cell_hash(cluster, lane, tile, x / grid->distance, y / grid->distance) & grid->mask;
+
+    while (grid->entries[slot].occupied) {
+        slot = (slot + 1) & grid->mask;
+    }
+
+    grid->entries[slot].cluster = cluster;
+    grid->entries[slot].lane = lane;
+    grid->entries[slot].tile = tile;
+    grid->entries[slot].x = x;
+    grid->entries[slot].y = y;
+    grid->entries[slot].occupied = 1;
+    grid->used++;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   rebuild
+ * Purpose:    Move the entries into a new table, eg. to grow the grid
+ * Parameters: grid -> grid
+ *             capacity = number of slots in new table
+ *             current_tile_only = true to drop finished tiles
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void rebuild(OpticalGrid* grid, uint64_t capacity, boolean current_tile_only)
+{
+    OpticalEntry* old_entries = grid->entries;
+    uint64_t old_capacity = grid->capacity;
+    uint64_t i;
+
+    grid->capacity = capacity;
+    grid->mask = grid->capacity - 1;
+    grid->entries = calloc(grid->capacity, sizeof(OpticalEntry));
+    if (grid->entries == NULL) {
+        printf("Error: can't allocate memory for optical duplicate grid\n");
+        exit(101);
+    }
+
+    if (grid->capacity > grid->peak_capacity) {
+        grid->peak_capacity = grid->capacity;
+    }
+
+    grid->used = 0;
+
+    for (i=0; i<old_capacity; i++) {
+        OpticalEntry* e = &old_entries[i];
+
+        if ((e->occupied) && ((!current_tile_only) || ((e->lane == grid->lane) && (e->tile == grid->tile)))) {
+            place(grid, e->cluster, e->lane, e->tile, e->x, e->y);
+        }
+    }
+
+    free(old_entries);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   start_tile
+ * Purpose:    Move on to a new tile. While the input looks grouped by
+ *             tile, check the tile hasn't been seen before.
+ * Parameters: grid -> grid
+ *             location -> location of first pair on the tile
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void start_tile(OpticalGrid* grid, OpticalLocation* location)
+{
+    uint64_t key = tile_key(location->lane, location->tile);
+    int i;
+
+    for (i=0; (grid->tile_ordered) && (i<grid->n_finished_tiles); i++) {
+        if (grid->finished_tiles[i] == key) {
+            grid->tile_ordered = false;
+            grid->undercounted = grid->entries_dropped > 0 ? true:false;
+            free(grid->finished_tiles);
+            grid->finished_tiles = NULL;
+            grid->n_finished_tiles = 0;
+        }
+    }
+
+    if ((grid->tile_ordered) && (grid->tile_used > 0)) {
+        if (grid->n_finished_tiles == grid->finished_tiles_capacity) {
+            grid->finished_tiles_capacity = grid->finished_tiles_capacity > 0 ? 2 * grid->finished_tiles_capacity : 256;
+            grid->finished_tiles = realloc(grid->finished_tiles, grid->finished_tiles_capacity * sizeof(uint64_t));
+            if (grid->finished_tiles == NULL) {
+                printf("Error: can't allocate memory for optical duplicate grid\n");
+                exit(101);
+            }
+        }
+        grid->finished_tiles[grid->n_finished_tiles++] = tile_key(grid->lane, grid->tile);
+    }
+
+    grid->lane = location->lane;
+    grid->tile = location->tile;
+    grid->tile_used = 0;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   optical_grid_parse_header
+ * Purpose:    Get lane, tile and position from an Illumina read header,
+ *             eg. @instrument:run:flowcell:lane:tile:x:y[:umi] or the
+ *             older @instrument:lane:tile:x:y#index/1
+ * Parameters: header -> read header
+ *             location -> returned location
+ * Returns:    true if the header had a location
+ *----------------------------------------------------------------------*/
+boolean optical_grid_parse_header(char* header, OpticalLocation* location)
+{
+    char* fields[8];
+    int values[4];
+    int n_fields = 1;
+    int first;
+    int i;
+    char* p;
+
+    fields[0] = header;
+    for (p=header; (*p != 0) && (*p != ' ') && (*p != '\t') && (*p != '\n'); p++) {
+        if (*p == ':') {
+            if (n_fields == 8) {
+                return false;
+            }
+            fields[n_fields++] = p + 1;
+        }
+    }
+
+    if (n_fields >= 7) {
+        first = 3;
+    } else if (n_fields == 5) {
+        first = 1;
+    } else {
+        return false;
+    }
+
+    for (i=0; i<4; i++) {
+        char* end;
+        values[i] = strtol(fields[first + i], &end, 10);
+        if (end == fields[first + i]) {
+            return false;
+        }
+    }
+
+    location->lane = values[0];
+    location->tile = values[1];
+    location->x = values[2];
+    location->y = values[3];
+
+    return true;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   optical_grid_initialise
+ * Purpose:    Allocate an empty grid
+ * Parameters: grid -> grid
+ *             distance = pixel distance for optical duplicates
+ * Returns:    true if allocated
+ *----------------------------------------------------------------------*/
+boolean optical_grid_initialise(OpticalGrid* grid, int distance)
+{
+    grid->capacity = INITIAL_CAPACITY;
+    grid->peak_capacity = grid->capacity;
+    grid->mask = grid->capacity - 1;
+    grid->used = 0;
+    grid->distance = distance;
+    grid->lane = -1;
+    grid->tile = -1;
+    grid->tile_used = 0;
+    grid->tile_ordered = true;
+    grid->entries_dropped = 0;
+    grid->undercounted = false;
+    grid->finished_tiles = NULL;
+    grid->n_finished_tiles = 0;
+    grid->finished_tiles_capacity = 0;
+    grid->entries = calloc(grid->capacity, sizeof(OpticalEntry));
+
+    return grid->entries != NULL ? true:false;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   optical_grid_add
+ * Purpose:    Look for an earlier pair from the same duplicate cluster
+ *             on the same tile within the optical distance, then add
+ *             this pair. Pairs must be added in file order.
+ * Parameters: grid -> grid
+ *             cluster = duplicate cluster the pair belongs to
+ *             location -> location of pair
+ * Returns:    true if an earlier pair of the cluster is close by
+ *----------------------------------------------------------------------*/
+boolean optical_grid_add(OpticalGrid* grid, uint64_t cluster, OpticalLocation* location)
+{
+    int cell_x = location->x / grid->distance;
+    int cell_y = location->y / grid->distance;
+    boolean close = false;
+    int dx, dy;
+
+    if ((location->lane != grid->lane) || (location->tile != grid->tile)) {
+        start_tile(grid, location);
+    }
+
+    for (dx=-1; (dx<=1) && (!close); dx++) {
+        for (dy=-1; (dy<=1) && (!close); dy++) {
+            uint64_t slot = cell_hash(cluster, location->lane, location->tile, cell_x + dx, cell_y + dy) & grid->mask;
+
+            while (grid->entries[slot].occupied) {
+                OpticalEntry* e = &grid->entries[slot];
+
+                if ((e->cluster == cluster) && (e->lane == location->lane) && (e->tile == location->tile) &&
+                    (abs(e->x - location->x) <= grid->distance) &&
+                    (abs(e->y - location->y) <= grid->distance)) {
+                    close = true;
+                    break;
+                }
+
+                slot = (slot + 1) & grid->mask;
+            }
+        }
+    }
+
+    if (grid->used + 1 > UTILISATION * grid->capacity) {
+        // Nothing to come can be close to a pair on a finished tile
+        if ((grid->tile_ordered) && (grid->used > grid->tile_used)) {
+            grid->entries_dropped += grid->used - grid->tile_used;
+            rebuild(grid, grid->capacity, true);
+        }
+
+        // Only grow if the current tile fills much of the grid by itself
+        if (grid->used + 1 > UTILISATION * grid->capacity / 2) {
+            rebuild(grid, 2 * grid->capacity, false);
+        }
+    }
+
+    place(grid, cluster, location->lane, location->tile, location->x, location->y);
+    grid->tile_used++;
+
+    return close;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   optical_grid_memory_for
+ * Purpose:    Memory for a grid that keeps every tile
+ * Parameters: pairs = number of located pairs
+ * Returns:    Bytes
+ *----------------------------------------------------------------------*/
+uint64_t optical_grid_memory_for(long int pairs)
+{
+    uint64_t capacity = INITIAL_CAPACITY;
+
+    while (pairs + 1 > UTILISATION * capacity) {
+        capacity *= 2;
+    }
+
+    return capacity * sizeof(OpticalEntry);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   optical_grid_print_stats
+ * Purpose:    Print grid size and whether finished tiles were dropped
+ * Parameters: grid -> grid
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void optical_grid_print_stats(OpticalGrid* grid)
+{
+    printf("Optical duplicate grid\n");
+    printf("            Slots: %lu\n", grid->capacity);
+    printf("      Peak memory: %lu MB\n", (grid->peak_capacity * sizeof(OpticalEntry)) / (1024 * 1024));
+    printf("          Entries: %ld\t%.2f %%\n", grid->used, (100.0 * grid->used) / grid->capacity);
+    printf("  Entries dropped: %ld\n", grid->entries_dropped);
+    printf("       Tile order: %s\n", grid->tile_ordered ? "grouped - finished tiles dropped" : "not grouped - every tile kept");
+
+    if (grid->undercounted) {
+        printf("Warning: a tile came back after the grid had dropped it - some optical duplicates may have been missed\n");
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   optical_grid_free
+ * Purpose:    Free memory used by grid
+ * Parameters: grid -> grid
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void optical_grid_free(OpticalGrid* grid)
+{
+    free(grid->entries);
+    free(grid->finished_tiles);
+    grid->entries = NULL;
+    grid->finished_tiles = NULL;
+}
@@ -0,0 +1,124 @@
+/*----------------------------------------------------------------------*
+ * File:    pair_cache.c                                                *
+ * Purpose: Cache of adaptor classification results for read pairs     *
+ *          seen before, keyed by a fingerprint of both reads           *
+ *----------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "global.h"
+#include "binary_kmer.h"
+#include "element.h"
+#include "hash_value.h"
+#include "pair_cache.h"
+
+/*
+ * The cache is direct mapped - each fingerprint has one slot and a new pair
+ * simply replaces whatever was there. Adaptor finding only looks at the bases
+ * of each read, so two pairs with the same bases get the same result. The
+ * fingerprint is two independent 64-bit hashes of both reads, so the chance
+ * of two different pairs sharing one is negligible.
+ */
+
+/*----------------------------------------------------------------------*
+ * Function:   pair_cache_fingerprint
+ * Purpose:    Make a 128-bit fingerprint of the bases of a read pair
+ * Parameters: read_one -> bases of read 1
+ *             length_one = length of read 1
+ *             read_two -> bases of read 2
+ *             length_two = length of read 2
+ *             fingerprint -> fingerprint
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void pair_cache_fingerprint(char* read_one, int length_one, char* read_two, int length_two, PairFingerprint* fingerprint)
+{
+    uint32_t c[2] = {1, 3};
+    uint32_t b[2] = {2, 4};
+    int i;
+
+    for (i=0; i<2; i++) {
+        hashlittle2(read_one, length_one, &c[i], &b[i]);
+        hashlittle2(read_two, length_two, &c[i], &b[i]);
+        fingerprint->word[i] = c[i] + (((uint64_t)b[i]) << 32);
+    }
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   pair_cache_initialise
+ * Purpose:    Allocate an empty cache
+ * Parameters: cache -> cache
+ *             entries = number of entries, rounded down to a power of 2
+ * Returns:    true if allocated
+ *----------------------------------------------------------------------*/
+boolean pair_cache_initialise(PairCache* cache, int entries)
+{
+    uint64_t size = 1;
+
+    while (size * 2 <= entries) {
+        size *= 2;
+    }
+
+    cache->mask = size - 1;
+    cache->lookups = 0;
+    cache->hits = 0;
+    cache->entries = calloc(size, sizeof(CachedPair));
+
+    return cache->entries != NULL ? true:false;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   pair_cache_find
+ * Purpose:    Look up a pair
+ * Parameters: cache -> cache
+ *             fingerprint -> fingerprint of pair
+ * Returns:    Pointer to cached results, or NULL if not found
+ *----------------------------------------------------------------------*/
+CachedPair* pair_cache_find(PairCache* cache, PairFingerprint* fingerprint)
+{
+    CachedPair* entry = &cache->entries[fingerprint->word[0] & cache->mask];
+
+    cache->lookups++;
+
+    // An all-zero fingerprint marks an empty slot, so treat it as never cached
+    if ((entry->fingerprint.word[0] == fingerprint->word[0]) &&
+        (entry->fingerprint.word[1] == fingerprint->word[1]) &&
+        ((fingerprint->word[0] | fingerprint->word[1]) != 0)) {
+        cache->hits++;
+        return entry;
+    }
+
+    return NULL;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   pair_cache_slot
+ * Purpose:    Claim the slot for a pair, replacing anything already
+ *             there. The caller fills in the results.
+ * Parameters: cache -> cache
+ *             fingerprint -> fingerprint of pair
+ * Returns:    Pointer to slot
+ *----------------------------------------------------------------------*/
+CachedPair* pair_cache_slot(PairCache* cache, PairFingerprint* fingerprint)
+{
+    CachedPair* entry = &cache->entries[fingerprint->word[0] & cache->mask];
+
+    entry->fingerprint = *fingerprint;
+
+    return entry;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   pair_cache_free
+ * Purpose:    Free cache memory
+ * Parameters: cache -> cache
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void pair_cache_free(PairCache* cache)
+{
+    if (cache->entries) {
+        free(cache->entries);
+        cache->entries = NULL;
+    }
+}
@@ -0,0 +1,375 @@
+/*----------------------------------------------------------------------*
+ * File:    pair_signature.c                                            *
+ * Purpose: Pack read windows straight into a canonical duplicate       *
+ *          signature                                                   *
+ *----------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "global.h"
+#include "binary_kmer.h"
+#include "pair_signature.h"
+
+/*
+ * A signature is the same value seq_to_binary_kmer and element_get_key
+ * would give for the windows joined together, but without building a
+ * string or shifting a kmer along one base at a time.
+ *
+ * Bases are converted eight at a time. For upper or lower case A, C, G
+ * and T, bits 1 and 2 of the character, xored with bits 2 and 3, give
+ * 0, 1, 2 and 3 - the same codes binary_kmer uses. Doing that on a whole
+ * 64-bit word converts every byte at once, and three shift-and-mask steps
+ * then pull the eight 2-bit codes together. Callers must have already
+ * checked the windows only contain A, C, G and T.
+ *
+ * The windows are joined into one 128-bit value and the reverse
+ * complement is found by complementing and reversing the order of the
+ * 2-bit codes, which is a few swaps and two byte swaps. The smaller of the
+ * two is the canonical signature.
+ *
+ * Reverse complementing all the windows as one doesn't mean much for a
+ * pair, and the same fragment read with R1 and R2 the other way round
+ * gives a different signature. The mate swap signature instead puts the
+ * windows from each read side by side and orders the two halves, so
+ * swapping the reads gives the same value.
+ *
+ * Fixed windows miss copies whose reads start a base or two apart, or were
+ * trimmed to different lengths. Instead each read can be split into
+ * regions and the window taken from wherever the region's minimizer is -
+ * the kmer with the smallest hash. The kmers are rolled along the read in
+ * one pass and hashed by multiplying by an odd constant, which never maps
+ * two kmers to the same value. A shift of a base or two only changes the
+ * kmers at the edges of each region, so the minimizer usually stays put.
+ *
+ * The number and size of the windows are chosen at run time, but with
+ * them fixed the compiler can unroll the packing and work out the shifts
+ * and masks in advance. So the common geometries get their own copies of
+ * the builders, generated by SPECIALISE_GEOMETRY, and
+ * pair_signature_set_geometry picks one of those if it can or falls back
+ * to the general version.
+ */
+
+#define LOW_TWO_BITS 0x0303030303030303ULL
+#define MINIMIZER_MULTIPLIER 0x9E3779B97F4A7C15ULL
+
+/*----------------------------------------------------------------------*
+ * Function:   pack_eight
+ * Purpose:    Convert eight bases to 2-bit codes
+ * Parameters: bases -> first base
+ * Returns:    16-bit value, first base in the top two bits
+ *----------------------------------------------------------------------*/
+static inline uint64_t pack_eight(char* bases)
+{
+    uint64_t word;
+
+    memcpy(&word, bases, sizeof(word));
+    word = __builtin_bswap64(word);
+    word = ((word >> 1) ^ (word >> 2)) & LOW_TWO_BITS;
+    word = (word | (word >> 6)) & 0x000F000F000F000FULL;
+    word = (word | (word >> 12)) & 0x000000FF000000FFULL;
+    word = (word | (word >> 24)) & 0xFFFFULL;
+
+    return word;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   pack_window
+ * Purpose:    Convert a window of bases to 2-bit codes
+ * Parameters: bases -> first base
+ *             size = number of bases, up to PAIR_SIGNATURE_MAX_WINDOW
+ * Returns:    Packed window, first base in the most significant bits
+ *----------------------------------------------------------------------*/
+static inline uint64_t pack_window(char* bases, int size)
+{
+    uint64_t packed = 0;
+    int i = 0;
+
+    if (size < 8) {
+        for (i=0; i<size; i++) {
+            packed = (packed << 2) | (((bases[i] >> 1) ^ (bases[i] >> 2)) & 3);
+        }
+        return packed;
+    }
+
+    for (i=0; i+8<=size; i+=8) {
+        packed = (packed << 16) | pack_eight(bases + i);
+    }
+
+    // Any bases left over are the end of an overlapping block of eight
+    if (i < size) {
+        int left = size - i;
+        packed = (packed << (2 * left)) | (pack_eight(bases + size - 8) & ((1ULL << (2 * left)) - 1));
+    }
+
+    return packed;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   reverse_codes
+ * Purpose:    Reverse the order of the 2-bit codes in a 64-bit word
+ * Parameters: x = word
+ * Returns:    Reversed word
+ *----------------------------------------------------------------------*/
+static inline uint64_t reverse_codes(uint64_t x)
+{
+    x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+    x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+
+    return __builtin_bswap64(x);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   build_canonical
+ * Purpose:    Join windows of bases into a canonical signature. Always
+ *             inlined, so constant arguments give a specialised copy.
+ * Parameters: windows -> array of pointers to the first base of each
+ *                        window
+ *             n_windows = number of windows
+ *             window_size = bases in each window
+ *             signature -> returned signature
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static inline __attribute__((always_inline)) void build_canonical(char** windows, int n_windows, int window_size, BinaryKmer* signature)
+{
+    unsigned __int128 forward = 0;
+    unsigned __int128 reverse;
+    unsigned __int128 mask;
+    int bits = 2 * n_windows * window_size;
+    int i;
+
+    for (i=0; i<n_windows; i++) {
+        forward = (forward << (2 * window_size)) | pack_window(windows[i], window_size);
+    }
+
+    mask = (((unsigned __int128)1) << bits) - 1;
+    reverse = ~forward & mask;
+    reverse = ((unsigned __int128)reverse_codes((uint64_t)reverse) << 64) | reverse_codes((uint64_t)(reverse >> 64));
+    reverse >>= 128 - bits;
+
+    if (reverse < forward) {
+        forward = reverse;
+    }
+
+    binary_kmer_initialise_to_zero(signature);
+    (*signature)[NUMBER_OF_BITFIELDS_IN_BINARY_KMER - 1] = (uint64_t)forward;
+#if NUMBER_OF_BITFIELDS_IN_BINARY_KMER > 1
+    (*signature)[NUMBER_OF_BITFIELDS_IN_BINARY_KMER - 2] = (uint64_t)(forward >> 64);
+#endif
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   build_mate_swap
+ * Purpose:    Join windows of bases into a signature that's the same
+ *             whichever way round the reads are. Always inlined, so
+ *             constant arguments give a specialised copy.
+ * Parameters: windows -> array of pointers to the first base of each
+ *                        window, the first half from one read and the
+ *                        second half from the other
+ *             n_windows = number of windows, even
+ *             window_size = bases in each window
+ *             signature -> returned signature
+ *             swapped -> returned true if the halves were swapped
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static inline __attribute__((always_inline)) void build_mate_swap(char** windows, int n_windows, int window_size, BinaryKmer* signature, boolean* swapped)
+{
+    unsigned __int128 halves[2] = {0, 0};
+    unsigned __int128 joined;
+    int half_windows = n_windows / 2;
+    int i;
+
+    for (i=0; i<n_windows; i++) {
+        halves[i / half_windows] = (halves[i / half_windows] << (2 * window_size)) | pack_window(windows[i], window_size);
+    }
+
+    *swapped = halves[1] < halves[0] ? true:false;
+    if (*swapped) {
+        joined = (halves[1] << (2 * half_windows * window_size)) | halves[0];
+    } else {
+        joined = (halves[0] << (2 * half_windows * window_size)) | halves[1];
+    }
+
+    binary_kmer_initialise_to_zero(signature);
+    (*signature)[NUMBER_OF_BITFIELDS_IN_BINARY_KMER - 1] = (uint64_t)joined;
+#if NUMBER_OF_BITFIELDS_IN_BINARY_KMER > 1
+    (*signature)[NUMBER_OF_BITFIELDS_IN_BINARY_KMER - 2] = (uint64_t)(joined >> 64);
+#endif
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   build_any
+ * Purpose:    Build a canonical signature for any geometry
+ * Parameters: geometry -> geometry
+ *             windows -> array of pointers to the first base of each
+ *                        window
+ *             signature -> returned signature
+ *             swapped -> returned false
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void build_any(PairSignatureGeometry* geometry, char** windows, BinaryKmer* signature, boolean* swapped)
+{
+    build_canonical(windows, geometry->n_windows, geometry->window_size, signature);
+    *swapped = false;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   build_mate_swap_any
+ * Purpose:    Build a mate swap signature for any geometry
+ * Parameters: geometry -> geometry
+ *             windows -> array of pointers to the first base of each
+ *                        window
+ *             signature -> returned signature
+ *             swapped -> returned true if the halves were swapped
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+static void build_mate_swap_any(PairSignatureGeometry* geometry, char** windows, BinaryKmer* signature, boolean* swapped)
+{
+    build_mate_swap(windows, geometry->n_windows, geometry->window_size, signature, swapped);
+}
+
+/*
+ * Builders for one geometry, eg. SPECIALISE_GEOMETRY(4, 11) gives
+ * build_4x11 and build_mate_swap_4x11.
+ */
+#define SPECIALISE_GEOMETRY(n, size) \
+static void build_##n##x##size(PairSignatureGeometry* geometry, char** windows, BinaryKmer* signature, boolean* swapped) \
+{ \
+    build_canonical(windows, n, size, signature); \
+    *swapped = false; \
+} \
+static void build_mate_swap_##n##x##size(PairSignatureGeometry* geometry, char** windows, BinaryKmer* signature, boolean* swapped) \
+{ \
+    build_mate_swap(windows, n, size, signature, swapped); \
+}
+
+SPECIALISE_GEOMETRY(4, 11)
+SPECIALISE_GEOMETRY(4, 8)
+SPECIALISE_GEOMETRY(4, 15)
+SPECIALISE_GEOMETRY(6, 7)
+SPECIALISE_GEOMETRY(6, 10)
+SPECIALISE_GEOMETRY(8, 7)
+
+static const struct {
+    int n_windows;
+    int window_size;
+    PairSignatureBuilder build;
+    PairSignatureBuilder build_mate_swap;
+} specialised[] = {
+    {4, 11, build_4x11, build_mate_swap_4x11},
+    {4, 8, build_4x8, build_mate_swap_4x8},
+    {4, 15, build_4x15, build_mate_swap_4x15},
+    {6, 7, build_6x7, build_mate_swap_6x7},
+    {6, 10, build_6x10, build_mate_swap_6x10},
+    {8, 7, build_8x7, build_mate_swap_8x7}
+};
+
+/*----------------------------------------------------------------------*
+ * Function:   pair_signature_build
+ * Purpose:    Join windows of bases into a canonical signature
+ * Parameters: windows -> array of pointers to the first base of each
+ *                        window
+ *             n_windows = number of windows
+ *             window_size = bases in each window
+ *             signature -> returned signature
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void pair_signature_build(char** windows, int n_windows, int window_size, BinaryKmer* signature)
+{
+    build_canonical(windows, n_windows, window_size, signature);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   pair_signature_build_mate_swap
+ * Purpose:    Join windows of bases into a signature that's the same
+ *             whichever way round the reads are
+ * Parameters: windows -> array of pointers to the first base of each
+ *                        window, the first half from one read and the
+ *                        second half from the other
+ *             n_windows = number of windows, even
+ *             window_size = bases in each window
+ *             signature -> returned signature
+ *             swapped -> returned true if the halves were swapped
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void pair_signature_build_mate_swap(char** windows, int n_windows, int window_size, BinaryKmer* signature, boolean* swapped)
+{
+    build_mate_swap(windows, n_windows, window_size, signature, swapped);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   pair_signature_set_geometry
+ * Purpose:    Set up a geometry and pick the builder for it
+ * Parameters: geometry -> geometry to set up
+ *             n_windows = number of windows, even for mate swap
+ *             window_size = bases in each window, up to
+ *                           PAIR_SIGNATURE_MAX_WINDOW
+ *             mate_swap = true for mate swap signatures
+ * Returns:    true if a specialised builder was found
+ *----------------------------------------------------------------------*/
+boolean pair_signature_set_geometry(PairSignatureGeometry* geometry, int n_windows, int window_size, boolean mate_swap)
+{
+    int i;
+
+    geometry->n_windows = n_windows;
+    geometry->window_size = window_size;
+    geometry->build = mate_swap ? build_mate_swap_any : build_any;
+
+    for (i=0; i<sizeof(specialised) / sizeof(specialised[0]); i++) {
+        if ((specialised[i].n_windows == n_windows) && (specialised[i].window_size == window_size)) {
+            geometry->build = mate_swap ? specialised[i].build_mate_swap : specialised[i].build;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   pair_signature_minimizers
+ * Purpose:    Split a read into equal regions and find the minimizer
+ *             window of each. Windows start in their region, but may
+ *             run on into the next one.
+ * Parameters: read -> bases of read, only A, C, G and T
+ *             read_size = length of read
+ *             window_size = bases in each window
+ *             n_regions = number of regions
+ *             positions -> returned start of each region's window
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void pair_signature_minimizers(char* read, int read_size, int window_size, int n_regions, int* positions)
+{
+    uint64_t mask = (1ULL << (2 * window_size)) - 1;
+    uint64_t kmer = 0;
+    uint64_t lowest = UINT64_MAX;
+    int region = 0;
+    int region_end = read_size / n_regions;
+    int i;
+
+    for (i=0; i<n_regions; i++) {
+        positions[i] = (i * read_size) / n_regions;
+    }
+
+    for (i=0; i<read_size; i++) {
+        int start = i - window_size + 1;
+        uint64_t hash;
+
+        kmer = ((kmer << 2) | (((read[i] >> 1) ^ (read[i] >> 2)) & 3)) & mask;
+        if (start < 0) {
+            continue;
+        }
+
+        while ((start >= region_end) && (region < n_regions - 1)) {
+            region++;
+            region_end = ((region + 1) * read_size) / n_regions;
+            lowest = UINT64_MAX;
+        }
+
+        hash = kmer * MINIMIZER_MULTIPLIER;
+        if (hash < lowest) {
+            lowest = hash;
+            positions[region] = start;
+        }
+    }
+}
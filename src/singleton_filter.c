@@ -0,0 +1,202 @@
+/*----------------------------------------------------------------------*
+ * File:    singleton_filter.c                                          *
+ * Purpose: Blocked Bloom filter that keeps signatures seen only once   *
+ *          out of the duplicate table                                  *
+ *----------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "global.h"
+#include "singleton_filter.h"
+
+/*
+ * Most signatures in a library are only ever seen once, but each one still
+ * takes a slot in the duplicate table and a trip out to memory to put it
+ * there. With this filter in front, a signature only goes into the table
+ * the second time it's seen, so the table just holds duplicated fragments
+ * and every count in it is one short.
+ *
+ * The filter is a blocked Bloom filter - each signature sets a few bits in
+ * one 64-byte block, so a lookup touches one cache line. A new signature
+ * that happens to find all its bits set already is a false positive: it
+ * is called a duplicate and goes into the table as if it were a second
+ * copy. The chance of that is about the fraction of the block's bits that
+ * are set, to the power of the number of bits per signature, so that's
+ * added up for every new signature to give the expected number of false
+ * duplicates.
+ */
+
+#define BLOCK_BITS (SINGLETON_FILTER_BLOCK_WORDS * 64)
+
+/*----------------------------------------------------------------------*
+ * Function:   mix
+ * Purpose:    Mix the bits of a 64-bit value
+ * Parameters: x = value to mix
+ * Returns:    Mixed value
+ *----------------------------------------------------------------------*/
+static inline uint64_t mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDULL;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ULL;
+    x ^= x >> 33;
+
+    return x;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   find_block
+ * Purpose:    Find the block for a signature
+ * Parameters: filter -> filter
+ *             hash = signature hash
+ * Returns:    Pointer to first word of block
+ *----------------------------------------------------------------------*/
+static inline uint64_t* find_block(SingletonFilter* filter, uint64_t hash)
+{
+    uint64_t block = filter->block_bits == 0 ? 0 : (hash >> (64 - filter->block_bits));
+
+    return &filter->blocks[block * SINGLETON_FILTER_BLOCK_WORDS];
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   singleton_filter_initialise
+ * Purpose:    Allocate an empty filter
+ * Parameters: filter -> filter
+ *             memory_meg = memory to use in MB, rounded down to a power
+ *                          of two
+ *             expected_entries = expected number of distinct signatures,
+ *                                used to choose bits per signature
+ * Returns:    true if allocated
+ *----------------------------------------------------------------------*/
+boolean singleton_filter_initialise(SingletonFilter* filter, long int memory_meg, long int expected_entries)
+{
+    uint64_t bytes = (uint64_t)memory_meg * 1024 * 1024;
+    double bits_per_entry;
+
+    filter->block_bits = 0;
+    while ((1ULL << (filter->block_bits + 1)) * SINGLETON_FILTER_BLOCK_WORDS * sizeof(uint64_t) <= bytes) {
+        filter->block_bits++;
+    }
+    filter->number_of_blocks = 1ULL << filter->block_bits;
+
+    bits_per_entry = (double)(filter->number_of_blocks * BLOCK_BITS) / (expected_entries > 0 ? expected_entries : 1);
+    filter->hashes = (int)(bits_per_entry * log(2) + 0.5);
+    if (filter->hashes < 1) {
+        filter->hashes = 1;
+    } else if (filter->hashes > SINGLETON_FILTER_MAX_HASHES) {
+        filter->hashes = SINGLETON_FILTER_MAX_HASHES;
+    }
+
+    filter->entries = 0;
+    filter->repeats = 0;
+    filter->expected_false_matches = 0;
+
+    if (posix_memalign((void**)&filter->blocks, 64, filter->number_of_blocks * SINGLETON_FILTER_BLOCK_WORDS * sizeof(uint64_t)) != 0) {
+        filter->blocks = NULL;
+        return false;
+    }
+    memset(filter->blocks, 0, filter->number_of_blocks * SINGLETON_FILTER_BLOCK_WORDS * sizeof(uint64_t));
+
+    return true;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   singleton_filter_prefetch
+ * Purpose:    Start fetching the block of a signature that's about to be
+ *             added
+ * Parameters: filter -> filter
+ *             hash = signature hash
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void singleton_filter_prefetch(SingletonFilter* filter, uint64_t hash)
+{
+    __builtin_prefetch(find_block(filter, hash), 1);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   singleton_filter_add
+ * Purpose:    Add a signature, finding whether it has been seen before.
+ *             Signatures must be added in file order, from one thread.
+ * Parameters: filter -> filter
+ *             hash = well mixed 64-bit signature hash
+ * Returns:    true if probably seen before
+ *----------------------------------------------------------------------*/
+boolean singleton_filter_add(SingletonFilter* filter, uint64_t hash)
+{
+    uint64_t* block = find_block(filter, hash);
+    uint64_t bits = mix(hash ^ 0x9E3779B97F4A7C15ULL);
+    boolean seen = true;
+    int set = 0;
+    int i;
+
+    for (i=0; i<filter->hashes; i++) {
+        int bit = bits & (BLOCK_BITS - 1);
+        uint64_t mask = 1ULL << (bit & 63);
+
+        if ((block[bit >> 6] & mask) == 0) {
+            block[bit >> 6] |= mask;
+            seen = false;
+        }
+        bits >>= 9;
+    }
+
+    if (seen) {
+        filter->repeats++;
+        return true;
+    }
+
+    for (i=0; i<SINGLETON_FILTER_BLOCK_WORDS; i++) {
+        set += __builtin_popcountll(block[i]);
+    }
+
+    filter->entries++;
+    filter->expected_false_matches += pow((double)set / BLOCK_BITS, filter->hashes);
+
+    return false;
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   singleton_filter_memory
+ * Purpose:    Find memory used by filter
+ * Parameters: filter -> filter
+ * Returns:    Bytes
+ *----------------------------------------------------------------------*/
+uint64_t singleton_filter_memory(SingletonFilter* filter)
+{
+    return filter->number_of_blocks * SINGLETON_FILTER_BLOCK_WORDS * sizeof(uint64_t);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   singleton_filter_print_stats
+ * Purpose:    Report size and use of filter
+ * Parameters: filter -> filter
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void singleton_filter_print_stats(SingletonFilter* filter)
+{
+    printf("Singleton filter\n");
+    printf("           Blocks: %lu\n", filter->number_of_blocks);
+    printf("           Memory: %lu MB\n", singleton_filter_memory(filter) / (1024 * 1024));
+    printf("   Hash functions: %d\n", filter->hashes);
+    if (filter->entries > 0) {
+        printf("   Bits per entry: %.1f\n", (singleton_filter_memory(filter) * 8.0) / filter->entries);
+    }
+    printf("   New signatures: %ld\n", filter->entries);
+    printf("      Seen before: %ld\n", filter->repeats);
+}
+
+/*----------------------------------------------------------------------*
+ * Function:   singleton_filter_free
+ * Purpose:    Free memory used by filter
+ * Parameters: filter -> filter
+ * Returns:    None
+ *----------------------------------------------------------------------*/
+void singleton_filter_free(SingletonFilter* filter)
+{
+    free(filter->blocks);
+    filter->blocks = NULL;
+}